@@ -41,6 +41,10 @@ const char *media_player_command_to_string(MediaPlayerCommand command) {
       return "VOLUME_UP";
     case MEDIA_PLAYER_COMMAND_VOLUME_DOWN:
       return "VOLUME_DOWN";
+    case MEDIA_PLAYER_COMMAND_ENQUEUE:
+      return "ENQUEUE";
+    case MEDIA_PLAYER_COMMAND_CLEAR_PLAYLIST:
+      return "CLEAR_PLAYLIST";
     default:
       return "UNKNOWN";
   }
@@ -56,14 +60,18 @@ const char *media_player_file_type_to_string(MediaFileType file_type) {
       return "MP3";
     case MediaFileType::WAV:
       return "WAV";
+    case MediaFileType::OPUS:
+      return "OPUS";
+    case MediaFileType::AAC:
+      return "AAC";
     default:
       return "unknonw";
   }
 }
 
 void MediaPlayerCall::validate_() {
-  if (this->media_url_.has_value()) {
-    if (this->command_.has_value()) {
+  if (this->media_url_.has_value() || this->media_file_.has_value()) {
+    if (this->command_.has_value() && (this->command_.value() != MEDIA_PLAYER_COMMAND_ENQUEUE)) {
       ESP_LOGW(TAG, "MediaPlayerCall: Setting both command and media_url is not needed.");
       this->command_.reset();
     }
@@ -116,6 +124,10 @@ MediaPlayerCall &MediaPlayerCall::set_command(const std::string &command) {
     this->set_command(MEDIA_PLAYER_COMMAND_UNMUTE);
   } else if (str_equals_case_insensitive(command, "TOGGLE")) {
     this->set_command(MEDIA_PLAYER_COMMAND_TOGGLE);
+  } else if (str_equals_case_insensitive(command, "ENQUEUE")) {
+    this->set_command(MEDIA_PLAYER_COMMAND_ENQUEUE);
+  } else if (str_equals_case_insensitive(command, "CLEAR_PLAYLIST")) {
+    this->set_command(MEDIA_PLAYER_COMMAND_CLEAR_PLAYLIST);
   } else {
     ESP_LOGW(TAG, "'%s' - Unrecognized command %s", this->parent_->get_name().c_str(), command.c_str());
   }
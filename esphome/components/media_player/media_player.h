@@ -24,6 +24,8 @@ enum MediaPlayerCommand : uint8_t {
   MEDIA_PLAYER_COMMAND_TOGGLE = 5,
   MEDIA_PLAYER_COMMAND_VOLUME_UP = 6,
   MEDIA_PLAYER_COMMAND_VOLUME_DOWN = 7,
+  MEDIA_PLAYER_COMMAND_ENQUEUE = 8,
+  MEDIA_PLAYER_COMMAND_CLEAR_PLAYLIST = 9,
 };
 const char *media_player_command_to_string(MediaPlayerCommand command);
 
@@ -32,6 +34,8 @@ enum class MediaFileType : uint8_t {
   WAV,
   MP3,
   FLAC,
+  OPUS,
+  AAC,
 };
 const char *media_player_file_type_to_string(MediaFileType file_type);
 
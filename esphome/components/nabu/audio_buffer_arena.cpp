@@ -0,0 +1,54 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_buffer_arena.h"
+
+#include "esphome/core/helpers.h"
+
+namespace esphome {
+namespace nabu {
+
+uint8_t *AudioBufferArena::lease(AudioBufferArena *arena, size_t bytes) {
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  uint8_t *buffer = allocator.allocate(bytes);
+
+  if ((buffer == nullptr) || (arena == nullptr)) {
+    return buffer;
+  }
+
+  size_t leased_bytes = (arena->leased_bytes_ += bytes);
+  ++arena->leases_;
+
+  size_t peak_leased_bytes = arena->peak_leased_bytes_.load();
+  while ((leased_bytes > peak_leased_bytes) &&
+         !arena->peak_leased_bytes_.compare_exchange_weak(peak_leased_bytes, leased_bytes)) {
+  }
+
+  return buffer;
+}
+
+void AudioBufferArena::give_back(AudioBufferArena *arena, uint8_t *buffer, size_t bytes) {
+  if (buffer == nullptr) {
+    return;
+  }
+
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  allocator.deallocate(buffer, bytes);
+
+  if (arena != nullptr) {
+    arena->leased_bytes_ -= bytes;
+    --arena->leases_;
+  }
+}
+
+AudioBufferArenaStats AudioBufferArena::get_stats() const {
+  AudioBufferArenaStats stats;
+  stats.leased_bytes = this->leased_bytes_.load();
+  stats.peak_leased_bytes = this->peak_leased_bytes_.load();
+  stats.leases = this->leases_.load();
+  return stats;
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
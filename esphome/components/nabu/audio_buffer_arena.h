@@ -0,0 +1,50 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nabu {
+
+struct AudioBufferArenaStats {
+  size_t leased_bytes;       // Bytes currently leased
+  size_t peak_leased_bytes;  // Highest number of bytes leased at once
+  uint32_t leases;           // Number of buffers currently leased
+};
+
+// Accounts for the large buffers (ring buffers and scratch buffers) that the media and announcement pipelines lease
+//  - Buffers are leased from external RAM (falling back to internal RAM) and given back when the pipeline releases
+//    them, e.g., after it has been idle for a while. Given back buffers return to the heap right away, so the memory
+//    is available to the rest of the firmware until a pipeline needs it again.
+//  - The counters are atomics, so any task may lease or give back buffers
+//  - Code that may run without an arena (e.g., the PCM cache builder) passes nullptr and allocates directly
+class AudioBufferArena {
+ public:
+  /// @brief Leases a buffer, preferring external RAM
+  /// @param arena Arena to account the buffer to; nullptr to allocate without accounting
+  /// @param bytes Size of the buffer
+  /// @return Pointer to the buffer if successful, nullptr otherwise
+  static uint8_t *lease(AudioBufferArena *arena, size_t bytes);
+
+  /// @brief Gives back a leased buffer. Does nothing for nullptr.
+  /// @param arena Arena the buffer was leased from
+  /// @param buffer Buffer returned by lease
+  /// @param bytes Size the buffer was leased with
+  static void give_back(AudioBufferArena *arena, uint8_t *buffer, size_t bytes);
+
+  /// @brief Snapshot of the current and peak usage. Safe to call from any task.
+  AudioBufferArenaStats get_stats() const;
+
+ protected:
+  std::atomic<size_t> leased_bytes_{0};
+  std::atomic<size_t> peak_leased_bytes_{0};
+  std::atomic<uint32_t> leases_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -1,71 +1,217 @@
 #ifdef USE_ESP_IDF
 
 #include "audio_decoder.h"
+#include "audio_downmix.h"
 
 #include "mp3_decoder.h"
 
-#include "esphome/core/ring_buffer.h"
+#include "esphome/core/helpers.h"
+
+#include <cstring>
 
 namespace esphome {
 namespace nabu {
 
-static const size_t READ_WRITE_TIMEOUT_MS = 20;
+// By default, decoded frames are collected in a span of the output ring buffer until it holds this many bytes (or the
+// next frame doesn't fit, or the input runs dry), then published at once
+static const size_t OUTPUT_BATCH_BYTES = 16 * 1024;
+
+// libhelix outputs at most 1152 samples per channel for each frame
+static const size_t MAX_MP3_FRAME_BYTES = 1152 * 2 * sizeof(int16_t);
+// libhelix outputs 1024 samples per channel for each AAC frame, twice that with SBR
+static const size_t AAC_SAMPLES_PER_FRAME = 1024;
+static const size_t MAX_AAC_FRAME_BYTES = 2 * AAC_SAMPLES_PER_FRAME * 2 * sizeof(int16_t);
+static const uint8_t AAC_LC_OBJECT_TYPE = 2;
+static const uint8_t AAC_SBR_OBJECT_TYPE = 5;
+
+static const size_t FLAC_MAX_FRAME_HEADER_SIZE = 16;
+
+static const uint32_t XING_FRAMES_FLAG = 0x01;
+static const uint32_t XING_BYTES_FLAG = 0x02;
+static const uint32_t XING_TOC_FLAG = 0x04;
+static const size_t XING_TOC_SIZE = 100;
+static const size_t VBRI_OFFSET = 4 + 32;  // The VBRI tag always follows 32 bytes after the frame header
+static const size_t VBRI_HEADER_SIZE = 26;
+
+static const size_t OGG_PAGE_HEADER_SIZE = 27;
+static const uint8_t OGG_CONTINUED_FLAG = 0x01;
+static const uint8_t OGG_FIRST_PAGE_FLAG = 0x02;
+static const uint64_t OGG_NO_GRANULE = UINT64_MAX;  // Set on pages where no packet ends
+static const size_t OPUS_HEAD_SIZE = 19;
+static const size_t OPUS_MAX_PACKET_SIZE = 1275 * 3 + 7;  // Three maximum size frames (up to 60 ms) plus framing
+static const uint32_t OPUS_GRANULE_RATE = 48000;           // Granule positions and the pre-skip are always at 48 kHz
+static const uint32_t OPUS_MAX_FRAME_MS = 120;
+static const uint32_t OPUS_SAMPLE_RATES[] = {8000, 12000, 16000, 24000, 48000};
+
+static uint16_t read_be16(const uint8_t *data) { return (data[0] << 8) | data[1]; }
+
+static uint32_t read_be32(const uint8_t *data) {
+  return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static uint16_t read_le16(const uint8_t *data) { return data[0] | (data[1] << 8); }
+
+static uint32_t read_le32(const uint8_t *data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+static uint64_t read_le64(const uint8_t *data) {
+  return (static_cast<uint64_t>(read_le32(data + 4)) << 32) | read_le32(data);
+}
 
-AudioDecoder::AudioDecoder(RingBuffer *input_ring_buffer, RingBuffer *output_ring_buffer, size_t internal_buffer_size) {
-  this->input_ring_buffer_ = input_ring_buffer;
-  this->output_ring_buffer_ = output_ring_buffer;
+AudioDecoder::AudioDecoder(size_t internal_buffer_size) {
   this->internal_buffer_size_ = internal_buffer_size;
+  this->output_batch_bytes_ = OUTPUT_BATCH_BYTES;
 }
 
-AudioDecoder::~AudioDecoder() {
-  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
-  if (this->input_buffer_ != nullptr) {
-    allocator.deallocate(this->input_buffer_, this->internal_buffer_size_);
-  }
-  if (this->output_buffer_ != nullptr) {
-    allocator.deallocate(this->output_buffer_, this->internal_buffer_size_);
-  }
+AudioDecoder::~AudioDecoder() { this->release_buffers(); }
 
-  if (this->flac_decoder_ != nullptr) {
-    this->flac_decoder_->free_buffers();
-    this->flac_decoder_.reset();  // Free the unique_ptr
-    this->flac_decoder_ = nullptr;
-  }
+void AudioDecoder::release_buffers() {
+  AudioBufferArena::give_back(this->buffer_arena_, this->input_buffer_, this->internal_buffer_size_);
+  this->input_buffer_ = nullptr;
+  this->input_buffer_current_ = nullptr;
+
+  // The parsed header can't be kept without the decoder, so the next stream starts over
+  this->free_file_decoder_();
+  this->resume_ = false;
+}
+
+void AudioDecoder::free_file_decoder_() {
+  this->flac_decoder_.reset();
 
   if (this->media_file_type_ == media_player::MediaFileType::MP3) {
     MP3FreeDecoder(this->mp3_decoder_);
   }
 
+  if (this->aac_decoder_ != nullptr) {
+    AACFreeDecoder(this->aac_decoder_);
+    this->aac_decoder_ = nullptr;
+  }
+  this->mp4_demuxer_.reset();
+
   if (this->wav_decoder_ != nullptr) {
     this->wav_decoder_.reset();  // Free the unique_ptr
     this->wav_decoder_ = nullptr;
   }
-}
 
-esp_err_t AudioDecoder::start(media_player::MediaFileType media_file_type) {
-  esp_err_t err = this->allocate_buffers_();
-
-  if (err != ESP_OK) {
-    return err;
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  if (this->opus_decoder_ != nullptr) {
+    allocator.deallocate(reinterpret_cast<uint8_t *>(this->opus_decoder_), this->opus_decoder_size_);
+    this->opus_decoder_ = nullptr;
+  }
+  if (this->opus_packet_ != nullptr) {
+    allocator.deallocate(this->opus_packet_, OPUS_MAX_PACKET_SIZE);
+    this->opus_packet_ = nullptr;
   }
 
-  this->media_file_type_ = media_file_type;
+  this->media_file_type_ = media_player::MediaFileType::NONE;
+}
+
+esp_err_t AudioDecoder::start(const AudioStreamFormat &input_format) {
+  const bool resume = this->resume_ && (input_format.file_type == this->media_file_type_);
+  this->resume_ = false;
 
-  this->input_buffer_current_ = this->input_buffer_;
   this->input_buffer_length_ = 0;
-  this->output_buffer_current_ = this->output_buffer_;
   this->output_buffer_length_ = 0;
-
   this->potentially_failed_count_ = 0;
+  this->input_consumed_ = false;
   this->end_of_file_ = false;
+  this->input_memory_ = input_format.data;
+  this->input_memory_length_ = input_format.data_length;
+
+  if (resume) {
+    // Keep the parsed header and continue the same stream at the offset seek located
+    this->input_buffer_current_ = this->input_buffer_;
+    this->input_bytes_read_ = this->resume_offset_;
+    if (this->media_file_type_ == media_player::MediaFileType::MP3) {
+      // Discard the bit reservoir of the frames before the old position
+      MP3FreeDecoder(this->mp3_decoder_);
+      this->mp3_decoder_ = MP3InitDecoder();
+    } else if (this->media_file_type_ == media_player::MediaFileType::AAC) {
+      AACFlushCodec(this->aac_decoder_);
+      this->aac_raw_params_set_ = false;
+    } else if (this->media_file_type_ == media_player::MediaFileType::OPUS) {
+      // Discard the partial page and the decoder's prediction state from the old position
+      this->opus_packet_length_ = 0;
+      this->opus_packet_dropped_ = false;
+      this->opus_lacing_index_ = this->opus_lacing_count_;
+      opus_decoder_ctl(this->opus_decoder_, OPUS_RESET_STATE);
+    }
+    // The Opus demuxer always searches for the next page header itself, and MP4 samples are located exactly
+    const bool adts = (this->media_file_type_ == media_player::MediaFileType::AAC) && (this->mp4_demuxer_ == nullptr);
+    this->resyncing_ = (this->media_file_type_ == media_player::MediaFileType::FLAC) ||
+                       (this->media_file_type_ == media_player::MediaFileType::MP3) || adts;
+    return ESP_OK;
+  }
 
-  switch (this->media_file_type_) {
+  this->free_file_decoder_();
+  this->audio_stream_info_.reset();
+
+  this->input_bytes_read_ = 0;
+  this->audio_data_offset_ = 0;
+  this->total_frames_ = 0;
+  this->mp3_first_frame_seen_ = false;
+  this->mp3_bitrate_ = 0;
+  this->mp3_stream_bytes_ = 0;
+  this->mp3_has_toc_ = false;
+  this->wav_data_length_ = 0;
+  this->wav_bytes_left_ = 0;
+  this->aac_bitrate_ = 0;
+  this->opus_granule_ = 0;
+  this->opus_granule_offset_ = 0;
+  this->resyncing_ = false;
+  this->frames_to_skip_ = 0;
+
+  if (!input_format.is_encoded()) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  // Only the FLAC decoder needs an input buffer, and only for input from the ring buffer; the others decode their input
+  // in place
+  if ((input_format.file_type == media_player::MediaFileType::FLAC) && (this->input_memory_ == nullptr)) {
+    esp_err_t err = this->allocate_buffers_();
+
+    if (err != ESP_OK) {
+      return err;
+    }
+  } else {
+    AudioBufferArena::give_back(this->buffer_arena_, this->input_buffer_, this->internal_buffer_size_);
+    this->input_buffer_ = nullptr;
+  }
+
+  this->input_buffer_current_ = this->input_buffer_;
+
+  switch (input_format.file_type) {
+    case media_player::MediaFileType::AAC:
+      this->aac_decoder_ = AACInitDecoder();
+      if (this->aac_decoder_ == nullptr) {
+        return ESP_ERR_NO_MEM;
+      }
+      this->aac_container_known_ = false;
+      this->aac_raw_params_set_ = false;
+      break;
     case media_player::MediaFileType::FLAC:
-      this->flac_decoder_ = make_unique<flac::FLACDecoder>(this->input_buffer_);
+      this->flac_decoder_ = make_unique<FlacStreamDecoder>();
       break;
     case media_player::MediaFileType::MP3:
       this->mp3_decoder_ = MP3InitDecoder();
       break;
+    case media_player::MediaFileType::OPUS: {
+      // The decoder itself is set up once the OpusHead packet gives the channel count
+      ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+      this->opus_packet_ = allocator.allocate(OPUS_MAX_PACKET_SIZE);
+      if (this->opus_packet_ == nullptr) {
+        return ESP_ERR_NO_MEM;
+      }
+      this->opus_packet_length_ = 0;
+      this->opus_packet_dropped_ = false;
+      this->opus_lacing_count_ = 0;
+      this->opus_lacing_index_ = 0;
+      this->opus_skip_page_ = false;
+      this->opus_serial_ = 0;
+      this->opus_header_packets_ = 0;
+      break;
+    }
     case media_player::MediaFileType::WAV:
       this->wav_decoder_ = make_unique<wav_decoder::WAVDecoder>(&this->input_buffer_current_);
       this->wav_decoder_->reset();
@@ -75,50 +221,175 @@ esp_err_t AudioDecoder::start(media_player::MediaFileType media_file_type) {
       break;
   }
 
+  this->media_file_type_ = input_format.file_type;
+
   return ESP_OK;
 }
 
-AudioDecoderState AudioDecoder::decode(bool stop_gracefully) {
-  if (stop_gracefully) {
-    if (this->output_buffer_length_ == 0) {
-      // If the file decoder believes it the end of file
-      if (this->end_of_file_) {
-        return AudioDecoderState::FINISHED;
+size_t AudioDecoder::seek(uint32_t position_ms, size_t source_length) {
+  this->resume_ = false;
+  this->frames_to_skip_ = 0;
+
+  if (!this->audio_stream_info_.has_value()) {
+    // Without the header, there is nothing to locate the position with
+    return 0;
+  }
+
+  const audio::AudioStreamInfo &stream_info = this->audio_stream_info_.value();
+  const uint64_t target_frame = static_cast<uint64_t>(position_ms) * stream_info.sample_rate / 1000;
+  const float fraction =
+      (this->total_frames_ > 0) ? std::min(1.0f, static_cast<float>(target_frame) / this->total_frames_) : 0.0f;
+
+  // If the position can't be located, continue from where decoding stopped
+  size_t offset = this->stream_position_();
+
+  switch (this->media_file_type_) {
+    case media_player::MediaFileType::WAV: {
+      const size_t bytes_per_frame = stream_info.channels * stream_info.bits_per_sample / 8;
+      if (bytes_per_frame == 0) {
+        break;
       }
-      // If all the internal buffers are empty, the decoding is done
-      if ((this->input_ring_buffer_->available() == 0) && (this->input_buffer_length_ == 0)) {
-        return AudioDecoderState::FINISHED;
+      const size_t data_bytes = std::min<uint64_t>(target_frame * bytes_per_frame,
+                                                   this->wav_data_length_ - this->wav_data_length_ % bytes_per_frame);
+      offset = this->audio_data_offset_ + data_bytes;
+      this->wav_bytes_left_ = this->wav_data_length_ - data_bytes;
+      break;
+    }
+    case media_player::MediaFileType::MP3:
+      if ((this->total_frames_ > 0) && (this->mp3_stream_bytes_ > 0)) {
+        float byte_fraction = fraction;
+        if (this->mp3_has_toc_) {
+          // Interpolate between the table's entries for the surrounding percents
+          const float percent = fraction * 100.0f;
+          const size_t index = std::min<size_t>(static_cast<size_t>(percent), XING_TOC_SIZE - 1);
+          const float start = this->mp3_toc_[index];
+          const float end = (index < XING_TOC_SIZE - 1) ? this->mp3_toc_[index + 1] : 256.0f;
+          byte_fraction = (start + (end - start) * (percent - index)) / 256.0f;
+        }
+        offset = this->audio_data_offset_ + static_cast<size_t>(byte_fraction * this->mp3_stream_bytes_);
+      } else if (this->mp3_bitrate_ > 0) {
+        // Assume a constant bitrate
+        offset = this->audio_data_offset_ + static_cast<uint64_t>(position_ms) * this->mp3_bitrate_ / 8000;
       }
+      break;
+    case media_player::MediaFileType::FLAC:
+      if (!this->flac_decoder_->get_seek_points().empty()) {
+        // Continue at the last seek point before the position, then drop the frames up to it
+        const FlacSeekPoint *seek_point = nullptr;
+        for (const auto &point : this->flac_decoder_->get_seek_points()) {
+          if (point.sample > target_frame) {
+            break;
+          }
+          seek_point = &point;
+        }
+        if (seek_point != nullptr) {
+          offset = this->audio_data_offset_ + seek_point->offset;
+          this->frames_to_skip_ = target_frame - seek_point->sample;
+        } else {
+          offset = this->audio_data_offset_;
+          this->frames_to_skip_ = target_frame;
+        }
+      } else if ((this->total_frames_ > 0) && (source_length > this->audio_data_offset_)) {
+        // Estimate with the average bitrate of the whole file
+        offset = this->audio_data_offset_ + static_cast<size_t>(fraction * (source_length - this->audio_data_offset_));
+      }
+      break;
+    case media_player::MediaFileType::AAC:
+      if ((this->mp4_demuxer_ != nullptr) && this->mp4_demuxer_->has_sample_tables()) {
+        // The sample tables locate every frame exactly
+        const uint64_t sample_rate = this->mp4_demuxer_->get_sample_rate();
+        offset = this->mp4_demuxer_->seek(position_ms * sample_rate / 1000 / AAC_SAMPLES_PER_FRAME);
+      } else if ((this->mp4_demuxer_ == nullptr) && (this->aac_bitrate_ > 0)) {
+        // Assume a constant bitrate
+        offset = this->audio_data_offset_ + static_cast<uint64_t>(position_ms) * this->aac_bitrate_ / 8000;
+      }
+      break;
+    case media_player::MediaFileType::OPUS:
+      if ((this->opus_granule_ > 0) && (this->opus_granule_offset_ > this->audio_data_offset_)) {
+        // Estimate with the average bitrate of the pages decoded so far
+        const uint64_t target_granule = static_cast<uint64_t>(position_ms) * OPUS_GRANULE_RATE / 1000;
+        offset = this->audio_data_offset_ +
+                 target_granule * (this->opus_granule_offset_ - this->audio_data_offset_) / this->opus_granule_;
+      }
+      break;
+    case media_player::MediaFileType::NONE:
+      return 0;
+  }
+
+  if (source_length > 0) {
+    offset = std::min(offset, source_length);
+  }
+
+  this->resume_ = true;
+  this->resume_offset_ = offset;
+  return offset;
+}
+
+optional<AudioStreamFormat> AudioDecoder::get_output_format() const {
+  if (!this->audio_stream_info_.has_value()) {
+    return {};
+  }
+
+  AudioStreamFormat output_format;
+  output_format.stream_info = this->audio_stream_info_.value();
+  output_format.stream_info.channels = downmixed_channels(output_format.stream_info.channels);
+  return output_format;
+}
+
+AudioStageState AudioDecoder::process(bool stop_gracefully) {
+  if (stop_gracefully) {
+    // If the file decoder believes it the end of file
+    if (this->end_of_file_) {
+      return AudioStageState::FINISHED;
+    }
+    // If all the internal buffers are empty, the decoding is done
+    if ((this->input_ring_buffer_->available() == 0) && (this->input_buffer_length_ == 0) &&
+        (this->input_memory_length_ == 0)) {
+      return AudioStageState::FINISHED;
     }
   }
 
   if (this->potentially_failed_count_ > 10) {
-    return AudioDecoderState::FAILED;
+    return AudioStageState::FAILED;
   }
 
   FileDecoderState state = FileDecoderState::MORE_TO_PROCESS;
 
-  while (state == FileDecoderState::MORE_TO_PROCESS) {
-    if (this->output_buffer_length_ > 0) {
-      // Have decoded data, write it to the output ring buffer
-
-      size_t bytes_to_write = this->output_buffer_length_;
+  // The file decoder reads audio in memory in place. It also decodes spans peeked from the ring buffer in place, except
+  // for FLAC, which copies them into its input buffer.
+  const bool flac = (this->media_file_type_ == media_player::MediaFileType::FLAC);
+  const bool in_place = (this->input_memory_ != nullptr);
+  const bool peek_input = (this->input_memory_ == nullptr) && !flac;
+  const size_t max_span = this->input_ring_buffer_->max_span();
 
-      if (bytes_to_write > 0) {
-        size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-            (void *) this->output_buffer_current_, bytes_to_write, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
-
-        this->output_buffer_length_ -= bytes_written;
-        this->output_buffer_current_ += bytes_written;
+  bool first_pass = true;
+  while (state == FileDecoderState::MORE_TO_PROCESS) {
+    size_t bytes_read = 0;
+    size_t bytes_to_read = 0;
+
+    if (in_place) {
+      if (this->input_memory_length_ > 0) {
+        // Hand the whole region to the file decoder at once. It only reads its input, so casting away const is safe.
+        this->input_buffer_current_ = const_cast<uint8_t *>(this->input_memory_);
+        this->input_buffer_length_ = this->input_memory_length_;
+        bytes_read = this->input_memory_length_;
+        this->input_bytes_read_ += bytes_read;
+        this->input_memory_ += bytes_read;
+        this->input_memory_length_ = 0;
       }
-
-      if (this->output_buffer_length_ > 0) {
-        // Output buffer still has decoded audio to write
-        return AudioDecoderState::DECODING;
+    } else if (peek_input) {
+      // Peek the unconsumed input again on every pass, as the ring buffer may have been resized since. A file decoder
+      // that potentially failed without consuming any input needs a longer span to make progress.
+      bytes_to_read = std::max<size_t>(this->input_buffer_length_, 1);
+      if ((this->potentially_failed_count_ > 0) && !this->input_consumed_) {
+        bytes_to_read =
+            std::max(this->input_buffer_length_ + 1, std::min(this->input_ring_buffer_->available(), max_span));
+      }
+      if (bytes_to_read > max_span) {
+        // The unconsumed input already fills the longest span
+        bytes_to_read = 0;
       }
     } else {
-      // Decode more data
-
       // Shift unread data in input buffer to start
       if (this->input_buffer_length_ > 0) {
         memmove(this->input_buffer_, this->input_buffer_current_, this->input_buffer_length_);
@@ -126,39 +397,107 @@ AudioDecoderState AudioDecoder::decode(bool stop_gracefully) {
       this->input_buffer_current_ = this->input_buffer_;
 
       // read in new ring buffer data to fill the remaining input buffer
-      size_t bytes_read = 0;
+      bytes_to_read = this->internal_buffer_size_ - this->input_buffer_length_;
+    }
 
-      size_t bytes_to_read = this->internal_buffer_size_ - this->input_buffer_length_;
+    if (bytes_to_read > 0) {
+      // Only sleep when there is nothing (complete) left to decode and no decoded audio is held back from the
+      // resampler; the reader notifies this task when it finishes. A later pass returns instead, since waiting for
+      // output space may have taken that notification.
+      TickType_t ticks_to_wait = 0;
+      if (first_pass && !stop_gracefully && (this->output_buffer_length_ == 0) &&
+          ((this->input_buffer_length_ == 0) || ((this->potentially_failed_count_ > 0) && !this->input_consumed_))) {
+        ticks_to_wait = this->input_ticks_to_wait_;
+      }
 
-      if (bytes_to_read > 0) {
+      if (peek_input) {
+        uint8_t *span;
+        const size_t span_length = this->input_ring_buffer_->peek(&span, bytes_to_read, ticks_to_wait);
+        if (span_length > 0) {
+          const size_t position = this->stream_position_();
+          bytes_read = (span_length > this->input_buffer_length_) ? span_length - this->input_buffer_length_ : 0;
+          this->input_buffer_current_ = span;
+          this->input_buffer_length_ = span_length;
+          this->input_bytes_read_ = position + span_length;
+        }
+      } else {
         uint8_t *new_audio_data = this->input_buffer_ + this->input_buffer_length_;
-        bytes_read = this->input_ring_buffer_->read((void *) new_audio_data, bytes_to_read,
-                                                    pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+        if (this->input_memory_ != nullptr) {
+          bytes_read = std::min(bytes_to_read, this->input_memory_length_);
+          std::memcpy(new_audio_data, this->input_memory_, bytes_read);
+          this->input_memory_ += bytes_read;
+          this->input_memory_length_ -= bytes_read;
+        } else {
+          bytes_read = this->input_ring_buffer_->read((void *) new_audio_data, bytes_to_read, ticks_to_wait);
+        }
 
         this->input_buffer_length_ += bytes_read;
+        this->input_bytes_read_ += bytes_read;
       }
+    }
 
-      if ((this->input_buffer_length_ == 0) || ((this->potentially_failed_count_ > 0) && (bytes_read == 0))) {
-        if ((this->input_buffer_length_ && stop_gracefully) || bytes_to_read == 0) {
-          // data in buffer won't change, don't try again
-          state = FileDecoderState::FAILED;
-        } else {
-          state = FileDecoderState::IDLE;
-        }
+    // A file decoder that potentially failed without consuming any input only makes progress once new data arrives.
+    // One that consumed input, e.g., an MP3 frame whose bit reservoir is missing after a seek, can continue.
+    const bool stalled = (this->potentially_failed_count_ > 0) && !this->input_consumed_ && (bytes_read == 0);
+    if ((this->input_buffer_length_ == 0) || stalled) {
+      if ((this->input_buffer_length_ && stop_gracefully) || (!in_place && (bytes_to_read == 0))) {
+        // data in buffer won't change, don't try again
+        state = FileDecoderState::FAILED;
       } else {
-        switch (this->media_file_type_) {
-          case media_player::MediaFileType::FLAC:
-            state = this->decode_flac_();
-            break;
-          case media_player::MediaFileType::MP3:
-            state = this->decode_mp3_();
-            break;
-          case media_player::MediaFileType::WAV:
-            state = this->decode_wav_();
-            break;
-          case media_player::MediaFileType::NONE:
-            state = FileDecoderState::IDLE;
-            break;
+        state = FileDecoderState::IDLE;
+      }
+    } else {
+      if (this->output_buffer_ == nullptr) {
+        // Reserve space in the output ring buffer, so the file decoder writes the decoded audio directly into it
+        this->output_buffer_size_ = this->output_ring_buffer_->acquire(
+            &this->output_buffer_, std::max(this->min_output_bytes_(), this->output_batch_bytes_), 0);
+        if (this->output_buffer_size_ == 0) {
+          // A full batch doesn't fit; settle for a single frame
+          this->output_buffer_size_ = this->output_ring_buffer_->acquire(
+              &this->output_buffer_, this->min_output_bytes_(), this->output_ticks_to_wait_);
+        }
+        if (this->output_buffer_size_ == 0) {
+          // Not enough free space; try again once the resampler has caught up
+          this->output_buffer_ = nullptr;
+          return AudioStageState::RUNNING;
+        }
+        this->output_buffer_length_ = 0;
+      }
+
+      const size_t input_length_before = this->input_buffer_length_;
+      switch (this->media_file_type_) {
+        case media_player::MediaFileType::AAC:
+          state = this->decode_aac_();
+          break;
+        case media_player::MediaFileType::FLAC:
+          state = this->decode_flac_();
+          break;
+        case media_player::MediaFileType::MP3:
+          state = this->decode_mp3_();
+          break;
+        case media_player::MediaFileType::OPUS:
+          state = this->decode_opus_();
+          break;
+        case media_player::MediaFileType::WAV:
+          state = this->decode_wav_();
+          break;
+        case media_player::MediaFileType::NONE:
+          state = FileDecoderState::IDLE;
+          break;
+      }
+      this->input_consumed_ = (this->input_buffer_length_ != input_length_before);
+      if (peek_input) {
+        this->input_ring_buffer_->release(input_length_before - this->input_buffer_length_);
+      }
+
+      const bool batch_full = (this->output_buffer_length_ >= this->output_batch_bytes_) ||
+                              (this->output_buffer_size_ - this->output_buffer_length_ < this->min_output_bytes_());
+      if (batch_full) {
+        this->publish_output_();
+        if (state == FileDecoderState::MORE_TO_PROCESS) {
+          // Return after each batch, so a plentiful input doesn't keep the task here until the output ring buffer fills
+          this->potentially_failed_count_ = 0;
+          return AudioStageState::RUNNING;
         }
       }
     }
@@ -167,93 +506,256 @@ AudioDecoderState AudioDecoder::decode(bool stop_gracefully) {
     } else if (state == FileDecoderState::END_OF_FILE) {
       this->end_of_file_ = true;
     } else if (state == FileDecoderState::FAILED) {
-      return AudioDecoderState::FAILED;
+      this->publish_output_();
+      return AudioStageState::FAILED;
     } else if (state == FileDecoderState::MORE_TO_PROCESS) {
       this->potentially_failed_count_ = 0;
     }
+    first_pass = false;
   }
-  return AudioDecoderState::DECODING;
+
+  // The input ran dry or the stream ended
+  this->publish_output_();
+  return AudioStageState::RUNNING;
 }
 
-esp_err_t AudioDecoder::allocate_buffers_() {
-  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+void AudioDecoder::publish_output_() {
+  if (this->output_buffer_ == nullptr) {
+    return;
+  }
 
-  if (this->input_buffer_ == nullptr)
-    this->input_buffer_ = allocator.allocate(this->internal_buffer_size_);
+  this->downmix_output_();
+  this->output_ring_buffer_->commit(this->output_buffer_length_);
+  this->output_buffer_ = nullptr;
+  this->output_buffer_length_ = 0;
+}
 
-  if (this->output_buffer_ == nullptr)
-    this->output_buffer_ = allocator.allocate(this->internal_buffer_size_);
+esp_err_t AudioDecoder::allocate_buffers_() {
+  if (this->input_buffer_ == nullptr)
+    this->input_buffer_ = AudioBufferArena::lease(this->buffer_arena_, this->internal_buffer_size_);
 
-  if ((this->input_buffer_ == nullptr) || (this->output_buffer_ == nullptr)) {
+  if (this->input_buffer_ == nullptr) {
     return ESP_ERR_NO_MEM;
   }
 
   return ESP_OK;
 }
 
+size_t AudioDecoder::min_output_bytes_() {
+  switch (this->media_file_type_) {
+    case media_player::MediaFileType::FLAC:
+      if (this->audio_stream_info_.has_value()) {
+        return this->flac_decoder_->get_max_output_bytes();
+      }
+      break;
+    case media_player::MediaFileType::AAC:
+      return MAX_AAC_FRAME_BYTES;
+    case media_player::MediaFileType::MP3:
+      return MAX_MP3_FRAME_BYTES;
+    case media_player::MediaFileType::OPUS:
+      if (this->audio_stream_info_.has_value()) {
+        return this->opus_max_frame_samples_ * this->audio_stream_info_.value().channels * sizeof(int16_t);
+      }
+      break;
+    case media_player::MediaFileType::WAV:
+      if (this->audio_stream_info_.has_value()) {
+        return this->audio_stream_info_.value().channels * this->audio_stream_info_.value().bits_per_sample / 8;
+      }
+      break;
+    case media_player::MediaFileType::NONE:
+      break;
+  }
+
+  return 1;
+}
+
+FileDecoderState AudioDecoder::decode_aac_() {
+  if (!this->aac_container_known_) {
+    if (this->input_buffer_length_ < 8) {
+      return FileDecoderState::POTENTIALLY_FAILED;
+    }
+    if (std::memcmp(this->input_buffer_current_ + 4, "ftyp", 4) == 0) {
+      this->mp4_demuxer_ = make_unique<MP4Demuxer>();
+    }
+    this->aac_container_known_ = true;
+  }
+
+  if (this->mp4_demuxer_ != nullptr) {
+    uint8_t *sample = nullptr;
+    size_t sample_length = 0;
+    const size_t length_before = this->input_buffer_length_;
+    MP4DemuxerState demuxer_state = this->mp4_demuxer_->next(&this->input_buffer_current_, &this->input_buffer_length_,
+                                                             &sample, &sample_length);
+    switch (demuxer_state) {
+      case MP4DemuxerState::NEED_MORE_DATA:
+        // The moov box streams through in pieces, so consuming anything counts as progress
+        return (this->input_buffer_length_ < length_before) ? FileDecoderState::MORE_TO_PROCESS
+                                                              : FileDecoderState::POTENTIALLY_FAILED;
+      case MP4DemuxerState::END_OF_TRACK:
+        return FileDecoderState::END_OF_FILE;
+      case MP4DemuxerState::FAILED:
+        return FileDecoderState::FAILED;
+      case MP4DemuxerState::SAMPLE_READY:
+        break;
+    }
+
+    if (!this->aac_raw_params_set_) {
+      const uint8_t object_type = this->mp4_demuxer_->get_object_type();
+      if ((object_type != AAC_LC_OBJECT_TYPE) && (object_type != AAC_SBR_OBJECT_TYPE)) {
+        // libhelix only decodes the low complexity profile
+        return FileDecoderState::FAILED;
+      }
+      AACFrameInfo frame_info = {};
+      frame_info.nChans = this->mp4_demuxer_->get_channels();
+      frame_info.sampRateCore = this->mp4_demuxer_->get_sample_rate();
+      frame_info.profile = AAC_PROFILE_LC;
+      if (AACSetRawBlockParams(this->aac_decoder_, 0, &frame_info) != ERR_AAC_NONE) {
+        return FileDecoderState::FAILED;
+      }
+      this->total_frames_ = static_cast<uint64_t>(this->mp4_demuxer_->get_sample_count()) * AAC_SAMPLES_PER_FRAME;
+      this->aac_raw_params_set_ = true;
+    }
+
+    int bytes_left = sample_length;
+    int err = AACDecode(this->aac_decoder_, &sample, &bytes_left, this->output_samples_());
+    if (err != ERR_AAC_NONE) {
+      // Corrupted sample; it's already consumed, so continue with the next one
+      return FileDecoderState::POTENTIALLY_FAILED;
+    }
+  } else {
+    // Look for the next ADTS sync word
+    int32_t offset = AACFindSyncWord(this->input_buffer_current_, this->input_buffer_length_);
+    if (offset < 0) {
+      // We may recover if we have more data
+      return FileDecoderState::POTENTIALLY_FAILED;
+    }
+
+    // Advance read pointer
+    this->input_buffer_current_ += offset;
+    this->input_buffer_length_ -= offset;
+
+    if (this->aac_bitrate_ == 0) {
+      this->audio_data_offset_ = this->stream_position_();
+    }
+
+    int err = AACDecode(this->aac_decoder_, &this->input_buffer_current_, (int *) &this->input_buffer_length_,
+                        this->output_samples_());
+    if (err == ERR_AAC_INDATA_UNDERFLOW) {
+      // Not a problem. Next call to decode will provide more data.
+      return FileDecoderState::POTENTIALLY_FAILED;
+    } else if (err != ERR_AAC_NONE) {
+      if (this->resyncing_ && (this->input_buffer_length_ > 0)) {
+        // Audio data that looked like a sync word; try the next one
+        ++this->input_buffer_current_;
+        --this->input_buffer_length_;
+        return FileDecoderState::MORE_TO_PROCESS;
+      }
+      return FileDecoderState::FAILED;
+    }
+    this->resyncing_ = false;
+  }
+
+  AACFrameInfo aac_frame_info;
+  AACGetLastFrameInfo(this->aac_decoder_, &aac_frame_info);
+  if (this->aac_bitrate_ == 0) {
+    this->aac_bitrate_ = aac_frame_info.bitRate;
+  }
+  if (aac_frame_info.outputSamps > 0) {
+    this->output_buffer_length_ += aac_frame_info.outputSamps * sizeof(int16_t);
+
+    audio::AudioStreamInfo stream_info;
+    stream_info.channels = aac_frame_info.nChans;
+    stream_info.sample_rate = aac_frame_info.sampRateOut;
+    stream_info.bits_per_sample = aac_frame_info.bitsPerSample;
+    this->audio_stream_info_ = stream_info;
+  }
+
+  return FileDecoderState::MORE_TO_PROCESS;
+}
+
 FileDecoderState AudioDecoder::decode_flac_() {
   if (!this->audio_stream_info_.has_value()) {
-    // Header hasn't been read
-    auto result = this->flac_decoder_->read_header(this->input_buffer_length_);
+    // Header hasn't been read; the metadata blocks are consumed as they arrive
+    size_t bytes_consumed = 0;
+    FlacDecoderResult result =
+        this->flac_decoder_->read_header(this->input_buffer_current_, this->input_buffer_length_, &bytes_consumed);
+    this->input_buffer_current_ += bytes_consumed;
+    this->input_buffer_length_ -= bytes_consumed;
 
-    if (result == flac::FLAC_DECODER_HEADER_OUT_OF_DATA) {
+    if (result == FlacDecoderResult::NEED_MORE_DATA) {
       return FileDecoderState::POTENTIALLY_FAILED;
     }
 
-    if (result != flac::FLAC_DECODER_SUCCESS) {
+    if (result != FlacDecoderResult::SUCCESS) {
       // Couldn't read FLAC header
       return FileDecoderState::FAILED;
     }
 
-    size_t bytes_consumed = this->flac_decoder_->get_bytes_index();
-    this->input_buffer_current_ += bytes_consumed;
-    this->input_buffer_length_ = this->flac_decoder_->get_bytes_left();
+    this->audio_data_offset_ = this->stream_position_();
+    this->total_frames_ = this->flac_decoder_->get_total_samples();
 
-    size_t flac_decoder_output_buffer_min_size = flac_decoder_->get_output_buffer_size();
-    if (this->internal_buffer_size_ < flac_decoder_output_buffer_min_size * sizeof(int16_t)) {
-      // Output buffer is not big enough
+    if (this->output_ring_buffer_->max_span() < this->flac_decoder_->get_max_output_bytes()) {
+      // Output ring buffer can't provide a large enough span for a single frame
       return FileDecoderState::FAILED;
     }
 
     audio::AudioStreamInfo audio_stream_info;
-    audio_stream_info.channels = this->flac_decoder_->get_num_channels();
+    audio_stream_info.channels = this->flac_decoder_->get_channels();
     audio_stream_info.sample_rate = this->flac_decoder_->get_sample_rate();
-    audio_stream_info.bits_per_sample = this->flac_decoder_->get_sample_depth();
+    audio_stream_info.bits_per_sample = this->flac_decoder_->get_output_bits_per_sample();
 
     this->audio_stream_info_ = audio_stream_info;
 
     return FileDecoderState::MORE_TO_PROCESS;
   }
 
-  uint32_t output_samples = 0;
-  auto result =
-      this->flac_decoder_->decode_frame(this->input_buffer_length_, (int16_t *) this->output_buffer_, &output_samples);
+  if (this->resyncing_) {
+    int32_t offset = FlacStreamDecoder::find_frame_header(this->input_buffer_current_, this->input_buffer_length_);
+    if (offset < 0) {
+      // Keep the bytes that may be the start of a header once more data arrives
+      size_t bytes_to_discard = 0;
+      if (this->input_buffer_length_ >= FLAC_MAX_FRAME_HEADER_SIZE) {
+        bytes_to_discard = this->input_buffer_length_ - FLAC_MAX_FRAME_HEADER_SIZE + 1;
+      }
+      this->input_buffer_current_ += bytes_to_discard;
+      this->input_buffer_length_ -= bytes_to_discard;
+      return FileDecoderState::POTENTIALLY_FAILED;
+    }
+    this->input_buffer_current_ += offset;
+    this->input_buffer_length_ -= offset;
+    this->resyncing_ = false;
+  }
 
-  if (result == flac::FLAC_DECODER_ERROR_OUT_OF_DATA) {
+  size_t bytes_consumed = 0;
+  uint32_t frames = 0;
+  FlacDecoderResult result =
+      this->flac_decoder_->decode_frame(this->input_buffer_current_, this->input_buffer_length_,
+                                        this->output_buffer_ + this->output_buffer_length_, &bytes_consumed, &frames);
+  this->input_buffer_current_ += bytes_consumed;
+  this->input_buffer_length_ -= bytes_consumed;
+
+  if (result == FlacDecoderResult::NEED_MORE_DATA) {
     // Not an issue, just needs more data that we'll get next time.
     return FileDecoderState::POTENTIALLY_FAILED;
-  } else if (result > flac::FLAC_DECODER_ERROR_OUT_OF_DATA) {
-    // Corrupted frame, don't retry with current buffer content, wait for new sync
-    size_t bytes_consumed = this->flac_decoder_->get_bytes_index();
-    this->input_buffer_current_ += bytes_consumed;
-    this->input_buffer_length_ = this->flac_decoder_->get_bytes_left();
-
+  } else if (result == FlacDecoderResult::CORRUPTED) {
+    // Search for the next frame header past the corrupted one
+    this->resyncing_ = true;
     return FileDecoderState::POTENTIALLY_FAILED;
+  } else if (result == FlacDecoderResult::UNSUPPORTED) {
+    return FileDecoderState::FAILED;
   }
 
   // We have successfully decoded some input data and have new output data
-  size_t bytes_consumed = this->flac_decoder_->get_bytes_index();
-  this->input_buffer_current_ += bytes_consumed;
-  this->input_buffer_length_ = this->flac_decoder_->get_bytes_left();
-
-  this->output_buffer_current_ = this->output_buffer_;
-  this->output_buffer_length_ = output_samples * sizeof(int16_t);
+  const audio::AudioStreamInfo &stream_info = this->audio_stream_info_.value();
+  const size_t frame_start = this->output_buffer_length_;
+  this->output_buffer_length_ += frames * stream_info.channels * (stream_info.bits_per_sample / 8);
+  this->skip_output_frames_(frame_start);
 
-  if (result == flac::FLAC_DECODER_NO_MORE_FRAMES) {
+  if (result == FlacDecoderResult::END_OF_STREAM) {
     return FileDecoderState::END_OF_FILE;
   }
 
-  return FileDecoderState::IDLE;
+  return FileDecoderState::MORE_TO_PROCESS;
 }
 
 FileDecoderState AudioDecoder::decode_mp3_() {
@@ -268,25 +770,50 @@ FileDecoderState AudioDecoder::decode_mp3_() {
   this->input_buffer_current_ += offset;
   this->input_buffer_length_ -= offset;
 
+  if (!this->mp3_first_frame_seen_) {
+    this->mp3_first_frame_seen_ = true;
+    this->audio_data_offset_ = this->stream_position_();
+    this->parse_mp3_info_frame_();
+  }
+
+  uint8_t *frame_start = this->input_buffer_current_;
+  const size_t length_before = this->input_buffer_length_;
   int err = MP3Decode(this->mp3_decoder_, &this->input_buffer_current_, (int *) &this->input_buffer_length_,
-                      (int16_t *) this->output_buffer_, 0);
+                      this->output_samples_(), 0);
   if (err) {
     switch (err) {
       case ERR_MP3_MAINDATA_UNDERFLOW:
         // Not a problem. Next call to decode will provide more data.
         return FileDecoderState::POTENTIALLY_FAILED;
         break;
+      case ERR_MP3_INDATA_UNDERFLOW:
+        // Only part of the frame has arrived. The decoder may have consumed its header already, so start over from the
+        // sync word once the rest is available.
+        this->input_buffer_current_ = frame_start;
+        this->input_buffer_length_ = length_before;
+        return FileDecoderState::POTENTIALLY_FAILED;
+        break;
       default:
+        if (this->resyncing_ && (this->input_buffer_length_ > 0)) {
+          // Audio data that looked like a sync word; try the next one
+          ++this->input_buffer_current_;
+          --this->input_buffer_length_;
+          return FileDecoderState::MORE_TO_PROCESS;
+        }
         return FileDecoderState::FAILED;
         break;
     }
   } else {
+    this->resyncing_ = false;
+
     MP3FrameInfo mp3_frame_info;
     MP3GetLastFrameInfo(this->mp3_decoder_, &mp3_frame_info);
+    if (this->mp3_bitrate_ == 0) {
+      this->mp3_bitrate_ = mp3_frame_info.bitrate;
+    }
     if (mp3_frame_info.outputSamps > 0) {
       int bytes_per_sample = (mp3_frame_info.bitsPerSample / 8);
-      this->output_buffer_length_ = mp3_frame_info.outputSamps * bytes_per_sample;
-      this->output_buffer_current_ = this->output_buffer_;
+      this->output_buffer_length_ += mp3_frame_info.outputSamps * bytes_per_sample;
 
       audio::AudioStreamInfo stream_info;
       stream_info.channels = mp3_frame_info.nChans;
@@ -299,10 +826,203 @@ FileDecoderState AudioDecoder::decode_mp3_() {
   return FileDecoderState::MORE_TO_PROCESS;
 }
 
+FileDecoderState AudioDecoder::decode_opus_() {
+  bool progressed = false;
+
+  while (true) {
+    if (this->opus_lacing_index_ == this->opus_lacing_count_) {
+      // Between pages; search for the next page's capture pattern, keeping the bytes that may be the start of it
+      size_t offset = 0;
+      while ((offset + 4 <= this->input_buffer_length_) &&
+             (std::memcmp(this->input_buffer_current_ + offset, "OggS", 4) != 0)) {
+        ++offset;
+      }
+      if (offset > 0) {
+        // Lost sync, or continuing at a new offset after a seek; the packet in progress can't be completed
+        this->input_buffer_current_ += offset;
+        this->input_buffer_length_ -= offset;
+        this->opus_packet_length_ = 0;
+        progressed = true;
+      }
+
+      if (this->input_buffer_length_ < OGG_PAGE_HEADER_SIZE) {
+        return progressed ? FileDecoderState::MORE_TO_PROCESS : FileDecoderState::POTENTIALLY_FAILED;
+      }
+
+      const uint8_t *header = this->input_buffer_current_;
+      if (header[4] != 0) {
+        // Unknown version, so audio data that happens to look like a capture pattern
+        ++this->input_buffer_current_;
+        --this->input_buffer_length_;
+        progressed = true;
+        continue;
+      }
+
+      const uint8_t segments = header[26];
+      if (this->input_buffer_length_ < OGG_PAGE_HEADER_SIZE + segments) {
+        return progressed ? FileDecoderState::MORE_TO_PROCESS : FileDecoderState::POTENTIALLY_FAILED;
+      }
+
+      const uint8_t header_type = header[5];
+      const uint32_t serial = read_le32(header + 14);
+      const bool awaiting_first_head = (this->opus_decoder_ == nullptr) && (this->opus_header_packets_ == 0);
+      if ((header_type & OGG_FIRST_PAGE_FLAG) || awaiting_first_head) {
+        // A new logical stream (e.g., the next stream of a chained radio stream) starts with its own headers. Before
+        // the first OpusHead, follow whichever stream comes first, so a stream without headers fails to parse.
+        this->opus_serial_ = serial;
+        this->opus_header_packets_ = 0;
+      }
+      this->opus_skip_page_ = (serial != this->opus_serial_);
+
+      if (!this->opus_skip_page_) {
+        if (header_type & OGG_CONTINUED_FLAG) {
+          // The page continues a packet whose start was lost
+          this->opus_packet_dropped_ |= (this->opus_packet_length_ == 0);
+        } else {
+          // The previous page's last packet was never finished
+          this->opus_packet_length_ = 0;
+          this->opus_packet_dropped_ = false;
+        }
+
+        const uint64_t granule = read_le64(header + 6);
+        if (granule != OGG_NO_GRANULE) {
+          this->opus_granule_ = granule;
+          this->opus_granule_offset_ = this->stream_position_();
+        }
+      }
+
+      std::memcpy(this->opus_lacing_, header + OGG_PAGE_HEADER_SIZE, segments);
+      this->opus_lacing_count_ = segments;
+      this->opus_lacing_index_ = 0;
+      this->input_buffer_current_ += OGG_PAGE_HEADER_SIZE + segments;
+      this->input_buffer_length_ -= OGG_PAGE_HEADER_SIZE + segments;
+      progressed = true;
+      continue;
+    }
+
+    const uint8_t segment_length = this->opus_lacing_[this->opus_lacing_index_];
+    if (this->input_buffer_length_ < segment_length) {
+      return progressed ? FileDecoderState::MORE_TO_PROCESS : FileDecoderState::POTENTIALLY_FAILED;
+    }
+
+    if (!this->opus_skip_page_ && !this->opus_packet_dropped_) {
+      if (this->opus_packet_length_ + segment_length > OPUS_MAX_PACKET_SIZE) {
+        this->opus_packet_dropped_ = true;
+      } else {
+        std::memcpy(this->opus_packet_ + this->opus_packet_length_, this->input_buffer_current_, segment_length);
+        this->opus_packet_length_ += segment_length;
+      }
+    }
+    this->input_buffer_current_ += segment_length;
+    this->input_buffer_length_ -= segment_length;
+    ++this->opus_lacing_index_;
+    progressed = true;
+
+    // A segment shorter than 255 bytes ends the packet
+    if ((segment_length == 255) || this->opus_skip_page_) {
+      continue;
+    }
+
+    const size_t packet_length = this->opus_packet_length_;
+    const bool dropped = this->opus_packet_dropped_;
+    this->opus_packet_length_ = 0;
+    this->opus_packet_dropped_ = false;
+    if (dropped) {
+      continue;
+    }
+
+    if (this->opus_header_packets_ == 0) {
+      ++this->opus_header_packets_;
+      return this->parse_opus_head_(this->opus_packet_, packet_length);
+    }
+    if (this->opus_header_packets_ == 1) {
+      // OpusTags; the audio packets follow
+      ++this->opus_header_packets_;
+      this->audio_data_offset_ = this->stream_position_();
+      continue;
+    }
+
+    int samples = opus_decode(this->opus_decoder_, this->opus_packet_, packet_length, this->output_samples_(),
+                              this->opus_max_frame_samples_, 0);
+    if (samples < 0) {
+      // Corrupted packet; continue with the next one
+      return FileDecoderState::POTENTIALLY_FAILED;
+    }
+
+    const size_t frame_start = this->output_buffer_length_;
+    this->output_buffer_length_ += samples * this->audio_stream_info_.value().channels * sizeof(int16_t);
+    this->skip_output_frames_(frame_start);
+    return FileDecoderState::MORE_TO_PROCESS;
+  }
+}
+
+FileDecoderState AudioDecoder::parse_opus_head_(const uint8_t *packet, size_t length) {
+  if ((length < OPUS_HEAD_SIZE) || (std::memcmp(packet, "OpusHead", 8) != 0) || ((packet[8] >> 4) != 0)) {
+    // Not an Opus stream (e.g., Ogg Vorbis), or an incompatible version
+    return FileDecoderState::FAILED;
+  }
+
+  const uint8_t channels = packet[9];
+  const uint16_t pre_skip = read_le16(packet + 10);
+  const uint32_t original_sample_rate = read_le32(packet + 12);
+  const int16_t output_gain = static_cast<int16_t>(read_le16(packet + 16));
+  const uint8_t channel_mapping_family = packet[18];
+
+  if ((channel_mapping_family != 0) || (channels == 0) || (channels > 2)) {
+    // Surround streams need libopus's multistream decoder
+    return FileDecoderState::FAILED;
+  }
+
+  // Decode at the rate the stream was encoded from if libopus supports it, avoiding resampling it twice
+  uint32_t sample_rate = OPUS_GRANULE_RATE;
+  for (uint32_t supported_rate : OPUS_SAMPLE_RATES) {
+    if (original_sample_rate == supported_rate) {
+      sample_rate = supported_rate;
+    }
+  }
+
+  if (this->opus_decoder_ != nullptr) {
+    // A chained stream; the stages after the decoder can't change format mid-stream
+    const audio::AudioStreamInfo &stream_info = this->audio_stream_info_.value();
+    if ((stream_info.channels != channels) || (stream_info.sample_rate != sample_rate)) {
+      return FileDecoderState::FAILED;
+    }
+    opus_decoder_ctl(this->opus_decoder_, OPUS_RESET_STATE);
+  } else {
+    this->opus_max_frame_samples_ = sample_rate * OPUS_MAX_FRAME_MS / 1000;
+    if (this->output_ring_buffer_->max_span() < this->opus_max_frame_samples_ * channels * sizeof(int16_t)) {
+      // Output ring buffer can't provide a large enough span for the longest packet
+      return FileDecoderState::FAILED;
+    }
+
+    ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+    this->opus_decoder_size_ = opus_decoder_get_size(channels);
+    this->opus_decoder_ = reinterpret_cast<OpusDecoder *>(allocator.allocate(this->opus_decoder_size_));
+    if (this->opus_decoder_ == nullptr) {
+      return FileDecoderState::FAILED;
+    }
+    if (opus_decoder_init(this->opus_decoder_, sample_rate, channels) != OPUS_OK) {
+      return FileDecoderState::FAILED;
+    }
+
+    audio::AudioStreamInfo audio_stream_info;
+    audio_stream_info.channels = channels;
+    audio_stream_info.sample_rate = sample_rate;
+    audio_stream_info.bits_per_sample = 16;
+    this->audio_stream_info_ = audio_stream_info;
+  }
+
+  opus_decoder_ctl(this->opus_decoder_, OPUS_SET_GAIN(output_gain));
+  this->frames_to_skip_ = static_cast<uint32_t>(pre_skip) * sample_rate / OPUS_GRANULE_RATE;
+
+  return FileDecoderState::MORE_TO_PROCESS;
+}
+
 FileDecoderState AudioDecoder::decode_wav_() {
   if (!this->audio_stream_info_.has_value() && (this->input_buffer_length_ > 44)) {
     // Header hasn't been processed
 
+    uint8_t *original_buffer_current = this->input_buffer_current_;
     size_t original_buffer_length = this->input_buffer_length_;
 
     size_t wav_bytes_to_skip = this->wav_decoder_->bytes_to_skip();
@@ -330,6 +1050,12 @@ FileDecoderState AudioDecoder::decode_wav_() {
           audio_stream_info.bits_per_sample = this->wav_decoder_->bits_per_sample();
           this->audio_stream_info_ = audio_stream_info;
           this->wav_bytes_left_ = this->wav_decoder_->chunk_bytes_left();
+          this->wav_data_length_ = this->wav_bytes_left_;
+          this->audio_data_offset_ = this->stream_position_();
+          const size_t bytes_per_frame = audio_stream_info.channels * audio_stream_info.bits_per_sample / 8;
+          if (bytes_per_frame > 0) {
+            this->total_frames_ = this->wav_data_length_ / bytes_per_frame;
+          }
           header_finished = true;
         } else if (result == wav_decoder::WAV_DECODER_SUCCESS_NEXT) {
           // Continue parsing header
@@ -343,7 +1069,7 @@ FileDecoderState AudioDecoder::decode_wav_() {
         // Something unexpected has happened
         // Reset state and hope we have enough info next time
         this->input_buffer_length_ = original_buffer_length;
-        this->input_buffer_current_ = this->input_buffer_;
+        this->input_buffer_current_ = original_buffer_current;
         return FileDecoderState::POTENTIALLY_FAILED;
       }
     }
@@ -351,22 +1077,138 @@ FileDecoderState AudioDecoder::decode_wav_() {
 
   if (this->wav_bytes_left_ > 0) {
     size_t bytes_to_write = std::min(this->wav_bytes_left_, this->input_buffer_length_);
-    bytes_to_write = std::min(bytes_to_write, this->internal_buffer_size_);
-    if (bytes_to_write > 0) {
-      std::memcpy(this->output_buffer_, this->input_buffer_current_, bytes_to_write);
-      this->input_buffer_current_ += bytes_to_write;
-      this->input_buffer_length_ -= bytes_to_write;
-      this->output_buffer_current_ = this->output_buffer_;
-      this->output_buffer_length_ = bytes_to_write;
-      this->wav_bytes_left_ -= bytes_to_write;
+    bytes_to_write = std::min(bytes_to_write, this->output_buffer_size_ - this->output_buffer_length_);
+
+    // Only transfer complete frames so the next span in the output ring buffer stays sample aligned
+    const audio::AudioStreamInfo &audio_stream_info = this->audio_stream_info_.value();
+    size_t bytes_per_frame = audio_stream_info.channels * audio_stream_info.bits_per_sample / 8;
+    bytes_to_write -= bytes_to_write % bytes_per_frame;
+
+    if (bytes_to_write == 0) {
+      // Not a complete frame yet; more data may fix this
+      return FileDecoderState::POTENTIALLY_FAILED;
     }
 
-    return FileDecoderState::IDLE;
+    std::memcpy(this->output_buffer_ + this->output_buffer_length_, this->input_buffer_current_, bytes_to_write);
+    this->input_buffer_current_ += bytes_to_write;
+    this->input_buffer_length_ -= bytes_to_write;
+    this->output_buffer_length_ += bytes_to_write;
+    this->wav_bytes_left_ -= bytes_to_write;
+
+    return FileDecoderState::MORE_TO_PROCESS;
   }
 
   return FileDecoderState::END_OF_FILE;
 }
 
+void AudioDecoder::parse_mp3_info_frame_() {
+  const uint8_t *frame = this->input_buffer_current_;
+  const size_t length = this->input_buffer_length_;
+  if (length < 4) {
+    return;
+  }
+
+  const bool mpeg1 = (((frame[1] >> 3) & 0x03) == 3);
+  const bool mono = ((frame[3] >> 6) == 3);
+  this->mp3_samples_per_frame_ = mpeg1 ? 1152 : 576;
+
+  // The Xing or Info tag follows the side information, whose size depends on the version and channel mode
+  const size_t xing_offset = 4 + (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+  if ((xing_offset + 8 <= length) &&
+      ((std::memcmp(frame + xing_offset, "Xing", 4) == 0) || (std::memcmp(frame + xing_offset, "Info", 4) == 0))) {
+    const uint8_t *field = frame + xing_offset + 4;
+    const uint8_t *end = frame + length;
+    const uint32_t flags = read_be32(field);
+    field += 4;
+
+    if ((flags & XING_FRAMES_FLAG) && (field + 4 <= end)) {
+      this->total_frames_ = static_cast<uint64_t>(read_be32(field)) * this->mp3_samples_per_frame_;
+      field += 4;
+    }
+    if ((flags & XING_BYTES_FLAG) && (field + 4 <= end)) {
+      this->mp3_stream_bytes_ = read_be32(field);
+      field += 4;
+    }
+    if ((flags & XING_TOC_FLAG) && (field + XING_TOC_SIZE <= end)) {
+      std::memcpy(this->mp3_toc_, field, XING_TOC_SIZE);
+      this->mp3_has_toc_ = true;
+    }
+    return;
+  }
+
+  if ((VBRI_OFFSET + VBRI_HEADER_SIZE <= length) && (std::memcmp(frame + VBRI_OFFSET, "VBRI", 4) == 0)) {
+    const uint8_t *header = frame + VBRI_OFFSET;
+    this->mp3_stream_bytes_ = read_be32(header + 10);
+    this->total_frames_ = static_cast<uint64_t>(read_be32(header + 14)) * this->mp3_samples_per_frame_;
+
+    const uint16_t entry_count = read_be16(header + 18);
+    const uint16_t scale = read_be16(header + 20);
+    const uint16_t entry_size = read_be16(header + 22);
+    const uint8_t *entries = header + VBRI_HEADER_SIZE;
+
+    if ((entry_count == 0) || (entry_size == 0) || (entry_size > 4) || (this->mp3_stream_bytes_ == 0) ||
+        (VBRI_OFFSET + VBRI_HEADER_SIZE + entry_count * entry_size > length)) {
+      return;
+    }
+
+    // Each entry is the size of one of entry_count equal stretches of time; convert them into a Xing style table of
+    // contents
+    auto read_entry = [entries, entry_size, scale](size_t index) {
+      uint32_t value = 0;
+      for (uint16_t i = 0; i < entry_size; ++i) {
+        value = (value << 8) | entries[index * entry_size + i];
+      }
+      return static_cast<uint64_t>(value) * scale;
+    };
+
+    uint64_t bytes_before_entry = 0;
+    size_t entry = 0;
+    for (size_t percent = 0; percent < XING_TOC_SIZE; ++percent) {
+      const float entry_position = percent * entry_count / 100.0f;
+      while ((entry + 1 < entry_count) && (entry + 1 <= entry_position)) {
+        bytes_before_entry += read_entry(entry);
+        ++entry;
+      }
+      const float bytes = bytes_before_entry + (entry_position - entry) * read_entry(entry);
+      this->mp3_toc_[percent] = std::min(255.0f, bytes * 256.0f / this->mp3_stream_bytes_);
+    }
+    this->mp3_has_toc_ = true;
+  }
+}
+
+void AudioDecoder::skip_output_frames_(size_t frame_start) {
+  if ((this->frames_to_skip_ == 0) || (this->output_buffer_length_ == frame_start)) {
+    return;
+  }
+
+  const audio::AudioStreamInfo &stream_info = this->audio_stream_info_.value();
+  const size_t bytes_per_frame = stream_info.channels * stream_info.bits_per_sample / 8;
+  const size_t frames_decoded = (this->output_buffer_length_ - frame_start) / bytes_per_frame;
+  const size_t frames_skipped = std::min<size_t>(this->frames_to_skip_, frames_decoded);
+
+  uint8_t *frame = this->output_buffer_ + frame_start;
+  std::memmove(frame, frame + frames_skipped * bytes_per_frame, (frames_decoded - frames_skipped) * bytes_per_frame);
+  this->output_buffer_length_ -= frames_skipped * bytes_per_frame;
+  this->frames_to_skip_ -= frames_skipped;
+}
+
+void AudioDecoder::downmix_output_() {
+  if (!this->audio_stream_info_.has_value() || (this->output_buffer_length_ == 0)) {
+    return;
+  }
+
+  const audio::AudioStreamInfo &stream_info = this->audio_stream_info_.value();
+  const uint8_t output_channels = downmixed_channels(stream_info.channels);
+  if (output_channels == stream_info.channels) {
+    return;
+  }
+
+  const uint8_t bytes_per_sample = stream_info.bits_per_sample / 8;
+  const size_t frames = this->output_buffer_length_ / (stream_info.channels * bytes_per_sample);
+  downmix_frames(this->output_buffer_, frames, stream_info.channels, bytes_per_sample);
+  this->output_buffer_length_ = frames * output_channels * bytes_per_sample;
+}
+
 }  // namespace nabu
 }  // namespace esphome
 
@@ -2,25 +2,23 @@
 
 #ifdef USE_ESP_IDF
 
-#include <flac_decoder.h>
+#include <aacdec.h>
 #include <wav_decoder.h>
 #include <mp3_decoder.h>
+#include <opus.h>
+
+#include "audio_stage.h"
+#include "flac_stream_decoder.h"
+#include "mp4_demuxer.h"
 
 #include "esphome/components/audio/audio.h"
 #include "esphome/components/media_player/media_player.h"
 
-#include "esphome/core/ring_buffer.h"
+#include <vector>
 
 namespace esphome {
 namespace nabu {
 
-enum class AudioDecoderState : uint8_t {
-  INITIALIZED = 0,
-  DECODING,
-  FINISHED,
-  FAILED,
-};
-
 // Only used within the AudioDecoder class; conveys the state of the particular file type decoder
 enum class FileDecoderState : uint8_t {
   MORE_TO_PROCESS,
@@ -30,49 +28,163 @@ enum class FileDecoderState : uint8_t {
   END_OF_FILE,
 };
 
-class AudioDecoder {
+// Decodes an AAC, FLAC, MP3, Opus, or WAV stream into PCM audio. Its input format is the file type, and its output
+// format is the stream information parsed from the file.
+//  - WAV and FLAC audio keep their sample width (16, 24, or 32 bits; FLAC widens odd depths like 20 bits to the next
+//    one); the resampler widens it for the mixer. MP3, AAC, and Opus decode to 16 bits.
+//  - Opus streams are demuxed from Ogg pages here and decoded with libopus at the stream's original sample rate if
+//    libopus supports it (otherwise 48 kHz), skipping the pre-skip samples. Only mono and stereo (channel mapping
+//    family 0) streams are supported. Chained streams continue if they keep the same format.
+//  - AAC-LC (optionally with SBR) is decoded with libhelix, either from ADTS frames or from the samples of a
+//    progressive MP4 (M4A) file, which the MP4Demuxer locates. An MP4 file is told apart by its leading ``ftyp`` box.
+//  - Sources with more than two channels (up to eight) are mixed down in place: 5.1 to stereo, and other layouts to
+//    mono. The output format reports the mixed down channel count.
+//  - While parsing the header, it keeps what it needs to locate a position in the file later: the FLAC SEEKTABLE, the
+//    MP3 Xing or VBRI table of contents, or the start of the WAV data
+//  - The file decoders read the encoded audio in memory in place if the input format points at it (e.g., a MediaFile in
+//    flash). The AAC, MP3, Opus, and WAV decoders also read spans peeked from the input ring buffer in place, released
+//    once decoded. A FLAC frame has to be whole to be decoded and may be longer than a span, so the FLAC decoder copies
+//    the ring buffer's data into its input buffer instead.
+//  - After a seek, the next start continues the same stream at a new offset, keeping the parsed header. FLAC, MP3,
+//    and ADTS streams first search for the next valid frame header, since the offset may be in the middle of a frame.
+//    MP4 sample tables locate the exact offset of a frame.
+class AudioDecoder : public AudioStage {
  public:
-  AudioDecoder(esphome::RingBuffer *input_ring_buffer, esphome::RingBuffer *output_ring_buffer,
-               size_t internal_buffer_size);
+  AudioDecoder(size_t internal_buffer_size);
   ~AudioDecoder();
 
-  esp_err_t start(media_player::MediaFileType media_file_type);
+  const char *get_name() const override { return "decoder"; }
+
+  esp_err_t start(const AudioStreamFormat &input_format) override;
+
+  /// @brief Locates a position in the current stream and prepares the next start to continue the stream from there
+  /// instead of starting a new one. Only call while the stage isn't running.
+  /// If the position can't be located (e.g., a FLAC file without a SEEKTABLE and of unknown length), the stream
+  /// continues where decoding stopped. If the header hasn't been parsed yet, the stream starts over.
+  /// @param position_ms Position to continue from, in milliseconds from the start of the stream
+  /// @param source_length Size of the whole file in bytes, 0 if unknown
+  /// @return Byte offset in the file the next start expects its input to begin at
+  size_t seek(uint32_t position_ms, size_t source_length);
 
-  AudioDecoderState decode(bool stop_gracefully);
+  /// @brief Sets how many bytes of decoded audio are collected in the output span before they are published at once.
+  /// 0 publishes every frame on its own. Only call while the stage isn't running.
+  void set_output_batch_bytes(size_t output_batch_bytes) { this->output_batch_bytes_ = output_batch_bytes; }
 
-  const optional<audio::AudioStreamInfo> &get_audio_stream_info() const { return this->audio_stream_info_; }
+  AudioStageState process(bool stop_gracefully) override;
+
+  optional<AudioStreamFormat> get_output_format() const override;
+
+  void release_buffers() override;
 
  protected:
   esp_err_t allocate_buffers_();
 
+  /// @brief Frees the file type specific decoder of the previous stream
+  void free_file_decoder_();
+
+  /// @brief Determines how much contiguous space the file decoder needs to decode its next frame
+  /// @return minimum number of bytes to acquire from the output ring buffer
+  size_t min_output_bytes_();
+
+  FileDecoderState decode_aac_();
   FileDecoderState decode_flac_();
   FileDecoderState decode_mp3_();
+  FileDecoderState decode_opus_();
   FileDecoderState decode_wav_();
 
-  esphome::RingBuffer *input_ring_buffer_;
-  esphome::RingBuffer *output_ring_buffer_;
+  /// @brief Reads the OpusHead packet and sets up the Opus decoder for the stream it describes
+  FileDecoderState parse_opus_head_(const uint8_t *packet, size_t length);
+
+  /// @brief Reads the Xing/Info or VBRI tag if the first MP3 frame (at the start of the input buffer) has one
+  void parse_mp3_info_frame_();
+
+  /// @brief Mixes the decoded frames in the output span down to stereo or mono in place if the source has more than
+  /// two channels
+  void downmix_output_();
+
+  /// @brief Drops frames from the start of the just decoded audio in the output span until the seek position is reached
+  /// @param frame_start Offset in the output span of the just decoded audio
+  void skip_output_frames_(size_t frame_start);
+
+  /// @brief Mixes down and commits the batch of decoded audio in the output span, if a span is acquired
+  void publish_output_();
+
+  /// @brief Where the file decoder writes its next frame, just past the audio already in the output span
+  int16_t *output_samples_() { return reinterpret_cast<int16_t *>(this->output_buffer_ + this->output_buffer_length_); }
+
+  /// @brief Offset in the file of the next byte in the input buffer
+  size_t stream_position_() const { return this->input_bytes_read_ - this->input_buffer_length_; }
+
   size_t internal_buffer_size_;
 
+  // The FLAC decoder needs whole frames, so compressed data from the input ring buffer is staged here
   uint8_t *input_buffer_{nullptr};
-  uint8_t *input_buffer_current_{nullptr};
+  uint8_t *input_buffer_current_{nullptr};  // Next byte to decode; in a peeked span only while process runs
   size_t input_buffer_length_;
 
+  // Set if the input is already in memory; the input ring buffer isn't used then
+  const uint8_t *input_memory_{nullptr};
+  size_t input_memory_length_{0};  // Bytes not yet handed to the file decoder
+
+  // Span acquired from the output ring buffer; the file decoders append decoded frames directly to it until a batch is
+  // published. Only set while process runs.
   uint8_t *output_buffer_{nullptr};
-  uint8_t *output_buffer_current_{nullptr};
-  size_t output_buffer_length_;
+  size_t output_buffer_size_{0};    // Contiguous bytes available in the span
+  size_t output_buffer_length_{0};  // Bytes of decoded audio written into the span
+  size_t output_batch_bytes_;
+
+  HAACDecoder aac_decoder_{nullptr};
+  std::unique_ptr<MP4Demuxer> mp4_demuxer_;  // Set if the AAC stream is in an MP4 container
+  bool aac_container_known_{false};
+  bool aac_raw_params_set_{false};  // MP4 samples are raw blocks; the decoder is told their format once
 
-  std::unique_ptr<flac::FLACDecoder> flac_decoder_;
+  std::unique_ptr<FlacStreamDecoder> flac_decoder_;
 
   HMP3Decoder mp3_decoder_;
 
+  // The Opus decoder's state and the buffer packets are assembled in, as a packet's segments may span Ogg pages
+  OpusDecoder *opus_decoder_{nullptr};
+  size_t opus_decoder_size_{0};
+  uint8_t *opus_packet_{nullptr};
+  size_t opus_packet_length_{0};
+  bool opus_packet_dropped_{false};  // The packet's start was lost or it is too large; skip its remaining segments
+  uint8_t opus_lacing_[255];        // Segment sizes of the current Ogg page
+  uint8_t opus_lacing_count_{0};
+  uint8_t opus_lacing_index_{0};  // Next segment of the current page; equals the count between pages
+  bool opus_skip_page_{false};    // The current page belongs to another logical stream
+  uint32_t opus_serial_{0};
+  uint8_t opus_header_packets_{0};  // OpusHead and OpusTags packets seen in the current logical stream
+  uint32_t opus_max_frame_samples_{0};
+
   std::unique_ptr<wav_decoder::WAVDecoder> wav_decoder_;
-  size_t wav_bytes_left_;
+  size_t wav_bytes_left_{0};
 
   media_player::MediaFileType media_file_type_{media_player::MediaFileType::NONE};
   optional<audio::AudioStreamInfo> audio_stream_info_{};
 
   size_t potentially_failed_count_{0};
+  bool input_consumed_{false};  // The last file decoder call consumed input
   bool end_of_file_{false};
+
+  // Where the stream is in the file and what is known about the file's layout, for seeking
+  size_t input_bytes_read_{0};   // Offset in the file just past the data in the input buffer
+  size_t audio_data_offset_{0};  // Offset of the first audio frame (or WAV sample) in the file
+  uint64_t total_frames_{0};     // Audio frames (samples per channel) in the stream, 0 if unknown
+  bool mp3_first_frame_seen_{false};
+  uint16_t mp3_samples_per_frame_{0};
+  uint32_t mp3_bitrate_{0};       // Bits per second of the first frame
+  uint32_t mp3_stream_bytes_{0};  // From the Xing or VBRI tag, 0 if unknown
+  bool mp3_has_toc_{false};
+  uint8_t mp3_toc_[100];  // Xing style table of contents; byte offset / total bytes * 256 for each percent of time
+  size_t wav_data_length_{0};
+  uint32_t aac_bitrate_{0};  // Bits per second of the first ADTS frame
+  uint64_t opus_granule_{0};       // Granule position (48 kHz samples) of the last page that completed a packet
+  size_t opus_granule_offset_{0};  // Offset in the file just past that page's header
+
+  bool resume_{false};          // Set by seek; the next start continues the current stream
+  size_t resume_offset_{0};     // Offset in the file the continued stream starts at
+  bool resyncing_{false};       // Searching for the next frame header after continuing at a new offset
+  uint32_t frames_to_skip_{0};  // Decoded frames to drop after continuing at a FLAC seek point
 };
 }  // namespace nabu
 }  // namespace esphome
@@ -0,0 +1,215 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_downmix.h"
+
+namespace esphome {
+namespace nabu {
+
+static const uint8_t SURROUND_5_1_CHANNELS = 6;
+static const int32_t DOWNMIX_UNITY_Q15 = 1 << 15;
+
+// Q15 weights for mixing 5.1 audio (FL, FR, FC, LFE, BL, BR) down to stereo; each output's weights sum to unity
+static const int32_t DOWNMIX_5_1_FRONT_WEIGHT = 13572;
+static const int32_t DOWNMIX_5_1_CENTER_WEIGHT = 9598;
+static const int32_t DOWNMIX_5_1_BACK_WEIGHT = 9598;
+
+enum Surround51Channel : uint8_t {
+  FRONT_LEFT = 0,
+  FRONT_RIGHT,
+  CENTER,
+  LOW_FREQUENCY,
+  BACK_LEFT,
+  BACK_RIGHT,
+};
+
+static int32_t load_sample(const uint8_t *data, uint8_t bytes_per_sample) {
+  switch (bytes_per_sample) {
+    case 2:
+      return static_cast<int16_t>(data[0] | (data[1] << 8));
+    case 3:
+      return static_cast<int32_t>((static_cast<uint32_t>(data[2]) << 24) | (data[1] << 16) | (data[0] << 8)) >> 8;
+    default:
+      return static_cast<int32_t>(data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24));
+  }
+}
+
+static void store_sample(uint8_t *data, int32_t value, uint8_t bytes_per_sample) {
+  for (uint8_t i = 0; i < bytes_per_sample; ++i) {
+    data[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+uint8_t downmixed_channels(uint8_t channels) {
+  if ((channels <= 2) || (channels > MAX_DOWNMIX_CHANNELS)) {
+    return channels;
+  }
+  return (channels == SURROUND_5_1_CHANNELS) ? 2 : 1;
+}
+
+void get_downmix_weights(uint8_t channels, int32_t *weights) {
+  if (channels == SURROUND_5_1_CHANNELS) {
+    int32_t *left = weights;
+    int32_t *right = weights + SURROUND_5_1_CHANNELS;
+    for (uint8_t channel = 0; channel < SURROUND_5_1_CHANNELS; ++channel) {
+      left[channel] = 0;
+      right[channel] = 0;
+    }
+    left[FRONT_LEFT] = DOWNMIX_5_1_FRONT_WEIGHT;
+    left[CENTER] = DOWNMIX_5_1_CENTER_WEIGHT;
+    left[BACK_LEFT] = DOWNMIX_5_1_BACK_WEIGHT;
+    right[FRONT_RIGHT] = DOWNMIX_5_1_FRONT_WEIGHT;
+    right[CENTER] = DOWNMIX_5_1_CENTER_WEIGHT;
+    right[BACK_RIGHT] = DOWNMIX_5_1_BACK_WEIGHT;
+    return;
+  }
+  for (uint8_t channel = 0; channel < channels; ++channel) {
+    weights[channel] = DOWNMIX_UNITY_Q15 / channels;
+  }
+}
+
+// Each output frame lies at or before the input frame it is computed from, so the loops below process the frames front
+// to back, and read each frame's inputs before writing any of its outputs
+
+// Only the front, center, and back channel of each side carry weight, so the other three are never read
+static void downmix_5_1_16bit(uint8_t *data, size_t frames) {
+  const int16_t *input = reinterpret_cast<const int16_t *>(data);
+  int16_t *output = reinterpret_cast<int16_t *>(data);
+  for (size_t frame = 0; frame < frames; ++frame) {
+    const int32_t center = input[CENTER] * DOWNMIX_5_1_CENTER_WEIGHT;
+    const int32_t left =
+        input[FRONT_LEFT] * DOWNMIX_5_1_FRONT_WEIGHT + center + input[BACK_LEFT] * DOWNMIX_5_1_BACK_WEIGHT;
+    const int32_t right =
+        input[FRONT_RIGHT] * DOWNMIX_5_1_FRONT_WEIGHT + center + input[BACK_RIGHT] * DOWNMIX_5_1_BACK_WEIGHT;
+    output[0] = static_cast<int16_t>(left >> 15);
+    output[1] = static_cast<int16_t>(right >> 15);
+    input += SURROUND_5_1_CHANNELS;
+    output += 2;
+  }
+}
+
+// The sample width is a template parameter, so loading and storing a sample compiles down to a few shifts
+template<uint8_t bytes_per_sample> static void downmix_5_1(uint8_t *data, size_t frames) {
+  const uint8_t *input = data;
+  uint8_t *output = data;
+  for (size_t frame = 0; frame < frames; ++frame) {
+    const int64_t front_left = load_sample(input + FRONT_LEFT * bytes_per_sample, bytes_per_sample);
+    const int64_t front_right = load_sample(input + FRONT_RIGHT * bytes_per_sample, bytes_per_sample);
+    const int64_t center = load_sample(input + CENTER * bytes_per_sample, bytes_per_sample);
+    const int64_t back_left = load_sample(input + BACK_LEFT * bytes_per_sample, bytes_per_sample);
+    const int64_t back_right = load_sample(input + BACK_RIGHT * bytes_per_sample, bytes_per_sample);
+
+    const int64_t weighted_center = center * DOWNMIX_5_1_CENTER_WEIGHT;
+    const int64_t left = front_left * DOWNMIX_5_1_FRONT_WEIGHT + weighted_center + back_left * DOWNMIX_5_1_BACK_WEIGHT;
+    const int64_t right =
+        front_right * DOWNMIX_5_1_FRONT_WEIGHT + weighted_center + back_right * DOWNMIX_5_1_BACK_WEIGHT;
+    store_sample(output, static_cast<int32_t>(left >> 15), bytes_per_sample);
+    store_sample(output + bytes_per_sample, static_cast<int32_t>(right >> 15), bytes_per_sample);
+    input += SURROUND_5_1_CHANNELS * bytes_per_sample;
+    output += 2 * bytes_per_sample;
+  }
+}
+
+// Every channel has the same weight, so the samples are summed first and weighted once. Eight full scale 16 bit
+// samples sum to 2^18 and the weight is at most 2^15 / 3, so the product fits in 32 bits.
+static void average_to_mono_16bit(uint8_t *data, size_t frames, uint8_t channels) {
+  const int32_t weight = DOWNMIX_UNITY_Q15 / channels;
+  const int16_t *input = reinterpret_cast<const int16_t *>(data);
+  int16_t *output = reinterpret_cast<int16_t *>(data);
+  for (size_t frame = 0; frame < frames; ++frame) {
+    int32_t sum = 0;
+    for (uint8_t channel = 0; channel < channels; ++channel) {
+      sum += input[channel];
+    }
+    output[frame] = static_cast<int16_t>((sum * weight) >> 15);
+    input += channels;
+  }
+}
+
+template<uint8_t bytes_per_sample> static void average_to_mono(uint8_t *data, size_t frames, uint8_t channels) {
+  const int32_t weight = DOWNMIX_UNITY_Q15 / channels;
+  const size_t input_frame_bytes = channels * bytes_per_sample;
+  const uint8_t *input = data;
+  uint8_t *output = data;
+  for (size_t frame = 0; frame < frames; ++frame) {
+    int64_t sum = 0;
+    for (uint8_t channel = 0; channel < channels; ++channel) {
+      sum += load_sample(input + channel * bytes_per_sample, bytes_per_sample);
+    }
+    store_sample(output, static_cast<int32_t>((sum * weight) >> 15), bytes_per_sample);
+    input += input_frame_bytes;
+    output += bytes_per_sample;
+  }
+}
+
+void downmix_frames(uint8_t *data, size_t frames, uint8_t channels, uint8_t bytes_per_sample) {
+  if (downmixed_channels(channels) == channels) {
+    return;
+  }
+
+  if (channels == SURROUND_5_1_CHANNELS) {
+    if (bytes_per_sample == 2) {
+      downmix_5_1_16bit(data, frames);
+    } else if (bytes_per_sample == 3) {
+      downmix_5_1<3>(data, frames);
+    } else {
+      downmix_5_1<4>(data, frames);
+    }
+  } else if (bytes_per_sample == 2) {
+    average_to_mono_16bit(data, frames, channels);
+  } else if (bytes_per_sample == 3) {
+    average_to_mono<3>(data, frames, channels);
+  } else {
+    average_to_mono<4>(data, frames, channels);
+  }
+}
+
+void downmix_frames_weighted(uint8_t *data, size_t frames, uint8_t input_channels, uint8_t output_channels,
+                             const int32_t *weights, uint8_t bytes_per_sample) {
+  if (bytes_per_sample == sizeof(int16_t)) {
+    // The weights of each output sum to at most unity, so 16 bit samples accumulate without overflowing 32 bits
+    const int16_t *input = reinterpret_cast<const int16_t *>(data);
+    int16_t *output = reinterpret_cast<int16_t *>(data);
+    for (size_t frame = 0; frame < frames; ++frame) {
+      int32_t mixed[2];
+      for (uint8_t out_channel = 0; out_channel < output_channels; ++out_channel) {
+        const int32_t *row = weights + out_channel * input_channels;
+        int32_t sum = 0;
+        for (uint8_t in_channel = 0; in_channel < input_channels; ++in_channel) {
+          sum += input[in_channel] * row[in_channel];
+        }
+        mixed[out_channel] = sum >> 15;
+      }
+      for (uint8_t out_channel = 0; out_channel < output_channels; ++out_channel) {
+        output[out_channel] = static_cast<int16_t>(mixed[out_channel]);
+      }
+      input += input_channels;
+      output += output_channels;
+    }
+    return;
+  }
+
+  const size_t input_frame_bytes = input_channels * bytes_per_sample;
+  const size_t output_frame_bytes = output_channels * bytes_per_sample;
+  for (size_t frame = 0; frame < frames; ++frame) {
+    const uint8_t *input = data + frame * input_frame_bytes;
+    int32_t mixed[2];
+    for (uint8_t out_channel = 0; out_channel < output_channels; ++out_channel) {
+      const int32_t *row = weights + out_channel * input_channels;
+      int64_t sum = 0;
+      for (uint8_t in_channel = 0; in_channel < input_channels; ++in_channel) {
+        sum += static_cast<int64_t>(load_sample(input + in_channel * bytes_per_sample, bytes_per_sample)) *
+               row[in_channel];
+      }
+      mixed[out_channel] = static_cast<int32_t>(sum >> 15);
+    }
+    uint8_t *output = data + frame * output_frame_bytes;
+    for (uint8_t out_channel = 0; out_channel < output_channels; ++out_channel) {
+      store_sample(output + out_channel * bytes_per_sample, mixed[out_channel], bytes_per_sample);
+    }
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nabu {
+
+// Sources with more than two channels are mixed down in the decoder, since the resampler only handles mono and stereo
+//  - 5.1 audio (FL, FR, FC, LFE, BL, BR) is mixed down to stereo. The center and back channels are attenuated by 3 dB
+//    and the LFE is dropped.
+//  - Other layouts (3, 4, 5, 7, or 8 channels) are averaged into mono, as their channel positions vary between formats
+//  - The weights of each output sum to at most unity, so a full scale source can't clip
+//  - Both layouts have their own loop that only reads the channels an output uses; 16 bit samples accumulate in 32
+//    bits and deeper ones in 64 bits. The general weighted loop gives the same results.
+
+static const uint8_t MAX_DOWNMIX_CHANNELS = 8;  // The most channels a FLAC stream can have
+
+/// @return number of channels a source with the given number of channels is mixed down to
+uint8_t downmixed_channels(uint8_t channels);
+
+/// @brief Mixes interleaved frames down in place to downmixed_channels(channels) channels
+/// @param data Frames of 16, 24, or 32 bit little endian samples
+/// @param frames Number of input frames at data
+/// @param channels Channels of the input frames
+/// @param bytes_per_sample 2, 3, or 4
+void downmix_frames(uint8_t *data, size_t frames, uint8_t channels, uint8_t bytes_per_sample);
+
+/// @brief Fills weights with the Q15 weights downmix_frames mixes with, a row of input channel weights per output
+/// channel
+/// @param weights Holds at least 2 * MAX_DOWNMIX_CHANNELS weights
+void get_downmix_weights(uint8_t channels, int32_t *weights);
+
+/// @brief Mixes interleaved frames down in place with Q15 weights by multiplying every input channel with its weight
+/// @param weights A row of input_channels weights for each output channel
+void downmix_frames_weighted(uint8_t *data, size_t frames, uint8_t input_channels, uint8_t output_channels,
+                             const int32_t *weights, uint8_t bytes_per_sample);
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -2,23 +2,32 @@
 
 #include "audio_mixer.h"
 
-#include <dsp.h>
-
 #include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
 
+#include <cstdlib>
+
 namespace esphome {
 namespace nabu {
 
-static const size_t INPUT_RING_BUFFER_SAMPLES = 24000;
+static const size_t MIN_INPUT_RING_BUFFER_SAMPLES = 24000;
 static const size_t OUTPUT_BUFFER_SAMPLES = 8192;
 static const size_t QUEUE_COUNT = 20;
 
 static const uint32_t TASK_STACK_SIZE = 3072;
 static const size_t TASK_DELAY_MS = 25;
 
-static const int16_t MAX_AUDIO_SAMPLE_VALUE = INT16_MAX;
-static const int16_t MIN_AUDIO_SAMPLE_VALUE = INT16_MIN;
+// A stream that underruns again within this window buffers half as much again before it continues
+static const uint32_t UNDERRUN_REPEAT_WINDOW_MS = 30000;
+// Each input ring buffer fits at least this multiple of its stream's configured prebuffer amount
+static const size_t PREBUFFER_GROWTH_HEADROOM = 2;
+// Leaves the producer room to keep writing while the mixer waits for the prebuffer amount
+static const size_t MAX_PREBUFFER_NUMERATOR = 3;
+static const size_t MAX_PREBUFFER_DENOMINATOR = 4;
+
+static const int32_t MAX_AUDIO_SAMPLE_VALUE = INT32_MAX;
+static const int32_t MIN_AUDIO_SAMPLE_VALUE = INT32_MIN;
+static const int16_t Q15_UNITY = INT16_MAX;  // Largest Q15 scaling factor, just under 1.0
 
 esp_err_t AudioMixer::start(speaker::Speaker *speaker, const std::string &task_name, UBaseType_t priority) {
   esp_err_t err = this->allocate_buffers_();
@@ -27,6 +36,10 @@ esp_err_t AudioMixer::start(speaker::Speaker *speaker, const std::string &task_n
     return err;
   }
 
+  const size_t max_prebuffer_bytes = max_prebuffer_bytes_(this->media_ring_buffer_.get());
+  this->media_input_.prebuffer_bytes = std::min(this->media_input_.prebuffer_bytes, max_prebuffer_bytes);
+  this->announcement_input_.prebuffer_bytes = std::min(this->announcement_input_.prebuffer_bytes, max_prebuffer_bytes);
+
   if (this->task_handle_ == nullptr) {
     this->task_handle_ = xTaskCreateStatic(AudioMixer::audio_mixer_task_, task_name.c_str(), TASK_STACK_SIZE,
                                            (void *) this, priority, this->stack_buffer_, &this->task_stack_);
@@ -49,6 +62,138 @@ void AudioMixer::stop() {
   xQueueReset(this->command_queue_);
 }
 
+uint32_t AudioMixer::get_wakeup_count() {
+  uint32_t wakeup_count = this->idle_wakeup_count_.load();
+  if (this->media_ring_buffer_ != nullptr) {
+    wakeup_count += this->media_ring_buffer_->get_wakeup_count();
+  }
+  if (this->announcement_ring_buffer_ != nullptr) {
+    wakeup_count += this->announcement_ring_buffer_->get_wakeup_count();
+  }
+  return wakeup_count;
+}
+
+AudioMixerStats AudioMixer::get_stats() {
+  AudioMixerStats stats{};
+
+  if ((this->media_ring_buffer_ == nullptr) || (this->announcement_ring_buffer_ == nullptr)) {
+    return stats;
+  }
+
+  stats.media_ring_buffer = this->media_ring_buffer_->get_stats();
+  stats.announcement_ring_buffer = this->announcement_ring_buffer_->get_stats();
+
+  stats.mixer.bytes_in = stats.media_ring_buffer.bytes_read + stats.announcement_ring_buffer.bytes_read;
+  stats.mixer.input_blocked_us = this->idle_us_.load(std::memory_order_relaxed);
+  stats.mixer.bytes_out = this->speaker_bytes_written_.load(std::memory_order_relaxed);
+  stats.mixer.output_blocked_us = this->speaker_blocked_us_.load(std::memory_order_relaxed);
+
+  stats.media_underruns = this->media_input_.underruns.load(std::memory_order_relaxed);
+  stats.announcement_underruns = this->announcement_input_.underruns.load(std::memory_order_relaxed);
+
+  return stats;
+}
+
+size_t AudioMixer::peek_input_(InputState &input, AudioRingBuffer *ring_buffer, int32_t **buffer,
+                               EventType underrun_event) {
+  size_t available = ring_buffer->available();
+
+  // Unsigned subtraction handles the counter wrapping around
+  if (input.end_pending && (static_cast<int32_t>(ring_buffer->get_stats().bytes_read - input.end_position) >= 0)) {
+    // Everything the finished stream wrote has been mixed. Any audio left directly follows it (e.g., the next
+    // playlist item), so it keeps playing without prebuffering.
+    input.end_pending = false;
+    input.starved = false;
+    if (available < sizeof(int32_t)) {
+      input.buffering = true;
+      return 0;
+    }
+  }
+
+  if (input.buffering) {
+    if ((available < sizeof(int32_t)) || ((available < input.prebuffer_bytes) && !input.end_pending)) {
+      return 0;
+    }
+    input.buffering = false;
+
+    if (input.starved) {
+      // The stream continued after running dry, so it wasn't the end of the stream
+      input.starved = false;
+      input.underruns.store(input.underruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+      uint32_t now = millis();
+      if ((input.underruns.load(std::memory_order_relaxed) > 1) &&
+          (now - input.last_underrun_time < UNDERRUN_REPEAT_WINDOW_MS)) {
+        input.prebuffer_bytes =
+            std::min(input.prebuffer_bytes + input.prebuffer_bytes / 2, max_prebuffer_bytes_(ring_buffer));
+      }
+      input.last_underrun_time = now;
+
+      TaskEvent event;
+      event.type = underrun_event;
+      event.err = ESP_OK;
+      xQueueSend(this->event_queue_, &event, 0);
+    }
+  }
+
+  size_t span = ring_buffer->peek(reinterpret_cast<uint8_t **>(buffer), sizeof(int32_t), 0);
+  if (span == 0) {
+    // Ran dry; buffer again instead of playing each span as it trickles in. It only counts as an underrun once more
+    // audio arrives, as the producer may have simply finished.
+    input.buffering = true;
+    input.starved = true;
+  }
+
+  return span;
+}
+
+size_t AudioMixer::max_prebuffer_bytes_(const AudioRingBuffer *ring_buffer) {
+  // The producer waits for room for a whole span, e.g., the resampler's 32 bit stereo output. If a full prebuffer
+  // left less than that free, the producer and the mixer would wait on each other.
+  const size_t capacity = ring_buffer->capacity();
+  const size_t max_prebuffer_bytes = capacity * MAX_PREBUFFER_NUMERATOR / MAX_PREBUFFER_DENOMINATOR;
+  if (capacity <= ring_buffer->max_span()) {
+    return std::min(max_prebuffer_bytes, sizeof(int32_t));
+  }
+  return std::min(max_prebuffer_bytes, capacity - ring_buffer->max_span());
+}
+
+size_t AudioMixer::input_ring_buffer_capacity_(const InputState &input) {
+  // Sized so max_prebuffer_bytes_ allows the grown prebuffer: three quarters of the capacity, leaving a span free
+  const size_t grown_prebuffer_bytes = input.prebuffer_bytes * PREBUFFER_GROWTH_HEADROOM;
+  size_t capacity = std::max(grown_prebuffer_bytes + OUTPUT_BUFFER_SAMPLES * sizeof(int32_t),
+                             grown_prebuffer_bytes * MAX_PREBUFFER_DENOMINATOR / MAX_PREBUFFER_NUMERATOR);
+  capacity = (capacity + sizeof(int32_t) - 1) / sizeof(int32_t) * sizeof(int32_t);
+  return std::max(capacity, MIN_INPUT_RING_BUFFER_SAMPLES * sizeof(int32_t));
+}
+
+size_t AudioMixer::wake_bytes_(const InputState &input) {
+  if (input.buffering && !input.end_pending) {
+    return std::max(input.prebuffer_bytes, sizeof(int32_t));
+  }
+  return sizeof(int32_t);
+}
+
+void AudioMixer::finish_input_(InputState &input, uint32_t stream_end) {
+  input.end_pending = true;
+  input.end_position = stream_end;
+}
+
+void AudioMixer::clear_input_(InputState &input) {
+  input.buffering = true;
+  input.starved = false;
+  input.end_pending = false;
+}
+
+void AudioMixer::restart_fill_ranges() {
+  if (this->media_ring_buffer_ != nullptr) {
+    this->media_ring_buffer_->restart_fill_range();
+  }
+  if (this->announcement_ring_buffer_ != nullptr) {
+    this->announcement_ring_buffer_->restart_fill_range();
+  }
+}
+
 void AudioMixer::suspend_task() {
   if (this->task_handle_ != nullptr) {
     vTaskSuspend(this->task_handle_);
@@ -67,15 +212,12 @@ void AudioMixer::audio_mixer_task_(void *params) {
   TaskEvent event;
   CommandEvent command_event;
 
-  ExternalRAMAllocator<int16_t> allocator(ExternalRAMAllocator<int16_t>::ALLOW_FAILURE);
-  int16_t *media_buffer = allocator.allocate(OUTPUT_BUFFER_SAMPLES);
-  int16_t *announcement_buffer = allocator.allocate(OUTPUT_BUFFER_SAMPLES);
-  int16_t *combination_buffer = allocator.allocate(OUTPUT_BUFFER_SAMPLES);
+  ExternalRAMAllocator<int32_t> allocator(ExternalRAMAllocator<int32_t>::ALLOW_FAILURE);
+  int32_t *combination_buffer = allocator.allocate(OUTPUT_BUFFER_SAMPLES);
 
-  int16_t *combination_buffer_current = combination_buffer;
   size_t combination_buffer_length = 0;
 
-  if ((media_buffer == nullptr) || (announcement_buffer == nullptr)) {
+  if (combination_buffer == nullptr) {
     event.type = EventType::WARNING;
     event.err = ESP_ERR_NO_MEM;
     xQueueSend(this_mixer->event_queue_, &event, portMAX_DELAY);
@@ -142,28 +284,52 @@ void AudioMixer::audio_mixer_task_(void *params) {
       } else if (command_event.command == CommandEventType::RESUME_MEDIA) {
         transfer_media = true;
       } else if (command_event.command == CommandEventType::CLEAR_MEDIA) {
-        this_mixer->media_ring_buffer_->reset();
+        this_mixer->media_ring_buffer_->discard_until(command_event.stream_end);
+        clear_input_(this_mixer->media_input_);
       } else if (command_event.command == CommandEventType::CLEAR_ANNOUNCEMENT) {
-        this_mixer->announcement_ring_buffer_->reset();
+        this_mixer->announcement_ring_buffer_->discard_until(command_event.stream_end);
+        clear_input_(this_mixer->announcement_input_);
+      } else if (command_event.command == CommandEventType::FINISH_MEDIA) {
+        finish_input_(this_mixer->media_input_, command_event.stream_end);
+      } else if (command_event.command == CommandEventType::FINISH_ANNOUNCEMENT) {
+        finish_input_(this_mixer->announcement_input_, command_event.stream_end);
       }
     }
 
     if (combination_buffer_length > 0) {
+      uint32_t play_start = micros();
       size_t output_bytes_written = this_mixer->speaker_->play((uint8_t *) combination_buffer,
                                                                combination_buffer_length, pdMS_TO_TICKS(TASK_DELAY_MS));
+      this_mixer->speaker_blocked_us_.store(
+          this_mixer->speaker_blocked_us_.load(std::memory_order_relaxed) + (micros() - play_start),
+          std::memory_order_relaxed);
+      this_mixer->speaker_bytes_written_.store(
+          this_mixer->speaker_bytes_written_.load(std::memory_order_relaxed) + output_bytes_written,
+          std::memory_order_relaxed);
+
       combination_buffer_length -= output_bytes_written;
       if ((combination_buffer_length > 0) && (output_bytes_written > 0)) {
-        memmove(combination_buffer, combination_buffer + output_bytes_written / sizeof(int16_t),
+        memmove(combination_buffer, combination_buffer + output_bytes_written / sizeof(int32_t),
                 combination_buffer_length);
       }
     } else {
-      size_t media_available = this_mixer->media_ring_buffer_->available();
-      size_t announcement_available = this_mixer->announcement_ring_buffer_->available();
+      // Peek at the audio in each ring buffer; it is ducked and mixed in place
+      int32_t *media_buffer = nullptr;
+      int32_t *announcement_buffer = nullptr;
+
+      size_t media_available = 0;
+      if (transfer_media) {
+        media_available = this_mixer->peek_input_(this_mixer->media_input_, this_mixer->media_ring_buffer_.get(),
+                                                  &media_buffer, EventType::MEDIA_UNDERRUN);
+      }
+      size_t announcement_available =
+          this_mixer->peek_input_(this_mixer->announcement_input_, this_mixer->announcement_ring_buffer_.get(),
+                                  &announcement_buffer, EventType::ANNOUNCEMENT_UNDERRUN);
 
-      if (media_available * transfer_media + announcement_available > 0) {
-        size_t bytes_to_read = OUTPUT_BUFFER_SAMPLES * sizeof(int16_t);
+      if (media_available + announcement_available > 0) {
+        size_t bytes_to_read = OUTPUT_BUFFER_SAMPLES * sizeof(int32_t);
 
-        if (media_available * transfer_media > 0) {
+        if (media_available > 0) {
           bytes_to_read = std::min(bytes_to_read, media_available);
         }
 
@@ -171,83 +337,82 @@ void AudioMixer::audio_mixer_task_(void *params) {
           bytes_to_read = std::min(bytes_to_read, announcement_available);
         }
 
+        bytes_to_read -= bytes_to_read % sizeof(int32_t);
+
         if (bytes_to_read > 0) {
           size_t media_bytes_read = 0;
-          if (media_available * transfer_media > 0) {
-            media_bytes_read = this_mixer->media_ring_buffer_->read((void *) media_buffer, bytes_to_read, 0);
-            if (media_bytes_read > 0) {
-              size_t samples_read = media_bytes_read / sizeof(int16_t);
-              if (ducking_transition_samples_remaining > 0) {
-                // Ducking level is still transitioning
+          if (media_available > 0) {
+            media_bytes_read = bytes_to_read;
+            size_t samples_read = media_bytes_read / sizeof(int32_t);
+            if (ducking_transition_samples_remaining > 0) {
+              // Ducking level is still transitioning
 
-                size_t samples_left = ducking_transition_samples_remaining;
+              size_t samples_left = ducking_transition_samples_remaining;
 
-                // There may be more than one step worth of samples to duck in the buffers, so manage positions
-                int16_t *current_media_buffer = media_buffer;
+              // There may be more than one step worth of samples to duck in the buffers, so manage positions
+              int32_t *current_media_buffer = media_buffer;
 
-                size_t samples_left_in_step = samples_left % samples_per_ducking_step;
-                if (samples_left_in_step == 0) {
-                  // Start of a new ducking step
+              size_t samples_left_in_step = samples_left % samples_per_ducking_step;
+              if (samples_left_in_step == 0) {
+                // Start of a new ducking step
 
-                  current_ducking_db_reduction += db_change_per_ducking_step;
-                  samples_left_in_step = samples_per_ducking_step;
-                }
-                size_t samples_left_to_duck = std::min(samples_left_in_step, samples_read);
+                current_ducking_db_reduction += db_change_per_ducking_step;
+                samples_left_in_step = samples_per_ducking_step;
+              }
+              size_t samples_left_to_duck = std::min(samples_left_in_step, samples_read);
 
-                size_t total_samples_ducked = 0;
+              size_t total_samples_ducked = 0;
 
-                while (samples_left_to_duck > 0) {
-                  // Ensure we only point to valid index in the Q15 scaling factor table
-                  uint8_t safe_db_reduction_index =
-                      clamp<uint8_t>(current_ducking_db_reduction, 0, decibel_reduction_table.size() - 1);
+              while (samples_left_to_duck > 0) {
+                // Ensure we only point to valid index in the Q15 scaling factor table
+                uint8_t safe_db_reduction_index =
+                    clamp<uint8_t>(current_ducking_db_reduction, 0, decibel_reduction_table.size() - 1);
 
-                  int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
-                  this_mixer->scale_audio_samples_(current_media_buffer, current_media_buffer, q15_scale_factor,
-                                                   samples_left_to_duck);
+                int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
+                this_mixer->scale_audio_samples_(current_media_buffer, current_media_buffer, q15_scale_factor,
+                                                 samples_left_to_duck);
 
-                  current_media_buffer += samples_left_to_duck;
+                current_media_buffer += samples_left_to_duck;
 
-                  samples_read -= samples_left_to_duck;
-                  samples_left -= samples_left_to_duck;
+                samples_read -= samples_left_to_duck;
+                samples_left -= samples_left_to_duck;
 
-                  total_samples_ducked += samples_left_to_duck;
+                total_samples_ducked += samples_left_to_duck;
 
-                  samples_left_in_step = samples_left % samples_per_ducking_step;
-                  if (samples_left_in_step == 0) {
-                    // Start of a new step
+                samples_left_in_step = samples_left % samples_per_ducking_step;
+                if (samples_left_in_step == 0) {
+                  // Start of a new step
 
-                    current_ducking_db_reduction += db_change_per_ducking_step;
-                    samples_left_in_step = samples_per_ducking_step;
-                  }
-                  samples_left_to_duck = std::min(samples_left_in_step, samples_read);
+                  current_ducking_db_reduction += db_change_per_ducking_step;
+                  samples_left_in_step = samples_per_ducking_step;
                 }
-              } else if (target_ducking_db_reduction > 0) {
-                // We still need to apply a ducking scaling, but we are done transitioning
+                samples_left_to_duck = std::min(samples_left_in_step, samples_read);
+              }
+            } else if (target_ducking_db_reduction > 0) {
+              // We still need to apply a ducking scaling, but we are done transitioning
 
-                uint8_t safe_db_reduction_index =
-                    clamp<uint8_t>(target_ducking_db_reduction, 0, decibel_reduction_table.size() - 1);
+              uint8_t safe_db_reduction_index =
+                  clamp<uint8_t>(target_ducking_db_reduction, 0, decibel_reduction_table.size() - 1);
 
-                int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
-                this_mixer->scale_audio_samples_(media_buffer, media_buffer, q15_scale_factor, samples_read);
-              }
+              int16_t q15_scale_factor = decibel_reduction_table[safe_db_reduction_index];
+              this_mixer->scale_audio_samples_(media_buffer, media_buffer, q15_scale_factor, samples_read);
             }
           }
 
           size_t announcement_bytes_read = 0;
           if (announcement_available > 0) {
-            announcement_bytes_read =
-                this_mixer->announcement_ring_buffer_->read((void *) announcement_buffer, bytes_to_read, 0);
+            announcement_bytes_read = bytes_to_read;
           }
 
           if ((media_bytes_read > 0) && (announcement_bytes_read > 0)) {
             // We have both a media and an announcement stream, so mix them together
 
-            size_t samples_read = bytes_to_read / sizeof(int16_t);
+            size_t samples_read = bytes_to_read / sizeof(int32_t);
 
             this_mixer->mix_audio_samples_without_clipping_(media_buffer, announcement_buffer, combination_buffer,
                                                             samples_read);
 
-            combination_buffer_length = samples_read * sizeof(int16_t);
+            combination_buffer_length = samples_read * sizeof(int32_t);
           } else if (media_bytes_read > 0) {
             memcpy(combination_buffer, media_buffer, media_bytes_read);
             combination_buffer_length = media_bytes_read;
@@ -256,15 +421,31 @@ void AudioMixer::audio_mixer_task_(void *params) {
             combination_buffer_length = announcement_bytes_read;
           }
 
-          size_t samples_written = combination_buffer_length / sizeof(int16_t);
+          // The samples were modified in place, so release everything that was mixed
+          this_mixer->media_ring_buffer_->release(media_bytes_read);
+          this_mixer->announcement_ring_buffer_->release(announcement_bytes_read);
+
+          size_t samples_written = combination_buffer_length / sizeof(int32_t);
           if (ducking_transition_samples_remaining > 0) {
             ducking_transition_samples_remaining -= std::min(samples_written, ducking_transition_samples_remaining);
           }
         }
       } else {
-        // No audio data available in either buffer
+        // No audio to mix in either buffer; sleep until a stream provides enough or a command arrives
+        bool audio_available = this_mixer->announcement_ring_buffer_->notify_when_available(
+            wake_bytes_(this_mixer->announcement_input_));
+        if (transfer_media) {
+          audio_available |=
+              this_mixer->media_ring_buffer_->notify_when_available(wake_bytes_(this_mixer->media_input_));
+        }
 
-        delay(TASK_DELAY_MS);
+        if (!audio_available) {
+          uint32_t idle_start = micros();
+          ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+          ++this_mixer->idle_wakeup_count_;
+          this_mixer->idle_us_.store(this_mixer->idle_us_.load(std::memory_order_relaxed) + (micros() - idle_start),
+                                     std::memory_order_relaxed);
+        }
       }
     }
   }
@@ -273,8 +454,6 @@ void AudioMixer::audio_mixer_task_(void *params) {
   xQueueSend(this_mixer->event_queue_, &event, portMAX_DELAY);
 
   this_mixer->reset_ring_buffers_();
-  allocator.deallocate(media_buffer, OUTPUT_BUFFER_SAMPLES);
-  allocator.deallocate(announcement_buffer, OUTPUT_BUFFER_SAMPLES);
   allocator.deallocate(combination_buffer, OUTPUT_BUFFER_SAMPLES);
 
   event.type = EventType::STOPPED;
@@ -287,10 +466,12 @@ void AudioMixer::audio_mixer_task_(void *params) {
 
 esp_err_t AudioMixer::allocate_buffers_() {
   if (this->media_ring_buffer_ == nullptr)
-    this->media_ring_buffer_ = RingBuffer::create(INPUT_RING_BUFFER_SAMPLES * sizeof(int16_t));
+    this->media_ring_buffer_ = AudioRingBuffer::create(input_ring_buffer_capacity_(this->media_input_),
+                                                       OUTPUT_BUFFER_SAMPLES * sizeof(int32_t));
 
   if (this->announcement_ring_buffer_ == nullptr)
-    this->announcement_ring_buffer_ = RingBuffer::create(INPUT_RING_BUFFER_SAMPLES * sizeof(int16_t));
+    this->announcement_ring_buffer_ = AudioRingBuffer::create(input_ring_buffer_capacity_(this->announcement_input_),
+                                                              OUTPUT_BUFFER_SAMPLES * sizeof(int32_t));
 
   if ((this->announcement_ring_buffer_ == nullptr) || (this->media_ring_buffer_ == nullptr)) {
     return ESP_ERR_NO_MEM;
@@ -321,8 +502,8 @@ void AudioMixer::reset_ring_buffers_() {
   this->announcement_ring_buffer_->reset();
 }
 
-void AudioMixer::mix_audio_samples_without_clipping_(int16_t *media_buffer, int16_t *announcement_buffer,
-                                                     int16_t *combination_buffer, size_t samples_to_mix) {
+void AudioMixer::mix_audio_samples_without_clipping_(int32_t *media_buffer, int32_t *announcement_buffer,
+                                                     int32_t *combination_buffer, size_t samples_to_mix) {
   // We first test adding the two clips samples together and check for any clipping
   // We want the announcement volume to be consistent, regardless if media is playing or not
   // If there is clipping, we determine what factor we need to multiply that media sample by to avoid it
@@ -332,49 +513,55 @@ void AudioMixer::mix_audio_samples_without_clipping_(int16_t *media_buffer, int1
   // we are not clipping. As a result, the mixed announcement will sound louder (by around 3dB if the audio
   // streams are independent?) than if it were by itself.
 
-  int16_t q15_scaling_factor = MAX_AUDIO_SAMPLE_VALUE;
+  int16_t q15_scaling_factor = Q15_UNITY;
 
   for (int i = 0; i < samples_to_mix; ++i) {
-    int32_t added_sample = static_cast<int32_t>(media_buffer[i]) + static_cast<int32_t>(announcement_buffer[i]);
+    int64_t added_sample = static_cast<int64_t>(media_buffer[i]) + static_cast<int64_t>(announcement_buffer[i]);
 
     if ((added_sample > MAX_AUDIO_SAMPLE_VALUE) || (added_sample < MIN_AUDIO_SAMPLE_VALUE)) {
-      // The largest magnitude the media sample can be to avoid clipping (converted to Q30 fixed point)
-      int32_t q30_media_sample_safe_max =
-          static_cast<int32_t>(std::abs(MIN_AUDIO_SAMPLE_VALUE) - std::abs(announcement_buffer[i])) << 15;
+      // The largest magnitude the media sample can be to avoid clipping (shifted for the Q15 division)
+      int64_t media_sample_safe_max = (static_cast<int64_t>(MAX_AUDIO_SAMPLE_VALUE) -
+                                       std::abs(static_cast<int64_t>(announcement_buffer[i])))
+                                      << 15;
 
-      // Actual media sample value (Q15 number stored in an int32 for future division)
-      int32_t media_sample_value = abs(media_buffer[i]);
+      // Actual media sample value; never 0 here, as the announcement sample alone can't clip
+      int64_t media_sample_value = std::abs(static_cast<int64_t>(media_buffer[i]));
 
       // Calculation to perform the Q15 division for media_sample_safe_max/media_sample_value
       // Reference: https://sestevenson.wordpress.com/2010/09/20/fixed-point-division-2/ (accessed August 15,
       // 2024)
-      int16_t necessary_q15_factor = static_cast<int16_t>(q30_media_sample_safe_max / media_sample_value);
+      int16_t necessary_q15_factor = static_cast<int16_t>(media_sample_safe_max / media_sample_value);
       // Take the minimum scaling factor (the smaller the factor, the more it needs to be scaled down)
       q15_scaling_factor = std::min(necessary_q15_factor, q15_scaling_factor);
     } else {
       // Store the combined samples in the combination buffer. If we do not need to scale, then the samples are already
       // mixed.
-      combination_buffer[i] = added_sample;
+      combination_buffer[i] = static_cast<int32_t>(added_sample);
     }
   }
 
-  if (q15_scaling_factor < MAX_AUDIO_SAMPLE_VALUE) {
+  if (q15_scaling_factor < Q15_UNITY) {
     // Need to scale to avoid clipping
 
     this->scale_audio_samples_(media_buffer, media_buffer, q15_scaling_factor, samples_to_mix);
 
-    // Mix both stream by adding them together with no bitshift
-    // The dsps_add functions have the following inputs:
-    // (buffer 1, buffer 2, output buffer, number of samples, buffer 1 step, buffer 2 step, output, buffer step,
-    // bitshift)
-    dsps_add_s16(media_buffer, announcement_buffer, combination_buffer, samples_to_mix, 1, 1, 1, 0);
+    // Mix both streams by adding them together. The scaled media leaves room for the announcement, so clamping only
+    // catches rounding.
+    for (size_t i = 0; i < samples_to_mix; ++i) {
+      int64_t added_sample = static_cast<int64_t>(media_buffer[i]) + static_cast<int64_t>(announcement_buffer[i]);
+      combination_buffer[i] =
+          static_cast<int32_t>(clamp<int64_t>(added_sample, MIN_AUDIO_SAMPLE_VALUE, MAX_AUDIO_SAMPLE_VALUE));
+    }
   }
 }
 
-void AudioMixer::scale_audio_samples_(int16_t *audio_samples, int16_t *output_buffer, int16_t scale_factor,
+void AudioMixer::scale_audio_samples_(int32_t *audio_samples, int32_t *output_buffer, int16_t scale_factor,
                                       size_t samples_to_scale) {
-  // Scale the audio samples and store them in the output buffer
-  dsps_mulc_s16(audio_samples, output_buffer, samples_to_scale, scale_factor, 1, 1);
+  // Scale the audio samples by the Q15 factor and store them in the output buffer. esp-dsp has no 32 bit version of
+  // dsps_mulc, so multiply in 64 bits.
+  for (size_t i = 0; i < samples_to_scale; ++i) {
+    output_buffer[i] = static_cast<int32_t>((static_cast<int64_t>(audio_samples[i]) * scale_factor) >> 15);
+  }
 }
 
 }  // namespace nabu
@@ -2,15 +2,19 @@
 
 #ifdef USE_ESP_IDF
 
+#include "audio_ring_buffer.h"
+
 #include "esphome/components/media_player/media_player.h"
 #include "esphome/components/speaker/speaker.h"
 
 #include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
-#include "esphome/core/ring_buffer.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include <atomic>
 
 namespace esphome {
 namespace nabu {
@@ -23,9 +27,16 @@ namespace nabu {
 //    - Unable to duck
 //    - Unable to pause
 //  - Each stream has a corresponding input ring buffer. Retrieved via the `get_media_ring_buffer` and
-//    `get_announcement_ring_buffer` functions
-//  - The mixed audio is sent to the configured speaker component.
+//    `get_announcement_ring_buffer` functions. The mixer reads (and ducks) the audio in place.
+//  - Each stream is prebuffered: the mixer only starts consuming it once its ring buffer holds the prebuffer amount, or
+//    once the stream's producer reports it finished writing. A stream that runs dry before it finished is an underrun.
+//    It is reported, buffered again to the same amount before it continues, and the amount grows if underruns repeat.
+//    Each ring buffer is sized for its stream's prebuffer amount, with room for it to grow to twice that.
+//  - Both streams are stereo 32 bit PCM at the speaker's sample rate; 16 bit sources occupy the upper half of each
+//    sample. Ducking and mixing keep the full width, and the mixed audio is sent to the configured speaker component
+//    as 32 bit audio. Only the speaker narrows it if its output is narrower.
 //  - The mixer runs as a FreeRTOS task
+//    - The task sleeps while it has no audio to mix. New audio in either ring buffer or a new command wakes it.
 //    - The task reports its state using the TaskEvent queue. Regularly call the  `read_event` function to obtain the
 //      current state
 //    - Commands are sent to the task using a the CommandEvent queue. Use the `send_command` function to do so.
@@ -39,6 +50,8 @@ enum class EventType : uint8_t {
   IDLE,
   STOPPING,
   STOPPED,
+  MEDIA_UNDERRUN,         // The media stream ran dry before it finished; it is buffered again before it continues
+  ANNOUNCEMENT_UNDERRUN,  // The announcement stream ran dry before it finished
   WARNING = 255,
 };
 
@@ -53,8 +66,10 @@ enum class CommandEventType : uint8_t {
   DUCK,                // Duck the media audio
   PAUSE_MEDIA,         // Pauses the media stream
   RESUME_MEDIA,        // Resumes the media stream
-  CLEAR_MEDIA,         // Resets the media ring buffer
-  CLEAR_ANNOUNCEMENT,  // Resets the announcement ring buffer
+  CLEAR_MEDIA,         // Discards the media ring buffer's audio written before stream_end
+  CLEAR_ANNOUNCEMENT,  // Discards the announcement ring buffer's audio written before stream_end
+  FINISH_MEDIA,        // The media stream's producer finished writing; play out the rest without prebuffering
+  FINISH_ANNOUNCEMENT,  // The announcement stream's producer finished writing
 };
 
 // Used to send commands to the mixer task
@@ -62,6 +77,18 @@ struct CommandEvent {
   CommandEventType command;
   uint8_t decibel_reduction;
   size_t transition_samples = 0;
+  // For FINISH and CLEAR commands, the ring buffer's bytes_written counter after the stream's last byte. A CLEAR keeps
+  // the audio a new stream writes before the mixer handles it.
+  uint32_t stream_end = 0;
+};
+
+// Snapshot of the mixer's telemetry. Its input is both ring buffers; its output is the speaker.
+struct AudioMixerStats {
+  AudioStageStats mixer;
+  RingBufferStats media_ring_buffer;
+  RingBufferStats announcement_ring_buffer;
+  uint32_t media_underruns;
+  uint32_t announcement_underruns;
 };
 
 // Gives the Q15 fixed point scaling factor to reduce by 0 dB, 1dB, ..., 50 dB
@@ -79,7 +106,12 @@ class AudioMixer {
   /// @param ticks_to_wait The number of FreeRTOS ticks to wait for an event to appear on the queue. Defaults to 0.
   /// @return pdTRUE if successful, pdFALSE otherwises
   BaseType_t send_command(CommandEvent *command, TickType_t ticks_to_wait = portMAX_DELAY) {
-    return xQueueSend(this->command_queue_, command, ticks_to_wait);
+    BaseType_t sent = xQueueSend(this->command_queue_, command, ticks_to_wait);
+    if ((sent == pdTRUE) && (this->task_handle_ != nullptr)) {
+      // Wake the task in case it is waiting for audio
+      xTaskNotifyGive(this->task_handle_);
+    }
+    return sent;
   }
 
   /// @brief Reads a TaskEvent from the event queue indicating its current status
@@ -100,13 +132,31 @@ class AudioMixer {
   /// @brief Stops the mixer task and clears the queues
   void stop();
 
+  /// @brief Sets how much audio each stream's ring buffer must hold before the mixer starts consuming it. Call before
+  /// starting the mixer the first time; its ring buffers are allocated to fit twice these amounts.
+  /// @param media_bytes Prebuffer amount for the media stream, in bytes
+  /// @param announcement_bytes Prebuffer amount for the announcement stream, in bytes
+  void set_prebuffer(size_t media_bytes, size_t announcement_bytes) {
+    this->media_input_.prebuffer_bytes = media_bytes;
+    this->announcement_input_.prebuffer_bytes = announcement_bytes;
+  }
+
   /// @brief Retrieves the media stream's ring buffer pointer
   /// @return pointer to media ring buffer
-  RingBuffer *get_media_ring_buffer() { return this->media_ring_buffer_.get(); }
+  AudioRingBuffer *get_media_ring_buffer() { return this->media_ring_buffer_.get(); }
 
   /// @brief Retrieves the announcement stream's ring buffer pointer
   /// @return pointer to announcement ring buffer
-  RingBuffer *get_announcement_ring_buffer() { return this->announcement_ring_buffer_.get(); }
+  AudioRingBuffer *get_announcement_ring_buffer() { return this->announcement_ring_buffer_.get(); }
+
+  /// @brief Number of times the mixer task and the tasks feeding it have woken up while waiting on its ring buffers
+  uint32_t get_wakeup_count();
+
+  /// @brief Snapshot of the mixer's throughput and blocked time and of its ring buffers' fill ranges
+  AudioMixerStats get_stats();
+
+  /// @brief Starts new min/max fill ranges for the media and announcement ring buffers
+  void restart_fill_ranges();
 
   /// @brief Suspends the mixer task
   void suspend_task();
@@ -114,6 +164,40 @@ class AudioMixer {
   void resume_task();
 
  protected:
+  // Prebuffering and underrun state of one input stream. Only the mixer task modifies it after starting.
+  struct InputState {
+    size_t prebuffer_bytes{0};  // Grows after repeated underruns
+    bool buffering{true};       // Holding the stream back until the ring buffer holds prebuffer_bytes
+    bool starved{false};        // Ran dry while playing; an underrun unless the stream turns out to have finished
+    bool end_pending{false};    // The producer finished writing at end_position
+    uint32_t end_position{0};
+    uint32_t last_underrun_time{0};
+    std::atomic<uint32_t> underruns{0};
+  };
+
+  /// @brief Peeks at the stream's audio if it may be mixed. Handles prebuffering, finished streams, and underruns.
+  /// @param input The stream's prebuffering and underrun state
+  /// @param ring_buffer The stream's ring buffer
+  /// @param buffer Set to the start of the readable span
+  /// @param underrun_event Event type reported if the stream underran
+  /// @return Number of bytes that may be mixed; 0 while the stream is buffering or empty
+  size_t peek_input_(InputState &input, AudioRingBuffer *ring_buffer, int32_t **buffer, EventType underrun_event);
+
+  /// @brief Capacity of the stream's ring buffer, so its prebuffer amount can grow to twice the configured amount
+  static size_t input_ring_buffer_capacity_(const InputState &input);
+
+  /// @brief Largest prebuffer amount for the ring buffer that still leaves its producer room to write a whole span
+  static size_t max_prebuffer_bytes_(const AudioRingBuffer *ring_buffer);
+
+  /// @brief Available bytes that let the mixer consume the stream; a finished stream plays out whatever is left
+  static size_t wake_bytes_(const InputState &input);
+
+  /// @brief Marks the stream's end so the mixer plays out the rest without prebuffering
+  static void finish_input_(InputState &input, uint32_t stream_end);
+
+  /// @brief Forgets the stream's progress after its ring buffer was reset
+  static void clear_input_(InputState &input);
+
   /// @brief Allocates the ring buffers, task stack, and queues
   /// @return ESP_OK if successful or an error otherwise
   esp_err_t allocate_buffers_();
@@ -126,15 +210,15 @@ class AudioMixer {
   /// @param announcement_buffer buffer for announcement samples
   /// @param combination_buffer buffer for the mixed samples
   /// @param samples_to_mix number of samples in the media and annoucnement buffers to mix together
-  void mix_audio_samples_without_clipping_(int16_t *media_buffer, int16_t *announcement_buffer,
-                                           int16_t *combination_buffer, size_t samples_to_mix);
+  void mix_audio_samples_without_clipping_(int32_t *media_buffer, int32_t *announcement_buffer,
+                                           int32_t *combination_buffer, size_t samples_to_mix);
 
   /// @brief Scales audio samples. Scales in place when audio_samples == output_buffer.
-  /// @param audio_samples PCM int16 audio samples
+  /// @param audio_samples PCM int32 audio samples
   /// @param output_buffer Buffer to store the scaled samples
   /// @param scale_factor Q15 fixed point scaling factor
   /// @param samples_to_scale Number of samples to scale
-  void scale_audio_samples_(int16_t *audio_samples, int16_t *output_buffer, int16_t scale_factor,
+  void scale_audio_samples_(int32_t *audio_samples, int32_t *output_buffer, int16_t scale_factor,
                             size_t samples_to_scale);
 
   static void audio_mixer_task_(void *params);
@@ -150,8 +234,19 @@ class AudioMixer {
 
   speaker::Speaker *speaker_{nullptr};
 
-  std::unique_ptr<RingBuffer> media_ring_buffer_;
-  std::unique_ptr<RingBuffer> announcement_ring_buffer_;
+  std::unique_ptr<AudioRingBuffer> media_ring_buffer_;
+  std::unique_ptr<AudioRingBuffer> announcement_ring_buffer_;
+
+  InputState media_input_;
+  InputState announcement_input_;
+
+  // Counts the mixer task's wakeups while idle
+  std::atomic<uint32_t> idle_wakeup_count_{0};
+
+  // Telemetry only written by the mixer task
+  std::atomic<uint32_t> idle_us_{0};
+  std::atomic<uint32_t> speaker_bytes_written_{0};
+  std::atomic<uint32_t> speaker_blocked_us_{0};
 };
 }  // namespace nabu
 }  // namespace esphome
@@ -0,0 +1,206 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_pcm_cache.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+// The resampler writes at most one span per call, which bounds the work done between checks of the time budget
+static const size_t CAPTURE_RING_BUFFER_SIZE = 16 * 1024;
+static const size_t CAPTURE_RING_BUFFER_MAX_SPAN = 4 * 1024;
+
+static const size_t CHUNK_SIZE = 32 * 1024;
+
+static const char *const TAG = "nabu_media_player.cache";
+
+AudioPcmCache::~AudioPcmCache() {
+  for (auto &entry : this->entries_) {
+    free_entry_(entry);
+  }
+  free_entry_(this->current_entry_);
+}
+
+bool AudioPcmCache::build(uint32_t duration_ms) {
+  uint32_t start_time = millis();
+
+  // Entries may be played while later files are still being cached, so they must never move
+  this->entries_.reserve(this->entries_.size() + this->pending_files_.size());
+
+  while (!this->pending_files_.empty() && (millis() - start_time < duration_ms)) {
+    if (!this->file_started_) {
+      esp_err_t err = this->start_file_();
+      if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to cache a media file: %s", esp_err_to_name(err));
+        this->finish_file_(false);
+        continue;
+      }
+    }
+
+    AudioStageState state = this->process_file_();
+    if ((state == AudioStageState::FINISHED) && (this->current_entry_.length == 0)) {
+      // The decoder finished without ever determining the stream information
+      state = AudioStageState::FAILED;
+    }
+    if (state == AudioStageState::FINISHED) {
+      this->finish_file_(true);
+      ESP_LOGD(TAG, "Cached %zu bytes of audio; the cache uses %zu of its %zu bytes", this->entries_.back().length,
+               this->size_, this->max_size_);
+    } else if (state == AudioStageState::FAILED) {
+      ESP_LOGW(TAG, "Unable to cache a media file; it will be decoded every time it plays");
+      this->finish_file_(false);
+    }
+  }
+
+  if (this->pending_files_.empty()) {
+    this->release_builder_();
+    return true;
+  }
+
+  return false;
+}
+
+const CachedPcmEntry *AudioPcmCache::find(media_player::MediaFile *media_file) const {
+  for (const auto &entry : this->entries_) {
+    if (entry.media_file == media_file) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+size_t AudioPcmCache::write_to(const CachedPcmEntry *entry, size_t position, AudioRingBuffer *ring_buffer) {
+  size_t bytes_written = 0;
+
+  while (position < entry->length) {
+    const size_t chunk_offset = position % CHUNK_SIZE;
+    const size_t bytes_to_write = std::min(CHUNK_SIZE - chunk_offset, entry->length - position);
+
+    size_t written = ring_buffer->write(entry->chunks[position / CHUNK_SIZE] + chunk_offset, bytes_to_write, 0);
+    bytes_written += written;
+    position += written;
+
+    if (written < bytes_to_write) {
+      // The ring buffer is full
+      break;
+    }
+  }
+
+  return bytes_written;
+}
+
+esp_err_t AudioPcmCache::start_file_() {
+  if (this->stages_.reader == nullptr) {
+    // Every MediaFile is read in place, so the ring buffer after the reader only needs the smallest capacity
+    this->stages_ = AudioPipeline::add_file_stages(&this->graph_, true);
+  }
+
+  if (this->capture_ring_buffer_ == nullptr) {
+    this->capture_ring_buffer_ = AudioRingBuffer::create(CAPTURE_RING_BUFFER_SIZE, CAPTURE_RING_BUFFER_MAX_SPAN);
+    if (this->capture_ring_buffer_ == nullptr) {
+      return ESP_ERR_NO_MEM;
+    }
+    this->graph_.set_sink(this->capture_ring_buffer_.get());
+  }
+  this->capture_ring_buffer_->reset();
+
+  this->current_entry_ = CachedPcmEntry();
+  this->current_entry_.media_file = this->pending_files_.front();
+  this->file_started_ = true;
+
+  this->stages_.reader->set_source(this->current_entry_.media_file);
+  this->stages_.resampler->set_target_sample_rate(this->sample_rate_);
+  return this->graph_.start_in_caller();
+}
+
+AudioStageState AudioPcmCache::process_file_() {
+  AudioStageState state = this->graph_.process();
+  this->log_events_();
+
+  if (this->drain_capture_() != ESP_OK) {
+    return AudioStageState::FAILED;
+  }
+
+  return state;
+}
+
+void AudioPcmCache::log_events_() {
+  AudioStageEvent event;
+  while (this->graph_.read_event(&event)) {
+    if (event.err.has_value()) {
+      ESP_LOGD(TAG, "The %s encountered an error: %s", this->graph_.get_stage(event.stage)->get_name(),
+               esp_err_to_name(event.err.value()));
+    }
+  }
+}
+
+esp_err_t AudioPcmCache::drain_capture_() {
+  uint8_t *span = nullptr;
+  size_t span_length = this->capture_ring_buffer_->peek(&span, 1, 0);
+
+  while (span_length > 0) {
+    const size_t chunk_offset = this->current_entry_.length % CHUNK_SIZE;
+    if (chunk_offset == 0) {
+      if (this->size_ + (this->current_entry_.chunks.size() + 1) * CHUNK_SIZE > this->max_size_) {
+        ESP_LOGW(TAG, "A media file needs more than the %zu bytes left of the cache's budget",
+                 this->max_size_ - this->size_);
+        return ESP_ERR_INVALID_SIZE;
+      }
+      ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+      uint8_t *chunk = allocator.allocate(CHUNK_SIZE);
+      if (chunk == nullptr) {
+        return ESP_ERR_NO_MEM;
+      }
+      this->current_entry_.chunks.push_back(chunk);
+    }
+
+    const size_t bytes_to_copy = std::min(span_length, CHUNK_SIZE - chunk_offset);
+    std::memcpy(this->current_entry_.chunks.back() + chunk_offset, span, bytes_to_copy);
+    this->current_entry_.length += bytes_to_copy;
+    this->capture_ring_buffer_->release(bytes_to_copy);
+
+    span_length = this->capture_ring_buffer_->peek(&span, 1, 0);
+  }
+
+  return ESP_OK;
+}
+
+void AudioPcmCache::free_entry_(CachedPcmEntry &entry) {
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  for (uint8_t *chunk : entry.chunks) {
+    allocator.deallocate(chunk, CHUNK_SIZE);
+  }
+  entry.chunks.clear();
+  entry.length = 0;
+}
+
+void AudioPcmCache::finish_file_(bool cached) {
+  if (cached) {
+    this->size_ += this->current_entry_.chunks.size() * CHUNK_SIZE;
+    this->entries_.push_back(std::move(this->current_entry_));
+  } else {
+    free_entry_(this->current_entry_);
+  }
+  this->current_entry_ = CachedPcmEntry();
+
+  this->pending_files_.erase(this->pending_files_.begin());
+  this->file_started_ = false;
+
+  // Clears the failed stage, if any, and the graph's ring buffers for the next file
+  this->graph_.stop();
+}
+
+void AudioPcmCache::release_builder_() {
+  this->graph_.release();
+  this->capture_ring_buffer_.reset();
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "audio_pipeline.h"
+#include "audio_ring_buffer.h"
+#include "audio_stage_graph.h"
+
+#include "esphome/components/media_player/media_player.h"
+
+#include <memory>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+// Decoded and resampled audio for a single MediaFile
+struct CachedPcmEntry {
+  media_player::MediaFile *media_file{nullptr};
+  std::vector<uint8_t *> chunks;  // Fixed size blocks in external RAM; only the last one may be partially filled
+  size_t length{0};               // Total bytes of stereo 32 bit PCM audio at the cache's sample rate
+};
+
+// Keeps selected MediaFiles (e.g., wake and button sounds) as PCM audio ready for the mixer, so playing them only
+// copies the audio into the mixer's ring buffer instead of reading, decoding, and resampling the file every time
+//  - The files are cached after boot, a slice at a time from the component's loop. The same reader, decoder, and
+//    resampler chain as a pipeline's runs in an AudioStageGraph driven from the calling task, so no tasks are needed.
+//    The graph's sink is a small capture ring buffer, which the cache empties into the entry after every pass. The
+//    graph's buffers are released once every file is cached.
+//  - The audio is stored in fixed size chunks in external RAM, so the cache never copies while it grows. Stereo 32 bit
+//    audio takes 384 kB per second at 48 kHz, so the chunks count against a byte budget.
+//  - A file that fails to decode, exceeds what is left of the budget, or doesn't fit in memory is left out and plays
+//    through a pipeline as usual. The files are cached in the order they were added.
+class AudioPcmCache {
+ public:
+  ~AudioPcmCache();
+
+  /// @brief Adds a file to cache. Call before building the cache.
+  void add_file(media_player::MediaFile *media_file) { this->pending_files_.push_back(media_file); }
+
+  /// @brief Sets the sample rate the audio is converted to. Call before building the cache.
+  void set_sample_rate(uint32_t sample_rate) { this->sample_rate_ = sample_rate; }
+
+  /// @brief Sets the byte budget for the chunks of every cached file together. Call before building the cache.
+  void set_max_size(size_t max_size) { this->max_size_ = max_size; }
+
+  /// @brief Bytes of chunks the cached files take
+  size_t get_size() const { return this->size_; }
+
+  /// @brief Decodes and resamples the pending files for about duration_ms
+  /// @return true once every file has been cached (or left out)
+  bool build(uint32_t duration_ms);
+
+  /// @brief Whether every file has been cached (or left out)
+  bool is_built() const { return this->pending_files_.empty(); }
+
+  /// @brief Finds the cached audio for a MediaFile
+  /// @return pointer to the entry if the file is fully cached, nullptr otherwise
+  const CachedPcmEntry *find(media_player::MediaFile *media_file) const;
+
+  /// @brief Copies cached audio into a ring buffer without blocking
+  /// @param entry Cached audio to copy
+  /// @param position Byte offset into the cached audio to start from
+  /// @param ring_buffer Ring buffer to copy into
+  /// @return Number of bytes copied
+  static size_t write_to(const CachedPcmEntry *entry, size_t position, AudioRingBuffer *ring_buffer);
+
+ protected:
+  /// @brief Assembles the graph on first use and starts caching the front pending file
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t start_file_();
+
+  /// @brief Runs each stage once and moves the resampled audio into the entry's chunks
+  /// @return RUNNING while the file is being cached, FINISHED once it is complete, or FAILED
+  AudioStageState process_file_();
+
+  /// @brief Logs the errors reported by the graph's stages and empties its event queue
+  void log_events_();
+
+  /// @brief Moves the resampled audio from the capture ring buffer into the entry's chunks
+  /// @return ESP_OK if successful, ESP_ERR_INVALID_SIZE if another chunk would exceed the budget, or ESP_ERR_NO_MEM if
+  /// a chunk couldn't be allocated
+  esp_err_t drain_capture_();
+
+  /// @brief Frees the chunks of an entry
+  static void free_entry_(CachedPcmEntry &entry);
+
+  /// @brief Drops the front pending file, keeping its entry only if it is complete
+  void finish_file_(bool cached);
+
+  /// @brief Gives back the graph's buffers and frees the capture ring buffer once every file is cached
+  void release_builder_();
+
+  uint32_t sample_rate_{0};
+  size_t max_size_{0};
+  size_t size_{0};  // Chunk bytes of the entries
+
+  std::vector<media_player::MediaFile *> pending_files_;
+  std::vector<CachedPcmEntry> entries_;
+
+  // Assembled on the first start; its ring buffers and the stages' scratch buffers are only allocated while building
+  AudioStageGraph graph_;
+  AudioFileStages stages_{};
+  std::unique_ptr<AudioRingBuffer> capture_ring_buffer_;
+
+  CachedPcmEntry current_entry_;
+  bool file_started_{false};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
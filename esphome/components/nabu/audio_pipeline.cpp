@@ -10,532 +10,433 @@ namespace nabu {
 
 static const size_t FILE_BUFFER_SIZE = 32 * 1024;
 static const size_t FILE_RING_BUFFER_SIZE = 64 * 1024;
+// The decoder peeks whole frames from the ring buffer: MP3 frames are at most 1441 bytes, stereo ADTS frames 1545
+// bytes, and Ogg page headers 282 bytes. The reader only needs a single byte to receive into.
+static const size_t FILE_RING_BUFFER_MAX_SPAN = 2 * 1024;
 static const size_t BUFFER_SIZE_SAMPLES = 32768;
 static const size_t BUFFER_SIZE_BYTES = BUFFER_SIZE_SAMPLES * sizeof(int16_t);
+// The decoder acquires a 16 KiB batch if it fits, but otherwise settles for the largest frame it writes in place: a
+// 4096 sample FLAC block with four 16 bit or two 32 bit channels before the downmix. A 120 ms stereo Opus frame at
+// 48 kHz takes 22.5 KiB.
+static const size_t BUFFER_MAX_SPAN = 32 * 1024;
+
+// Wake the decoder once a reasonable chunk has arrived rather than for every network packet, and wake the reader once
+// there is room for a large read. Both together are far below the ring buffer size, so the two tasks can't deadlock.
+static const size_t FILE_RING_BUFFER_FILL_WATERMARK = 512;
+static const size_t FILE_RING_BUFFER_SPACE_WATERMARK = 4 * 1024;
+
+// The decoder reads a MediaFile in place, so its ring buffer stays empty and only needs the smallest capacity
+static const size_t LOCAL_FILE_RING_BUFFER_SIZE = FILE_RING_BUFFER_MAX_SPAN;
+
+// A url stream's ring buffer doubles once the decoder waited this long for the network within one check interval
+static const uint32_t STREAM_STALL_CHECK_INTERVAL_MS = 1000;
+static const uint32_t STREAM_STALL_THRESHOLD_US = 20 * 1000;
 
 static const uint32_t READER_TASK_STACK_SIZE = 5 * 1024;
-static const uint32_t DECODER_TASK_STACK_SIZE = 3 * 1024;
+// libopus keeps its per-frame scratch arrays on the stack, which needs far more than the MP3, FLAC, and AAC decoders.
+// Each pipeline logs how much of every task's stack was never used when its stream finishes.
+static const uint32_t DECODER_TASK_STACK_SIZE = 12 * 1024;
 static const uint32_t RESAMPLER_TASK_STACK_SIZE = 3 * 1024;
 
-static const size_t INFO_ERROR_QUEUE_COUNT = 5;
-
 static const char *const TAG = "nabu_media_player.pipeline";
 
-enum EventGroupBits : uint32_t {
-  // The stop() function clears all unfinished bits
-  // MESSAGE_* bits are only set by their respective tasks
-
-  // Stops all activity in the pipeline elements and set by stop() or by each task
-  PIPELINE_COMMAND_STOP = (1 << 0),
-
-  // Read audio from an HTTP source; cleared by reader task and set by start(uri,...)
-  READER_COMMAND_INIT_HTTP = (1 << 4),
-  // Read audio from an audio file from the flash; cleared by reader task and set by start(media_file,...)
-  READER_COMMAND_INIT_FILE = (1 << 5),
-
-  // Audio file type is read after checking it is supported; cleared by decoder task
-  READER_MESSAGE_LOADED_MEDIA_TYPE = (1 << 6),
-  // Reader is done (either through a failure or just end of the stream); cleared by reader task
-  READER_MESSAGE_FINISHED = (1 << 7),
-  // Error reading the file; cleared by get_state()
-  READER_MESSAGE_ERROR = (1 << 8),
-
-  // Decoder has determined the stream information; cleared by resampler
-  DECODER_MESSAGE_LOADED_STREAM_INFO = (1 << 11),
-  // Decoder is done (either through a faiilure or the end of the stream); cleared by decoder task
-  DECODER_MESSAGE_FINISHED = (1 << 12),
-  // Error decoding the file; cleared by get_state() by decoder task
-  DECODER_MESSAGE_ERROR = (1 << 13),
-
-  // Resampler is done (either through a failure or the end of the stream); cleared by resampler task
-  RESAMPLER_MESSAGE_FINISHED = (1 << 17),
-  // Error resampling the file; cleared by get_state()
-  RESAMPLER_MESSAGE_ERROR = (1 << 18),
-
-  // Cleared by respective tasks
-  FINISHED_BITS = READER_MESSAGE_FINISHED | DECODER_MESSAGE_FINISHED | RESAMPLER_MESSAGE_FINISHED,
-  UNFINISHED_BITS = ~(FINISHED_BITS | 0xff000000),  // Only 24 bits are valid for the event group, so make sure first 8
-                                                    // bits of uint32 are not set; cleared by stop()
+// Indices of the stages in the graph
+enum PipelineStage : size_t {
+  READER_STAGE = 0,
+  DECODER_STAGE,
+  RESAMPLER_STAGE,
 };
 
 AudioPipeline::AudioPipeline(AudioMixer *mixer, AudioPipelineType pipeline_type) {
   this->mixer_ = mixer;
   this->pipeline_type_ = pipeline_type;
+
+  this->stream_buffer_size_ = FILE_RING_BUFFER_SIZE;
+  this->stream_buffer_max_size_ = FILE_RING_BUFFER_SIZE;
+
+  AudioFileStages stages = add_file_stages(&this->graph_, false);
+  this->reader_ = stages.reader;
+  this->decoder_ = stages.decoder;
+  this->resampler_ = stages.resampler;
+
+  this->graph_.set_sink(this->get_mixer_ring_buffer_());
+}
+
+AudioFileStages AudioPipeline::add_file_stages(AudioStageGraph *graph, bool local_file) {
+  AudioFileStages stages;
+  stages.reader = graph->add_stage(make_unique<AudioReader>(FILE_BUFFER_SIZE), READER_TASK_STACK_SIZE);
+  graph->add_ring_buffer(local_file ? LOCAL_FILE_RING_BUFFER_SIZE : FILE_RING_BUFFER_SIZE, FILE_RING_BUFFER_MAX_SPAN,
+                         FILE_RING_BUFFER_FILL_WATERMARK, FILE_RING_BUFFER_SPACE_WATERMARK);
+  stages.decoder = graph->add_stage(make_unique<AudioDecoder>(FILE_BUFFER_SIZE), DECODER_TASK_STACK_SIZE);
+  graph->add_ring_buffer(BUFFER_SIZE_BYTES, BUFFER_MAX_SPAN);
+  stages.resampler = graph->add_stage(make_unique<AudioResampler>(BUFFER_SIZE_SAMPLES), RESAMPLER_TASK_STACK_SIZE);
+  return stages;
 }
 
 esp_err_t AudioPipeline::start(const std::string &uri, uint32_t target_sample_rate, const std::string &task_name,
                                UBaseType_t priority) {
-  esp_err_t err = this->common_start_(target_sample_rate, task_name, priority);
-
-  if (err == ESP_OK) {
-    this->current_uri_ = uri;
-    xEventGroupSetBits(this->event_group_, READER_COMMAND_INIT_HTTP);
-  }
-
-  return err;
+  this->reader_->set_source(uri);
+  return this->common_start_(target_sample_rate, task_name, priority, false);
 }
 
 esp_err_t AudioPipeline::start(media_player::MediaFile *media_file, uint32_t target_sample_rate,
                                const std::string &task_name, UBaseType_t priority) {
-  esp_err_t err = this->common_start_(target_sample_rate, task_name, priority);
-
-  if (err == ESP_OK) {
-    this->current_media_file_ = media_file;
-    xEventGroupSetBits(this->event_group_, READER_COMMAND_INIT_FILE);
-  }
+  this->reader_->set_source(media_file);
+  return this->common_start_(target_sample_rate, task_name, priority, false);
+}
 
-  return err;
+esp_err_t AudioPipeline::prefetch(const std::string &uri, uint32_t target_sample_rate, const std::string &task_name,
+                                  UBaseType_t priority) {
+  this->reader_->set_source(uri);
+  return this->common_start_(target_sample_rate, task_name, priority, true);
 }
 
-esp_err_t AudioPipeline::allocate_buffers_() {
-  if (this->raw_file_ring_buffer_ == nullptr)
-    this->raw_file_ring_buffer_ = RingBuffer::create(FILE_RING_BUFFER_SIZE);
+esp_err_t AudioPipeline::prefetch(media_player::MediaFile *media_file, uint32_t target_sample_rate,
+                                  const std::string &task_name, UBaseType_t priority) {
+  this->reader_->set_source(media_file);
+  return this->common_start_(target_sample_rate, task_name, priority, true);
+}
 
-  if (this->decoded_ring_buffer_ == nullptr)
-    this->decoded_ring_buffer_ = RingBuffer::create(BUFFER_SIZE_BYTES);
+void AudioPipeline::start_output() { this->graph_.start_output(); }
 
-  if ((this->raw_file_ring_buffer_ == nullptr) || (this->decoded_ring_buffer_ == nullptr)) {
-    return ESP_ERR_NO_MEM;
+esp_err_t AudioPipeline::common_start_(uint32_t target_sample_rate, const std::string &task_name,
+                                       UBaseType_t priority, bool hold_output) {
+  esp_err_t err;
+  if (hold_output) {
+    // The mixer is still playing another pipeline's audio, so don't clear it
+    err = this->graph_.stop();
+  } else {
+    err = this->stop();
   }
 
-  if (this->read_task_stack_buffer_ == nullptr)
-    this->read_task_stack_buffer_ = (StackType_t *) malloc(READER_TASK_STACK_SIZE);
+  if (err != ESP_OK) {
+    return err;
+  }
 
-  if (this->decode_task_stack_buffer_ == nullptr)
-    this->decode_task_stack_buffer_ = (StackType_t *) malloc(DECODER_TASK_STACK_SIZE);
+  // The mixer allocates its ring buffers when it starts, which may be after this pipeline was constructed
+  this->graph_.set_sink(this->get_mixer_ring_buffer_());
+  this->resampler_->set_target_sample_rate(target_sample_rate);
 
-  if (this->resample_task_stack_buffer_ == nullptr)
-    this->resample_task_stack_buffer_ = (StackType_t *) malloc(RESAMPLER_TASK_STACK_SIZE);
+  this->task_name_ = task_name;
+  this->priority_ = priority;
 
-  if ((this->read_task_stack_buffer_ == nullptr) || (this->decode_task_stack_buffer_ == nullptr) ||
-      (this->resample_task_stack_buffer_ == nullptr)) {
-    return ESP_ERR_NO_MEM;
+  media_player::MediaFile *media_file = this->reader_->get_media_file();
+  size_t raw_file_ring_buffer_size = this->stream_buffer_size_;
+  if (media_file != nullptr) {
+    raw_file_ring_buffer_size = LOCAL_FILE_RING_BUFFER_SIZE;
   }
+  this->graph_.set_ring_buffer_capacity(READER_STAGE, raw_file_ring_buffer_size);
 
-  if (this->event_group_ == nullptr)
-    this->event_group_ = xEventGroupCreate();
-
-  if (this->event_group_ == nullptr) {
-    return ESP_ERR_NO_MEM;
+  err = this->graph_.start(task_name, priority, hold_output);
+  if (err != ESP_OK) {
+    return err;
   }
+  this->finish_unreported_ = true;
 
-  if (this->info_error_queue_ == nullptr)
-    this->info_error_queue_ = xQueueCreate(INFO_ERROR_QUEUE_COUNT, sizeof(InfoErrorEvent));
+  // The graph keeps the previous size if the new one couldn't be allocated
+  RingBufferStats raw_file_stats = this->graph_.get_ring_buffer(READER_STAGE)->get_stats();
+  if (media_file != nullptr) {
+    ESP_LOGD(TAG, "Decoding the file in place");
+  } else {
+    ESP_LOGD(TAG, "Buffering the stream in %zu bytes", raw_file_stats.capacity);
+  }
 
-  if (this->info_error_queue_ == nullptr)
-    return ESP_ERR_NO_MEM;
+  this->stream_buffer_primed_ = false;
+  this->last_stall_check_time_ = millis();
+  this->last_decoder_blocked_us_ = raw_file_stats.consumer_blocked_us;
 
   return ESP_OK;
 }
 
-esp_err_t AudioPipeline::common_start_(uint32_t target_sample_rate, const std::string &task_name,
-                                       UBaseType_t priority) {
-  esp_err_t err = this->allocate_buffers_();
+esp_err_t AudioPipeline::seek(uint32_t position_ms) {
+  if (!this->graph_.has_started()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  // Clears the mixer's ring buffer if this pipeline's output was started, so the old position stops playing right away
+  esp_err_t err = this->stop();
   if (err != ESP_OK) {
     return err;
   }
 
-  if (this->read_task_handle_ == nullptr) {
-    this->read_task_handle_ =
-        xTaskCreateStatic(AudioPipeline::read_task_, (task_name + "_read").c_str(), READER_TASK_STACK_SIZE,
-                          (void *) this, priority, this->read_task_stack_buffer_, &this->read_task_stack_);
-  }
-  if (this->decode_task_handle_ == nullptr) {
-    this->decode_task_handle_ =
-        xTaskCreateStatic(AudioPipeline::decode_task_, (task_name + "_decode").c_str(), DECODER_TASK_STACK_SIZE,
-                          (void *) this, priority, this->decode_task_stack_buffer_, &this->decode_task_stack_);
-  }
-  if (this->resample_task_handle_ == nullptr) {
-    this->resample_task_handle_ =
-        xTaskCreateStatic(AudioPipeline::resample_task_, (task_name + "_resample").c_str(), RESAMPLER_TASK_STACK_SIZE,
-                          (void *) this, priority, this->resample_task_stack_buffer_, &this->resample_task_stack_);
-  }
+  // Every task has stopped, so the reader and decoder can be reconfigured
+  const size_t offset = this->decoder_->seek(position_ms, this->reader_->get_source_length());
+  this->reader_->set_start_offset(offset);
+  ESP_LOGD(TAG, "Seeking to %" PRIu32 " ms at byte offset %zu", position_ms, offset);
+
+  err = this->graph_.start(this->task_name_, this->priority_, false);
+  this->finish_unreported_ = (err == ESP_OK);
+  return err;
+}
 
-  if ((this->read_task_handle_ == nullptr) || (this->decode_task_handle_ == nullptr) ||
-      (this->resample_task_handle_ == nullptr)) {
-    return ESP_FAIL;
+AudioRingBuffer *AudioPipeline::get_mixer_ring_buffer_() {
+  if (this->pipeline_type_ == AudioPipelineType::MEDIA) {
+    return this->mixer_->get_media_ring_buffer();
   }
+  return this->mixer_->get_announcement_ring_buffer();
+}
 
-  this->target_sample_rate_ = target_sample_rate;
+void AudioPipeline::log_events_() {
+  AudioStageEvent event;
+  while (this->graph_.read_event(&event)) {
+    const char *stage_name = this->graph_.get_stage(event.stage)->get_name();
 
-  return this->stop();
-}
+    if (event.output_format.has_value()) {
+      const AudioStreamFormat &format = event.output_format.value();
+      if (format.is_encoded()) {
+        ESP_LOGD(TAG, "Reading %s file type", media_player::media_player_file_type_to_string(format.file_type));
+      } else {
+        ESP_LOGD(TAG, "The %s outputs audio with %d channels, %" PRId32 " Hz sample rate, and %d bits per sample",
+                 stage_name, format.stream_info.channels, format.stream_info.sample_rate,
+                 format.stream_info.bits_per_sample);
+      }
+    }
 
-AudioPipelineState AudioPipeline::get_state() {
-  InfoErrorEvent event;
-  if (this->info_error_queue_ != nullptr) {
-    while (xQueueReceive(this->info_error_queue_, &event, 0)) {
-      switch (event.source) {
-        case InfoErrorSource::READER:
-          if (event.err.has_value()) {
-            ESP_LOGE(TAG, "Media reader encountered an error: %s", esp_err_to_name(event.err.value()));
-          } else if (event.file_type.has_value()) {
-            ESP_LOGD(TAG, "Reading %s file type",
-                     media_player::media_player_file_type_to_string(event.file_type.value()));
-          }
-
-          break;
-        case InfoErrorSource::DECODER:
-          if (event.err.has_value()) {
-            ESP_LOGE(TAG, "Decoder encountered an error: %s", esp_err_to_name(event.err.value()));
-          }
-
-          if (event.audio_stream_info.has_value()) {
-            ESP_LOGD(TAG, "Decoded audio has %d channels, %" PRId32 " Hz sample rate, and %d bits per sample",
-                     event.audio_stream_info.value().channels, event.audio_stream_info.value().sample_rate,
-                     event.audio_stream_info.value().bits_per_sample);
-          }
-
-          if (event.decoding_err.has_value()) {
-            switch (event.decoding_err.value()) {
-              case DecodingError::FAILED_HEADER:
-                ESP_LOGE(TAG, "Failed to parse the file's header.");
-                break;
-              case DecodingError::INCOMPATIBLE_BITS_PER_SAMPLE:
-                ESP_LOGE(TAG, "Incompatible bits per sample. Only 16 bits per sample is supported");
-                break;
-              case DecodingError::INCOMPATIBLE_CHANNELS:
-                ESP_LOGE(TAG, "Incompatible number of channels. Only 1 or 2 channel audio is supported.");
-                break;
-            }
-          }
-          break;
-        case InfoErrorSource::RESAMPLER:
-          if (event.err.has_value()) {
-            ESP_LOGE(TAG, "Resampler encountered an error: %s", esp_err_to_name(event.err.has_value()));
-          } else if (event.resample_info.has_value()) {
-            if (event.resample_info.value().resample) {
-              ESP_LOGD(TAG, "Converting the audio sample rate");
-            }
-            if (event.resample_info.value().mono_to_stereo) {
-              ESP_LOGD(TAG, "Converting mono channel audio to stereo channel audio");
-            }
-          }
-          break;
+    if (event.err.has_value()) {
+      if ((event.err.value() == ESP_ERR_NOT_SUPPORTED) && event.input_format.has_value()) {
+        const AudioStreamFormat &format = event.input_format.value();
+        if (format.is_encoded()) {
+          ESP_LOGE(TAG, "The %s can't process the %s file type", stage_name,
+                   media_player::media_player_file_type_to_string(format.file_type));
+        } else {
+          ESP_LOGE(TAG, "The %s can't process audio with %d channels and %d bits per sample", stage_name,
+                   format.stream_info.channels, format.stream_info.bits_per_sample);
+        }
+      } else {
+        ESP_LOGE(TAG, "The %s encountered an error: %s", stage_name, esp_err_to_name(event.err.value()));
       }
     }
   }
+}
 
-  EventBits_t event_bits = xEventGroupGetBits(this->event_group_);
-  if (!this->read_task_handle_ && !this->decode_task_handle_ && !this->resample_task_handle_) {
-    return AudioPipelineState::STOPPED;
+void AudioPipeline::log_stack_high_water_marks_() {
+  for (size_t i = 0; i < this->graph_.get_stage_count(); ++i) {
+    UBaseType_t unused = this->graph_.get_stack_high_water_mark(i);
+    if (unused > 0) {
+      ESP_LOGD(TAG, "The %s task has never used %u bytes of its stack", this->graph_.get_stage(i)->get_name(),
+               static_cast<unsigned>(unused));
+    }
   }
+}
 
-  if ((event_bits & READER_MESSAGE_ERROR)) {
-    xEventGroupClearBits(this->event_group_, READER_MESSAGE_ERROR);
-    return AudioPipelineState::ERROR_READING;
+AudioPipelineState AudioPipeline::get_state() {
+  this->log_events_();
+
+  if (!this->graph_.has_started()) {
+    return AudioPipelineState::STOPPED;
   }
 
-  if ((event_bits & DECODER_MESSAGE_ERROR)) {
-    xEventGroupClearBits(this->event_group_, DECODER_MESSAGE_ERROR);
-    return AudioPipelineState::ERROR_DECODING;
+  if (this->clear_mixer_when_stopped_ && this->graph_.is_finished()) {
+    this->clear_mixer_();
+    this->clear_mixer_when_stopped_ = false;
   }
 
-  if ((event_bits & RESAMPLER_MESSAGE_ERROR)) {
-    xEventGroupClearBits(this->event_group_, RESAMPLER_MESSAGE_ERROR);
-    return AudioPipelineState::ERROR_RESAMPLING;
+  optional<size_t> failed_stage = this->graph_.take_failed_stage();
+  if (failed_stage.has_value()) {
+    switch (failed_stage.value()) {
+      case READER_STAGE:
+        return AudioPipelineState::ERROR_READING;
+      case DECODER_STAGE:
+        return AudioPipelineState::ERROR_DECODING;
+      default:
+        return AudioPipelineState::ERROR_RESAMPLING;
+    }
   }
 
-  if ((event_bits & READER_MESSAGE_FINISHED) && (event_bits & DECODER_MESSAGE_FINISHED) &&
-      (event_bits & RESAMPLER_MESSAGE_FINISHED)) {
+  if (this->graph_.is_finished()) {
+    if (this->finish_unreported_) {
+      this->log_stack_high_water_marks_();
+      if (this->graph_.is_output_started()) {
+        this->finish_mixer_();
+      }
+    }
+    this->finish_unreported_ = false;
     return AudioPipelineState::STOPPED;
   }
 
+  if (this->reader_->get_media_file() == nullptr) {
+    this->adapt_stream_buffer_();
+  }
+
   return AudioPipelineState::PLAYING;
 }
 
-esp_err_t AudioPipeline::stop() {
-  xEventGroupSetBits(this->event_group_, PIPELINE_COMMAND_STOP);
+void AudioPipeline::adapt_stream_buffer_() {
+  uint32_t now = millis();
+  if (now - this->last_stall_check_time_ < STREAM_STALL_CHECK_INTERVAL_MS) {
+    return;
+  }
+  this->last_stall_check_time_ = now;
 
-  uint32_t event_group_bits = xEventGroupWaitBits(this->event_group_,
-                                                  FINISHED_BITS,        // Bit message to read
-                                                  pdFALSE,              // Clear the bits on exit
-                                                  pdTRUE,               // Wait for all the bits,
-                                                  pdMS_TO_TICKS(300));  // Duration to block/wait
+  AudioRingBuffer *raw_file_ring_buffer = this->graph_.get_ring_buffer(READER_STAGE);
+  RingBufferStats stats = raw_file_ring_buffer->get_stats();
 
-  if (!(event_group_bits & READER_MESSAGE_FINISHED)) {
-    // Reader failed to stop
-    xEventGroupSetBits(this->event_group_, EventGroupBits::READER_MESSAGE_ERROR);
+  // Unsigned subtraction handles the counter wrapping around
+  const uint32_t decoder_blocked_us = stats.consumer_blocked_us - this->last_decoder_blocked_us_;
+  this->last_decoder_blocked_us_ = stats.consumer_blocked_us;
+
+  if (!this->stream_buffer_primed_) {
+    this->stream_buffer_primed_ = (raw_file_ring_buffer->available() >= stats.capacity / 2);
+    return;
   }
-  if (!(event_group_bits & DECODER_MESSAGE_FINISHED)) {
-    // Ddecoder failed to stop
-    xEventGroupSetBits(this->event_group_, EventGroupBits::DECODER_MESSAGE_ERROR);
+
+  if ((decoder_blocked_us < STREAM_STALL_THRESHOLD_US) || (stats.capacity < this->stream_buffer_size_)) {
+    // Either the network keeps up or the last resize couldn't be allocated
+    return;
   }
-  if (!(event_group_bits & RESAMPLER_MESSAGE_FINISHED)) {
-    // Resampler failed to stop
-    xEventGroupSetBits(this->event_group_, EventGroupBits::RESAMPLER_MESSAGE_ERROR);
+
+  const size_t new_size = std::min(stats.capacity * 2, this->stream_buffer_max_size_);
+  if (new_size <= stats.capacity) {
+    return;
   }
 
-  if ((event_group_bits & FINISHED_BITS) != FINISHED_BITS) {
-    // Not all bits were set, so it timed out
-    return ESP_ERR_TIMEOUT;
+  if (this->graph_.resize_ring_buffer(READER_STAGE, new_size) == ESP_OK) {
+    ESP_LOGI(TAG, "The stream stalled for %" PRIu32 " ms; growing its buffer to %zu bytes", decoder_blocked_us / 1000,
+             new_size);
+    this->stream_buffer_size_ = new_size;
+    this->stream_buffer_primed_ = false;
   }
+}
 
-  // Clear the ring buffer in the mixer; avoids playing incorrect audio when starting a new file while paused
-  CommandEvent command_event;
-  if (this->pipeline_type_ == AudioPipelineType::MEDIA) {
-    command_event.command = CommandEventType::CLEAR_MEDIA;
-  } else {
-    command_event.command = CommandEventType::CLEAR_ANNOUNCEMENT;
+esp_err_t AudioPipeline::stop() {
+  bool output_started = this->graph_.is_output_started();
+  this->finish_unreported_ = false;
+
+  esp_err_t err = this->graph_.stop();
+  if ((err != ESP_OK) || !output_started) {
+    // A pipeline that never started its output hasn't written anything to the mixer
+    return err;
   }
-  this->mixer_->send_command(&command_event);
 
-  xEventGroupClearBits(this->event_group_, UNFINISHED_BITS);
-  this->reset_ring_buffers();
+  // Clear the ring buffer in the mixer; avoids playing incorrect audio when starting a new file while paused
+  this->clear_mixer_();
+  this->clear_mixer_when_stopped_ = false;
 
   return ESP_OK;
 }
 
-void AudioPipeline::reset_ring_buffers() {
-  this->raw_file_ring_buffer_->reset();
-  this->decoded_ring_buffer_->reset();
-}
+void AudioPipeline::cancel() {
+  bool output_started = this->graph_.is_output_started();
+  this->finish_unreported_ = false;
 
-void AudioPipeline::suspend_tasks() {
-  if (this->read_task_handle_ != nullptr) {
-    vTaskSuspend(this->read_task_handle_);
-  }
-  if (this->decode_task_handle_ != nullptr) {
-    vTaskSuspend(this->decode_task_handle_);
-  }
-  if (this->resample_task_handle_ != nullptr) {
-    vTaskSuspend(this->resample_task_handle_);
+  this->graph_.request_stop();
+
+  if (output_started) {
+    this->clear_mixer_();
+    this->clear_mixer_when_stopped_ = true;
   }
 }
 
-void AudioPipeline::resume_tasks() {
-  if (this->read_task_handle_ != nullptr) {
-    vTaskResume(this->read_task_handle_);
-  }
-  if (this->decode_task_handle_ != nullptr) {
-    vTaskResume(this->decode_task_handle_);
-  }
-  if (this->resample_task_handle_ != nullptr) {
-    vTaskResume(this->resample_task_handle_);
+void AudioPipeline::clear_mixer_() {
+  CommandEvent command_event;
+  if (this->pipeline_type_ == AudioPipelineType::MEDIA) {
+    command_event.command = CommandEventType::CLEAR_MEDIA;
+  } else {
+    command_event.command = CommandEventType::CLEAR_ANNOUNCEMENT;
   }
+  command_event.stream_end = this->get_mixer_ring_buffer_()->get_stats().bytes_written;
+  this->mixer_->send_command(&command_event);
 }
 
-void AudioPipeline::read_task_(void *params) {
-  AudioPipeline *this_pipeline = (AudioPipeline *) params;
-
-  while (true) {
-    xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::READER_MESSAGE_FINISHED);
-
-    // Wait until the pipeline notifies us the source of the media file
-    EventBits_t event_bits =
-        xEventGroupWaitBits(this_pipeline->event_group_,
-                            READER_COMMAND_INIT_FILE | READER_COMMAND_INIT_HTTP,  // Bit message to read
-                            pdTRUE,                                               // Clear the bit on exit
-                            pdFALSE,                                              // Wait for all the bits,
-                            portMAX_DELAY);                                       // Block indefinitely until bit is set
-
-    xEventGroupClearBits(this_pipeline->event_group_, EventGroupBits::READER_MESSAGE_FINISHED);
-
-    {
-      InfoErrorEvent event;
-      event.source = InfoErrorSource::READER;
-      esp_err_t err = ESP_OK;
-
-      AudioReader reader = AudioReader(this_pipeline->raw_file_ring_buffer_.get(), FILE_BUFFER_SIZE);
-
-      if (event_bits & READER_COMMAND_INIT_FILE) {
-        err = reader.start(this_pipeline->current_media_file_, this_pipeline->current_media_file_type_);
-      } else {
-        err = reader.start(this_pipeline->current_uri_, this_pipeline->current_media_file_type_);
-      }
-      if (err != ESP_OK) {
-        // Send specific error message
-        event.err = err;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-
-        // Setting up the reader failed, stop the pipeline
-        xEventGroupSetBits(this_pipeline->event_group_,
-                           EventGroupBits::READER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-      } else {
-        // Send the file type to the pipeline
-        event.file_type = this_pipeline->current_media_file_type_;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-
-        // Inform the decoder that the media type is available
-        xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::READER_MESSAGE_LOADED_MEDIA_TYPE);
-      }
-
-      while (true) {
-        event_bits = xEventGroupGetBits(this_pipeline->event_group_);
-
-        if (event_bits & PIPELINE_COMMAND_STOP) {
-          break;
-        }
-
-        AudioReaderState reader_state = reader.read();
-
-        if (reader_state == AudioReaderState::FINISHED) {
-          break;
-        } else if (reader_state == AudioReaderState::FAILED) {
-          xEventGroupSetBits(this_pipeline->event_group_,
-                             EventGroupBits::READER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          break;
-        }
-      }
-    }
+void AudioPipeline::finish_mixer_() {
+  CommandEvent command_event;
+  if (this->pipeline_type_ == AudioPipelineType::MEDIA) {
+    command_event.command = CommandEventType::FINISH_MEDIA;
+  } else {
+    command_event.command = CommandEventType::FINISH_ANNOUNCEMENT;
   }
+  // The resampler has committed its last span, and no other pipeline writes to the ring buffer until this one's
+  // state is read, so the counter marks the end of this stream
+  command_event.stream_end = this->get_mixer_ring_buffer_()->get_stats().bytes_written;
+  this->mixer_->send_command(&command_event);
 }
 
-void AudioPipeline::decode_task_(void *params) {
-  AudioPipeline *this_pipeline = (AudioPipeline *) params;
-
-  while (true) {
-    xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::DECODER_MESSAGE_FINISHED);
-
-    // Wait until the reader notifies us that the media type is available
-    EventBits_t event_bits = xEventGroupWaitBits(this_pipeline->event_group_,
-                                                 READER_MESSAGE_LOADED_MEDIA_TYPE,  // Bit message to read
-                                                 pdTRUE,                            // Clear the bit on exit
-                                                 pdFALSE,                           // Wait for all the bits,
-                                                 portMAX_DELAY);  // Block indefinitely until bit is set
-
-    xEventGroupClearBits(this_pipeline->event_group_, EventGroupBits::DECODER_MESSAGE_FINISHED);
-
-    {
-      InfoErrorEvent event;
-      event.source = InfoErrorSource::DECODER;
-
-      std::unique_ptr<AudioDecoder> decoder = make_unique<AudioDecoder>(
-          this_pipeline->raw_file_ring_buffer_.get(), this_pipeline->decoded_ring_buffer_.get(), FILE_BUFFER_SIZE);
-      esp_err_t err = decoder->start(this_pipeline->current_media_file_type_);
-
-      if (err != ESP_OK) {
-        // Send specific error message
-        event.err = err;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-
-        // Setting up the decoder failed, stop the pipeline
-        xEventGroupSetBits(this_pipeline->event_group_,
-                           EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-      }
-
-      bool has_stream_info = false;
-
-      while (true) {
-        event_bits = xEventGroupGetBits(this_pipeline->event_group_);
-
-        if (event_bits & PIPELINE_COMMAND_STOP) {
-          break;
-        }
-
-        // Stop gracefully if the reader has finished
-        AudioDecoderState decoder_state = decoder->decode(event_bits & READER_MESSAGE_FINISHED);
-
-        if (decoder_state == AudioDecoderState::FINISHED) {
-          break;
-        } else if (decoder_state == AudioDecoderState::FAILED) {
-          if (!has_stream_info) {
-            event.decoding_err = DecodingError::FAILED_HEADER;
-            xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-          }
-          xEventGroupSetBits(this_pipeline->event_group_,
-                             EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          break;
-        }
-
-        if (!has_stream_info && decoder->get_audio_stream_info().has_value()) {
-          has_stream_info = true;
-
-          this_pipeline->current_audio_stream_info_ = decoder->get_audio_stream_info().value();
-
-          // Send the stream information to the pipeline
-          event.audio_stream_info = this_pipeline->current_audio_stream_info_;
-
-          if (this_pipeline->current_audio_stream_info_.bits_per_sample != 16) {
-            // Error state, incompatible bits per sample
-            event.decoding_err = DecodingError::INCOMPATIBLE_BITS_PER_SAMPLE;
-            xEventGroupSetBits(this_pipeline->event_group_,
-                               EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          } else if ((this_pipeline->current_audio_stream_info_.channels > 2)) {
-            // Error state, incompatible number of channels
-            event.decoding_err = DecodingError::INCOMPATIBLE_CHANNELS;
-            xEventGroupSetBits(this_pipeline->event_group_,
-                               EventGroupBits::DECODER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          } else {
-            // Inform the resampler that the stream information is available
-            xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::DECODER_MESSAGE_LOADED_STREAM_INFO);
-          }
-
-          xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-        }
-      }
+void AudioPipeline::reset_ring_buffers() {
+  for (size_t i = 0; i < this->graph_.get_stage_count() - 1; ++i) {
+    AudioRingBuffer *ring_buffer = this->graph_.get_ring_buffer(i);
+    if (ring_buffer != nullptr) {
+      ring_buffer->reset();
     }
   }
 }
 
-void AudioPipeline::resample_task_(void *params) {
-  AudioPipeline *this_pipeline = (AudioPipeline *) params;
+bool AudioPipeline::release_if_idle(uint32_t idle_timeout_ms) {
+  if (!this->graph_.has_started()) {
+    // Never started or already released
+    return false;
+  }
 
-  while (true) {
-    xEventGroupSetBits(this_pipeline->event_group_, EventGroupBits::RESAMPLER_MESSAGE_FINISHED);
+  if (!this->graph_.is_finished() || this->finish_unreported_ || this->clear_mixer_when_stopped_) {
+    // get_state still has to tell the mixer about this stream
+    this->idle_since_.reset();
+    return false;
+  }
 
-    // Wait until the decoder notifies us that the stream information is available
-    EventBits_t event_bits = xEventGroupWaitBits(this_pipeline->event_group_,
-                                                 DECODER_MESSAGE_LOADED_STREAM_INFO,  // Bit message to read
-                                                 pdTRUE,                              // Clear the bit on exit
-                                                 pdFALSE,                             // Wait for all the bits,
-                                                 portMAX_DELAY);  // Block indefinitely until bit is set
+  uint32_t now = millis();
+  if (!this->idle_since_.has_value()) {
+    this->idle_since_ = now;
+    return false;
+  }
 
-    xEventGroupClearBits(this_pipeline->event_group_, EventGroupBits::RESAMPLER_MESSAGE_FINISHED);
+  if ((now - this->idle_since_.value() < idle_timeout_ms) || (this->graph_.release() != ESP_OK)) {
+    return false;
+  }
 
-    {
-      InfoErrorEvent event;
-      event.source = InfoErrorSource::RESAMPLER;
+  this->idle_since_.reset();
+  return true;
+}
 
-      RingBuffer *output_ring_buffer = nullptr;
+uint32_t AudioPipeline::get_wakeup_count() { return this->graph_.get_wakeup_count(); }
 
-      if (this_pipeline->pipeline_type_ == AudioPipelineType::MEDIA) {
-        output_ring_buffer = this_pipeline->mixer_->get_media_ring_buffer();
-      } else {
-        output_ring_buffer = this_pipeline->mixer_->get_announcement_ring_buffer();
-      }
+AudioPipelineStats AudioPipeline::get_stats() {
+  AudioPipelineStats stats{};
 
-      AudioResampler resampler =
-          AudioResampler(this_pipeline->decoded_ring_buffer_.get(), output_ring_buffer, BUFFER_SIZE_SAMPLES);
+  AudioRingBuffer *raw_file_ring_buffer = this->graph_.get_ring_buffer(READER_STAGE);
+  AudioRingBuffer *decoded_ring_buffer = this->graph_.get_ring_buffer(DECODER_STAGE);
+  if ((raw_file_ring_buffer == nullptr) || (decoded_ring_buffer == nullptr)) {
+    return stats;
+  }
 
-      esp_err_t err = resampler.start(this_pipeline->current_audio_stream_info_, this_pipeline->target_sample_rate_,
-                                      this_pipeline->current_resample_info_);
+  stats.raw_file_ring_buffer = raw_file_ring_buffer->get_stats();
+  stats.decoded_ring_buffer = decoded_ring_buffer->get_stats();
 
-      if (err != ESP_OK) {
-        // Send specific error message
-        event.err = err;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
+  AudioRingBuffer *output_ring_buffer = this->get_mixer_ring_buffer_();
+  RingBufferStats output_stats{};
+  if (output_ring_buffer != nullptr) {
+    output_stats = output_ring_buffer->get_stats();
+  }
 
-        // Setting up the resampler failed, stop the pipeline
-        xEventGroupSetBits(this_pipeline->event_group_,
-                           EventGroupBits::RESAMPLER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-      } else {
-        event.resample_info = this_pipeline->current_resample_info_;
-        xQueueSend(this_pipeline->info_error_queue_, &event, portMAX_DELAY);
-      }
+  // The reader passes the bytes through unchanged
+  stats.reader.bytes_in = stats.raw_file_ring_buffer.bytes_written;
+  stats.reader.bytes_out = stats.raw_file_ring_buffer.bytes_written;
+  stats.reader.output_blocked_us = stats.raw_file_ring_buffer.producer_blocked_us;
 
-      while (true) {
-        event_bits = xEventGroupGetBits(this_pipeline->event_group_);
+  stats.decoder.bytes_in = stats.raw_file_ring_buffer.bytes_read;
+  stats.decoder.input_blocked_us = stats.raw_file_ring_buffer.consumer_blocked_us;
+  stats.decoder.bytes_out = stats.decoded_ring_buffer.bytes_written;
+  stats.decoder.output_blocked_us = stats.decoded_ring_buffer.producer_blocked_us;
 
-        if (event_bits & PIPELINE_COMMAND_STOP) {
-          break;
-        }
+  stats.resampler.bytes_in = stats.decoded_ring_buffer.bytes_read;
+  stats.resampler.input_blocked_us = stats.decoded_ring_buffer.consumer_blocked_us;
+  stats.resampler.bytes_out = output_stats.bytes_written;
+  stats.resampler.output_blocked_us = output_stats.producer_blocked_us;
 
-        // Stop gracefully if the decoder is done
-        AudioResamplerState resampler_state = resampler.resample(event_bits & DECODER_MESSAGE_FINISHED);
+  return stats;
+}
 
-        if (resampler_state == AudioResamplerState::FINISHED) {
-          break;
-        } else if (resampler_state == AudioResamplerState::FAILED) {
-          xEventGroupSetBits(this_pipeline->event_group_,
-                             EventGroupBits::RESAMPLER_MESSAGE_ERROR | EventGroupBits::PIPELINE_COMMAND_STOP);
-          break;
-        }
-      }
+void AudioPipeline::restart_fill_ranges() {
+  for (size_t i = 0; i < this->graph_.get_stage_count() - 1; ++i) {
+    AudioRingBuffer *ring_buffer = this->graph_.get_ring_buffer(i);
+    if (ring_buffer != nullptr) {
+      ring_buffer->restart_fill_range();
     }
   }
 }
 
+void AudioPipeline::suspend_tasks() { this->graph_.suspend_tasks(); }
+
+void AudioPipeline::resume_tasks() { this->graph_.resume_tasks(); }
+
 }  // namespace nabu
 }  // namespace esphome
 #endif
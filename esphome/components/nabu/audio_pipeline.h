@@ -2,21 +2,21 @@
 
 #ifdef USE_ESP_IDF
 
+#include "audio_buffer_arena.h"
 #include "audio_reader.h"
 #include "audio_decoder.h"
 #include "audio_resampler.h"
 #include "audio_mixer.h"
+#include "audio_ring_buffer.h"
+#include "audio_stage_graph.h"
 
 #include "esphome/components/audio/audio.h"
 #include "esphome/components/media_player/media_player.h"
 
 #include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
-#include "esphome/core/ring_buffer.h"
 
 #include <freertos/FreeRTOS.h>
-#include <freertos/event_groups.h>
-#include <freertos/queue.h>
 
 namespace esphome {
 namespace nabu {
@@ -34,28 +34,25 @@ enum class AudioPipelineState : uint8_t {
   ERROR_RESAMPLING,
 };
 
-enum class InfoErrorSource : uint8_t {
-  READER = 0,
-  DECODER,
-  RESAMPLER,
+// Snapshot of the pipeline's telemetry. The resampler's output counters come from the mixer's ring buffer, which the
+// mixer reports on itself.
+struct AudioPipelineStats {
+  AudioStageStats reader;  // The reader's input is the network or flash, so its input blocked time is always 0
+  AudioStageStats decoder;
+  AudioStageStats resampler;
+  RingBufferStats raw_file_ring_buffer;
+  RingBufferStats decoded_ring_buffer;
 };
 
-enum class DecodingError : uint8_t {
-  FAILED_HEADER = 0,
-  INCOMPATIBLE_BITS_PER_SAMPLE,
-  INCOMPATIBLE_CHANNELS,
-};
-
-// Used to pass information from each task.
-struct InfoErrorEvent {
-  InfoErrorSource source;
-  optional<esp_err_t> err;
-  optional<media_player::MediaFileType> file_type;
-  optional<audio::AudioStreamInfo> audio_stream_info;
-  optional<ResampleInfo> resample_info;
-  optional<DecodingError> decoding_err;
+// The stages of the chain that reads, decodes, and resamples a media file
+struct AudioFileStages {
+  AudioReader *reader;
+  AudioDecoder *decoder;
+  AudioResampler *resampler;
 };
 
+// Reads, decodes, and resamples a media file into one of the mixer's ring buffers. The reader, decoder, and resampler
+// are stages of an AudioStageGraph, which decides which tasks run them.
 class AudioPipeline {
  public:
   AudioPipeline(AudioMixer *mixer, AudioPipelineType pipeline_type);
@@ -78,73 +75,168 @@ class AudioPipeline {
   esp_err_t start(media_player::MediaFile *media_file, uint32_t target_sample_rate, const std::string &task_name,
                   UBaseType_t priority = 1);
 
-  /// @brief Stops the pipeline. Sends a stop signal to each task (if running) and clears the ring buffers.
+  /// @brief Starts an audio pipeline given a media url, but holds the resampled audio back from the mixer until
+  /// start_output() is called. Reading, decoding, and the connection setup all happen while another pipeline plays.
+  /// @param uri media file url
+  /// @param target_sample_rate the desired sample rate of the audio stream
+  /// @param task_name FreeRTOS task name
+  /// @param priority FreeRTOS task priority
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t prefetch(const std::string &uri, uint32_t target_sample_rate, const std::string &task_name,
+                     UBaseType_t priority = 1);
+
+  /// @brief Starts an audio pipeline given a MediaFile pointer, but holds the resampled audio back from the mixer
+  /// until start_output() is called.
+  /// @param media_file pointer to a MediaFile object
+  /// @param target_sample_rate the desired sample rate of the audio stream
+  /// @param task_name FreeRTOS task name
+  /// @param priority FreeRTOS task priority
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t prefetch(media_player::MediaFile *media_file, uint32_t target_sample_rate, const std::string &task_name,
+                     UBaseType_t priority = 1);
+
+  /// @brief Lets a prefetched pipeline write to the mixer. Call it once the pipeline previously feeding the mixer has
+  /// finished, so the new stream's first sample directly follows the previous stream's last sample.
+  void start_output();
+
+  /// @brief Stops the pipeline. Sends a stop signal to each task (if running) and clears the ring buffers. Clears the
+  /// mixer's ring buffer if this pipeline's output was started.
   /// @return ESP_OK if successful or ESP_ERR_TIMEOUT if the tasks did not indicate they stopped
   esp_err_t stop();
 
-  /// @brief Gets the state of the audio pipeline based on the info_error_queue_ and event_group_
+  /// @brief Stops the pipeline without waiting for its tasks. Aborts blocking reads and clears the mixer's ring buffer
+  /// right away if this pipeline's output was started, so the audio stops within milliseconds. The next start or stop
+  /// waits for the tasks to finish.
+  void cancel();
+
+  /// @brief Continues the current stream at a new position. Restarts the reader at the position's byte offset (with an
+  /// HTTP Range request for urls) and the decoder with the header it already parsed. The mixer keeps running; it only
+  /// drops the audio from before the seek.
+  /// @param position_ms Position to continue from, in milliseconds from the start of the stream
+  /// @return ESP_OK if successful, ESP_ERR_INVALID_STATE if the pipeline never started, or another error
+  esp_err_t seek(uint32_t position_ms);
+
+  /// @brief Gets the state of the audio pipeline based on the graph's events and state
   /// @return AudioPipelineState
   AudioPipelineState get_state();
 
   /// @brief Resets the ring buffers, discarding any existing data
   void reset_ring_buffers();
 
+  /// @brief Runs the reader, decoder, and resampler cooperatively in the read task when playing a MediaFile. Saves the
+  /// decoder and resampler tasks (they are only created once the pipeline plays a url) and the context switches
+  /// between them. Takes effect on the next start.
+  /// @param fuse_file_stages true to use a single task for MediaFile sources
+  void set_fuse_file_stages(bool fuse_file_stages) { this->graph_.set_allow_fusing(fuse_file_stages); }
+
+  /// @brief Sets the largest size the ring buffer between the reader and decoder grows to while playing a url. Takes
+  /// effect on the next start.
+  /// @param max_size Size in bytes; at least the default size of 64 KiB
+  void set_stream_buffer_max_size(size_t max_size) { this->stream_buffer_max_size_ = max_size; }
+
+  /// @brief Sets the arena the pipeline leases its ring buffers and scratch buffers from. Call before the first start.
+  void set_buffer_arena(AudioBufferArena *buffer_arena) { this->graph_.set_buffer_arena(buffer_arena); }
+
+  /// @brief Sets the pool the reader reuses idle HTTP connections from
+  void set_connection_pool(HttpConnectionPool *connection_pool) { this->reader_->set_connection_pool(connection_pool); }
+
+  /// @brief Sets the cache the reader looks up urls in and adds them to
+  void set_url_cache(AudioUrlCache *url_cache) { this->reader_->set_url_cache(url_cache); }
+
+  /// @brief Gives back the pipeline's buffers and tasks once it has been stopped for idle_timeout_ms. Call it
+  /// periodically; the next start allocates everything again.
+  /// @param idle_timeout_ms How long the pipeline must be stopped before its memory is released
+  /// @return true if the memory was released by this call
+  bool release_if_idle(uint32_t idle_timeout_ms);
+
+  /// @brief Number of times the pipeline's tasks have woken up while waiting on the reader's or decoder's ring buffer
+  uint32_t get_wakeup_count();
+
+  /// @brief Snapshot of each stage's throughput and blocked time and of the ring buffers' fill ranges. All zero before
+  /// the pipeline first starts.
+  AudioPipelineStats get_stats();
+
+  /// @brief Starts new min/max fill ranges for the reader's and decoder's ring buffers
+  void restart_fill_ranges();
+
   /// @brief Suspends any running tasks
   void suspend_tasks();
   /// @brief Resumes any running tasks
   void resume_tasks();
 
- protected:
-  /// @brief Allocates the ring buffers, event group, and info error queue.
-  /// @return ESP_OK if successful or ESP_ERR_NO_MEM if it is unable to allocate all parts
-  esp_err_t allocate_buffers_();
+  /// @brief Appends a reader, a decoder, and a resampler, connected by ring buffers, to an empty graph. Every graph
+  /// running this chain (e.g., the PCM cache's) assembles it here, so they share the buffer sizes.
+  /// @param graph Graph to assemble; the caller sets its sink
+  /// @param local_file true to size the reader's ring buffer for a MediaFile the decoder reads in place
+  /// @return Pointers to the stages, so they can be configured between streams
+  static AudioFileStages add_file_stages(AudioStageGraph *graph, bool local_file);
 
-  /// @brief Common start code for the pipeline, regardless if the source is a file or url.
+ protected:
+  /// @brief Common start code for the pipeline, regardless if the source is a file or url. Configure the reader's
+  /// source before calling.
   /// @param target_sample_rate the desired sample rate of the audio stream
   /// @param task_name FreeRTOS task name
   /// @param priority FreeRTOS task priority
+  /// @param hold_output If true, the resampler waits for start_output() before writing to the mixer
   /// @return ESP_OK if successful or an appropriate error if not
-  esp_err_t common_start_(uint32_t target_sample_rate, const std::string &task_name, UBaseType_t priority);
-
-  // Pointer to the media player's mixer object. The resample task feeds the appropriate ring buffer directly
-  AudioMixer *mixer_;
+  esp_err_t common_start_(uint32_t target_sample_rate, const std::string &task_name, UBaseType_t priority,
+                          bool hold_output);
 
-  std::string current_uri_{};
-  media_player::MediaFile *current_media_file_{nullptr};
+  /// @brief Logs the output formats and errors reported by the graph's stages
+  void log_events_();
 
-  media_player::MediaFileType current_media_file_type_;
-  audio::AudioStreamInfo current_audio_stream_info_;
-  ResampleInfo current_resample_info_;
-  uint32_t target_sample_rate_;
+  /// @brief Logs how much of each stage task's stack was never used, so the stack sizes' margins can be checked
+  void log_stack_high_water_marks_();
 
-  AudioPipelineType pipeline_type_;
+  /// @brief Doubles the ring buffer between the reader and decoder, up to the maximum size, if the decoder waited for
+  /// the network for too long since the last check. Only used for url sources.
+  void adapt_stream_buffer_();
 
-  std::unique_ptr<RingBuffer> raw_file_ring_buffer_;
-  std::unique_ptr<RingBuffer> decoded_ring_buffer_;
+  /// @brief Tells the mixer to discard the audio this pipeline wrote into its ring buffer
+  void clear_mixer_();
 
-  // Handles basic control/state of the three tasks
-  EventGroupHandle_t event_group_{nullptr};
+  /// @brief Tells the mixer the stream finished, so it plays out the rest even if that is less than its prebuffer
+  void finish_mixer_();
 
-  // Receives detailed info (file type, stream info, resampling info) or specific errors from the three tasks
-  QueueHandle_t info_error_queue_{nullptr};
+  /// @brief The mixer's ring buffer this pipeline feeds
+  AudioRingBuffer *get_mixer_ring_buffer_();
 
-  // Handles reading the media file from flash or a url
-  static void read_task_(void *params);
-  TaskHandle_t read_task_handle_{nullptr};
-  StaticTask_t read_task_stack_;
-  StackType_t *read_task_stack_buffer_{nullptr};
+  // Pointer to the media player's mixer object. The resampler feeds the appropriate ring buffer directly
+  AudioMixer *mixer_;
 
-  // Decodes the media file into PCM audio
-  static void decode_task_(void *params);
-  TaskHandle_t decode_task_handle_{nullptr};
-  StaticTask_t decode_task_stack_;
-  StackType_t *decode_task_stack_buffer_{nullptr};
+  AudioPipelineType pipeline_type_;
 
-  // Resamples the audio to match the specified target sample rate. Converts mono audio to stereo audio if necessary.
-  static void resample_task_(void *params);
-  TaskHandle_t resample_task_handle_{nullptr};
-  StaticTask_t resample_task_stack_;
-  StackType_t *resample_task_stack_buffer_{nullptr};
+  // Used to restart the graph when seeking
+  std::string task_name_;
+  UBaseType_t priority_{1};
+
+  // Size of the ring buffer between the reader and decoder for url sources. Grows while streams stall and carries over
+  // to the next stream, as it usually comes over the same network.
+  size_t stream_buffer_size_;
+  size_t stream_buffer_max_size_;
+
+  // Stall detection for the current url stream. The ring buffer only counts as primed once it filled halfway, so the
+  // decoder waiting for the first bytes of a stream doesn't count as a stall.
+  bool stream_buffer_primed_{false};
+  uint32_t last_stall_check_time_{0};
+  uint32_t last_decoder_blocked_us_{0};
+
+  // Set while a started stream may still finish on its own; the mixer is told once it does
+  bool finish_unreported_{false};
+
+  // Set by cancel(); the resampler may still write a last span after the mixer was cleared, so clear it again once the
+  // tasks have stopped
+  bool clear_mixer_when_stopped_{false};
+
+  // When the pipeline was first seen stopped with nothing left to report; unset while it plays
+  optional<uint32_t> idle_since_;
+
+  // Reader -> raw file ring buffer -> decoder -> decoded ring buffer -> resampler -> mixer. Each stage works in place
+  // on spans of the ring buffers rather than copying through them.
+  AudioStageGraph graph_;
+  AudioReader *reader_;
+  AudioDecoder *decoder_;
+  AudioResampler *resampler_;
 };
 
 }  // namespace nabu
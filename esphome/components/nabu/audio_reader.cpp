@@ -2,7 +2,12 @@
 
 #include "audio_reader.h"
 
-#include "esphome/core/ring_buffer.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+
+#include <cstring>
+#include <strings.h>
 
 #if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
 #include "esp_crt_bundle.h"
@@ -13,94 +18,257 @@ namespace nabu {
 
 static const size_t READ_WRITE_TIMEOUT_MS = 20;
 
-// The number of times the http read times out with no data before throwing an error
+// esp_http_client_read only returns once it has filled the whole request (or the connection timed out), so small
+// requests let the reader hand data to the decoder and notice a cancel request as soon as a little data arrives
+static const size_t HTTP_MAX_READ_SIZE = 1024;
+
+// Keeps receiving while the ring buffer is full. Matches the free space the reader waits for, so the socket is read
+// about as much while the decoder catches up as it is between two waits.
+static const size_t STAGING_BUFFER_SIZE = 4 * 1024;
+
+// Status of a response to a Range request the server honored
+static const int HTTP_PARTIAL_CONTENT_STATUS = 206;
+
+// The number of times the http read times out with no data before the connection counts as stalled
 static const size_t ERROR_COUNT_NO_DATA_READ_TIMEOUT = 50;
 
-AudioReader::AudioReader(esphome::RingBuffer *output_ring_buffer, size_t transfer_buffer_size) {
-  this->output_ring_buffer_ = output_ring_buffer;
-  this->transfer_buffer_size_ = transfer_buffer_size;
+// Reconnecting after a dropped or stalled connection waits 250 ms, 500 ms, 1 s, ... up to 4 s between attempts, and
+// gives up once the stream has gone 30 s without data
+static const uint32_t RECONNECT_INITIAL_BACKOFF_MS = 250;
+static const uint32_t RECONNECT_MAX_BACKOFF_MS = 4000;
+static const uint32_t RECONNECT_BUDGET_MS = 30000;
+// The backoff is waited out in slices, so the graph can stop or resize the ring buffer in between
+static const uint32_t RECONNECT_POLL_MS = 100;
+
+static const char *const TAG = "nabu_media_player.reader";
+
+// Maps a Content-Type header to a file type. Parameters (e.g., "; charset=...") and case are ignored.
+// @return the file type, or NONE if the header is missing or doesn't name a supported audio type
+static media_player::MediaFileType file_type_from_content_type(const std::string &content_type) {
+  std::string mime_type = str_lower_case(content_type.substr(0, content_type.find(';')));
+  while (!mime_type.empty() && (mime_type.back() == ' ')) {
+    mime_type.pop_back();
+  }
+
+  if ((mime_type == "audio/flac") || (mime_type == "audio/x-flac")) {
+    return media_player::MediaFileType::FLAC;
+  }
+  if ((mime_type == "audio/wav") || (mime_type == "audio/x-wav") || (mime_type == "audio/wave") ||
+      (mime_type == "audio/vnd.wave")) {
+    return media_player::MediaFileType::WAV;
+  }
+  if ((mime_type == "audio/mpeg") || (mime_type == "audio/mp3") || (mime_type == "audio/mpeg3") ||
+      (mime_type == "audio/x-mpeg") || (mime_type == "audio/x-mp3")) {
+    return media_player::MediaFileType::MP3;
+  }
+  if ((mime_type == "audio/aac") || (mime_type == "audio/aacp") || (mime_type == "audio/x-aac") ||
+      (mime_type == "audio/mp4") || (mime_type == "audio/m4a") || (mime_type == "audio/x-m4a")) {
+    return media_player::MediaFileType::AAC;
+  }
+  if ((mime_type == "audio/ogg") || (mime_type == "audio/opus") || (mime_type == "application/ogg")) {
+    // Ogg Vorbis is also served as audio/ogg; the decoder rejects streams without an OpusHead
+    return media_player::MediaFileType::OPUS;
+  }
+  return media_player::MediaFileType::NONE;
+}
+
+// Maps the extension of a url's path to a file type, ignoring any query or fragment
+static media_player::MediaFileType file_type_from_url(const std::string &url) {
+  std::string path = str_lower_case(url.substr(0, url.find_first_of("?#")));
+
+  if (str_endswith(path, ".wav")) {
+    return media_player::MediaFileType::WAV;
+  }
+  if (str_endswith(path, ".mp3")) {
+    return media_player::MediaFileType::MP3;
+  }
+  if (str_endswith(path, ".flac")) {
+    return media_player::MediaFileType::FLAC;
+  }
+  if (str_endswith(path, ".aac") || str_endswith(path, ".m4a") || str_endswith(path, ".m4b") ||
+      str_endswith(path, ".mp4")) {
+    return media_player::MediaFileType::AAC;
+  }
+  if (str_endswith(path, ".opus") || str_endswith(path, ".ogg") || str_endswith(path, ".oga")) {
+    return media_player::MediaFileType::OPUS;
+  }
+  return media_player::MediaFileType::NONE;
 }
 
-AudioReader::~AudioReader() {
-  if (this->transfer_buffer_ != nullptr) {
-    ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
-    allocator.deallocate(this->transfer_buffer_, this->transfer_buffer_size_);
+// Identifies a file type by the signature at the start of the file
+static media_player::MediaFileType file_type_from_signature(const uint8_t *data, size_t length) {
+  if ((length >= 4) && (std::memcmp(data, "fLaC", 4) == 0)) {
+    return media_player::MediaFileType::FLAC;
+  }
+  if ((length >= 12) && (std::memcmp(data, "RIFF", 4) == 0) && (std::memcmp(data + 8, "WAVE", 4) == 0)) {
+    return media_player::MediaFileType::WAV;
+  }
+  // An Ogg page whose first packet is an OpusHead
+  if ((length >= 36) && (std::memcmp(data, "OggS", 4) == 0) && (std::memcmp(data + 28, "OpusHead", 8) == 0)) {
+    return media_player::MediaFileType::OPUS;
   }
+  if ((length >= 3) && (std::memcmp(data, "ID3", 3) == 0)) {
+    return media_player::MediaFileType::MP3;
+  }
+  // An MPEG audio frame sync with a valid layer; AAC's ADTS sync has the layer bits cleared
+  if ((length >= 2) && (data[0] == 0xFF) && ((data[1] & 0xE0) == 0xE0) && ((data[1] & 0x06) != 0)) {
+    return media_player::MediaFileType::MP3;
+  }
+  // An ADTS frame sync: MPEG-4 or MPEG-2 with the layer bits cleared
+  if ((length >= 2) && (data[0] == 0xFF) && ((data[1] & 0xF6) == 0xF0)) {
+    return media_player::MediaFileType::AAC;
+  }
+  // An MP4 file starts with its ftyp box
+  if ((length >= 8) && (std::memcmp(data + 4, "ftyp", 4) == 0)) {
+    return media_player::MediaFileType::AAC;
+  }
+  return media_player::MediaFileType::NONE;
+}
+
+AudioReader::AudioReader(size_t max_read_size) { this->max_read_size_ = max_read_size; }
 
+AudioReader::~AudioReader() {
   this->cleanup_connection_();
+  this->release_buffers();
 }
 
-esp_err_t AudioReader::allocate_buffers_() {
-  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
-  if (this->transfer_buffer_ == nullptr)
-    this->transfer_buffer_ = allocator.allocate(this->transfer_buffer_size_);
+void AudioReader::release_buffers() {
+  AudioBufferArena::give_back(this->buffer_arena_, this->staging_buffer_, STAGING_BUFFER_SIZE);
+  this->staging_buffer_ = nullptr;
+  this->staged_start_ = 0;
+  this->staged_length_ = 0;
+}
 
-  if (this->transfer_buffer_ == nullptr)
-    return ESP_ERR_NO_MEM;
+void AudioReader::set_source(const std::string &uri) {
+  this->current_uri_ = uri;
+  this->detected_file_type_ = media_player::MediaFileType::NONE;
+  this->current_media_file_ = nullptr;
+  this->start_offset_ = 0;
+}
 
-  return ESP_OK;
+void AudioReader::set_source(media_player::MediaFile *media_file) {
+  this->current_uri_.clear();
+  this->current_media_file_ = media_file;
+  this->start_offset_ = 0;
 }
 
-esp_err_t AudioReader::start(media_player::MediaFile *media_file, media_player::MediaFileType &file_type) {
-  file_type = media_player::MediaFileType::NONE;
+esp_err_t AudioReader::start(const AudioStreamFormat &input_format) {
+  this->output_format_.reset();
+  this->cleanup_connection_();
 
-  esp_err_t err = this->allocate_buffers_();
-  if (err != ESP_OK) {
-    return err;
+  const size_t start_offset = this->start_offset_;
+  this->start_offset_ = 0;
+  this->source_length_ = 0;
+  this->bytes_to_discard_ = 0;
+  this->next_offset_ = start_offset;
+  this->resumable_ = false;
+  this->reconnect_pending_ = false;
+  this->reconnect_attempts_ = 0;
+  this->first_byte_pending_ = false;
+  this->staged_start_ = 0;
+  this->staged_length_ = 0;
+  this->cached_url_.reset();
+  this->url_capture_.reset();
+
+  if (this->current_media_file_ != nullptr) {
+    const size_t offset = std::min(start_offset, this->current_media_file_->length);
+    this->source_length_ = this->current_media_file_->length;
+
+    AudioStreamFormat output_format;
+    output_format.file_type = this->current_media_file_->file_type;
+    output_format.data = this->current_media_file_->data + offset;
+    output_format.data_length = this->current_media_file_->length - offset;
+    this->output_format_ = output_format;
+
+    return ESP_OK;
   }
 
-  this->current_media_file_ = media_file;
+  if ((this->url_cache_ != nullptr) && (start_offset == 0) && !this->current_uri_.empty()) {
+    this->cached_url_ = this->url_cache_->find(this->current_uri_);
+    if (this->cached_url_ != nullptr) {
+      ESP_LOGD(TAG, "Playing %zu cached bytes", this->cached_url_->length);
+      this->source_length_ = this->cached_url_->length;
 
-  this->transfer_buffer_current_ = media_file->data;
-  this->transfer_buffer_length_ = media_file->length;
-  file_type = media_file->file_type;
+      AudioStreamFormat output_format;
+      output_format.file_type = this->cached_url_->file_type;
+      output_format.data = this->cached_url_->data;
+      output_format.data_length = this->cached_url_->length;
+      this->output_format_ = output_format;
 
-  return ESP_OK;
-}
+      return ESP_OK;
+    }
+  }
 
-esp_err_t AudioReader::start(const std::string &uri, media_player::MediaFileType &file_type) {
-  file_type = media_player::MediaFileType::NONE;
+  this->stream_start_us_ = micros();
+  this->first_byte_pending_ = true;
 
-  esp_err_t err = this->allocate_buffers_();
-  if (err != ESP_OK) {
-    return err;
+  if (!this->staging_) {
+    // Give back a staging buffer leased for an earlier stream
+    this->release_buffers();
+  } else if (this->staging_buffer_ == nullptr) {
+    // Optional; without it, the reader stops reading the socket while the ring buffer is full
+    this->staging_buffer_ = AudioBufferArena::lease(this->buffer_arena_, STAGING_BUFFER_SIZE);
   }
 
-  this->cleanup_connection_();
+  return this->start_http_(start_offset, false);
+}
+
+esp_err_t AudioReader::start_http_(size_t start_offset, bool resume) {
+  esp_err_t err = ESP_OK;
 
-  if (uri.empty()) {
+  if (this->current_uri_.empty()) {
     return ESP_ERR_INVALID_ARG;
   }
 
-  esp_http_client_config_t client_config = {};
-
-  client_config.url = uri.c_str();
-  client_config.cert_pem = nullptr;
-  client_config.disable_auto_redirect = false;
-  client_config.max_redirection_count = 10;
-  client_config.buffer_size = 512;
-  client_config.keep_alive_enable = true;
-  client_config.timeout_ms = 5000;  // Doesn't raise an error if exceeded in esp-idf v4.4, it just prevents the
-                                    // http_client_read command from blocking for too long
+  this->content_type_.clear();
 
-#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
-  if (uri.find("https:") != std::string::npos) {
-    client_config.crt_bundle_attach = esp_crt_bundle_attach;
+  int content_length = 0;
+  err = this->open_connection_(start_offset, true, &content_length);
+  if ((err != ESP_OK) && this->connection_reused_ && !this->cancelled_.load()) {
+    // The server most likely closed the idle connection in the meantime
+    ESP_LOGD(TAG, "Reused connection failed; opening a new one");
+    this->content_type_.clear();
+    err = this->open_connection_(start_offset, false, &content_length);
+  }
+  if (err != ESP_OK) {
+    return err;
   }
-#endif
 
-  this->client_ = esp_http_client_init(&client_config);
+  this->bytes_to_discard_ = 0;
+  this->no_data_read_count_ = 0;
 
-  if (this->client_ == nullptr) {
-    return ESP_FAIL;
-  }
+  if (resume) {
+    if (esp_http_client_get_status_code(this->client_) == HTTP_PARTIAL_CONTENT_STATUS) {
+      return ESP_OK;
+    }
+    if ((content_length > 0) && (static_cast<size_t>(content_length) == this->source_length_)) {
+      // The server doesn't support ranges, but it sent the same source again
+      this->bytes_to_discard_ = start_offset;
+      return ESP_OK;
+    }
 
-  if ((err = esp_http_client_open(this->client_, 0)) != ESP_OK) {
+    // The source changed; the decoder can't continue it
+    this->resumable_ = false;
     this->cleanup_connection_();
-    return err;
+    return ESP_ERR_INVALID_RESPONSE;
   }
 
-  int content_length = esp_http_client_fetch_headers(this->client_);
+  if (start_offset > 0) {
+    if (esp_http_client_get_status_code(this->client_) == HTTP_PARTIAL_CONTENT_STATUS) {
+      // The content length only covers the requested range
+      if (content_length > 0) {
+        this->source_length_ = start_offset + content_length;
+      }
+    } else {
+      // The server doesn't support ranges; read from the beginning and throw away everything before the offset
+      this->bytes_to_discard_ = start_offset;
+      if (content_length > 0) {
+        this->source_length_ = content_length;
+      }
+    }
+  } else if (content_length > 0) {
+    this->source_length_ = content_length;
+  }
 
   char url[500];
   err = esp_http_client_get_url(this->client_, url, 500);
@@ -109,94 +277,364 @@ esp_err_t AudioReader::start(const std::string &uri, media_player::MediaFileType
     return err;
   }
 
-  std::string url_string = url;
+  media_player::MediaFileType file_type = file_type_from_content_type(this->content_type_);
+  if (file_type == media_player::MediaFileType::NONE) {
+    file_type = file_type_from_url(url);
+  }
+  if ((file_type == media_player::MediaFileType::NONE) && (start_offset > 0)) {
+    // The middle of a file has no signature to sniff
+    file_type = this->detected_file_type_;
+    if (file_type == media_player::MediaFileType::NONE) {
+      this->cleanup_connection_();
+      return ESP_ERR_NOT_SUPPORTED;
+    }
+  }
 
-  if (str_endswith(url_string, ".wav")) {
-    file_type = media_player::MediaFileType::WAV;
-  } else if (str_endswith(url_string, ".mp3")) {
-    file_type = media_player::MediaFileType::MP3;
-  } else if (str_endswith(url_string, ".flac")) {
-    file_type = media_player::MediaFileType::FLAC;
-  } else {
-    file_type = media_player::MediaFileType::NONE;
-    this->cleanup_connection_();
-    return ESP_ERR_NOT_SUPPORTED;
+  this->sniff_length_ = 0;
+  if (file_type != media_player::MediaFileType::NONE) {
+    AudioStreamFormat output_format;
+    output_format.file_type = file_type;
+    this->output_format_ = output_format;
+    this->detected_file_type_ = file_type;
   }
+  // Otherwise the first reads sniff the file type before publishing the output format
 
-  this->transfer_buffer_current_ = this->transfer_buffer_;
-  this->transfer_buffer_length_ = 0;
-  this->no_data_read_count_ = 0;
+  // Without the length, a dropped connection can't tell the end of the source from a lost connection
+  this->resumable_ = (this->source_length_ > 0);
+
+  if ((this->url_cache_ != nullptr) && (start_offset == 0)) {
+    // Without memory for it (or a known length), the url is just not cached
+    this->url_capture_ = this->url_cache_->create_entry(this->current_uri_, this->source_length_);
+  }
 
   return ESP_OK;
 }
 
-AudioReaderState AudioReader::read() {
+esp_err_t AudioReader::open_connection_(size_t start_offset, bool reuse, int *content_length) {
+  esp_err_t err = ESP_OK;
+
+  this->connection_reused_ = false;
+  if (reuse && (this->connection_pool_ != nullptr)) {
+    this->client_ = this->connection_pool_->take(this->current_uri_);
+  }
+
   if (this->client_ != nullptr) {
+    this->connection_reused_ = true;
+    esp_http_client_set_url(this->client_, this->current_uri_.c_str());
+    esp_http_client_set_user_data(this->client_, this);
+  } else {
+    esp_http_client_config_t client_config = {};
+
+    client_config.url = this->current_uri_.c_str();
+    client_config.cert_pem = nullptr;
+    client_config.disable_auto_redirect = false;
+    client_config.max_redirection_count = 10;
+    client_config.buffer_size = 512;
+    client_config.keep_alive_enable = true;
+    client_config.timeout_ms = 5000;  // Doesn't raise an error if exceeded in esp-idf v4.4, it just prevents the
+                                      // http_client_read command from blocking for too long
+    client_config.event_handler = AudioReader::http_event_handler_;
+    client_config.user_data = this;
+
+#if CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+    if (this->current_uri_.find("https:") != std::string::npos) {
+      client_config.crt_bundle_attach = esp_crt_bundle_attach;
+    }
+#endif
+
+    this->client_ = esp_http_client_init(&client_config);
+
+    if (this->client_ == nullptr) {
+      return ESP_FAIL;
+    }
+  }
+
+  if (start_offset > 0) {
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%zu-", start_offset);
+    esp_http_client_set_header(this->client_, "Range", range);
+  } else {
+    // A reused client still carries the header of its previous request
+    esp_http_client_delete_header(this->client_, "Range");
+  }
+
+  if ((err = esp_http_client_open(this->client_, 0)) != ESP_OK) {
+    this->discard_connection_();
+    return err;
+  }
+
+  *content_length = esp_http_client_fetch_headers(this->client_);
+
+  if (this->cancelled_.load()) {
+    // Stopped while connecting; don't bother checking the response
+    this->discard_connection_();
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if (this->connection_reused_ && (*content_length < 0) && !esp_http_client_is_chunked_response(this->client_)) {
+    // No response headers; the server closed the idle connection. A new connection keeps the old behavior, as a live
+    // stream without a Content-Length header reports the same length.
+    this->discard_connection_();
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
+AudioStageState AudioReader::process(bool stop_gracefully) {
+  if (this->reconnect_pending_) {
+    return this->reconnect_();
+  } else if (this->client_ != nullptr) {
     return this->http_read_();
-  } else if (this->current_media_file_ != nullptr) {
-    return this->file_read_();
+  } else if (this->output_format_.has_value()) {
+    // The url has been read completely, or the source is in memory and the decoder reads it in place
+    return AudioStageState::FINISHED;
   }
 
-  return AudioReaderState::FAILED;
+  return AudioStageState::FAILED;
 }
 
-AudioReaderState AudioReader::file_read_() {
-  if (this->transfer_buffer_length_ > 0) {
-    size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-        (void *) this->transfer_buffer_current_, this->transfer_buffer_length_, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
-    this->transfer_buffer_length_ -= bytes_written;
-    this->transfer_buffer_current_ += bytes_written;
+AudioStageState AudioReader::http_read_() {
+  if (!this->output_format_.has_value()) {
+    return this->sniff_file_type_();
+  }
 
-    return AudioReaderState::READING;
+  const bool received_all = esp_http_client_is_complete_data_received(this->client_) ||
+                            (this->resumable_ && (this->next_offset_ >= this->source_length_));
+  if (received_all && (this->staged_length_ == 0)) {
+    this->cleanup_connection_();
+    if ((this->url_capture_ != nullptr) && (this->next_offset_ == this->url_capture_->length)) {
+      this->url_capture_->file_type = this->output_format_.value().file_type;
+      this->url_cache_->insert(std::move(this->url_capture_));
+    }
+    this->url_capture_.reset();
+    return AudioStageState::FINISHED;
   }
-  return AudioReaderState::FINISHED;
-}
 
-AudioReaderState AudioReader::http_read_() {
-  if (this->transfer_buffer_length_ > 0) {
-    size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-        (void *) this->transfer_buffer_, this->transfer_buffer_length_, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
-    this->transfer_buffer_length_ -= bytes_written;
+  uint8_t *write_buffer = nullptr;
+  size_t bytes_free = this->output_ring_buffer_->acquire(&write_buffer, 1, 0);
 
-    // Shift remaining data to the start of the transfer buffer
-    memmove(this->transfer_buffer_, this->transfer_buffer_ + bytes_written, this->transfer_buffer_length_);
+  if ((this->staged_length_ > 0) && (bytes_free > 0)) {
+    // The staged bytes come first, so the stream stays in order
+    this->flush_staged_(write_buffer, bytes_free);
+    return AudioStageState::RUNNING;
   }
 
-  if (esp_http_client_is_complete_data_received(this->client_)) {
-    if (this->transfer_buffer_length_ == 0) {
-      this->cleanup_connection_();
-      return AudioReaderState::FINISHED;
+  // Receive directly into the free space of the ring buffer
+  uint8_t *receive_buffer = write_buffer;
+  size_t bytes_to_read = std::min(bytes_free, std::min(this->max_read_size_, HTTP_MAX_READ_SIZE));
+  bool staging = false;
+
+  if (bytes_to_read == 0) {
+    // The ring buffer is full; keep the socket flowing into the staging buffer
+    const size_t staging_end = this->staged_start_ + this->staged_length_;
+    if (received_all || (this->staging_buffer_ == nullptr) || (staging_end >= STAGING_BUFFER_SIZE)) {
+      // Nothing left to receive or both are full; wait for the decoder to free up space, or for another reason to
+      // wake up, e.g., to stop
+      this->output_ring_buffer_->acquire(&write_buffer, 1, this->output_ticks_to_wait_);
+      return AudioStageState::RUNNING;
     }
-  } else {
-    size_t bytes_to_read = this->transfer_buffer_size_ - this->transfer_buffer_length_;
-    int received_len = esp_http_client_read(
-        this->client_, (char *) this->transfer_buffer_ + this->transfer_buffer_length_, bytes_to_read);
-
-    if (received_len > 0) {
-      this->transfer_buffer_length_ += received_len;
-      this->no_data_read_count_ = 0;
-    } else if (received_len < 0) {
-      // HTTP read error
-      this->cleanup_connection_();
-      return AudioReaderState::FAILED;
+    receive_buffer = this->staging_buffer_ + staging_end;
+    bytes_to_read = std::min(STAGING_BUFFER_SIZE - staging_end, HTTP_MAX_READ_SIZE);
+    staging = true;
+  }
+
+  if (this->bytes_to_discard_ > 0) {
+    // Receive into the free space without committing or staging it
+    bytes_to_read = std::min(bytes_to_read, this->bytes_to_discard_);
+  }
+
+  int received_len = esp_http_client_read(this->client_, (char *) receive_buffer, bytes_to_read);
+
+  if (received_len > 0) {
+    if (this->bytes_to_discard_ > 0) {
+      this->bytes_to_discard_ -= received_len;
+    } else if (staging) {
+      this->note_received_(receive_buffer, received_len);
+      this->staged_length_ += received_len;
     } else {
-      if (bytes_to_read > 0) {
-        // Read timed out
-        ++this->no_data_read_count_;
-        if (this->no_data_read_count_ >= ERROR_COUNT_NO_DATA_READ_TIMEOUT) {
-          // Timed out with no data read too many times, so the http read has failed
-          this->cleanup_connection_();
-          return AudioReaderState::FAILED;
-        }
+      this->note_received_(receive_buffer, received_len);
+      this->output_ring_buffer_->commit(received_len);
+    }
+    this->no_data_read_count_ = 0;
+    this->reconnect_attempts_ = 0;
+  } else if (received_len < 0) {
+    // HTTP read error, e.g., the connection dropped
+    return this->lose_connection_();
+  } else {
+    // Read timed out
+    ++this->no_data_read_count_;
+    if (this->no_data_read_count_ >= ERROR_COUNT_NO_DATA_READ_TIMEOUT) {
+      // Timed out with no data read too many times, so the connection has stalled
+      return this->lose_connection_();
+    }
+    if (!this->cancelled_.load()) {
+      vTaskDelay(pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+    }
+  }
+
+  return AudioStageState::RUNNING;
+}
+
+void AudioReader::flush_staged_(uint8_t *write_buffer, size_t bytes_free) {
+  const size_t bytes_to_move = std::min(bytes_free, this->staged_length_);
+  std::memcpy(write_buffer, this->staging_buffer_ + this->staged_start_, bytes_to_move);
+  this->output_ring_buffer_->commit(bytes_to_move);
+
+  this->staged_start_ += bytes_to_move;
+  this->staged_length_ -= bytes_to_move;
+  if (this->staged_length_ == 0) {
+    this->staged_start_ = 0;
+  }
+}
+
+AudioStageState AudioReader::sniff_file_type_() {
+  const size_t sniff_size = sizeof(this->sniff_buffer_);
+
+  int received_len = esp_http_client_read(this->client_, (char *) this->sniff_buffer_ + this->sniff_length_,
+                                          sniff_size - this->sniff_length_);
+  if (received_len < 0) {
+    this->cleanup_connection_();
+    return AudioStageState::FAILED;
+  }
+  this->sniff_length_ += received_len;
+
+  if ((this->sniff_length_ < sniff_size) && !esp_http_client_is_complete_data_received(this->client_)) {
+    if (received_len == 0) {
+      ++this->no_data_read_count_;
+      if (this->no_data_read_count_ >= ERROR_COUNT_NO_DATA_READ_TIMEOUT) {
+        this->cleanup_connection_();
+        return AudioStageState::FAILED;
+      }
+      if (!this->cancelled_.load()) {
         vTaskDelay(pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
       }
     }
+    return AudioStageState::RUNNING;
+  }
+
+  media_player::MediaFileType file_type = file_type_from_signature(this->sniff_buffer_, this->sniff_length_);
+  if (file_type == media_player::MediaFileType::NONE) {
+    ESP_LOGE(TAG, "Unable to determine the file type (Content-Type: '%s')", this->content_type_.c_str());
+    this->cleanup_connection_();
+    return AudioStageState::FAILED;
+  }
+
+  // The decoder needs the sniffed bytes too. The ring buffer is empty at the start of a stream, so they fit.
+  size_t bytes_written =
+      this->output_ring_buffer_->write(this->sniff_buffer_, this->sniff_length_, this->output_ticks_to_wait_);
+  if (bytes_written < this->sniff_length_) {
+    this->cleanup_connection_();
+    return AudioStageState::FAILED;
+  }
+  this->note_received_(this->sniff_buffer_, bytes_written);
+  this->no_data_read_count_ = 0;
+
+  AudioStreamFormat output_format;
+  output_format.file_type = file_type;
+  this->output_format_ = output_format;
+  this->detected_file_type_ = file_type;
+
+  return AudioStageState::RUNNING;
+}
+
+esp_err_t AudioReader::http_event_handler_(esp_http_client_event_t *event) {
+  if ((event->event_id == HTTP_EVENT_ON_HEADER) && (strcasecmp(event->header_key, "Content-Type") == 0)) {
+    // Each response overwrites it, so after redirects it holds the final response's type
+    static_cast<AudioReader *>(event->user_data)->content_type_ = event->header_value;
+  }
+  return ESP_OK;
+}
+
+void AudioReader::note_received_(const uint8_t *data, size_t length) {
+  if (this->url_capture_ != nullptr) {
+    if (this->next_offset_ + length <= this->url_capture_->length) {
+      std::memcpy(this->url_capture_->data + this->next_offset_, data, length);
+    } else {
+      // The response is longer than it claimed to be
+      this->url_capture_.reset();
+    }
+  }
+
+  this->next_offset_ += length;
+  this->note_first_byte_();
+}
+
+void AudioReader::note_first_byte_() {
+  if (!this->first_byte_pending_) {
+    return;
+  }
+  this->first_byte_pending_ = false;
+
+  const uint32_t first_byte_time_ms = (micros() - this->stream_start_us_) / 1000;
+  ESP_LOGD(TAG, "First byte after %u ms (%s connection)", (unsigned) first_byte_time_ms,
+           this->connection_reused_ ? "reused" : "new");
+  if (this->connection_pool_ != nullptr) {
+    this->connection_pool_->record_first_byte_time(first_byte_time_ms);
   }
+}
+
+AudioStageState AudioReader::lose_connection_() {
+  this->discard_connection_();
+
+  if (this->cancelled_.load() || !this->resumable_) {
+    return AudioStageState::FAILED;
+  }
+
+  uint32_t now = millis();
+  if (this->reconnect_attempts_ == 0) {
+    this->outage_start_ms_ = now;
+  } else if (now - this->outage_start_ms_ >= RECONNECT_BUDGET_MS) {
+    ESP_LOGE(TAG, "Unable to reconnect to the stream within %u ms; giving up", (unsigned) RECONNECT_BUDGET_MS);
+    return AudioStageState::FAILED;
+  }
+
+  uint32_t backoff_ms = RECONNECT_MAX_BACKOFF_MS;
+  if (this->reconnect_attempts_ < 8) {
+    backoff_ms = std::min(RECONNECT_INITIAL_BACKOFF_MS << this->reconnect_attempts_, RECONNECT_MAX_BACKOFF_MS);
+  }
+  ++this->reconnect_attempts_;
+
+  ESP_LOGW(TAG, "Lost the connection at byte %zu; reconnecting in %u ms", this->next_offset_, (unsigned) backoff_ms);
+  this->reconnect_at_ms_ = now + backoff_ms;
+  this->reconnect_pending_ = true;
+
+  return AudioStageState::RUNNING;
+}
 
-  return AudioReaderState::READING;
+AudioStageState AudioReader::reconnect_() {
+  if (this->cancelled_.load()) {
+    return AudioStageState::FAILED;
+  }
+
+  // Signed difference handles millis() wrapping around
+  int32_t remaining_ms = static_cast<int32_t>(this->reconnect_at_ms_ - millis());
+  if (remaining_ms > 0) {
+    // Stopping the graph notifies the task, which ends the wait early
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(std::min(static_cast<uint32_t>(remaining_ms), RECONNECT_POLL_MS)));
+    return AudioStageState::RUNNING;
+  }
+
+  this->reconnect_pending_ = false;
+  esp_err_t err = this->start_http_(this->next_offset_, true);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Reconnecting failed: %s", esp_err_to_name(err));
+    return this->lose_connection_();
+  }
+
+  ESP_LOGI(TAG, "Reconnected; continuing the stream at byte %zu", this->next_offset_);
+  return AudioStageState::RUNNING;
 }
 
 void AudioReader::cleanup_connection_() {
+  if ((this->client_ != nullptr) && (this->connection_pool_ != nullptr)) {
+    this->connection_pool_->give_back(this->client_);
+    this->client_ = nullptr;
+  }
+  this->discard_connection_();
+}
+
+void AudioReader::discard_connection_() {
   if (this->client_ != nullptr) {
     esp_http_client_close(this->client_);
     esp_http_client_cleanup(this->client_);
@@ -2,51 +2,172 @@
 
 #ifdef USE_ESP_IDF
 
+#include "audio_stage.h"
+#include "audio_url_cache.h"
+#include "http_connection_pool.h"
+
 #include "esphome/components/media_player/media_player.h"
-#include "esphome/core/ring_buffer.h"
 
 #include <esp_http_client.h>
 
 namespace esphome {
 namespace nabu {
 
-enum class AudioReaderState : uint8_t {
-  READING = 0,
-  FINISHED,
-  FAILED,
-};
-
-class AudioReader {
+// Source stage that reads an encoded audio file from a url or from a MediaFile in flash. Its output format is the file
+// type.
+//  - A MediaFile (or a cached url) is already in memory, so the reader doesn't copy it into the ring buffer. Its output
+//    format points the decoder at the memory instead, and the reader finishes right away.
+//  - A url source keeps track of the offset of the next byte it writes to the ring buffer. If the connection drops or
+//    stalls, it reconnects with an HTTP Range request at that offset, backing off exponentially up to a total time
+//    budget. The decoder just waits for more input in the meantime.
+//  - Only sources with a known length can be resumed; a live stream fails like before
+//  - A url's file type comes from the Content-Type header, then the url's extension. If neither is conclusive, the
+//    reader sniffs the first bytes of the response (``fLaC``, ``RIFF....WAVE``, an Ogg page with an ``OpusHead``, ID3,
+//    an MPEG or ADTS frame sync, or an MP4 ``ftyp`` box) before it publishes its output format. The sniffed bytes are
+//    then written to the ring buffer like any others.
+//  - A url source receives straight into the ring buffer's free space. While the ring buffer is full, it keeps reading
+//    the socket into a small staging buffer instead, so the TCP window stays open while the decoder drains the ring
+//    buffer. The staged bytes are moved into the ring buffer before anything else once space frees up.
+//  - With a url cache, a url source that is cached is read from memory like a MediaFile. Otherwise the reader copies
+//    the response into a new cache entry as it arrives and inserts it once the response is complete.
+//  - With a connection pool, a url source reuses an idle keep-alive connection to the same host and gives its
+//    connection back once the response is read completely. A reused connection the server has closed in the meantime
+//    is replaced by a fresh one.
+class AudioReader : public AudioStage {
  public:
-  AudioReader(esphome::RingBuffer *output_ring_buffer, size_t transfer_buffer_size);
+  AudioReader(size_t max_read_size);
   ~AudioReader();
 
-  esp_err_t start(const std::string &uri, media_player::MediaFileType &file_type);
-  esp_err_t start(media_player::MediaFile *media_file, media_player::MediaFileType &file_type);
+  const char *get_name() const override { return "reader"; }
+
+  /// @brief Reads from a url on the next start. Later starts at an offset (e.g., to seek) reuse the file type detected
+  /// for the url, since the middle of a file can't be sniffed.
+  void set_source(const std::string &uri);
+  /// @brief Reads from a MediaFile on the next start
+  void set_source(media_player::MediaFile *media_file);
+
+  /// @brief Skips to a byte offset in the source on the next start only, e.g., to continue a stream at a new position.
+  /// Url sources request the offset with an HTTP Range header.
+  void set_start_offset(size_t start_offset) { this->start_offset_ = start_offset; }
+
+  /// @brief Sets the pool url sources take idle connections from and give them back to. Without a pool, every stream
+  /// opens a new connection.
+  void set_connection_pool(HttpConnectionPool *connection_pool) { this->connection_pool_ = connection_pool; }
+
+  /// @brief Sets the cache url sources are looked up in and added to. Without a cache, every url is fetched.
+  void set_url_cache(AudioUrlCache *url_cache) { this->url_cache_ = url_cache; }
+
+  /// @brief Sets whether url sources keep reading the socket into the staging buffer while the ring buffer is full.
+  /// On by default. Takes effect on the next start.
+  void set_staging(bool staging) { this->staging_ = staging; }
+
+  /// @brief The MediaFile source set for the next start, nullptr for a url source
+  media_player::MediaFile *get_media_file() const { return this->current_media_file_; }
+
+  /// @brief Size of the whole source in bytes, 0 if unknown (e.g., a chunked HTTP response). Only valid after start.
+  size_t get_source_length() const { return this->source_length_; }
+
+  esp_err_t start(const AudioStreamFormat &input_format) override;
+
+  AudioStageState process(bool stop_gracefully) override;
+
+  optional<AudioStreamFormat> get_output_format() const override { return this->output_format_; }
+
+  void release_buffers() override;
 
-  AudioReaderState read();
+  /// @brief A url source blocks on the network
+  bool may_block_on_io() const override { return this->current_media_file_ == nullptr; }
 
  protected:
-  esp_err_t allocate_buffers_();
+  /// @brief Connects to the url source and requests the source from an offset
+  /// @param start_offset Byte offset in the source to start from
+  /// @param resume If true, continues a stream whose connection was lost. The output format and source length are
+  ///               kept, and a server that ignores the Range header must send the same source again.
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t start_http_(size_t start_offset, bool resume);
 
-  AudioReaderState file_read_();
-  AudioReaderState http_read_();
+  /// @brief Opens a connection to the url source and fetches the response headers
+  /// @param start_offset Byte offset in the source to request with a Range header; 0 requests the whole source
+  /// @param reuse If true, takes an idle connection from the pool if there is one
+  /// @param content_length Set to the response's content length
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t open_connection_(size_t start_offset, bool reuse, int *content_length);
 
+  AudioStageState http_read_();
+
+  /// @brief Moves staged bytes into the free span of the ring buffer
+  void flush_staged_(uint8_t *write_buffer, size_t bytes_free);
+
+  /// @brief Reads the first bytes of the response until they reveal the file type, then writes them to the ring buffer
+  AudioStageState sniff_file_type_();
+
+  /// @brief Records the Content-Type header of the response
+  static esp_err_t http_event_handler_(esp_http_client_event_t *event);
+
+  /// @brief Closes a dropped or stalled connection and schedules a reconnect if the stream can be resumed
+  /// @return RUNNING if a reconnect is scheduled, FAILED if the stream can't be resumed or the time budget is used up
+  AudioStageState lose_connection_();
+
+  /// @brief Waits out the backoff in short slices, then reconnects at the offset of the next byte
+  AudioStageState reconnect_();
+
+  /// @brief Accounts for bytes received from the url: copies them into the cache entry being filled and advances the
+  /// offset of the next byte
+  /// @param data The received bytes
+  /// @param length Number of bytes received
+  void note_received_(const uint8_t *data, size_t length);
+
+  /// @brief Records the time from starting the stream to its first byte of audio, once per stream
+  void note_first_byte_();
+
+  /// @brief Gives the connection back to the pool, which keeps it only if the response was read completely
   void cleanup_connection_();
+  /// @brief Closes the connection without giving it back, e.g., after it failed
+  void discard_connection_();
+
+  size_t max_read_size_;  // Largest amount of data to transfer into the ring buffer at once (in bytes)
+
+  size_t no_data_read_count_;
 
-  esphome::RingBuffer *output_ring_buffer_;
+  size_t start_offset_{0};
+  size_t source_length_{0};
+  size_t bytes_to_discard_{0};  // Set if the server ignored the Range header and sent the source from the beginning
 
-  size_t transfer_buffer_length_;  // Amount of data currently stored in transfer buffer (in bytes)
-  size_t transfer_buffer_size_;    // Capacity of transfer buffer (in bytes)
+  std::string content_type_;
+  media_player::MediaFileType detected_file_type_{media_player::MediaFileType::NONE};  // Of current_uri_
+  uint8_t sniff_buffer_[36];  // Long enough for the longest signature, an Ogg page header followed by "OpusHead"
+  size_t sniff_length_{0};
 
-  ssize_t no_data_read_count_;
+  // Receives the stream while the ring buffer is full; the staged bytes are at staging_buffer_ + staged_start_
+  uint8_t *staging_buffer_{nullptr};
+  size_t staged_start_{0};
+  size_t staged_length_{0};
+  bool staging_{true};
 
-  uint8_t *transfer_buffer_{nullptr};
-  const uint8_t *transfer_buffer_current_{nullptr};
+  // Offset in the source of the next byte received (written to the ring buffer or staged); a reconnect requests the
+  // source from here
+  size_t next_offset_{0};
+  bool resumable_{false};
+  bool reconnect_pending_{false};
+  uint8_t reconnect_attempts_{0};  // Since data last arrived
+  uint32_t reconnect_at_ms_{0};
+  uint32_t outage_start_ms_{0};
 
   esp_http_client_handle_t client_{nullptr};
+  HttpConnectionPool *connection_pool_{nullptr};
 
+  AudioUrlCache *url_cache_{nullptr};
+  std::shared_ptr<const CachedUrlEntry> cached_url_;  // Set while reading a cached url from memory
+  std::shared_ptr<CachedUrlEntry> url_capture_;       // Set while filling a cache entry from the response
+  bool connection_reused_{false};
+
+  uint32_t stream_start_us_{0};
+  bool first_byte_pending_{false};
+
+  std::string current_uri_{};
   media_player::MediaFile *current_media_file_{nullptr};
+
+  optional<AudioStreamFormat> output_format_{};
 };
 }  // namespace nabu
 }  // namespace esphome
@@ -2,9 +2,10 @@
 
 #include "audio_resampler.h"
 
-#include "esphome/core/ring_buffer.h"
 #include "esphome/core/helpers.h"
 
+#include <cstring>
+
 namespace esphome {
 namespace nabu {
 
@@ -14,91 +15,100 @@ static const bool USE_PRE_POST_FILTER = true;
 
 // These output parameters are currently hardcoded in the elements further down the pipeline (mixer and speaker)
 static const uint8_t OUTPUT_CHANNELS = 2;
-static const uint8_t OUTPUT_BITS_PER_SAMPLE = 16;
+static const uint8_t OUTPUT_BITS_PER_SAMPLE = 32;
+
+// Full scale of a 32 bit sample as a float, and the largest float below it
+static const float SAMPLE_SCALE = 2147483648.0f;
+static const float MAX_SAMPLE_FLOAT = 2147483520.0f;
+
+// Reads a little endian PCM sample of 2, 3, or 4 bytes as a 32 bit sample, with narrower samples in the upper bits
+static inline int32_t read_sample(const uint8_t *data, uint8_t bytes_per_sample) {
+  switch (bytes_per_sample) {
+    case 2:
+      return static_cast<int32_t>((static_cast<uint32_t>(data[0]) << 16) | (static_cast<uint32_t>(data[1]) << 24));
+    case 3:
+      return static_cast<int32_t>((static_cast<uint32_t>(data[0]) << 8) | (static_cast<uint32_t>(data[1]) << 16) |
+                                  (static_cast<uint32_t>(data[2]) << 24));
+    default:
+      return static_cast<int32_t>(static_cast<uint32_t>(data[0]) | (static_cast<uint32_t>(data[1]) << 8) |
+                                  (static_cast<uint32_t>(data[2]) << 16) | (static_cast<uint32_t>(data[3]) << 24));
+  }
+}
 
-static const size_t READ_WRITE_TIMEOUT_MS = 20;
+static inline int32_t float_to_sample(float value) {
+  return static_cast<int32_t>(clamp(value * SAMPLE_SCALE, -SAMPLE_SCALE, MAX_SAMPLE_FLOAT));
+}
 
-AudioResampler::AudioResampler(RingBuffer *input_ring_buffer, RingBuffer *output_ring_buffer,
-                               size_t internal_buffer_samples) {
-  this->input_ring_buffer_ = input_ring_buffer;
-  this->output_ring_buffer_ = output_ring_buffer;
+AudioResampler::AudioResampler(size_t internal_buffer_samples) {
   this->internal_buffer_samples_ = internal_buffer_samples;
 }
 
-AudioResampler::~AudioResampler() {
-  ExternalRAMAllocator<int16_t> int16_allocator(ExternalRAMAllocator<int16_t>::ALLOW_FAILURE);
-  ExternalRAMAllocator<float> float_allocator(ExternalRAMAllocator<float>::ALLOW_FAILURE);
+AudioResampler::~AudioResampler() { this->release_buffers(); }
+
+void AudioResampler::release_buffers() {
+  const size_t float_buffer_bytes = this->internal_buffer_samples_ * sizeof(float);
+
+  AudioBufferArena::give_back(this->buffer_arena_, reinterpret_cast<uint8_t *>(this->float_input_buffer_),
+                              float_buffer_bytes);
+  AudioBufferArena::give_back(this->buffer_arena_, reinterpret_cast<uint8_t *>(this->float_output_buffer_),
+                              float_buffer_bytes);
+  this->float_input_buffer_ = nullptr;
+  this->float_output_buffer_ = nullptr;
 
-  if (this->input_buffer_ != nullptr) {
-    int16_allocator.deallocate(this->input_buffer_, this->internal_buffer_samples_);
-  }
-  if (this->output_buffer_ != nullptr) {
-    int16_allocator.deallocate(this->output_buffer_, this->internal_buffer_samples_);
-  }
-  if (this->float_input_buffer_ != nullptr) {
-    float_allocator.deallocate(this->float_input_buffer_, this->internal_buffer_samples_);
-  }
-  if (this->float_output_buffer_ != nullptr) {
-    float_allocator.deallocate(this->float_output_buffer_, this->internal_buffer_samples_);
-  }
   if (this->resampler_ != nullptr) {
     resampleFree(this->resampler_);
     this->resampler_ = nullptr;
   }
+  this->resampler_channels_ = 0;
+  this->resampler_lowpass_ratio_ = 0.0;
+  this->resampler_flags_ = 0;
 }
 
 esp_err_t AudioResampler::allocate_buffers_() {
-  ExternalRAMAllocator<int16_t> int16_allocator(ExternalRAMAllocator<int16_t>::ALLOW_FAILURE);
-  ExternalRAMAllocator<float> float_allocator(ExternalRAMAllocator<float>::ALLOW_FAILURE);
+  const size_t float_buffer_bytes = this->internal_buffer_samples_ * sizeof(float);
 
-  if (this->input_buffer_ == nullptr)
-    this->input_buffer_ = int16_allocator.allocate(this->internal_buffer_samples_);
-  if (this->output_buffer_ == nullptr)
-    this->output_buffer_ = int16_allocator.allocate(this->internal_buffer_samples_);
-
-  if (this->float_input_buffer_ == nullptr)
-    this->float_input_buffer_ = float_allocator.allocate(this->internal_buffer_samples_);
+  if (this->float_input_buffer_ == nullptr) {
+    this->float_input_buffer_ =
+        reinterpret_cast<float *>(AudioBufferArena::lease(this->buffer_arena_, float_buffer_bytes));
+  }
 
-  if (this->float_output_buffer_ == nullptr)
-    this->float_output_buffer_ = float_allocator.allocate(this->internal_buffer_samples_);
+  if (this->float_output_buffer_ == nullptr) {
+    this->float_output_buffer_ =
+        reinterpret_cast<float *>(AudioBufferArena::lease(this->buffer_arena_, float_buffer_bytes));
+  }
 
-  if ((this->input_buffer_ == nullptr) || (this->output_buffer_ == nullptr) || (this->float_input_buffer_ == nullptr) ||
-      (this->float_output_buffer_ == nullptr)) {
+  if ((this->float_input_buffer_ == nullptr) || (this->float_output_buffer_ == nullptr)) {
     return ESP_ERR_NO_MEM;
   }
 
   return ESP_OK;
 }
 
-esp_err_t AudioResampler::start(audio::AudioStreamInfo &stream_info, uint32_t target_sample_rate,
-                                ResampleInfo &resample_info) {
-  esp_err_t err = this->allocate_buffers_();
-  if (err != ESP_OK) {
-    return err;
-  }
-
-  this->stream_info_ = stream_info;
+esp_err_t AudioResampler::start(const AudioStreamFormat &input_format) {
+  this->output_format_.reset();
 
-  this->input_buffer_current_ = this->input_buffer_;
-  this->input_buffer_length_ = 0;
-  this->float_input_buffer_current_ = this->float_input_buffer_;
-  this->float_input_buffer_length_ = 0;
+  // Discard the previous stream's filter state. The resampler itself is kept, as it can be reused if the next stream
+  // needs the same conversion.
+  this->sample_ratio_ = 1.0;
+  this->lowpass_ratio_ = 1.0;
+  this->pre_filter_ = false;
+  this->post_filter_ = false;
 
-  this->output_buffer_current_ = this->output_buffer_;
-  this->output_buffer_length_ = 0;
-  this->float_output_buffer_current_ = this->float_output_buffer_;
-  this->float_output_buffer_length_ = 0;
+  const audio::AudioStreamInfo &stream_info = input_format.stream_info;
 
-  resample_info.mono_to_stereo = (stream_info.channels != 2);
-
-  if ((stream_info.channels > OUTPUT_CHANNELS) || (stream_info_.bits_per_sample != OUTPUT_BITS_PER_SAMPLE)) {
+  if (input_format.is_encoded() || (stream_info.channels == 0) || (stream_info.channels > OUTPUT_CHANNELS) ||
+      ((stream_info.bits_per_sample != 16) && (stream_info.bits_per_sample != 24) &&
+       (stream_info.bits_per_sample != 32))) {
     return ESP_ERR_NOT_SUPPORTED;
   }
 
-  if (stream_info.channels > 0) {
-    this->channel_factor_ = 2 / stream_info.channels;
-  }
+  this->stream_info_ = stream_info;
+  this->input_bytes_per_sample_ = stream_info.bits_per_sample / 8;
 
+  ResampleInfo &resample_info = this->resample_info_;
+  resample_info.mono_to_stereo = (stream_info.channels != 2);
+
+  const uint32_t target_sample_rate = this->target_sample_rate_;
   if (stream_info.sample_rate != target_sample_rate) {
     int flags = 0;
 
@@ -137,178 +147,195 @@ esp_err_t AudioResampler::start(audio::AudioStreamInfo &stream_info, uint32_t ta
       }
     }
 
+    double lowpass_ratio = 1.0;
     if (this->sample_ratio_ < 1.0) {
-      this->resampler_ = resampleInit(stream_info.channels, NUM_TAPS, NUM_FILTERS,
-                                      this->sample_ratio_ * this->lowpass_ratio_, flags | INCLUDE_LOWPASS);
+      lowpass_ratio = this->sample_ratio_ * this->lowpass_ratio_;
+      flags |= INCLUDE_LOWPASS;
     } else if (this->lowpass_ratio_ < 1.0) {
-      this->resampler_ =
-          resampleInit(stream_info.channels, NUM_TAPS, NUM_FILTERS, this->lowpass_ratio_, flags | INCLUDE_LOWPASS);
+      lowpass_ratio = this->lowpass_ratio_;
+      flags |= INCLUDE_LOWPASS;
+    }
+
+    if ((this->resampler_ != nullptr) && (this->resampler_channels_ == stream_info.channels) &&
+        (this->resampler_lowpass_ratio_ == lowpass_ratio) && (this->resampler_flags_ == flags)) {
+      // Computing the filter bank is expensive; streams usually share the same conversion, so only clear the history
+      resampleReset(this->resampler_);
     } else {
-      this->resampler_ = resampleInit(stream_info.channels, NUM_TAPS, NUM_FILTERS, 1.0, flags);
+      if (this->resampler_ != nullptr) {
+        resampleFree(this->resampler_);
+      }
+      this->resampler_ = resampleInit(stream_info.channels, NUM_TAPS, NUM_FILTERS, lowpass_ratio, flags);
+      if (this->resampler_ == nullptr) {
+        return ESP_ERR_NO_MEM;
+      }
+      this->resampler_channels_ = stream_info.channels;
+      this->resampler_lowpass_ratio_ = lowpass_ratio;
+      this->resampler_flags_ = flags;
     }
 
     resampleAdvancePosition(this->resampler_, NUM_TAPS / 2.0);
 
+    // Only converting the sample rate needs the float buffers
+    esp_err_t err = this->allocate_buffers_();
+    if (err != ESP_OK) {
+      return err;
+    }
   } else {
     resample_info.resample = false;
   }
 
-  this->resample_info_ = resample_info;
+  AudioStreamFormat output_format;
+  output_format.stream_info.channels = OUTPUT_CHANNELS;
+  output_format.stream_info.bits_per_sample = OUTPUT_BITS_PER_SAMPLE;
+  output_format.stream_info.sample_rate = target_sample_rate;
+  this->output_format_ = output_format;
+
   return ESP_OK;
 }
 
-AudioResamplerState AudioResampler::resample(bool stop_gracefully) {
-  if (stop_gracefully) {
-    if ((this->input_ring_buffer_->available() == 0) && (this->output_ring_buffer_->available() == 0) &&
-        (this->input_buffer_length_ == 0) && (this->output_buffer_length_ == 0)) {
-      return AudioResamplerState::FINISHED;
-    }
+AudioStageState AudioResampler::process(bool stop_gracefully) {
+  const uint8_t input_bytes_per_sample = this->input_bytes_per_sample_;
+  const size_t input_frame_bytes = this->stream_info_.channels * input_bytes_per_sample;
+  const size_t output_frame_bytes = OUTPUT_CHANNELS * sizeof(int32_t);
+
+  if (stop_gracefully && (this->input_ring_buffer_->available() < input_frame_bytes)) {
+    // All decoded audio has been written to the mixer; it plays out the rest on its own
+    return AudioStageState::FINISHED;
   }
 
-  if (this->output_buffer_length_ > 0) {
-    size_t bytes_to_write = this->output_buffer_length_;
+  // Samples are individual 16, 24, or 32 bit values on the input and int32 values on the output. Frames include 1
+  // sample for mono and 2 samples for stereo
+  // Be careful converting between bytes, samples, and frames!
+  // 1 input sample = input_bytes_per_sample bytes; 1 output sample = 4 bytes = sizeof(int32_t)
+  // if mono:
+  //    1 frame = 1 sample
+  // if stereo:
+  //    1 frame = 2 samples (left and right)
 
-    if (bytes_to_write > 0) {
-      size_t bytes_written = this->output_ring_buffer_->write_without_replacement(
-          (void *) this->output_buffer_current_, bytes_to_write, pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+  //////
+  // Peek at the decoded audio in place
+  //////
 
-      this->output_buffer_current_ += bytes_written / sizeof(int16_t);
-      this->output_buffer_length_ -= bytes_written;
-    }
+  uint8_t *input_span = nullptr;
+  size_t input_frames =
+      this->input_ring_buffer_->peek(&input_span, input_frame_bytes, this->input_ticks_to_wait_) / input_frame_bytes;
 
-    return AudioResamplerState::RESAMPLING;
+  if (input_frames == 0) {
+    return AudioStageState::RUNNING;
   }
 
-  // Copy audio data directly to output_buffer if resampling isn't required
-  if (!this->resample_info_.resample && !this->resample_info_.mono_to_stereo) {
-    size_t bytes_read =
-        this->input_ring_buffer_->read((void *) this->output_buffer_, this->internal_buffer_samples_ * sizeof(int16_t),
-                                       pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
+  // Limit the input so the output fits in a single span of the output ring buffer (and in the float buffers if
+  // resampling)
+  size_t max_output_frames = this->output_ring_buffer_->max_span() / output_frame_bytes;
+  if (this->resample_info_.resample) {
+    max_output_frames = std::min(max_output_frames, this->internal_buffer_samples_ / this->stream_info_.channels);
 
-    this->output_buffer_current_ = this->output_buffer_;
-    this->output_buffer_length_ += bytes_read;
+    // Leave a spare output frame for the resampler's rounding
+    input_frames = std::min(input_frames, static_cast<size_t>((max_output_frames - 1) / this->sample_ratio_));
+    input_frames = std::min(input_frames, this->internal_buffer_samples_ / this->stream_info_.channels);
+  } else {
+    input_frames = std::min(input_frames, max_output_frames);
+  }
 
-    return AudioResamplerState::RESAMPLING;
+  size_t output_frames_needed = input_frames;
+  if (this->resample_info_.resample) {
+    output_frames_needed =
+        std::min(max_output_frames, static_cast<size_t>(std::ceil(input_frames * this->sample_ratio_)) + 1);
   }
 
   //////
-  // Refill input buffer
+  // Acquire space in the output ring buffer to write into in place
   //////
 
-  // Depending on if we are converting mono to stereo or if we are upsampling, we may need to restrict how many input
-  // samples we transfer
-  size_t max_input_samples = this->internal_buffer_samples_;
+  uint8_t *output_span = nullptr;
+  size_t output_frames_free =
+      this->output_ring_buffer_->acquire(&output_span, output_frames_needed * output_frame_bytes,
+                                         this->output_ticks_to_wait_) /
+      output_frame_bytes;
 
-  // Mono to stereo -> cut in half
-  max_input_samples /= (2 / this->stream_info_.channels);
-
-  if (this->sample_ratio_ > 1.0) {
-    // Upsampling -> reduce by a factor of the ceiling of sample_ratio_
-    uint32_t upsampling_factor = std::ceil(this->sample_ratio_);
-    max_input_samples /= upsampling_factor;
+  if (output_frames_free == 0) {
+    // Not enough room yet, e.g., woken up before the mixer consumed enough audio to stop
+    return AudioStageState::RUNNING;
   }
+  output_frames_free = std::min(output_frames_free, max_output_frames);
 
-  // Move old data to the start of the buffer
-  if (this->input_buffer_length_ > 0) {
-    memmove((void *) this->input_buffer_, (void *) this->input_buffer_current_, this->input_buffer_length_);
-  }
-  this->input_buffer_current_ = this->input_buffer_;
+  const uint8_t *input_buffer = input_span;
+  int32_t *output_buffer = reinterpret_cast<int32_t *>(output_span);
 
-  // Copy new data to the end of the of the buffer
-  size_t bytes_to_read = max_input_samples * sizeof(int16_t) - this->input_buffer_length_;
-
-  if (bytes_to_read > 0) {
-    int16_t *new_input_buffer_data = this->input_buffer_ + this->input_buffer_length_ / sizeof(int16_t);
-    size_t bytes_read = this->input_ring_buffer_->read((void *) new_input_buffer_data, bytes_to_read,
-                                                       pdMS_TO_TICKS(READ_WRITE_TIMEOUT_MS));
-
-    this->input_buffer_length_ += bytes_read;
-  }
-
-  if (this->input_buffer_length_ == 0) {
-    return AudioResamplerState::RESAMPLING;
-  }
+  size_t frames_used = 0;
+  size_t frames_generated = 0;
 
   if (this->resample_info_.resample) {
-    if (this->input_buffer_length_ > 0) {
-      // Samples are indiviudal int16 values. Frames include 1 sample for mono and 2 samples for stereo
-      // Be careful converting between bytes, samples, and frames!
-      // 1 sample = 2 bytes = sizeof(int16_t)
-      // if mono:
-      //    1 frame = 1 sample
-      // if stereo:
-      //    1 frame = 2 samples (left and right)
-
-      size_t samples_read = this->input_buffer_length_ / sizeof(int16_t);
-
-      for (int i = 0; i < samples_read; ++i) {
-        this->float_input_buffer_[i] = static_cast<float>(this->input_buffer_[i]) / 32768.0f;
-      }
+    size_t samples_read = input_frames * this->stream_info_.channels;
 
-      size_t frames_read = samples_read / this->stream_info_.channels;
+    for (size_t i = 0; i < samples_read; ++i) {
+      this->float_input_buffer_[i] =
+          static_cast<float>(read_sample(input_buffer + i * input_bytes_per_sample, input_bytes_per_sample)) /
+          SAMPLE_SCALE;
+    }
 
-      if (this->pre_filter_) {
-        for (int i = 0; i < this->stream_info_.channels; ++i) {
-          biquad_apply_buffer(&this->lowpass_[i][0], this->float_input_buffer_ + i, frames_read,
-                              this->stream_info_.channels);
-          biquad_apply_buffer(&this->lowpass_[i][1], this->float_input_buffer_ + i, frames_read,
-                              this->stream_info_.channels);
-        }
+    if (this->pre_filter_) {
+      for (int i = 0; i < this->stream_info_.channels; ++i) {
+        biquad_apply_buffer(&this->lowpass_[i][0], this->float_input_buffer_ + i, input_frames,
+                            this->stream_info_.channels);
+        biquad_apply_buffer(&this->lowpass_[i][1], this->float_input_buffer_ + i, input_frames,
+                            this->stream_info_.channels);
       }
+    }
 
-      ResampleResult res;
+    ResampleResult res;
 
-      res = resampleProcessInterleaved(this->resampler_, this->float_input_buffer_, frames_read,
-                                       this->float_output_buffer_,
-                                       this->internal_buffer_samples_ / this->channel_factor_, this->sample_ratio_);
+    res = resampleProcessInterleaved(this->resampler_, this->float_input_buffer_, input_frames,
+                                     this->float_output_buffer_, output_frames_free, this->sample_ratio_);
 
-      size_t frames_used = res.input_used;
-      size_t samples_used = frames_used * this->stream_info_.channels;
+    frames_used = res.input_used;
+    frames_generated = res.output_generated;
 
-      size_t frames_generated = res.output_generated;
-      if (this->post_filter_) {
-        for (int i = 0; i < this->stream_info_.channels; ++i) {
-          biquad_apply_buffer(&this->lowpass_[i][0], this->float_output_buffer_ + i, frames_generated,
-                              this->stream_info_.channels);
-          biquad_apply_buffer(&this->lowpass_[i][1], this->float_output_buffer_ + i, frames_generated,
-                              this->stream_info_.channels);
-        }
+    if (this->post_filter_) {
+      for (int i = 0; i < this->stream_info_.channels; ++i) {
+        biquad_apply_buffer(&this->lowpass_[i][0], this->float_output_buffer_ + i, frames_generated,
+                            this->stream_info_.channels);
+        biquad_apply_buffer(&this->lowpass_[i][1], this->float_output_buffer_ + i, frames_generated,
+                            this->stream_info_.channels);
       }
+    }
 
-      size_t samples_generated = frames_generated * this->stream_info_.channels;
-
-      for (int i = 0; i < samples_generated; ++i) {
-        this->output_buffer_[i] = static_cast<int16_t>(this->float_output_buffer_[i] * 32767);
+    if (this->resample_info_.mono_to_stereo) {
+      for (size_t i = 0; i < frames_generated; ++i) {
+        int32_t sample = float_to_sample(this->float_output_buffer_[i]);
+        output_buffer[2 * i] = sample;
+        output_buffer[2 * i + 1] = sample;
+      }
+    } else {
+      for (size_t i = 0; i < frames_generated * OUTPUT_CHANNELS; ++i) {
+        output_buffer[i] = float_to_sample(this->float_output_buffer_[i]);
       }
-
-      this->input_buffer_current_ += samples_used;
-      this->input_buffer_length_ -= samples_used * sizeof(int16_t);
-
-      this->output_buffer_current_ = this->output_buffer_;
-      this->output_buffer_length_ += samples_generated * sizeof(int16_t);
     }
   } else {
-    size_t bytes_to_transfer =
-        std::min(this->internal_buffer_samples_ / this->channel_factor_ * sizeof(int16_t), this->input_buffer_length_);
-    std::memcpy((void *) this->output_buffer_, (void *) this->input_buffer_current_, bytes_to_transfer);
-
-    this->input_buffer_current_ += bytes_to_transfer / sizeof(int16_t);
-    this->input_buffer_length_ -= bytes_to_transfer;
-
-    this->output_buffer_current_ = this->output_buffer_;
-    this->output_buffer_length_ += bytes_to_transfer;
+    frames_used = std::min(input_frames, output_frames_free);
+    frames_generated = frames_used;
+
+    if (this->resample_info_.mono_to_stereo) {
+      // Convert mono to stereo
+      for (size_t i = 0; i < frames_used; ++i) {
+        int32_t sample = read_sample(input_buffer + i * input_bytes_per_sample, input_bytes_per_sample);
+        output_buffer[2 * i] = sample;
+        output_buffer[2 * i + 1] = sample;
+      }
+    } else if (input_bytes_per_sample == sizeof(int32_t)) {
+      std::memcpy(output_buffer, input_buffer, frames_used * output_frame_bytes);
+    } else {
+      // Widen the samples
+      for (size_t i = 0; i < frames_used * OUTPUT_CHANNELS; ++i) {
+        output_buffer[i] = read_sample(input_buffer + i * input_bytes_per_sample, input_bytes_per_sample);
+      }
+    }
   }
 
-  if (this->resample_info_.mono_to_stereo) {
-    // Convert mono to stereo
-    for (int i = this->output_buffer_length_ / (sizeof(int16_t)) - 1; i >= 0; --i) {
-      this->output_buffer_[2 * i] = this->output_buffer_[i];
-      this->output_buffer_[2 * i + 1] = this->output_buffer_[i];
-    }
+  this->output_ring_buffer_->commit(frames_generated * output_frame_bytes);
+  this->input_ring_buffer_->release(frames_used * input_frame_bytes);
 
-    this->output_buffer_length_ *= 2;  // double the bytes for stereo samples
-  }
-  return AudioResamplerState::RESAMPLING;
+  return AudioStageState::RUNNING;
 }
 
 }  // namespace nabu
@@ -2,75 +2,72 @@
 
 #ifdef USE_ESP_IDF
 
+#include "audio_stage.h"
+
 #include "biquad.h"
 #include "resampler.h"
 
 #include "esphome/components/audio/audio.h"
-#include "esphome/core/ring_buffer.h"
 
 namespace esphome {
 namespace nabu {
 
-enum class AudioResamplerState : uint8_t {
-  INITIALIZED = 0,
-  RESAMPLING,
-  FINISHED,
-  FAILED,
-};
-
 struct ResampleInfo {
   bool resample;
   bool mono_to_stereo;
 };
 
-class AudioResampler {
+// Converts 16, 24, or 32 bit mono or stereo PCM audio to 32 bit stereo at the target sample rate, the mixer's format.
+// Narrower samples are placed in the upper bits, so no precision is lost before the speaker.
+class AudioResampler : public AudioStage {
  public:
-  AudioResampler(esphome::RingBuffer *input_ring_buffer, esphome::RingBuffer *output_ring_buffer,
-                 size_t internal_buffer_samples);
+  AudioResampler(size_t internal_buffer_samples);
   ~AudioResampler();
 
+  const char *get_name() const override { return "resampler"; }
+
+  /// @brief Sets the sample rate to convert to on the next start
+  void set_target_sample_rate(uint32_t target_sample_rate) { this->target_sample_rate_ = target_sample_rate; }
+
   /// @brief Sets up the various bits necessary to resample
-  /// @param stream_info the incoming sample rate, bits per sample, and number of channels
-  /// @param target_sample_rate the necessary sample rate to convert to
-  /// @return ESP_OK if it is able to convert the incoming stream or an error otherwise
-  esp_err_t start(audio::AudioStreamInfo &stream_info, uint32_t target_sample_rate, ResampleInfo &resample_info);
+  /// @param input_format the incoming sample rate, bits per sample, and number of channels
+  /// @return ESP_OK if it is able to convert the incoming stream or ESP_ERR_NOT_SUPPORTED otherwise
+  esp_err_t start(const AudioStreamFormat &input_format) override;
 
-  AudioResamplerState resample(bool stop_gracefully);
+  AudioStageState process(bool stop_gracefully) override;
+
+  optional<AudioStreamFormat> get_output_format() const override { return this->output_format_; }
+
+  void release_buffers() override;
 
  protected:
   esp_err_t allocate_buffers_();
 
-  esphome::RingBuffer *input_ring_buffer_;
-  esphome::RingBuffer *output_ring_buffer_;
+  // Decoded audio is read in place from the input ring buffer, and the resampled audio is written in place into the
+  // output ring buffer. Only the float conversion for the resampler needs internal buffers.
   size_t internal_buffer_samples_;
 
-  int16_t *input_buffer_{nullptr};
-  int16_t *input_buffer_current_{nullptr};
-  size_t input_buffer_length_;
-
-  int16_t *output_buffer_{nullptr};
-  int16_t *output_buffer_current_{nullptr};
-  size_t output_buffer_length_;
+  uint32_t target_sample_rate_{0};
+  optional<AudioStreamFormat> output_format_{};
 
   float *float_input_buffer_{nullptr};
-  float *float_input_buffer_current_{nullptr};
-  size_t float_input_buffer_length_;
-
   float *float_output_buffer_{nullptr};
-  float *float_output_buffer_current_{nullptr};
-  size_t float_output_buffer_length_;
 
   audio::AudioStreamInfo stream_info_;
+  uint8_t input_bytes_per_sample_{2};
   ResampleInfo resample_info_;
 
   Resample *resampler_{nullptr};
+  // Parameters resampler_ was created with, so it is only recreated when a stream needs a different conversion
+  uint8_t resampler_channels_{0};
+  double resampler_lowpass_ratio_{0.0};
+  int resampler_flags_{0};
 
   Biquad lowpass_[2][2];
   BiquadCoefficients lowpass_coeff_;
 
   float sample_ratio_{1.0};
   float lowpass_ratio_{1.0};
-  uint8_t channel_factor_{1};
 
   bool pre_filter_{false};
   bool post_filter_{false};
@@ -0,0 +1,298 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_ring_buffer.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+
+namespace esphome {
+namespace nabu {
+
+AudioRingBuffer::AudioRingBuffer(size_t capacity, size_t max_span) {
+  this->capacity_ = capacity;
+  this->max_span_ = max_span;
+}
+
+AudioRingBuffer::~AudioRingBuffer() {
+  AudioBufferArena::give_back(this->arena_, this->storage_, this->capacity_ + this->max_span_);
+}
+
+std::unique_ptr<AudioRingBuffer> AudioRingBuffer::create(size_t capacity, size_t max_span, AudioBufferArena *arena) {
+  if ((max_span == 0) || (max_span > capacity)) {
+    return nullptr;
+  }
+
+  std::unique_ptr<AudioRingBuffer> ring_buffer(new AudioRingBuffer(capacity, max_span));
+
+  ring_buffer->arena_ = arena;
+  ring_buffer->storage_ = AudioBufferArena::lease(arena, capacity + max_span);
+
+  if (ring_buffer->storage_ == nullptr) {
+    return nullptr;
+  }
+
+  return ring_buffer;
+}
+
+size_t AudioRingBuffer::acquire(uint8_t **data, size_t min_bytes, TickType_t ticks_to_wait) {
+  min_bytes = clamp<size_t>(min_bytes, 1, this->max_span_);
+
+  if (!this->wait_for_(true, min_bytes, ticks_to_wait)) {
+    return 0;
+  }
+
+  *data = this->storage_ + this->write_pos_;
+
+  size_t bytes_until_end = this->capacity_ - this->write_pos_;
+  if (bytes_until_end >= min_bytes) {
+    return std::min(this->free(), bytes_until_end);
+  }
+
+  // Not enough room before the end of the storage, so the span continues into the mirror. Only hand out what was
+  // requested to keep the copy in commit as small as possible.
+  return min_bytes;
+}
+
+void AudioRingBuffer::commit(size_t bytes) {
+  size_t bytes_until_end = this->capacity_ - this->write_pos_;
+  if (bytes > bytes_until_end) {
+    // The producer wrote into the mirror; move those bytes to where the consumer expects them
+    const size_t wrapped_bytes = bytes - bytes_until_end;
+    std::memcpy(this->storage_, this->storage_ + this->capacity_, wrapped_bytes);
+    this->producer_bytes_copied_.store(this->producer_bytes_copied_.load(std::memory_order_relaxed) + wrapped_bytes,
+                                       std::memory_order_relaxed);
+  }
+
+  this->advance_write_(bytes);
+  this->bytes_written_.store(this->bytes_written_.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+}
+
+size_t AudioRingBuffer::peek(uint8_t **data, size_t min_bytes, TickType_t ticks_to_wait) {
+  min_bytes = clamp<size_t>(min_bytes, 1, this->max_span_);
+
+  if (!this->wait_for_(false, min_bytes, ticks_to_wait)) {
+    return 0;
+  }
+
+  *data = this->storage_ + this->read_pos_;
+
+  size_t bytes_until_end = this->capacity_ - this->read_pos_;
+  if (bytes_until_end >= min_bytes) {
+    return std::min(this->available(), bytes_until_end);
+  }
+
+  // The requested data wraps around the end of the storage. Copy the wrapped part into the mirror so the span is
+  // contiguous.
+  const size_t wrapped_bytes = min_bytes - bytes_until_end;
+  std::memcpy(this->storage_ + this->capacity_, this->storage_, wrapped_bytes);
+  this->consumer_bytes_copied_.store(this->consumer_bytes_copied_.load(std::memory_order_relaxed) + wrapped_bytes,
+                                     std::memory_order_relaxed);
+  return min_bytes;
+}
+
+void AudioRingBuffer::release(size_t bytes) {
+  bytes = std::min(bytes, this->available());
+  this->advance_read_(bytes);
+  this->bytes_read_.store(this->bytes_read_.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+}
+
+size_t AudioRingBuffer::write(const void *data, size_t len, TickType_t ticks_to_wait) {
+  if ((len == 0) || !this->wait_for_(true, 1, ticks_to_wait)) {
+    return 0;
+  }
+
+  size_t bytes_to_write = std::min(len, this->free());
+  size_t bytes_until_end = std::min(bytes_to_write, this->capacity_ - this->write_pos_);
+
+  std::memcpy(this->storage_ + this->write_pos_, data, bytes_until_end);
+  std::memcpy(this->storage_, (const uint8_t *) data + bytes_until_end, bytes_to_write - bytes_until_end);
+
+  this->advance_write_(bytes_to_write);
+  this->bytes_written_.store(this->bytes_written_.load(std::memory_order_relaxed) + bytes_to_write,
+                             std::memory_order_relaxed);
+  this->producer_bytes_copied_.store(this->producer_bytes_copied_.load(std::memory_order_relaxed) + bytes_to_write,
+                                     std::memory_order_relaxed);
+
+  return bytes_to_write;
+}
+
+size_t AudioRingBuffer::read(void *data, size_t len, TickType_t ticks_to_wait) {
+  if ((len == 0) || !this->wait_for_(false, 1, ticks_to_wait)) {
+    return 0;
+  }
+
+  size_t bytes_to_read = std::min(len, this->available());
+  size_t bytes_until_end = std::min(bytes_to_read, this->capacity_ - this->read_pos_);
+
+  std::memcpy(data, this->storage_ + this->read_pos_, bytes_until_end);
+  std::memcpy((uint8_t *) data + bytes_until_end, this->storage_, bytes_to_read - bytes_until_end);
+
+  this->advance_read_(bytes_to_read);
+  this->bytes_read_.store(this->bytes_read_.load(std::memory_order_relaxed) + bytes_to_read, std::memory_order_relaxed);
+  this->consumer_bytes_copied_.store(this->consumer_bytes_copied_.load(std::memory_order_relaxed) + bytes_to_read,
+                                     std::memory_order_relaxed);
+
+  return bytes_to_read;
+}
+
+void AudioRingBuffer::reset() { this->advance_read_(this->available()); }
+
+void AudioRingBuffer::discard_until(uint32_t position) {
+  const int32_t bytes = static_cast<int32_t>(position - this->bytes_consumed_);
+  if (bytes > 0) {
+    this->advance_read_(std::min(static_cast<size_t>(bytes), this->available()));
+  }
+}
+
+esp_err_t AudioRingBuffer::resize(size_t capacity) {
+  const size_t used = this->available();
+  if ((capacity < this->max_span_) || (capacity < used)) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (capacity == this->capacity_) {
+    return ESP_OK;
+  }
+
+  uint8_t *storage = AudioBufferArena::lease(this->arena_, capacity + this->max_span_);
+  if (storage == nullptr) {
+    return ESP_ERR_NO_MEM;
+  }
+
+  // Unwrap the available data to the start of the new storage
+  const size_t bytes_until_end = std::min(used, this->capacity_ - this->read_pos_);
+  std::memcpy(storage, this->storage_ + this->read_pos_, bytes_until_end);
+  std::memcpy(storage + bytes_until_end, this->storage_, used - bytes_until_end);
+
+  AudioBufferArena::give_back(this->arena_, this->storage_, this->capacity_ + this->max_span_);
+  this->storage_ = storage;
+  this->capacity_ = capacity;
+  this->read_pos_ = 0;
+  this->write_pos_ = (used < capacity) ? used : 0;
+
+  this->fill_watermark_ = std::min(this->fill_watermark_, capacity);
+  this->space_watermark_ = std::min(this->space_watermark_, capacity);
+
+  return ESP_OK;
+}
+
+bool AudioRingBuffer::notify_when_available(size_t min_bytes) {
+  return this->request_notification_(false, clamp<size_t>(min_bytes, 1, this->capacity_));
+}
+
+RingBufferStats AudioRingBuffer::get_stats() const {
+  RingBufferStats stats;
+  stats.bytes_written = this->bytes_written_.load(std::memory_order_relaxed);
+  stats.writes = this->writes_.load(std::memory_order_relaxed);
+  stats.bytes_read = this->bytes_read_.load(std::memory_order_relaxed);
+  stats.producer_blocked_us = this->producer_blocked_us_.load(std::memory_order_relaxed);
+  stats.consumer_blocked_us = this->consumer_blocked_us_.load(std::memory_order_relaxed);
+  stats.producer_bytes_copied = this->producer_bytes_copied_.load(std::memory_order_relaxed);
+  stats.consumer_bytes_copied = this->consumer_bytes_copied_.load(std::memory_order_relaxed);
+  stats.capacity = this->capacity_;
+  stats.min_fill = this->min_fill_.load(std::memory_order_relaxed);
+  stats.max_fill = this->max_fill_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void AudioRingBuffer::restart_fill_range() {
+  size_t used = this->used_.load();
+  this->min_fill_.store(used, std::memory_order_relaxed);
+  this->max_fill_.store(used, std::memory_order_relaxed);
+}
+
+bool AudioRingBuffer::wait_for_(bool for_space, size_t min_bytes, TickType_t ticks_to_wait) {
+  if ((for_space ? this->free() : this->available()) >= min_bytes) {
+    return true;
+  }
+
+  if (ticks_to_wait == 0) {
+    return false;
+  }
+
+  if (this->request_notification_(for_space, min_bytes)) {
+    return true;
+  }
+
+  uint32_t wait_start = micros();
+  ulTaskNotifyTake(pdTRUE, ticks_to_wait);
+  ++this->wakeup_count_;
+
+  std::atomic<uint32_t> &blocked_us = for_space ? this->producer_blocked_us_ : this->consumer_blocked_us_;
+  blocked_us.store(blocked_us.load(std::memory_order_relaxed) + (micros() - wait_start), std::memory_order_relaxed);
+
+  // Withdraw the request in case the wait timed out or the notification came from elsewhere
+  (for_space ? this->producer_wake_bytes_ : this->consumer_wake_bytes_).store(0);
+
+  return (for_space ? this->free() : this->available()) >= min_bytes;
+}
+
+bool AudioRingBuffer::request_notification_(bool for_space, size_t min_bytes) {
+  size_t wake_bytes = std::max(min_bytes, for_space ? this->space_watermark_ : this->fill_watermark_);
+
+  if (for_space) {
+    this->producer_task_ = xTaskGetCurrentTaskHandle();
+    this->producer_wake_bytes_.store(wake_bytes);
+  } else {
+    this->consumer_task_ = xTaskGetCurrentTaskHandle();
+    this->consumer_wake_bytes_.store(wake_bytes);
+  }
+
+  // Check again after requesting, so a commit or release that happened in between isn't missed
+  if ((for_space ? this->free() : this->available()) >= min_bytes) {
+    (for_space ? this->producer_wake_bytes_ : this->consumer_wake_bytes_).store(0);
+    return true;
+  }
+
+  return false;
+}
+
+void AudioRingBuffer::advance_write_(size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+
+  this->write_pos_ += bytes;
+  if (this->write_pos_ >= this->capacity_) {
+    this->write_pos_ -= this->capacity_;
+  }
+  this->writes_.store(this->writes_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+  size_t used = (this->used_ += bytes);
+  if (used > this->max_fill_.load(std::memory_order_relaxed)) {
+    this->max_fill_.store(used, std::memory_order_relaxed);
+  }
+
+  size_t wake_bytes = this->consumer_wake_bytes_.load();
+  if ((wake_bytes > 0) && (this->available() >= wake_bytes) &&
+      this->consumer_wake_bytes_.compare_exchange_strong(wake_bytes, 0)) {
+    xTaskNotifyGive(this->consumer_task_);
+  }
+}
+
+void AudioRingBuffer::advance_read_(size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+
+  this->read_pos_ += bytes;
+  if (this->read_pos_ >= this->capacity_) {
+    this->read_pos_ -= this->capacity_;
+  }
+  this->bytes_consumed_ += bytes;
+
+  size_t used = (this->used_ -= bytes);
+  if (used < this->min_fill_.load(std::memory_order_relaxed)) {
+    this->min_fill_.store(used, std::memory_order_relaxed);
+  }
+
+  size_t wake_bytes = this->producer_wake_bytes_.load();
+  if ((wake_bytes > 0) && (this->free() >= wake_bytes) &&
+      this->producer_wake_bytes_.compare_exchange_strong(wake_bytes, 0)) {
+    xTaskNotifyGive(this->producer_task_);
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
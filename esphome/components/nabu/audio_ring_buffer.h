@@ -0,0 +1,199 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "audio_buffer_arena.h"
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace esphome {
+namespace nabu {
+
+// Counters kept by a ring buffer. They describe the stages on either side of it: the producer's output and the
+// consumer's input. The byte and time counters wrap around, so compare two snapshots using unsigned subtraction.
+struct RingBufferStats {
+  uint32_t bytes_written;          // Bytes committed or written by the producer
+  uint32_t writes;                 // Commits or writes of at least one byte; each may wake the consumer
+  uint32_t bytes_read;             // Bytes released or read by the consumer (not counting discarded bytes)
+  uint32_t producer_blocked_us;    // Time the producer spent waiting for free space
+  uint32_t consumer_blocked_us;    // Time the consumer spent waiting for data
+  uint32_t producer_bytes_copied;  // Bytes write copied in, or commit moved out of the mirror
+  uint32_t consumer_bytes_copied;  // Bytes read copied out, or peek copied into the mirror
+  size_t capacity;
+  size_t min_fill;  // Lowest number of available bytes since the fill range was last restarted
+  size_t max_fill;  // Highest number of available bytes since the fill range was last restarted
+};
+
+// Counters describing one pipeline stage, taken from the ring buffers (or the speaker) on either side of it. The byte
+// and time counters wrap around, so compare two snapshots using unsigned subtraction.
+struct AudioStageStats {
+  uint32_t bytes_in;
+  uint32_t bytes_out;
+  uint32_t input_blocked_us;   // Time spent waiting for input
+  uint32_t output_blocked_us;  // Time spent waiting for room to output
+};
+
+// Single producer, single consumer byte queue that hands out spans of its storage instead of copying through it
+//  - The producer ``acquire``s a contiguous writable span, fills (part of) it in place, and ``commit``s the bytes
+//  - The consumer ``peek``s a contiguous readable span, processes it in place, and ``release``s the bytes
+//  - The storage is followed by a mirror region of ``max_span`` bytes. A span that needs more contiguous bytes than are
+//    left before the end of the storage extends into the mirror, and only those few bytes are copied around the wrap.
+//    Spans that fit before the end of the storage never copy.
+//  - Any in place modifications to a peeked span are only guaranteed to be visible until the bytes are released
+//  - ``write`` and ``read`` are copying wrappers for callers that have to use their own buffer
+//  - A side that has to wait blocks on a direct task notification. The other side only notifies it once the fill level
+//    satisfies the request and crosses the configured watermark, so neither side polls or wakes for every few bytes.
+//    A notification that doesn't satisfy the request (e.g., one sent to stop the task) ends the wait early.
+class AudioRingBuffer {
+ public:
+  ~AudioRingBuffer();
+
+  /// @brief Allocates a ring buffer, preferring external RAM
+  /// @param capacity Number of bytes the ring buffer can hold
+  /// @param max_span Largest contiguous span (in bytes) that acquire or peek must be able to provide. Must not be
+  ///                 larger than capacity.
+  /// @param arena Arena the storage is leased from, also when resizing; nullptr to allocate it directly
+  /// @return unique_ptr to the ring buffer if successful, nullptr otherwise
+  static std::unique_ptr<AudioRingBuffer> create(size_t capacity, size_t max_span, AudioBufferArena *arena = nullptr);
+
+  /// @brief Acquires a contiguous writable span. Blocks until at least min_bytes are free or the timeout expires.
+  /// @param data Set to the start of the writable span
+  /// @param min_bytes Minimum contiguous bytes required. Clamped to max_span.
+  /// @param ticks_to_wait FreeRTOS ticks to wait for enough free space
+  /// @return Number of contiguous bytes that may be written at data; 0 if the timeout expired
+  size_t acquire(uint8_t **data, size_t min_bytes, TickType_t ticks_to_wait = 0);
+
+  /// @brief Publishes bytes written into the most recently acquired span to the consumer
+  /// @param bytes Number of bytes written; must not exceed the acquired span length
+  void commit(size_t bytes);
+
+  /// @brief Peeks a contiguous readable span. Blocks until at least min_bytes are available or the timeout expires.
+  /// @param data Set to the start of the readable span
+  /// @param min_bytes Minimum contiguous bytes required. Clamped to max_span.
+  /// @param ticks_to_wait FreeRTOS ticks to wait for enough data
+  /// @return Number of contiguous bytes that may be read at data; 0 if the timeout expired
+  size_t peek(uint8_t **data, size_t min_bytes, TickType_t ticks_to_wait = 0);
+
+  /// @brief Returns bytes of the most recently peeked span to the producer
+  /// @param bytes Number of bytes consumed; must not exceed the peeked span length
+  void release(size_t bytes);
+
+  /// @brief Copies data into the ring buffer. Blocks until some space is free or the timeout expires.
+  /// @return Number of bytes written
+  size_t write(const void *data, size_t len, TickType_t ticks_to_wait = 0);
+
+  /// @brief Copies data out of the ring buffer. Blocks until some data is available or the timeout expires.
+  /// @return Number of bytes read
+  size_t read(void *data, size_t len, TickType_t ticks_to_wait = 0);
+
+  /// @brief Number of bytes available to read
+  size_t available() const { return this->used_.load(); }
+
+  /// @brief Number of bytes free to write
+  size_t free() const { return this->capacity_ - this->used_.load(); }
+
+  size_t capacity() const { return this->capacity_; }
+  size_t max_span() const { return this->max_span_; }
+
+  /// @brief Discards all available data. Only call from the consumer or when neither side is active.
+  void reset();
+
+  /// @brief Discards the available data the producer wrote before its bytes_written counter reached position; data
+  /// written after that stays. Only call from the consumer.
+  void discard_until(uint32_t position);
+
+  /// @brief Moves the available data into newly allocated storage of a different capacity. Keeps the counters and
+  /// watermarks. Only call when neither side is active.
+  /// @param capacity New number of bytes the ring buffer can hold. Must be at least max_span and the available bytes.
+  /// @return ESP_OK if successful, ESP_ERR_INVALID_ARG if the capacity is too small, or ESP_ERR_NO_MEM
+  esp_err_t resize(size_t capacity);
+
+  /// @brief Sets how many bytes must be available before a waiting consumer is notified. A consumer that needs more
+  /// than this is notified once its request is satisfied. Defaults to 0 (notify as soon as the request is satisfied).
+  void set_fill_watermark(size_t bytes) { this->fill_watermark_ = std::min(bytes, this->capacity_); }
+
+  /// @brief Sets how many bytes must be free before a waiting producer is notified. A producer that needs more than
+  /// this is notified once its request is satisfied. Defaults to 0 (notify as soon as the request is satisfied).
+  void set_space_watermark(size_t bytes) { this->space_watermark_ = std::min(bytes, this->capacity_); }
+
+  /// @brief Asks for the calling (consumer) task to be notified once at least min_bytes are available, without
+  /// blocking. Lets a task wait on several ring buffers at once with ulTaskNotifyTake.
+  /// @param min_bytes Minimum bytes required. Clamped to the capacity.
+  /// @return true if min_bytes are already available; no notification is requested in that case
+  bool notify_when_available(size_t min_bytes);
+
+  /// @brief Number of times a task waiting on this ring buffer has woken up
+  uint32_t get_wakeup_count() const { return this->wakeup_count_.load(); }
+
+  /// @brief Snapshot of the throughput, blocked time, and fill range counters. Safe to call from any task.
+  RingBufferStats get_stats() const;
+
+  /// @brief Starts a new min/max fill range at the current fill level. Call from one task only, e.g., whichever one
+  /// publishes the ring buffer's stats.
+  void restart_fill_range();
+
+ protected:
+  AudioRingBuffer(size_t capacity, size_t max_span);
+
+  /// @brief Waits until the fill level satisfies the request
+  /// @param for_space true if waiting for free space, false if waiting for available data
+  /// @param min_bytes Required number of bytes
+  /// @param ticks_to_wait FreeRTOS ticks to wait
+  /// @return true if the condition is met, false if the timeout expired or the task was notified for another reason
+  bool wait_for_(bool for_space, size_t min_bytes, TickType_t ticks_to_wait);
+
+  /// @brief Asks for the calling task to be notified once the fill level satisfies the request
+  /// @return true if the request is already satisfied; no notification is requested in that case
+  bool request_notification_(bool for_space, size_t min_bytes);
+
+  void advance_write_(size_t bytes);
+  void advance_read_(size_t bytes);
+
+  AudioBufferArena *arena_{nullptr};
+  uint8_t *storage_{nullptr};  // capacity_ bytes followed by max_span_ mirror bytes
+  size_t capacity_;
+  size_t max_span_;
+
+  size_t write_pos_{0};  // Only modified by the producer
+  size_t read_pos_{0};   // Only modified by the consumer
+  std::atomic<size_t> used_{0};
+
+  size_t fill_watermark_{0};
+  size_t space_watermark_{0};
+
+  // The task waiting on each side and the fill level (in available or free bytes) that wakes it; 0 if not waiting
+  TaskHandle_t consumer_task_{nullptr};
+  TaskHandle_t producer_task_{nullptr};
+  std::atomic<size_t> consumer_wake_bytes_{0};
+  std::atomic<size_t> producer_wake_bytes_{0};
+
+  std::atomic<uint32_t> wakeup_count_{0};
+
+  // Telemetry; each counter has a single writer, so relaxed loads and stores are enough. A concurrent
+  // restart_fill_range may lose one min or max update, which is fine for diagnostics.
+  std::atomic<uint32_t> bytes_written_{0};
+  std::atomic<uint32_t> writes_{0};
+  std::atomic<uint32_t> bytes_read_{0};
+  std::atomic<uint32_t> producer_blocked_us_{0};
+  std::atomic<uint32_t> consumer_blocked_us_{0};
+  std::atomic<uint32_t> producer_bytes_copied_{0};
+  std::atomic<uint32_t> consumer_bytes_copied_{0};
+  std::atomic<size_t> min_fill_{0};
+  std::atomic<size_t> max_fill_{0};
+
+  // Bytes the consumer released, read, or discarded; only the consumer uses it
+  uint32_t bytes_consumed_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
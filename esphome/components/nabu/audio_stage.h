@@ -0,0 +1,114 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "audio_buffer_arena.h"
+#include "audio_ring_buffer.h"
+
+#include "esphome/components/audio/audio.h"
+#include "esphome/components/media_player/media_player.h"
+
+#include "esphome/core/helpers.h"
+
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+
+namespace esphome {
+namespace nabu {
+
+enum class AudioStageState : uint8_t {
+  RUNNING = 0,
+  FINISHED,
+  FAILED,
+};
+
+// Describes the data flowing out of a stage and into the next one
+struct AudioStreamFormat {
+  // Encoded audio (e.g., the reader's output) has a file type; decoded PCM audio has NONE
+  media_player::MediaFileType file_type{media_player::MediaFileType::NONE};
+  // Only meaningful for PCM audio
+  audio::AudioStreamInfo stream_info;
+  // Set if the encoded audio is already in memory (e.g., a MediaFile in flash). The next stage reads it in place, and
+  // the ring buffer in between stays empty.
+  const uint8_t *data{nullptr};
+  size_t data_length{0};
+
+  bool is_encoded() const { return this->file_type != media_player::MediaFileType::NONE; }
+};
+
+// A step in an audio pipeline. Stages are long lived; they are started once per stream and don't know which task runs
+// them or which stages they are connected to.
+//  - The stage reads its input from and writes its output to AudioRingBuffers set by whoever assembles the pipeline.
+//    A source stage has no input ring buffer.
+//  - A stage is started with the format of the previous stage's output. It rejects formats it can't handle.
+//  - Scratch buffers are leased from the stage's arena (if set) on start and kept across streams until
+//    ``release_buffers`` is called
+//  - ``process`` does one chunk of work. It waits on the ring buffers for at most the configured ticks, so a stage can
+//    either block in its own task or yield to other stages sharing its task.
+class AudioStage {
+ public:
+  virtual ~AudioStage() = default;
+
+  /// @brief Short lower case name, used for task names and log messages
+  virtual const char *get_name() const = 0;
+
+  /// @brief Prepares the stage for a new stream, discarding any state from the previous one
+  /// @param input_format Format of the previous stage's output. Ignored by source stages.
+  /// @return ESP_OK if successful, ESP_ERR_NOT_SUPPORTED if the stage can't process input_format, or another error
+  virtual esp_err_t start(const AudioStreamFormat &input_format) = 0;
+
+  /// @brief Processes the next chunk of the stream
+  /// @param stop_gracefully true if the previous stage has finished, so no more input will arrive
+  /// @return RUNNING while there is more to do, FINISHED at the end of the stream, or FAILED
+  virtual AudioStageState process(bool stop_gracefully) = 0;
+
+  /// @brief Format of the stage's output. Empty until the stage knows it, e.g., until the decoder parsed the header.
+  virtual optional<AudioStreamFormat> get_output_format() const = 0;
+
+  /// @brief Gives back the stage's scratch buffers and frees any per stream state. Only call while the stage isn't
+  /// running; the next start allocates them again.
+  virtual void release_buffers() {}
+
+  /// @brief Sets the arena the stage leases its scratch buffers from. Without one, it allocates them directly.
+  void set_buffer_arena(AudioBufferArena *buffer_arena) { this->buffer_arena_ = buffer_arena; }
+
+  /// @brief Whether process() may block on something other than its ring buffers, e.g., a network read. Such a stage
+  /// would stall any other stage sharing its task.
+  virtual bool may_block_on_io() const { return false; }
+
+  /// @brief Asks the stage to give up on blocking work (e.g., connecting or a network read) as soon as possible. Safe
+  /// to call from any task. A cancelled stage may fail instead of finishing.
+  void cancel() { this->cancelled_.store(true); }
+
+  /// @brief Clears a previous cancel request. Only call while the stage isn't running.
+  void clear_cancel() { this->cancelled_.store(false); }
+
+  void set_ring_buffers(AudioRingBuffer *input_ring_buffer, AudioRingBuffer *output_ring_buffer) {
+    this->input_ring_buffer_ = input_ring_buffer;
+    this->output_ring_buffer_ = output_ring_buffer;
+  }
+
+  /// @brief Sets how long process() may wait for input and for room to output. Defaults to waiting until either is
+  /// available. Use 0 for a ring buffer shared with a stage running in the same task.
+  void set_ticks_to_wait(TickType_t input_ticks_to_wait, TickType_t output_ticks_to_wait) {
+    this->input_ticks_to_wait_ = input_ticks_to_wait;
+    this->output_ticks_to_wait_ = output_ticks_to_wait;
+  }
+
+ protected:
+  AudioBufferArena *buffer_arena_{nullptr};
+
+  AudioRingBuffer *input_ring_buffer_{nullptr};
+  AudioRingBuffer *output_ring_buffer_{nullptr};
+
+  TickType_t input_ticks_to_wait_{portMAX_DELAY};
+  TickType_t output_ticks_to_wait_{portMAX_DELAY};
+
+  std::atomic<bool> cancelled_{false};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,769 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_stage_graph.h"
+
+namespace esphome {
+namespace nabu {
+
+// Each bit group holds one bit per stage or worker; only 24 bits are valid for the event group
+static const size_t MAX_STAGES = 6;
+
+static const size_t EVENT_QUEUE_COUNT = 5;
+
+static const uint32_t STOP_TIMEOUT_MS = 300;
+
+// How often a task parked for a ring buffer resize checks whether the consumer's stage went idle
+static const uint32_t RESIZE_POLL_MS = 20;
+
+enum EventGroupBits : uint32_t {
+  // Stops all activity in the graph; set by stop() or by a failing stage
+  COMMAND_STOP = (1 << 0),
+  // The last stage may write to the sink; set by start(...) or start_output() and cleared by stop()
+  COMMAND_START_OUTPUT = (1 << 1),
+
+  // Starts worker n; set by start(...) for the first worker and by the worker running the previous stage for the
+  // others; cleared by the worker
+  WORKER_COMMAND_START = (1 << 2),  // Shifted by the worker index
+
+  // Stage n is done (either through a failure, the end of the stream, or because it never started); set by its worker
+  // and cleared before its worker is started
+  STAGE_MESSAGE_FINISHED = (1 << 8),  // Shifted by the stage index
+
+  // Error in stage n; cleared by take_failed_stage() or stop()
+  STAGE_MESSAGE_ERROR = (1 << 14),  // Shifted by the stage index
+
+  // The producer's task is waiting for the consumer's task to resize the ring buffer between them
+  RESIZE_PRODUCER_PARKED = (1 << 20),
+  // The consumer's task has resized the ring buffer; cleared by the producer's task
+  RESIZE_DONE = (1 << 21),
+
+  // Everything except the finished bits is cleared by stop(); the first 8 bits of the uint32 are never valid
+  STAGE_FINISHED_MASK = ((1 << MAX_STAGES) - 1) * STAGE_MESSAGE_FINISHED,
+  STOP_CLEARED_BITS = ~(STAGE_FINISHED_MASK | 0xff000000),
+};
+
+static EventBits_t worker_start_bit(size_t worker) { return WORKER_COMMAND_START << worker; }
+static EventBits_t stage_finished_bit(size_t stage) { return STAGE_MESSAGE_FINISHED << stage; }
+static EventBits_t stage_error_bit(size_t stage) { return STAGE_MESSAGE_ERROR << stage; }
+
+void AudioStageGraph::add_ring_buffer(size_t capacity, size_t max_span, size_t fill_watermark,
+                                      size_t space_watermark) {
+  RingBufferConfig config;
+  config.capacity = capacity;
+  config.max_span = max_span;
+  config.fill_watermark = fill_watermark;
+  config.space_watermark = space_watermark;
+  this->ring_buffer_configs_.push_back(config);
+}
+
+esp_err_t AudioStageGraph::allocate_() {
+  const size_t stage_count = this->stages_.size();
+  if ((stage_count == 0) || (stage_count > MAX_STAGES) || (this->ring_buffer_configs_.size() != stage_count - 1)) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if (this->ring_buffers_.empty()) {
+    for (const RingBufferConfig &config : this->ring_buffer_configs_) {
+      std::unique_ptr<AudioRingBuffer> ring_buffer =
+          AudioRingBuffer::create(config.capacity, config.max_span, this->buffer_arena_);
+      if (ring_buffer == nullptr) {
+        this->ring_buffers_.clear();
+        return ESP_ERR_NO_MEM;
+      }
+      ring_buffer->set_fill_watermark(config.fill_watermark);
+      ring_buffer->set_space_watermark(config.space_watermark);
+      this->ring_buffers_.push_back(std::move(ring_buffer));
+    }
+  } else {
+    // The tasks are idle, so the ring buffers can be resized directly. One that can't keeps its previous capacity.
+    for (size_t i = 0; i < this->ring_buffers_.size(); ++i) {
+      this->ring_buffers_[i]->resize(this->ring_buffer_configs_[i].capacity);
+    }
+  }
+
+  if (this->event_group_ == nullptr) {
+    this->event_group_ = xEventGroupCreate();
+
+    if (this->event_group_ == nullptr) {
+      return ESP_ERR_NO_MEM;
+    }
+
+    // Tasks are only created once a placement needs them; until then their stages count as finished
+    xEventGroupSetBits(this->event_group_, this->all_finished_bits_());
+  }
+
+  if (this->event_queue_ == nullptr)
+    this->event_queue_ = xQueueCreate(EVENT_QUEUE_COUNT, sizeof(AudioStageEvent));
+
+  if (this->event_queue_ == nullptr)
+    return ESP_ERR_NO_MEM;
+
+  if (this->workers_ == nullptr) {
+    this->workers_ = std::unique_ptr<Worker[]>(new Worker[stage_count]);
+    for (size_t i = 0; i < stage_count; ++i) {
+      this->workers_[i].graph = this;
+      this->workers_[i].index = i;
+      this->workers_[i].first_stage = 1;
+      this->workers_[i].last_stage = 0;
+    }
+    this->output_formats_.resize(stage_count);
+    this->stage_workers_.resize(stage_count);
+    this->stage_progress_.resize(stage_count);
+  }
+
+  return ESP_OK;
+}
+
+void AudioStageGraph::set_buffer_arena(AudioBufferArena *buffer_arena) {
+  this->buffer_arena_ = buffer_arena;
+  for (auto &stage : this->stages_) {
+    stage->set_buffer_arena(buffer_arena);
+  }
+}
+
+esp_err_t AudioStageGraph::place_stages_(const std::string &task_name, UBaseType_t priority, bool in_caller) {
+  const size_t stage_count = this->stages_.size();
+
+  bool fuse = this->allow_fusing_ || in_caller;
+  for (const auto &stage : this->stages_) {
+    if (stage->may_block_on_io()) {
+      if (in_caller) {
+        // It would stall the caller
+        return ESP_ERR_NOT_SUPPORTED;
+      }
+      // It would stall every other stage in its task
+      fuse = false;
+    }
+  }
+
+  for (size_t i = 0; i < stage_count; ++i) {
+    Worker &worker = this->workers_[i];
+    if (fuse) {
+      // The first worker runs everything; the others stay idle
+      worker.first_stage = (i == 0) ? 0 : 1;
+      worker.last_stage = (i == 0) ? stage_count - 1 : 0;
+      this->stage_workers_[i] = 0;
+    } else {
+      worker.first_stage = i;
+      worker.last_stage = i;
+      this->stage_workers_[i] = i;
+    }
+
+    // Stages sharing a task don't wait on the ring buffer between them
+    TickType_t input_ticks_to_wait = portMAX_DELAY;
+    TickType_t output_ticks_to_wait = portMAX_DELAY;
+    if (fuse) {
+      if ((i > 0) || in_caller) {
+        input_ticks_to_wait = 0;
+      }
+      if ((i < stage_count - 1) || in_caller) {
+        output_ticks_to_wait = 0;
+      }
+    }
+    this->stages_[i]->set_ticks_to_wait(input_ticks_to_wait, output_ticks_to_wait);
+
+    AudioRingBuffer *input_ring_buffer = (i > 0) ? this->ring_buffers_[i - 1].get() : nullptr;
+    AudioRingBuffer *output_ring_buffer = (i < stage_count - 1) ? this->ring_buffers_[i].get() : this->sink_;
+    this->stages_[i]->set_ring_buffers(input_ring_buffer, output_ring_buffer);
+  }
+
+  if (in_caller) {
+    return ESP_OK;
+  }
+
+  for (size_t i = 0; i < stage_count; ++i) {
+    Worker &worker = this->workers_[i];
+    if ((worker.first_stage > worker.last_stage) || (worker.handle != nullptr)) {
+      continue;
+    }
+
+    // The first worker may have to run every stage at some point, so it gets the largest stack
+    uint32_t stack_size = this->task_stack_sizes_[i];
+    if (i == 0) {
+      for (uint32_t stage_stack_size : this->task_stack_sizes_) {
+        stack_size = std::max(stack_size, stage_stack_size);
+      }
+    }
+
+    if (worker.task_stack_buffer == nullptr)
+      worker.task_stack_buffer = (StackType_t *) malloc(stack_size);
+
+    if (worker.task_stack_buffer == nullptr) {
+      return ESP_ERR_NO_MEM;
+    }
+
+    worker.handle = xTaskCreateStatic(AudioStageGraph::worker_task_,
+                                      (task_name + "_" + this->stages_[i]->get_name()).c_str(), stack_size,
+                                      (void *) &worker, priority, worker.task_stack_buffer, &worker.task_stack);
+
+    if (worker.handle == nullptr) {
+      return ESP_FAIL;
+    }
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t AudioStageGraph::prepare_start_() {
+  if (this->sink_ == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  esp_err_t err = this->allocate_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  if (!this->is_finished()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  for (auto &stage : this->stages_) {
+    stage->clear_cancel();
+  }
+
+  // allocate_ already applied any resize that was still pending
+  this->resize_pending_.store(false);
+
+  return ESP_OK;
+}
+
+esp_err_t AudioStageGraph::start(const std::string &task_name, UBaseType_t priority, bool hold_output) {
+  esp_err_t err = this->prepare_start_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  // All tasks are idle, so they pick up the new placement once they are started
+  err = this->place_stages_(task_name, priority, false);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  if (!hold_output) {
+    xEventGroupSetBits(this->event_group_, COMMAND_START_OUTPUT);
+  }
+
+  this->hand_off_(0);
+
+  return ESP_OK;
+}
+
+esp_err_t AudioStageGraph::start_in_caller() {
+  esp_err_t err = this->prepare_start_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  // Places every stage on the first worker without creating its task
+  err = this->place_stages_("", 0, true);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  // No task waits for a start command, so report the stages as running directly
+  xEventGroupSetBits(this->event_group_, COMMAND_START_OUTPUT);
+  xEventGroupClearBits(this->event_group_, this->all_finished_bits_());
+  for (StageProgress &progress : this->stage_progress_) {
+    progress = StageProgress();
+  }
+  this->running_in_caller_ = true;
+
+  return ESP_OK;
+}
+
+AudioStageState AudioStageGraph::process() {
+  if (!this->running_in_caller_) {
+    return AudioStageState::FINISHED;
+  }
+
+  if (!this->run_pass_(&this->workers_[0])) {
+    return AudioStageState::RUNNING;
+  }
+
+  this->running_in_caller_ = false;
+  xEventGroupSetBits(this->event_group_, this->all_finished_bits_());
+
+  EventBits_t event_bits = xEventGroupGetBits(this->event_group_);
+  for (size_t i = 0; i < this->stages_.size(); ++i) {
+    if (event_bits & stage_error_bit(i)) {
+      return AudioStageState::FAILED;
+    }
+  }
+  return AudioStageState::FINISHED;
+}
+
+esp_err_t AudioStageGraph::resize_ring_buffer(size_t index, size_t capacity) {
+  if (this->resize_pending_.load()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  this->ring_buffer_configs_[index].capacity = capacity;
+
+  if ((this->workers_ == nullptr) || this->ring_buffers_.empty()) {
+    // Not allocated yet; the next start uses the new capacity
+    return ESP_OK;
+  }
+
+  this->resize_index_ = index;
+  this->resize_capacity_ = capacity;
+  this->resize_pending_.store(true);
+
+  // Wake the tasks on either side in case they are waiting on a ring buffer, so they reach a safe point
+  for (size_t stage : {index, index + 1}) {
+    TaskHandle_t handle = this->workers_[this->stage_workers_[stage]].handle;
+    if (handle != nullptr) {
+      xTaskNotifyGive(handle);
+    }
+  }
+
+  return ESP_OK;
+}
+
+void AudioStageGraph::start_output() {
+  if (this->event_group_ != nullptr) {
+    xEventGroupSetBits(this->event_group_, COMMAND_START_OUTPUT);
+  }
+}
+
+bool AudioStageGraph::is_output_started() {
+  return (this->event_group_ != nullptr) && (xEventGroupGetBits(this->event_group_) & COMMAND_START_OUTPUT);
+}
+
+void AudioStageGraph::request_stop() {
+  if (this->event_group_ == nullptr) {
+    return;
+  }
+
+  xEventGroupSetBits(this->event_group_, COMMAND_STOP);
+
+  // Unblock any stage waiting on something other than a ring buffer
+  for (auto &stage : this->stages_) {
+    stage->cancel();
+  }
+
+  // Wake any task waiting on a ring buffer so it sees the stop command
+  for (size_t i = 0; i < this->stages_.size(); ++i) {
+    if (this->workers_[i].handle != nullptr) {
+      xTaskNotifyGive(this->workers_[i].handle);
+    }
+  }
+}
+
+esp_err_t AudioStageGraph::stop() {
+  if (this->event_group_ == nullptr) {
+    return ESP_OK;
+  }
+
+  this->request_stop();
+
+  if (this->running_in_caller_) {
+    // The caller isn't in process() while it stops the graph, so the stages are done right away
+    this->running_in_caller_ = false;
+    xEventGroupSetBits(this->event_group_, this->all_finished_bits_());
+  }
+
+  EventBits_t finished_bits = this->all_finished_bits_();
+  EventBits_t event_group_bits = xEventGroupWaitBits(this->event_group_,
+                                                     finished_bits,                     // Bit message to read
+                                                     pdFALSE,                           // Clear the bits on exit
+                                                     pdTRUE,                            // Wait for all the bits,
+                                                     pdMS_TO_TICKS(STOP_TIMEOUT_MS));  // Duration to block/wait
+
+  if ((event_group_bits & finished_bits) != finished_bits) {
+    // Not all bits were set, so it timed out. Report the stages that failed to stop.
+    for (size_t i = 0; i < this->stages_.size(); ++i) {
+      if (!(event_group_bits & stage_finished_bit(i))) {
+        xEventGroupSetBits(this->event_group_, stage_error_bit(i));
+      }
+    }
+    return ESP_ERR_TIMEOUT;
+  }
+
+  xEventGroupClearBits(this->event_group_, STOP_CLEARED_BITS);
+
+  for (auto &ring_buffer : this->ring_buffers_) {
+    ring_buffer->reset();
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t AudioStageGraph::release() {
+  if (!this->is_finished()) {
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  if (this->workers_ != nullptr) {
+    // A task sets its stages' finished bits just before it goes back to waiting for the next start, so only delete
+    // the tasks once every one of them is blocked there
+    for (size_t i = 0; i < this->stages_.size(); ++i) {
+      if ((this->workers_[i].handle != nullptr) && (eTaskGetState(this->workers_[i].handle) != eBlocked)) {
+        return ESP_ERR_INVALID_STATE;
+      }
+    }
+
+    for (size_t i = 0; i < this->stages_.size(); ++i) {
+      Worker &worker = this->workers_[i];
+      if (worker.handle != nullptr) {
+        vTaskDelete(worker.handle);
+        worker.handle = nullptr;
+      }
+      if (worker.task_stack_buffer != nullptr) {
+        free(worker.task_stack_buffer);
+        worker.task_stack_buffer = nullptr;
+      }
+    }
+  }
+
+  this->ring_buffers_.clear();
+  for (auto &stage : this->stages_) {
+    stage->set_ring_buffers(nullptr, nullptr);
+    stage->release_buffers();
+  }
+
+  return ESP_OK;
+}
+
+BaseType_t AudioStageGraph::read_event(AudioStageEvent *event) {
+  if (this->event_queue_ == nullptr) {
+    return pdFALSE;
+  }
+  return xQueueReceive(this->event_queue_, event, 0);
+}
+
+bool AudioStageGraph::is_finished() {
+  if (this->event_group_ == nullptr) {
+    return true;
+  }
+
+  EventBits_t finished_bits = this->all_finished_bits_();
+  return (xEventGroupGetBits(this->event_group_) & finished_bits) == finished_bits;
+}
+
+UBaseType_t AudioStageGraph::get_stack_high_water_mark(size_t stage) const {
+  if ((this->workers_ == nullptr) || (this->workers_[stage].handle == nullptr)) {
+    return 0;
+  }
+  return uxTaskGetStackHighWaterMark(this->workers_[stage].handle);
+}
+
+optional<size_t> AudioStageGraph::take_failed_stage() {
+  if (this->event_group_ == nullptr) {
+    return {};
+  }
+
+  EventBits_t event_bits = xEventGroupGetBits(this->event_group_);
+  for (size_t i = 0; i < this->stages_.size(); ++i) {
+    if (event_bits & stage_error_bit(i)) {
+      xEventGroupClearBits(this->event_group_, stage_error_bit(i));
+      return i;
+    }
+  }
+
+  return {};
+}
+
+AudioRingBuffer *AudioStageGraph::get_ring_buffer(size_t index) {
+  if (index >= this->ring_buffers_.size()) {
+    return nullptr;
+  }
+  return this->ring_buffers_[index].get();
+}
+
+uint32_t AudioStageGraph::get_wakeup_count() {
+  uint32_t wakeup_count = 0;
+  for (auto &ring_buffer : this->ring_buffers_) {
+    wakeup_count += ring_buffer->get_wakeup_count();
+  }
+  return wakeup_count;
+}
+
+void AudioStageGraph::suspend_tasks() {
+  if (this->workers_ == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < this->stages_.size(); ++i) {
+    if (this->workers_[i].handle != nullptr) {
+      vTaskSuspend(this->workers_[i].handle);
+    }
+  }
+}
+
+void AudioStageGraph::resume_tasks() {
+  if (this->workers_ == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < this->stages_.size(); ++i) {
+    if (this->workers_[i].handle != nullptr) {
+      vTaskResume(this->workers_[i].handle);
+    }
+  }
+}
+
+EventBits_t AudioStageGraph::all_finished_bits_() const {
+  EventBits_t finished_bits = 0;
+  for (size_t i = 0; i < this->stages_.size(); ++i) {
+    finished_bits |= stage_finished_bit(i);
+  }
+  return finished_bits;
+}
+
+void AudioStageGraph::hand_off_(size_t index) {
+  const Worker &worker = this->workers_[this->stage_workers_[index]];
+
+  // Report the worker's stages as running before starting it, so the graph never looks finished in between
+  EventBits_t finished_bits = 0;
+  for (size_t i = worker.first_stage; i <= worker.last_stage; ++i) {
+    finished_bits |= stage_finished_bit(i);
+  }
+  xEventGroupClearBits(this->event_group_, finished_bits);
+  xEventGroupSetBits(this->event_group_, worker_start_bit(worker.index));
+}
+
+void AudioStageGraph::fail_(size_t index, esp_err_t err, const optional<AudioStreamFormat> &input_format) {
+  if (xEventGroupGetBits(this->event_group_) & COMMAND_STOP) {
+    // The stage was most likely cancelled; stopping isn't an error
+    return;
+  }
+
+  AudioStageEvent event;
+  event.stage = index;
+  event.err = err;
+  event.input_format = input_format;
+  if (xQueueSend(this->event_queue_, &event, 0) != pdTRUE) {
+    // Events only feed the logs, so the stage never waits on loop() to drain them. An error is worth more than the
+    // oldest queued event; the failure itself is reported through the event group either way.
+    AudioStageEvent dropped_event;
+    xQueueReceive(this->event_queue_, &dropped_event, 0);
+    xQueueSend(this->event_queue_, &event, 0);
+  }
+
+  xEventGroupSetBits(this->event_group_, stage_error_bit(index) | COMMAND_STOP);
+}
+
+void AudioStageGraph::resize_at_safe_point_(Worker *worker) {
+  if (!this->resize_pending_.load()) {
+    return;
+  }
+
+  const size_t producer_stage = this->resize_index_;
+  const size_t consumer_stage = producer_stage + 1;
+  const bool runs_producer = (worker->first_stage <= producer_stage) && (producer_stage <= worker->last_stage);
+  const bool runs_consumer = (worker->first_stage <= consumer_stage) && (consumer_stage <= worker->last_stage);
+
+  EventBits_t event_bits = 0;
+  if (runs_producer && !runs_consumer) {
+    if (xEventGroupGetBits(this->event_group_) & stage_finished_bit(producer_stage)) {
+      // Won't write to the ring buffer again; the consumer's task resizes it on its own
+      return;
+    }
+
+    // Park until the consumer's task has moved the audio. If the consumer's stage is idle, it never reaches a safe
+    // point, and this task resizes the ring buffer itself.
+    xEventGroupSetBits(this->event_group_, RESIZE_PRODUCER_PARKED);
+    while (true) {
+      event_bits = xEventGroupWaitBits(this->event_group_,
+                                       RESIZE_DONE | COMMAND_STOP,  // Bit message to read
+                                       pdFALSE,                     // Clear the bit on exit
+                                       pdFALSE,                     // Wait for all the bits,
+                                       pdMS_TO_TICKS(RESIZE_POLL_MS));
+      if (event_bits & (RESIZE_DONE | COMMAND_STOP)) {
+        // Stopping resets the ring buffers anyway; the next start applies the new capacity
+        xEventGroupClearBits(this->event_group_, RESIZE_DONE | RESIZE_PRODUCER_PARKED);
+        return;
+      }
+      if (event_bits & stage_finished_bit(consumer_stage)) {
+        // The consumer's stage sets its finished bit only after leaving its last safe point
+        xEventGroupClearBits(this->event_group_, RESIZE_PRODUCER_PARKED);
+        break;
+      }
+    }
+  } else if (runs_consumer && !runs_producer) {
+    // Wait until the producer's task has parked or won't write to the ring buffer again
+    event_bits = xEventGroupWaitBits(this->event_group_,
+                                     RESIZE_PRODUCER_PARKED | COMMAND_STOP | stage_finished_bit(producer_stage),
+                                     pdFALSE,  // Clear the bit on exit
+                                     pdFALSE,  // Wait for all the bits,
+                                     portMAX_DELAY);
+    if (event_bits & COMMAND_STOP) {
+      return;
+    }
+  } else if (!runs_producer) {
+    return;
+  }
+
+  // If it fails, the ring buffer keeps its capacity
+  this->ring_buffers_[producer_stage]->resize(this->resize_capacity_);
+  this->resize_pending_.store(false);
+
+  if (!runs_producer && (event_bits & RESIZE_PRODUCER_PARKED)) {
+    // Let the producer's task continue
+    xEventGroupSetBits(this->event_group_, RESIZE_DONE);
+  }
+}
+
+uint32_t AudioStageGraph::read_ahead_progress_(const Worker *worker) const {
+  uint32_t progress = 0;
+  for (size_t i = worker->first_stage; i < worker->last_stage; ++i) {
+    const StageProgress &stage_progress = this->stage_progress_[i];
+    progress += stage_progress.started + stage_progress.format_known + stage_progress.finished;
+    progress += this->ring_buffers_[i]->get_stats().bytes_written;
+  }
+  return progress;
+}
+
+void AudioStageGraph::worker_task_(void *params) {
+  Worker *worker = (Worker *) params;
+  AudioStageGraph *graph = worker->graph;
+
+  while (true) {
+    // Wait until the graph or the previous stage's task starts this worker. Its stages count as finished until then.
+    xEventGroupWaitBits(graph->event_group_,
+                        worker_start_bit(worker->index),  // Bit message to read
+                        pdTRUE,                           // Clear the bit on exit
+                        pdFALSE,                          // Wait for all the bits,
+                        portMAX_DELAY);                   // Block indefinitely until bit is set
+
+    graph->run_stages_(worker);
+
+    // Read the placement before reporting the stages as finished; the graph may place the next stream afterwards
+    EventBits_t finished_bits = 0;
+    for (size_t i = worker->first_stage; i <= worker->last_stage; ++i) {
+      finished_bits |= stage_finished_bit(i);
+    }
+    TaskHandle_t next_task = nullptr;
+    size_t next_stage = worker->last_stage + 1;
+    if (next_stage < graph->stages_.size()) {
+      next_task = graph->workers_[graph->stage_workers_[next_stage]].handle;
+    }
+
+    xEventGroupSetBits(graph->event_group_, finished_bits);
+
+    // Wake the next stage's task in case it is waiting for more input; it finishes once it has processed the rest
+    if (next_task != nullptr) {
+      xTaskNotifyGive(next_task);
+    }
+  }
+}
+
+void AudioStageGraph::run_stages_(Worker *worker) {
+  for (size_t i = worker->first_stage; i <= worker->last_stage; ++i) {
+    this->stage_progress_[i] = StageProgress();
+  }
+
+  while (!this->run_pass_(worker)) {
+  }
+}
+
+bool AudioStageGraph::run_pass_(Worker *worker) {
+  const size_t first = worker->first_stage;
+  const size_t last = worker->last_stage;
+  const size_t last_in_graph = this->stages_.size() - 1;
+
+  EventBits_t event_bits = xEventGroupGetBits(this->event_group_);
+
+  if (event_bits & COMMAND_STOP) {
+    return true;
+  }
+
+  this->resize_at_safe_point_(worker);
+
+  // A worker that also runs the stages before the held one keeps reading ahead with them. It only waits for the output
+  // to start once a pass gets nowhere, e.g., because their ring buffers are full.
+  const bool output_held = (last == last_in_graph) && (first < last) && !this->stage_progress_[last].started &&
+                           !(event_bits & COMMAND_START_OUTPUT);
+  const uint32_t progress_before = output_held ? this->read_ahead_progress_(worker) : 0;
+
+  for (size_t i = first; i <= last; ++i) {
+    AudioStage *stage = this->stages_[i].get();
+    StageProgress &progress = this->stage_progress_[i];
+
+    if (!progress.started) {
+      if ((i > first) && !this->stage_progress_[i - 1].format_known) {
+        // The previous stage in this task doesn't know its output format yet
+        return false;
+      }
+
+      if ((i == last_in_graph) && !(event_bits & COMMAND_START_OUTPUT)) {
+        if (output_held && (this->read_ahead_progress_(worker) != progress_before)) {
+          return false;
+        }
+
+        // Hold the audio back until the stage is allowed to write to the sink
+        event_bits = xEventGroupWaitBits(this->event_group_,
+                                         COMMAND_START_OUTPUT | COMMAND_STOP,  // Bit message to read
+                                         pdFALSE,                              // Clear the bit on exit
+                                         pdFALSE,                              // Wait for all the bits,
+                                         portMAX_DELAY);  // Block indefinitely until a bit is set
+        if (event_bits & COMMAND_STOP) {
+          return true;
+        }
+      }
+
+      AudioStreamFormat input_format;
+      if (i > 0) {
+        input_format = this->output_formats_[i - 1];
+      }
+
+      esp_err_t err = stage->start(input_format);
+      if (err != ESP_OK) {
+        this->fail_(i, err, input_format);
+        return true;
+      }
+      progress.started = true;
+    }
+
+    if (progress.finished) {
+      continue;
+    }
+
+    // Stop gracefully once the previous stage has finished
+    bool stop_gracefully = false;
+    if (i > first) {
+      stop_gracefully = this->stage_progress_[i - 1].finished;
+    } else if (i > 0) {
+      stop_gracefully = event_bits & stage_finished_bit(i - 1);
+    }
+
+    AudioStageState state = stage->process(stop_gracefully);
+
+    if (state == AudioStageState::FAILED) {
+      this->fail_(i, ESP_FAIL, {});
+      return true;
+    }
+
+    if (!progress.format_known) {
+      optional<AudioStreamFormat> output_format = stage->get_output_format();
+      if (output_format.has_value()) {
+        progress.format_known = true;
+        this->output_formats_[i] = output_format.value();
+
+        AudioStageEvent event;
+        event.stage = i;
+        event.output_format = output_format;
+        xQueueSend(this->event_queue_, &event, 0);  // Dropped if loop() is behind; it's only logged
+
+        if ((i == last) && (i < last_in_graph)) {
+          // The next stage runs in another task
+          this->hand_off_(i + 1);
+        }
+      }
+    }
+
+    if (state == AudioStageState::FINISHED) {
+      progress.finished = true;
+      if ((i == last) || !progress.format_known) {
+        // Either all of this task's stages are done, or the later ones never get an input format
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,252 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "audio_ring_buffer.h"
+#include "audio_stage.h"
+
+#include "esphome/core/helpers.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+// Reported by the graph's tasks through the event queue
+struct AudioStageEvent {
+  uint8_t stage;                              // Index of the stage in the graph
+  optional<esp_err_t> err;                    // Set if the stage failed to start or failed while processing
+  optional<AudioStreamFormat> input_format;   // Set with err if the stage failed to start
+  optional<AudioStreamFormat> output_format;  // Set once the stage has determined its output format
+};
+
+// Runs a chain of AudioStages, each feeding the next through an AudioRingBuffer
+//  - Assemble the graph by alternating add_stage and add_ring_buffer calls. The last stage writes into a sink ring
+//    buffer owned by someone else (e.g., the mixer).
+//  - A stage is started once the previous stage knows its output format, which becomes the stage's input format
+//  - The graph decides which tasks run which stages; the stages and whoever assembled the graph don't:
+//    - By default, every stage runs in its own task and blocks on its ring buffers
+//    - If fusing is allowed and no stage blocks on I/O, the first task runs every stage cooperatively. Stages in the
+//      same task don't wait on the ring buffer between them, so each one yields to the next when it can't progress.
+//      Only the last stage blocks, on the sink.
+//    - Tasks are created the first time a placement needs them and then reused
+//  - The last stage can be held back from writing to the sink until start_output() is called, so a graph can read and
+//    decode ahead while another graph feeds the sink
+//  - Instead of tasks, start_in_caller() runs every stage in the calling task, one pass per process() call, so a
+//    component's loop() can drive the graph in time slices. No stage waits on a ring buffer, including the sink.
+//  - A ring buffer can be resized while the graph runs. Between two process() calls, the producer's task parks and
+//    the consumer's task moves the audio into the new storage.
+//  - Once the graph is idle, release() gives back its ring buffers, the stages' scratch buffers, and the tasks. The
+//    next start allocates them again.
+//  - FreeRTOS Event Groups coordinate the tasks; the event queue reports output formats and errors for logging. A
+//    task drops an event rather than waiting for room in the queue.
+class AudioStageGraph {
+ public:
+  /// @brief Appends a stage to the graph. Separate it from the previous stage with add_ring_buffer.
+  /// @param stage The stage; owned by the graph from now on
+  /// @param task_stack_size Stack size (in bytes) needed by the task running this stage
+  /// @return Pointer to the stage, so it can be configured between streams
+  template<typename T> T *add_stage(std::unique_ptr<T> stage, uint32_t task_stack_size) {
+    T *added_stage = stage.get();
+    this->stages_.push_back(std::move(stage));
+    this->task_stack_sizes_.push_back(task_stack_size);
+    return added_stage;
+  }
+
+  /// @brief Appends the ring buffer connecting the previously added stage to the next one. Allocated on the first
+  /// start.
+  void add_ring_buffer(size_t capacity, size_t max_span, size_t fill_watermark = 0, size_t space_watermark = 0);
+
+  /// @brief Sets the capacity of the ring buffer connecting stage index to stage index + 1. Takes effect on the next
+  /// start. If the ring buffer can't be reallocated, it keeps its previous capacity.
+  void set_ring_buffer_capacity(size_t index, size_t capacity) {
+    this->ring_buffer_configs_[index].capacity = capacity;
+  }
+
+  /// @brief Resizes the ring buffer connecting stage index to stage index + 1 while the graph runs, keeping its audio.
+  /// Returns right away; the stages' tasks carry out the resize the next time they are between two process() calls.
+  /// Also sets the capacity for later starts.
+  /// @return ESP_OK if the resize was requested or ESP_ERR_INVALID_STATE if another resize is still pending
+  esp_err_t resize_ring_buffer(size_t index, size_t capacity);
+
+  /// @brief Sets the ring buffer the last stage writes into. Takes effect on the next start.
+  void set_sink(AudioRingBuffer *sink) { this->sink_ = sink; }
+
+  /// @brief Sets the arena the ring buffers and the stages' scratch buffers are leased from. Call before the first
+  /// start.
+  void set_buffer_arena(AudioBufferArena *buffer_arena);
+
+  /// @brief Allows running all stages in a single task when none of them blocks on I/O. Takes effect on the next start.
+  void set_allow_fusing(bool allow_fusing) { this->allow_fusing_ = allow_fusing; }
+
+  /// @brief Starts a new stream through the graph. The graph must be stopped; configure the stages before calling.
+  /// @param task_name Prefix for the FreeRTOS task names
+  /// @param priority FreeRTOS task priority
+  /// @param hold_output If true, the last stage waits for start_output() before it starts. The earlier stages read
+  /// ahead into their ring buffers meanwhile, even if they share its task.
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t start(const std::string &task_name, UBaseType_t priority, bool hold_output);
+
+  /// @brief Starts a new stream that runs every stage in the calling task instead of the graph's tasks. The graph must
+  /// be stopped; configure the stages before calling. Drive the stream with process().
+  /// @return ESP_OK if successful, ESP_ERR_NOT_SUPPORTED if a stage may block on I/O, or another error
+  esp_err_t start_in_caller();
+
+  /// @brief Runs each stage of a stream started with start_in_caller() once, without blocking. Read the events after
+  /// each call; the event queue is small and drops events that don't fit.
+  /// @return RUNNING while the stream continues, FINISHED once every stage is done, or FAILED if a stage failed
+  AudioStageState process();
+
+  /// @brief Lets the last stage write to the sink
+  void start_output();
+
+  /// @brief Whether the last stage may write to the sink
+  bool is_output_started();
+
+  /// @brief Stops every task and discards the audio in the graph's ring buffers. Leaves the sink alone.
+  /// @return ESP_OK if successful or ESP_ERR_TIMEOUT if a task did not indicate it stopped
+  esp_err_t stop();
+
+  /// @brief Tells every task to stop and cancels any blocking work in the stages, but doesn't wait for them. The next
+  /// start or stop waits for the tasks to finish.
+  void request_stop();
+
+  /// @brief Deletes the tasks and gives back the ring buffers and the stages' scratch buffers. The event group and
+  /// queue are kept, so the graph's state can still be queried. The next start allocates everything again.
+  /// @return ESP_OK if successful or ESP_ERR_INVALID_STATE if a stage is running or a task isn't idle yet
+  esp_err_t release();
+
+  /// @brief Reads an event reported by the graph's tasks
+  /// @return pdTRUE if an event was read, pdFALSE otherwise
+  BaseType_t read_event(AudioStageEvent *event);
+
+  /// @brief Whether the graph has ever started
+  bool has_started() const { return (this->workers_ != nullptr) && (this->workers_[0].handle != nullptr); }
+
+  /// @brief Whether every stage has finished (or was never started)
+  bool is_finished();
+
+  /// @brief Index of a stage that failed since the last call, if any
+  optional<size_t> take_failed_stage();
+
+  size_t get_stage_count() const { return this->stages_.size(); }
+  AudioStage *get_stage(size_t index) { return this->stages_[index].get(); }
+
+  /// @brief Smallest amount of stack the task created for the stage has had left since it started (in bytes on
+  /// ESP-IDF). Shows the margin of the stack sizes passed to add_stage.
+  /// @return 0 if no task was created for the stage, e.g., because its stages were fused into the first task
+  UBaseType_t get_stack_high_water_mark(size_t stage) const;
+
+  /// @brief Ring buffer connecting stage index to stage index + 1; nullptr before the first start
+  AudioRingBuffer *get_ring_buffer(size_t index);
+
+  /// @brief Number of times the graph's tasks have woken up while waiting on its ring buffers
+  uint32_t get_wakeup_count();
+
+  /// @brief Suspends any running tasks
+  void suspend_tasks();
+  /// @brief Resumes any running tasks
+  void resume_tasks();
+
+ protected:
+  // Progress of a stage in the current stream; only touched by the worker running it
+  struct StageProgress {
+    bool started;
+    bool finished;
+    bool format_known;
+  };
+
+  struct RingBufferConfig {
+    size_t capacity;
+    size_t max_span;
+    size_t fill_watermark;
+    size_t space_watermark;
+  };
+
+  // A FreeRTOS task that runs a contiguous range of stages
+  struct Worker {
+    AudioStageGraph *graph;
+    size_t index;
+    size_t first_stage;  // Placement for the current stream; the range is empty if first_stage > last_stage
+    size_t last_stage;
+    TaskHandle_t handle{nullptr};
+    StaticTask_t task_stack;
+    StackType_t *task_stack_buffer{nullptr};
+  };
+
+  /// @brief Allocates the ring buffers, event group, event queue, and workers
+  /// @return ESP_OK if successful, ESP_ERR_INVALID_STATE if the graph is malformed, or ESP_ERR_NO_MEM
+  esp_err_t allocate_();
+
+  /// @brief Decides which worker runs which stages and creates the tasks the placement needs. With in_caller, the
+  /// first worker's placement runs every stage in the calling task and no task is created.
+  esp_err_t place_stages_(const std::string &task_name, UBaseType_t priority, bool in_caller);
+
+  /// @brief Clears the graph's state from the previous stream and gets the stages ready to start
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t prepare_start_();
+
+  /// @brief Runs the worker's stages until they finish, fail, or the graph stops
+  void run_stages_(Worker *worker);
+
+  /// @brief Runs each of the worker's stages once, starting any whose input format became known
+  /// @return true once the worker's stages are done, false while there is more to do
+  bool run_pass_(Worker *worker);
+
+  /// @brief Changes whenever one of the worker's stages before its last starts, learns its output format, finishes,
+  /// or writes to the ring buffer after it. Tells whether a pass got anywhere while the output is held.
+  uint32_t read_ahead_progress_(const Worker *worker) const;
+
+  /// @brief Lets the worker running stage index start it with the format published by the previous stage
+  void hand_off_(size_t index);
+
+  /// @brief Reports a failed stage and stops the graph
+  void fail_(size_t index, esp_err_t err, const optional<AudioStreamFormat> &input_format);
+
+  /// @brief Carries out a pending resize if the worker runs a stage on either side of the ring buffer. Waits for the
+  /// task on the other side unless it is idle. Only call between two process() calls.
+  void resize_at_safe_point_(Worker *worker);
+
+  static void worker_task_(void *params);
+
+  EventBits_t all_finished_bits_() const;
+
+  std::vector<std::unique_ptr<AudioStage>> stages_;
+  std::vector<uint32_t> task_stack_sizes_;
+  std::vector<RingBufferConfig> ring_buffer_configs_;
+  std::vector<std::unique_ptr<AudioRingBuffer>> ring_buffers_;
+  AudioRingBuffer *sink_{nullptr};
+  AudioBufferArena *buffer_arena_{nullptr};
+
+  // Output format of each stage, published to the next stage's task before it is started
+  std::vector<AudioStreamFormat> output_formats_;
+  // The worker running each stage for the current stream
+  std::vector<size_t> stage_workers_;
+  std::vector<StageProgress> stage_progress_;
+  std::unique_ptr<Worker[]> workers_;
+
+  bool allow_fusing_{false};
+  bool running_in_caller_{false};  // A stream started with start_in_caller() hasn't finished yet
+
+  // Requested by resize_ring_buffer and carried out by the stages' tasks; the index and capacity are written before
+  // the flag is set
+  std::atomic<bool> resize_pending_{false};
+  size_t resize_index_{0};
+  size_t resize_capacity_{0};
+
+  EventGroupHandle_t event_group_{nullptr};
+  QueueHandle_t event_queue_{nullptr};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,90 @@
+#ifdef USE_ESP_IDF
+
+#include "audio_url_cache.h"
+
+#include "esphome/core/helpers.h"
+
+namespace esphome {
+namespace nabu {
+
+CachedUrlEntry::~CachedUrlEntry() {
+  if (this->data != nullptr) {
+    ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->data, this->length);
+  }
+}
+
+AudioUrlCache::AudioUrlCache() { this->lock_ = xSemaphoreCreateMutex(); }
+
+AudioUrlCache::~AudioUrlCache() { vSemaphoreDelete(this->lock_); }
+
+std::shared_ptr<const CachedUrlEntry> AudioUrlCache::find(const std::string &url) {
+  std::shared_ptr<const CachedUrlEntry> found;
+
+  xSemaphoreTake(this->lock_, portMAX_DELAY);
+  for (auto it = this->entries_.begin(); it != this->entries_.end(); ++it) {
+    if ((*it)->url == url) {
+      found = *it;
+      this->entries_.erase(it);
+      this->entries_.insert(this->entries_.begin(), found);
+      break;
+    }
+  }
+  xSemaphoreGive(this->lock_);
+
+  if (found != nullptr) {
+    ++this->hits_;
+  } else {
+    ++this->misses_;
+  }
+
+  return found;
+}
+
+std::shared_ptr<CachedUrlEntry> AudioUrlCache::create_entry(const std::string &url, size_t length) {
+  if ((length == 0) || (length > this->max_size_)) {
+    return nullptr;
+  }
+
+  ExternalRAMAllocator<uint8_t> allocator(ExternalRAMAllocator<uint8_t>::ALLOW_FAILURE);
+  uint8_t *data = allocator.allocate(length);
+  if (data == nullptr) {
+    return nullptr;
+  }
+
+  auto entry = std::make_shared<CachedUrlEntry>();
+  entry->url = url;
+  entry->data = data;
+  entry->length = length;
+  return entry;
+}
+
+void AudioUrlCache::insert(std::shared_ptr<CachedUrlEntry> entry) {
+  // Freed outside the lock, unless a reader still holds them
+  std::vector<std::shared_ptr<const CachedUrlEntry>> evicted;
+
+  xSemaphoreTake(this->lock_, portMAX_DELAY);
+  size_t size = this->size_.load();
+  for (auto it = this->entries_.begin(); it != this->entries_.end(); ++it) {
+    if ((*it)->url == entry->url) {
+      size -= (*it)->length;
+      evicted.push_back(*it);
+      this->entries_.erase(it);
+      break;
+    }
+  }
+  while (!this->entries_.empty() && (size + entry->length > this->max_size_)) {
+    size -= this->entries_.back()->length;
+    evicted.push_back(this->entries_.back());
+    this->entries_.pop_back();
+  }
+  size += entry->length;
+  this->entries_.insert(this->entries_.begin(), std::move(entry));
+  this->size_.store(size);
+  xSemaphoreGive(this->lock_);
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,75 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include "esphome/components/media_player/media_player.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+// The complete encoded payload fetched from a url
+struct CachedUrlEntry {
+  ~CachedUrlEntry();
+
+  std::string url;
+  media_player::MediaFileType file_type{media_player::MediaFileType::NONE};
+  uint8_t *data{nullptr};  // In external RAM
+  size_t length{0};
+};
+
+// Keeps the encoded audio of recently played urls in external RAM, so a url that is played again (e.g., a repeated TTS
+// response, whose url is derived from its content) is read from memory instead of the network
+//  - Entries are evicted least recently used first to stay within a byte budget
+//  - A reader that finds an entry holds a reference to it, so evicting it never pulls the audio out from under the
+//    reader; the memory is freed once the reader is done
+//  - Only responses with a known length that fits the budget are cached; the reader fills the entry as the audio
+//    arrives and inserts it once the response is complete
+//  - Shared by the readers of all announcement pipelines, so a mutex guards the entries
+class AudioUrlCache {
+ public:
+  AudioUrlCache();
+  ~AudioUrlCache();
+
+  /// @brief Sets the byte budget. 0 disables the cache. Call before the first lookup.
+  void set_max_size(size_t max_size) { this->max_size_ = max_size; }
+
+  /// @brief Looks up a url and marks it as the most recently used. Counts a hit or a miss.
+  /// @return the entry if the url is cached, nullptr otherwise
+  std::shared_ptr<const CachedUrlEntry> find(const std::string &url);
+
+  /// @brief Allocates an entry to fill while reading a url
+  /// @return the entry if the length fits the budget and memory is available, nullptr otherwise
+  std::shared_ptr<CachedUrlEntry> create_entry(const std::string &url, size_t length);
+
+  /// @brief Adds a filled entry as the most recently used, replacing any entry for the same url and evicting the least
+  /// recently used ones to stay within the budget
+  void insert(std::shared_ptr<CachedUrlEntry> entry);
+
+  uint32_t get_hits() const { return this->hits_.load(); }
+  uint32_t get_misses() const { return this->misses_.load(); }
+
+  /// @brief Bytes of audio currently cached
+  size_t get_size() const { return this->size_.load(); }
+
+ protected:
+  SemaphoreHandle_t lock_;
+  std::vector<std::shared_ptr<const CachedUrlEntry>> entries_;  // Most recently used first
+  size_t max_size_{0};
+  std::atomic<size_t> size_{0};
+
+  std::atomic<uint32_t> hits_{0};
+  std::atomic<uint32_t> misses_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,906 @@
+#ifdef USE_ESP_IDF
+
+#include "flac_stream_decoder.h"
+
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+static const uint8_t STREAMINFO_BLOCK = 0;
+static const uint8_t SEEKTABLE_BLOCK = 3;
+static const uint8_t INVALID_BLOCK = 127;
+static const size_t BLOCK_HEADER_SIZE = 4;
+static const size_t STREAMINFO_SIZE = 34;
+static const size_t SEEK_POINT_SIZE = 18;
+static const uint64_t PLACEHOLDER_SEEK_POINT = UINT64_MAX;
+static const size_t MAX_SEEK_POINTS = 256;  // Larger tables are thinned out
+
+static const size_t MAX_FRAME_HEADER_SIZE = 16;
+static const size_t FRAME_FOOTER_SIZE = 2;  // CRC-16
+static const uint16_t MIN_BLOCK_SIZE = 16;
+
+// Channel assignments of a frame header past the independent ones
+static const uint8_t LEFT_SIDE = 8;
+static const uint8_t SIDE_RIGHT = 9;
+static const uint8_t MID_SIDE = 10;
+
+static const uint8_t MAX_FIXED_ORDER = 4;
+static const uint8_t MAX_LPC_ORDER = 32;
+
+static const uint8_t FRAME_SAMPLE_SIZES[] = {0, 8, 12, 0, 16, 20, 24, 32};
+
+static uint16_t read_be16(const uint8_t *data) { return (data[0] << 8) | data[1]; }
+
+static uint32_t read_be24(const uint8_t *data) { return (data[0] << 16) | (data[1] << 8) | data[2]; }
+
+static uint32_t read_be32(const uint8_t *data) {
+  return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static uint64_t read_be64(const uint8_t *data) {
+  return (static_cast<uint64_t>(read_be32(data)) << 32) | read_be32(data + 4);
+}
+
+static uint8_t crc8(const uint8_t *data, size_t length) {
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; ++i) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// CRC-16 with the polynomial x^16 + x^15 + x^2 + 1, one table entry per byte value
+static const std::array<uint16_t, 256> &crc16_table() {
+  static const std::array<uint16_t, 256> TABLE = [] {
+    std::array<uint16_t, 256> table{};
+    for (uint32_t value = 0; value < 256; ++value) {
+      uint16_t crc = value << 8;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc & 0x8000) ? ((crc << 1) ^ 0x8005) : (crc << 1);
+      }
+      table[value] = crc;
+    }
+    return table;
+  }();
+  return TABLE;
+}
+
+static uint16_t crc16(const uint8_t *data, size_t length) {
+  const std::array<uint16_t, 256> &table = crc16_table();
+  uint16_t crc = 0;
+  for (size_t i = 0; i < length; ++i) {
+    crc = (crc << 8) ^ table[(crc >> 8) ^ data[i]];
+  }
+  return crc;
+}
+
+struct FrameHeader {
+  uint32_t block_size;
+  uint8_t channel_assignment;
+  uint8_t bits_per_sample;  // 0 if the STREAMINFO block's
+  bool variable_block_size;
+  uint64_t number;  // Sample number if the block size is variable, otherwise the frame number
+};
+
+// Parses a frame header, checking its reserved bits and its CRC-8
+// @return size of the header including its CRC-8, 0 if it isn't valid, or -1 if it isn't whole in the data
+static int32_t parse_frame_header(const uint8_t *data, size_t length, FrameHeader *header) {
+  if (length < 5) {
+    return -1;
+  }
+  if ((data[0] != 0xFF) || ((data[1] & 0xFE) != 0xF8)) {
+    return 0;
+  }
+
+  const uint8_t block_size_code = data[2] >> 4;
+  const uint8_t sample_rate_code = data[2] & 0x0F;
+  const uint8_t channel_code = data[3] >> 4;
+  const uint8_t sample_size_code = (data[3] >> 1) & 0x07;
+  if ((block_size_code == 0) || (sample_rate_code == 0x0F) || (channel_code > MID_SIDE) || (sample_size_code == 3) ||
+      (data[3] & 0x01)) {
+    return 0;
+  }
+
+  // The frame or sample number is coded like UTF-8, using up to 7 bytes
+  size_t header_size = 5;
+  uint64_t number = data[4];
+  if (data[4] & 0x80) {
+    uint8_t leading_ones = 0;
+    while ((leading_ones < 8) && (data[4] & (0x80 >> leading_ones))) {
+      ++leading_ones;
+    }
+    if ((leading_ones < 2) || (leading_ones > 7)) {
+      // Not a valid leading byte
+      return 0;
+    }
+    if (length < 4 + leading_ones) {
+      return -1;
+    }
+    number = data[4] & (0x7F >> leading_ones);
+    for (uint8_t i = 1; i < leading_ones; ++i) {
+      const uint8_t byte = data[4 + i];
+      if ((byte & 0xC0) != 0x80) {
+        return 0;
+      }
+      number = (number << 6) | (byte & 0x3F);
+    }
+    header_size = 4 + leading_ones;
+  }
+
+  const size_t block_size_offset = header_size;
+  if (block_size_code == 6) {
+    header_size += 1;
+  } else if (block_size_code == 7) {
+    header_size += 2;
+  }
+  if (sample_rate_code == 12) {
+    header_size += 1;
+  } else if ((sample_rate_code == 13) || (sample_rate_code == 14)) {
+    header_size += 2;
+  }
+
+  if (length < header_size + 1) {
+    return -1;
+  }
+  if (crc8(data, header_size) != data[header_size]) {
+    return 0;
+  }
+
+  if (block_size_code == 1) {
+    header->block_size = 192;
+  } else if (block_size_code <= 5) {
+    header->block_size = 576 << (block_size_code - 2);
+  } else if (block_size_code == 6) {
+    header->block_size = data[block_size_offset] + 1;
+  } else if (block_size_code == 7) {
+    header->block_size = read_be16(data + block_size_offset) + 1;
+  } else {
+    header->block_size = 256 << (block_size_code - 8);
+  }
+  header->channel_assignment = channel_code;
+  header->bits_per_sample = FRAME_SAMPLE_SIZES[sample_size_code];
+  header->variable_block_size = data[1] & 0x01;
+  header->number = number;
+
+  return header_size + 1;
+}
+
+// Reads the bits of a frame most significant bit first. Reads past the end of the data return zeros and are flagged,
+// so the hot loops don't have to check the length on every read.
+class FlacBitReader {
+ public:
+  FlacBitReader(const uint8_t *data, size_t length) : data_(data), end_(data + length), length_bits_(length * 8) {}
+
+  /// @brief Reads an unsigned value of up to 32 bits
+  inline uint32_t read(uint8_t bits) {
+    if (bits == 0) {
+      return 0;
+    }
+    if (this->cache_bits_ < bits) {
+      this->refill_();
+    }
+    const uint32_t value = this->cache_ >> (64 - bits);
+    this->consume_(bits);
+    return value;
+  }
+
+  /// @brief Reads a two's complement value of up to 32 bits
+  inline int32_t read_signed(uint8_t bits) {
+    if (bits == 0) {
+      return 0;
+    }
+    return static_cast<int32_t>(this->read(bits) << (32 - bits)) >> (32 - bits);
+  }
+
+  /// @brief Reads a two's complement value of up to 33 bits, e.g., a sample of a 32 bit stream's side channel
+  inline int64_t read_signed_wide(uint8_t bits) {
+    if (bits == 0) {
+      return 0;
+    }
+    if (this->cache_bits_ < bits) {
+      this->refill_();
+    }
+    const uint64_t value = this->cache_ >> (64 - bits);
+    this->consume_(bits);
+    return static_cast<int64_t>(value << (64 - bits)) >> (64 - bits);
+  }
+
+  /// @brief Reads a unary coded value: the number of zero bits before the next one bit
+  inline uint32_t read_unary() {
+    uint32_t zeros = 0;
+    while (true) {
+      if (this->cache_bits_ < 32) {
+        this->refill_();
+      }
+      if (this->cache_ == 0) {
+        // All the cached bits are zeros; count them and continue with the next bits
+        zeros += this->cache_bits_;
+        this->consume_(this->cache_bits_);
+        if (this->overrun()) {
+          return zeros;
+        }
+        continue;
+      }
+      const uint8_t leading_zeros = __builtin_clzll(this->cache_);
+      zeros += leading_zeros;
+      this->consume_(leading_zeros + 1);
+      return zeros;
+    }
+  }
+
+  /// @brief Reads a Rice coded, zigzag mapped residual
+  inline int32_t read_rice(uint8_t parameter) {
+    const uint32_t quotient = this->read_unary();
+    const uint32_t value = (quotient << parameter) | this->read(parameter);
+    return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+  }
+
+  /// @brief Skips to the next byte boundary
+  void align() { this->read(this->bits_consumed_ % 8 ? 8 - this->bits_consumed_ % 8 : 0); }
+
+  /// @brief Bytes consumed so far, rounded up
+  size_t bytes_consumed() const { return (this->bits_consumed_ + 7) / 8; }
+
+  /// @brief Whether more bits were consumed than the data holds
+  bool overrun() const { return this->bits_consumed_ > this->length_bits_; }
+
+ protected:
+  inline void refill_() {
+    while (this->cache_bits_ <= 56) {
+      const uint64_t byte = (this->data_ < this->end_) ? *this->data_++ : 0;
+      this->cache_ |= byte << (56 - this->cache_bits_);
+      this->cache_bits_ += 8;
+    }
+  }
+
+  inline void consume_(uint8_t bits) {
+    // Shifting a 64 bit value by 64 is undefined
+    this->cache_ = (bits < 64) ? (this->cache_ << bits) : 0;
+    this->cache_bits_ -= bits;
+    this->bits_consumed_ += bits;
+  }
+
+  const uint8_t *data_;
+  const uint8_t *end_;
+  uint64_t length_bits_;
+  uint64_t cache_{0};  // Next bits to read, aligned to the most significant bit
+  uint8_t cache_bits_{0};
+  uint64_t bits_consumed_{0};
+};
+
+FlacStreamDecoder::~FlacStreamDecoder() { this->free_samples_(); }
+
+void FlacStreamDecoder::free_samples_() {
+  if (this->samples_ != nullptr) {
+    ExternalRAMAllocator<int32_t> allocator(ExternalRAMAllocator<int32_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->samples_, this->samples_length_);
+    this->samples_ = nullptr;
+  }
+  if (this->side_samples_ != nullptr) {
+    ExternalRAMAllocator<int64_t> allocator(ExternalRAMAllocator<int64_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->side_samples_, this->max_block_size_);
+    this->side_samples_ = nullptr;
+  }
+}
+
+FlacDecoderResult FlacStreamDecoder::read_header(const uint8_t *data, size_t length, size_t *bytes_consumed) {
+  size_t position = 0;
+
+  while (true) {
+    const size_t available = length - position;
+    switch (this->header_state_) {
+      case HeaderState::MARKER:
+        if (available < 4) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::NEED_MORE_DATA;
+        }
+        if (std::memcmp(data + position, "fLaC", 4) != 0) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::UNSUPPORTED;
+        }
+        position += 4;
+        this->header_state_ = HeaderState::BLOCK_HEADER;
+        break;
+      case HeaderState::BLOCK_HEADER: {
+        if (this->last_block_) {
+          this->header_state_ = HeaderState::DONE;
+          break;
+        }
+        if (available < BLOCK_HEADER_SIZE) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::NEED_MORE_DATA;
+        }
+        const uint8_t *block_header = data + position;
+        const uint8_t block_type = block_header[0] & 0x7F;
+        this->last_block_ = block_header[0] & 0x80;
+        this->block_bytes_left_ = read_be24(block_header + 1);
+        position += BLOCK_HEADER_SIZE;
+
+        if ((block_type == INVALID_BLOCK) ||
+            ((block_type == STREAMINFO_BLOCK) && (this->block_bytes_left_ < STREAMINFO_SIZE))) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::UNSUPPORTED;
+        }
+        if (block_type == STREAMINFO_BLOCK) {
+          this->header_state_ = HeaderState::STREAM_INFO;
+        } else if ((block_type == SEEKTABLE_BLOCK) && this->seek_points_.empty()) {
+          this->seek_points_total_ = this->block_bytes_left_ / SEEK_POINT_SIZE;
+          this->seek_point_index_ = 0;
+          this->seek_point_stride_ = (this->seek_points_total_ + MAX_SEEK_POINTS - 1) / MAX_SEEK_POINTS;
+          this->seek_points_done_ = false;
+          this->seek_points_.reserve(std::min<size_t>(this->seek_points_total_, MAX_SEEK_POINTS));
+          this->header_state_ = HeaderState::SEEK_TABLE;
+        } else {
+          this->header_state_ = HeaderState::SKIP_BLOCK;
+        }
+        break;
+      }
+      case HeaderState::STREAM_INFO:
+        if (available < STREAMINFO_SIZE) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::NEED_MORE_DATA;
+        }
+        if (!this->parse_stream_info_(data + position)) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::UNSUPPORTED;
+        }
+        position += STREAMINFO_SIZE;
+        this->block_bytes_left_ -= STREAMINFO_SIZE;
+        this->header_state_ = HeaderState::SKIP_BLOCK;
+        break;
+      case HeaderState::SEEK_TABLE: {
+        const size_t consumed = this->read_seek_points_(data + position, available);
+        position += consumed;
+        this->block_bytes_left_ -= consumed;
+        if (this->seek_point_index_ < this->seek_points_total_) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::NEED_MORE_DATA;
+        }
+        // Skip any bytes past the last whole point
+        this->header_state_ = HeaderState::SKIP_BLOCK;
+        break;
+      }
+      case HeaderState::SKIP_BLOCK: {
+        const size_t skipped = std::min<size_t>(this->block_bytes_left_, available);
+        position += skipped;
+        this->block_bytes_left_ -= skipped;
+        if (this->block_bytes_left_ > 0) {
+          *bytes_consumed = position;
+          return FlacDecoderResult::NEED_MORE_DATA;
+        }
+        this->header_state_ = HeaderState::BLOCK_HEADER;
+        break;
+      }
+      case HeaderState::DONE:
+        *bytes_consumed = position;
+        return this->stream_info_read_ ? FlacDecoderResult::SUCCESS : FlacDecoderResult::UNSUPPORTED;
+    }
+  }
+}
+
+bool FlacStreamDecoder::parse_stream_info_(const uint8_t *block) {
+  this->min_block_size_ = read_be16(block);
+  this->max_block_size_ = read_be16(block + 2);
+  this->max_frame_size_ = read_be24(block + 7);
+  this->sample_rate_ = (block[10] << 12) | (block[11] << 4) | (block[12] >> 4);
+  this->channels_ = ((block[12] >> 1) & 0x07) + 1;
+  this->bits_per_sample_ = (((block[12] & 0x01) << 4) | (block[13] >> 4)) + 1;
+  // The total number of samples is the 36 bits after the sample rate, channels, and bits per sample
+  this->total_samples_ = (static_cast<uint64_t>(block[13] & 0x0F) << 32) | read_be32(block + 14);
+
+  if ((this->max_block_size_ < MIN_BLOCK_SIZE) || (this->sample_rate_ == 0) || (this->bits_per_sample_ < 4)) {
+    return false;
+  }
+
+  if (this->bits_per_sample_ <= 16) {
+    this->output_bytes_per_sample_ = 2;
+  } else if (this->bits_per_sample_ <= 24) {
+    this->output_bytes_per_sample_ = 3;
+  } else {
+    this->output_bytes_per_sample_ = 4;
+  }
+
+  this->free_samples_();
+  ExternalRAMAllocator<int32_t> allocator(ExternalRAMAllocator<int32_t>::ALLOW_FAILURE);
+  this->samples_length_ = static_cast<size_t>(this->max_block_size_) * this->channels_;
+  this->samples_ = allocator.allocate(this->samples_length_);
+  if (this->samples_ == nullptr) {
+    return false;
+  }
+  if ((this->bits_per_sample_ == 32) && (this->channels_ == 2)) {
+    ExternalRAMAllocator<int64_t> side_allocator(ExternalRAMAllocator<int64_t>::ALLOW_FAILURE);
+    this->side_samples_ = side_allocator.allocate(this->max_block_size_);
+    if (this->side_samples_ == nullptr) {
+      return false;
+    }
+  }
+
+  this->stream_info_read_ = true;
+  return true;
+}
+
+size_t FlacStreamDecoder::read_seek_points_(const uint8_t *data, size_t length) {
+  size_t position = 0;
+  while ((this->seek_point_index_ < this->seek_points_total_) && (position + SEEK_POINT_SIZE <= length)) {
+    if (!this->seek_points_done_ && (this->seek_point_index_ % this->seek_point_stride_ == 0)) {
+      const uint64_t sample = read_be64(data + position);
+      const uint64_t offset = read_be64(data + position + 8);
+      if ((sample == PLACEHOLDER_SEEK_POINT) || (sample > UINT32_MAX) || (offset > UINT32_MAX)) {
+        // Placeholders are always at the end of the table
+        this->seek_points_done_ = true;
+      } else {
+        this->seek_points_.push_back({static_cast<uint32_t>(sample), static_cast<uint32_t>(offset)});
+      }
+    }
+    ++this->seek_point_index_;
+    position += SEEK_POINT_SIZE;
+  }
+  return position;
+}
+
+int32_t FlacStreamDecoder::find_frame_header(const uint8_t *data, size_t length) {
+  FrameHeader header;
+  for (size_t i = 0; i + MAX_FRAME_HEADER_SIZE <= length; ++i) {
+    if ((data[i] == 0xFF) && (parse_frame_header(data + i, length - i, &header) > 0)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+FlacDecoderResult FlacStreamDecoder::decode_frame(const uint8_t *data, size_t length, uint8_t *output,
+                                                  size_t *bytes_consumed, uint32_t *frames) {
+  *bytes_consumed = 0;
+  *frames = 0;
+
+  FrameHeader header;
+  const int32_t header_size = parse_frame_header(data, length, &header);
+  if (header_size < 0) {
+    return FlacDecoderResult::NEED_MORE_DATA;
+  }
+
+  const uint8_t channels = (header.channel_assignment < LEFT_SIDE) ? header.channel_assignment + 1 : 2;
+  if ((header_size == 0) || (header.block_size > this->max_block_size_) || (channels != this->channels_) ||
+      ((header.bits_per_sample != 0) && (header.bits_per_sample != this->bits_per_sample_))) {
+    *bytes_consumed = 1;
+    return FlacDecoderResult::CORRUPTED;
+  }
+  const uint32_t block_size = header.block_size;
+  FlacBitReader reader(data + header_size, length - header_size);
+  bool valid = true;
+  for (uint8_t channel = 0; (channel < channels) && valid; ++channel) {
+    uint8_t bits_per_sample = this->bits_per_sample_;
+    if (((header.channel_assignment == LEFT_SIDE) && (channel == 1)) ||
+        ((header.channel_assignment == SIDE_RIGHT) && (channel == 0)) ||
+        ((header.channel_assignment == MID_SIDE) && (channel == 1))) {
+      ++bits_per_sample;
+    }
+    int32_t *samples = this->samples_ + channel * this->max_block_size_;
+    if (bits_per_sample > 32) {
+      // A 32 bit stream's side channel; its int32 samples hold the residuals
+      valid = this->decode_wide_subframe_(reader, samples, this->side_samples_, block_size, bits_per_sample);
+    } else {
+      valid = this->decode_subframe_(reader, samples, block_size, bits_per_sample);
+    }
+  }
+  if (!valid && !reader.overrun()) {
+    *bytes_consumed = 1;
+    return FlacDecoderResult::CORRUPTED;
+  }
+  reader.align();
+
+  const size_t frame_size = header_size + reader.bytes_consumed() + FRAME_FOOTER_SIZE;
+  if (reader.overrun() || (frame_size > length)) {
+    // Either the frame isn't whole yet, or it is corrupted and its bits claim more data than any frame has
+    size_t max_frame_size = this->max_frame_size_;
+    if (max_frame_size == 0) {
+      // A verbatim subframe of the side channel is the largest an encoder writes
+      const size_t max_subframe_size =
+          1 + (static_cast<size_t>(this->max_block_size_) * (this->bits_per_sample_ + 1) + 7) / 8;
+      max_frame_size = MAX_FRAME_HEADER_SIZE + channels * max_subframe_size + FRAME_FOOTER_SIZE;
+    }
+    if (length < max_frame_size) {
+      return FlacDecoderResult::NEED_MORE_DATA;
+    }
+    *bytes_consumed = 1;
+    return FlacDecoderResult::CORRUPTED;
+  }
+  if (crc16(data, frame_size) != 0) {
+    // The CRC-16 over the frame and its stored CRC-16 is 0 if they match
+    *bytes_consumed = 1;
+    return FlacDecoderResult::CORRUPTED;
+  }
+
+  // Unsigned arithmetic wraps where the samples of a corrupted frame, rejected by its CRC-16 above, would overflow
+  uint32_t *first = reinterpret_cast<uint32_t *>(this->samples_);
+  uint32_t *second = first + this->max_block_size_;
+  const int64_t *side = this->side_samples_;
+  if (this->bits_per_sample_ == 32) {
+    // The side channel is in side_samples_, and each result fits in 32 bits again
+    switch (header.channel_assignment) {
+      case LEFT_SIDE:
+        for (uint32_t i = 0; i < block_size; ++i) {
+          second[i] = static_cast<uint32_t>(static_cast<int32_t>(first[i]) - side[i]);
+        }
+        break;
+      case SIDE_RIGHT:
+        for (uint32_t i = 0; i < block_size; ++i) {
+          first[i] = static_cast<uint32_t>(side[i] + static_cast<int32_t>(second[i]));
+        }
+        break;
+      case MID_SIDE:
+        for (uint32_t i = 0; i < block_size; ++i) {
+          const int64_t mid = (static_cast<int64_t>(static_cast<int32_t>(first[i])) * 2) | (side[i] & 1);
+          first[i] = static_cast<uint32_t>((mid + side[i]) >> 1);
+          second[i] = static_cast<uint32_t>((mid - side[i]) >> 1);
+        }
+        break;
+      default:
+        break;
+    }
+  } else {
+    switch (header.channel_assignment) {
+      case LEFT_SIDE:
+        for (uint32_t i = 0; i < block_size; ++i) {
+          second[i] = first[i] - second[i];
+        }
+        break;
+      case SIDE_RIGHT:
+        for (uint32_t i = 0; i < block_size; ++i) {
+          first[i] += second[i];
+        }
+        break;
+      case MID_SIDE:
+        if (this->bits_per_sample_ <= 30) {
+          for (uint32_t i = 0; i < block_size; ++i) {
+            const uint32_t side = second[i];
+            const uint32_t mid = (first[i] << 1) | (side & 1);
+            first[i] = static_cast<int32_t>(mid + side) >> 1;
+            second[i] = static_cast<int32_t>(mid - side) >> 1;
+          }
+        } else {
+          for (uint32_t i = 0; i < block_size; ++i) {
+            const int64_t side = static_cast<int32_t>(second[i]);
+            const int64_t mid = (static_cast<int64_t>(static_cast<int32_t>(first[i])) * 2) | (side & 1);
+            first[i] = static_cast<uint32_t>((mid + side) >> 1);
+            second[i] = static_cast<uint32_t>((mid - side) >> 1);
+          }
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // Interleave the channels, placing the samples in the upper bits of their containers
+  const uint8_t shift = this->output_bytes_per_sample_ * 8 - this->bits_per_sample_;
+  if (this->output_bytes_per_sample_ == 2) {
+    int16_t *output_samples = reinterpret_cast<int16_t *>(output);
+    for (uint8_t channel = 0; channel < channels; ++channel) {
+      const int32_t *samples = this->samples_ + channel * this->max_block_size_;
+      for (uint32_t i = 0; i < block_size; ++i) {
+        output_samples[i * channels + channel] = static_cast<int16_t>(static_cast<uint32_t>(samples[i]) << shift);
+      }
+    }
+  } else if (this->output_bytes_per_sample_ == 3) {
+    for (uint8_t channel = 0; channel < channels; ++channel) {
+      const int32_t *samples = this->samples_ + channel * this->max_block_size_;
+      uint8_t *sample_output = output + channel * 3;
+      for (uint32_t i = 0; i < block_size; ++i) {
+        const uint32_t sample = static_cast<uint32_t>(samples[i]) << shift;
+        sample_output[0] = sample;
+        sample_output[1] = sample >> 8;
+        sample_output[2] = sample >> 16;
+        sample_output += channels * 3;
+      }
+    }
+  } else {
+    int32_t *output_samples = reinterpret_cast<int32_t *>(output);
+    for (uint8_t channel = 0; channel < channels; ++channel) {
+      const int32_t *samples = this->samples_ + channel * this->max_block_size_;
+      for (uint32_t i = 0; i < block_size; ++i) {
+        output_samples[i * channels + channel] = static_cast<int32_t>(static_cast<uint32_t>(samples[i]) << shift);
+      }
+    }
+  }
+
+  *bytes_consumed = frame_size;
+  *frames = block_size;
+
+  if (this->total_samples_ > 0) {
+    // A fixed block size stream numbers its frames, a variable one its samples
+    const uint64_t first_sample = header.variable_block_size ? header.number : header.number * this->max_block_size_;
+    if (first_sample + block_size >= this->total_samples_) {
+      return FlacDecoderResult::END_OF_STREAM;
+    }
+  }
+
+  return FlacDecoderResult::SUCCESS;
+}
+
+bool FlacStreamDecoder::decode_subframe_(FlacBitReader &reader, int32_t *samples, uint32_t block_size,
+                                         uint8_t bits_per_sample) {
+  const uint32_t subframe_header = reader.read(8);
+  if (subframe_header & 0x80) {
+    // The padding bit has to be zero
+    return false;
+  }
+  const uint8_t type = (subframe_header >> 1) & 0x3F;
+
+  uint8_t wasted_bits = 0;
+  if (subframe_header & 0x01) {
+    wasted_bits = reader.read_unary() + 1;
+    if (wasted_bits >= bits_per_sample) {
+      return false;
+    }
+    bits_per_sample -= wasted_bits;
+  }
+
+  if (type == 0) {
+    // Constant
+    std::fill(samples, samples + block_size, reader.read_signed(bits_per_sample));
+  } else if (type == 1) {
+    // Verbatim
+    for (uint32_t i = 0; i < block_size; ++i) {
+      samples[i] = reader.read_signed(bits_per_sample);
+    }
+  } else if ((type >= 8) && (type <= 8 + MAX_FIXED_ORDER)) {
+    const uint8_t order = type - 8;
+    if (order > block_size) {
+      return false;
+    }
+    for (uint8_t i = 0; i < order; ++i) {
+      samples[i] = reader.read_signed(bits_per_sample);
+    }
+    if (!this->decode_residual_(reader, samples, block_size, order)) {
+      return false;
+    }
+
+    // The fixed predictors' coefficients sum to at most 16 times a sample. Unsigned arithmetic wraps where a corrupted
+    // frame's samples would overflow.
+    if (bits_per_sample + 4 <= 32) {
+      uint32_t *values = reinterpret_cast<uint32_t *>(samples);
+      switch (order) {
+        case 1:
+          for (uint32_t i = 1; i < block_size; ++i) {
+            values[i] += values[i - 1];
+          }
+          break;
+        case 2:
+          for (uint32_t i = 2; i < block_size; ++i) {
+            values[i] += 2 * values[i - 1] - values[i - 2];
+          }
+          break;
+        case 3:
+          for (uint32_t i = 3; i < block_size; ++i) {
+            values[i] += 3 * (values[i - 1] - values[i - 2]) + values[i - 3];
+          }
+          break;
+        case 4:
+          for (uint32_t i = 4; i < block_size; ++i) {
+            values[i] += 4 * (values[i - 1] + values[i - 3]) - 6 * values[i - 2] - values[i - 4];
+          }
+          break;
+        default:
+          break;
+      }
+    } else {
+      static const int8_t FIXED_COEFFICIENTS[MAX_FIXED_ORDER + 1][MAX_FIXED_ORDER] = {
+          {0, 0, 0, 0}, {1, 0, 0, 0}, {2, -1, 0, 0}, {3, -3, 1, 0}, {4, -6, 4, -1}};
+      for (uint32_t i = order; i < block_size; ++i) {
+        int64_t prediction = 0;
+        for (uint8_t j = 0; j < order; ++j) {
+          prediction += static_cast<int64_t>(FIXED_COEFFICIENTS[order][j]) * samples[i - 1 - j];
+        }
+        samples[i] = static_cast<int32_t>(samples[i] + prediction);
+      }
+    }
+  } else if (type >= 32) {
+    // Linear prediction
+    const uint8_t order = (type & 0x1F) + 1;
+    if (order > block_size) {
+      return false;
+    }
+    for (uint8_t i = 0; i < order; ++i) {
+      samples[i] = reader.read_signed(bits_per_sample);
+    }
+    const uint8_t precision = reader.read(4) + 1;
+    const int32_t shift = reader.read_signed(5);
+    if ((precision == 16) || (shift < 0)) {
+      return false;
+    }
+    int32_t coefficients[MAX_LPC_ORDER];
+    for (uint8_t i = 0; i < order; ++i) {
+      coefficients[i] = reader.read_signed(precision);
+    }
+    if (!this->decode_residual_(reader, samples, block_size, order)) {
+      return false;
+    }
+
+    // Accumulate in 32 bits if the sum of the products can't overflow
+    const uint8_t order_bits = 32 - __builtin_clz(order);
+    if (bits_per_sample + precision + order_bits <= 32) {
+      // Unsigned arithmetic wraps where a corrupted frame's samples would overflow
+      uint32_t *values = reinterpret_cast<uint32_t *>(samples);
+      for (uint32_t i = order; i < block_size; ++i) {
+        const uint32_t *history = values + i - 1;
+        uint32_t prediction = 0;
+        for (uint8_t j = 0; j < order; ++j) {
+          prediction += static_cast<uint32_t>(coefficients[j]) * history[-j];
+        }
+        values[i] += static_cast<int32_t>(prediction) >> shift;
+      }
+    } else {
+      for (uint32_t i = order; i < block_size; ++i) {
+        const int32_t *history = samples + i - 1;
+        int64_t prediction = 0;
+        for (uint8_t j = 0; j < order; ++j) {
+          prediction += static_cast<int64_t>(coefficients[j]) * history[-j];
+        }
+        samples[i] = static_cast<int32_t>(samples[i] + (prediction >> shift));
+      }
+    }
+  } else {
+    // Reserved subframe type
+    return false;
+  }
+
+  if (reader.overrun()) {
+    return false;
+  }
+
+  if (wasted_bits > 0) {
+    for (uint32_t i = 0; i < block_size; ++i) {
+      samples[i] = static_cast<int32_t>(static_cast<uint32_t>(samples[i]) << wasted_bits);
+    }
+  }
+
+  return true;
+}
+
+bool FlacStreamDecoder::decode_wide_subframe_(FlacBitReader &reader, int32_t *residuals, int64_t *samples,
+                                              uint32_t block_size, uint8_t bits_per_sample) {
+  const uint32_t subframe_header = reader.read(8);
+  if (subframe_header & 0x80) {
+    // The padding bit has to be zero
+    return false;
+  }
+  const uint8_t type = (subframe_header >> 1) & 0x3F;
+
+  uint8_t wasted_bits = 0;
+  if (subframe_header & 0x01) {
+    wasted_bits = reader.read_unary() + 1;
+    if (wasted_bits >= bits_per_sample) {
+      return false;
+    }
+    bits_per_sample -= wasted_bits;
+  }
+
+  if (type == 0) {
+    // Constant
+    std::fill(samples, samples + block_size, reader.read_signed_wide(bits_per_sample));
+  } else if (type == 1) {
+    // Verbatim
+    for (uint32_t i = 0; i < block_size; ++i) {
+      samples[i] = reader.read_signed_wide(bits_per_sample);
+    }
+  } else if ((type >= 8) && (type <= 8 + MAX_FIXED_ORDER)) {
+    const uint8_t order = type - 8;
+    if (order > block_size) {
+      return false;
+    }
+    for (uint8_t i = 0; i < order; ++i) {
+      samples[i] = reader.read_signed_wide(bits_per_sample);
+    }
+    if (!this->decode_residual_(reader, residuals, block_size, order)) {
+      return false;
+    }
+    static const int8_t FIXED_COEFFICIENTS[MAX_FIXED_ORDER + 1][MAX_FIXED_ORDER] = {
+        {0, 0, 0, 0}, {1, 0, 0, 0}, {2, -1, 0, 0}, {3, -3, 1, 0}, {4, -6, 4, -1}};
+    for (uint32_t i = order; i < block_size; ++i) {
+      int64_t prediction = 0;
+      for (uint8_t j = 0; j < order; ++j) {
+        prediction += FIXED_COEFFICIENTS[order][j] * samples[i - 1 - j];
+      }
+      samples[i] = residuals[i] + prediction;
+    }
+  } else if (type >= 32) {
+    // Linear prediction
+    const uint8_t order = (type & 0x1F) + 1;
+    if (order > block_size) {
+      return false;
+    }
+    for (uint8_t i = 0; i < order; ++i) {
+      samples[i] = reader.read_signed_wide(bits_per_sample);
+    }
+    const uint8_t precision = reader.read(4) + 1;
+    const int32_t shift = reader.read_signed(5);
+    if ((precision == 16) || (shift < 0)) {
+      return false;
+    }
+    int32_t coefficients[MAX_LPC_ORDER];
+    for (uint8_t i = 0; i < order; ++i) {
+      coefficients[i] = reader.read_signed(precision);
+    }
+    if (!this->decode_residual_(reader, residuals, block_size, order)) {
+      return false;
+    }
+
+    // 33 bit samples times 15 bit coefficients, summed over at most 32 of them, fit in 64 bits
+    for (uint32_t i = order; i < block_size; ++i) {
+      const int64_t *history = samples + i - 1;
+      int64_t prediction = 0;
+      for (uint8_t j = 0; j < order; ++j) {
+        prediction += coefficients[j] * history[-j];
+      }
+      samples[i] = residuals[i] + (prediction >> shift);
+    }
+  } else {
+    // Reserved subframe type
+    return false;
+  }
+
+  if (reader.overrun()) {
+    return false;
+  }
+
+  if (wasted_bits > 0) {
+    for (uint32_t i = 0; i < block_size; ++i) {
+      samples[i] = static_cast<int64_t>(static_cast<uint64_t>(samples[i]) << wasted_bits);
+    }
+  }
+
+  return true;
+}
+
+bool FlacStreamDecoder::decode_residual_(FlacBitReader &reader, int32_t *samples, uint32_t block_size,
+                                         uint8_t order) {
+  const uint32_t method = reader.read(2);
+  if (method > 1) {
+    return false;
+  }
+  const uint8_t parameter_bits = (method == 0) ? 4 : 5;
+  const uint32_t escape_parameter = (1 << parameter_bits) - 1;
+
+  const uint8_t partition_order = reader.read(4);
+  const uint32_t partition_size = block_size >> partition_order;
+  if (((partition_size << partition_order) != block_size) || (partition_size < order)) {
+    return false;
+  }
+
+  uint32_t sample = order;
+  for (uint32_t partition = 0; partition < (1u << partition_order); ++partition) {
+    const uint32_t end = (partition + 1) * partition_size;
+    const uint32_t parameter = reader.read(parameter_bits);
+    if (parameter == escape_parameter) {
+      // Unencoded residuals of a fixed width
+      const uint8_t bits = reader.read(5);
+      for (; sample < end; ++sample) {
+        samples[sample] = reader.read_signed(bits);
+      }
+    } else {
+      for (; sample < end; ++sample) {
+        samples[sample] = reader.read_rice(parameter);
+      }
+    }
+    if (reader.overrun()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
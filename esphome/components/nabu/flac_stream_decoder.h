@@ -0,0 +1,136 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+enum class FlacDecoderResult : uint8_t {
+  SUCCESS,         // The header was read or a frame was decoded
+  END_OF_STREAM,   // The last frame of a stream of known length was decoded
+  NEED_MORE_DATA,  // The next metadata block or frame isn't whole in the input yet
+  CORRUPTED,       // The frame failed its checks; continue at the next frame header
+  UNSUPPORTED,     // Not a FLAC stream, or a stream this decoder can't handle
+};
+
+class FlacBitReader;
+
+struct FlacSeekPoint {
+  uint32_t sample;  // First sample of the target frame
+  uint32_t offset;  // Offset of the target frame from the first frame
+};
+
+// Decodes a FLAC stream read front to back into interleaved little endian PCM audio.
+//  - Samples of up to 16 bits are output as 16 bit samples, up to 24 bits as 24 bit (3 byte) samples, and deeper ones
+//    as 32 bit samples. Narrower samples than their container are placed in the upper bits.
+//  - The STREAMINFO and SEEKTABLE metadata blocks are read as they stream by; the other blocks (e.g., pictures) are
+//    skipped without having to be whole in the input
+//  - Frames are decoded from the caller's input in place, so each frame has to be whole in it. The header and the
+//    frame's CRC-16 are checked, so a seek into the middle of a frame is detected.
+//  - The side channel of a 32 bit stereo frame needs 33 bits, so it is decoded into a separate int64 buffer
+class FlacStreamDecoder {
+ public:
+  ~FlacStreamDecoder();
+
+  /// @brief Consumes the "fLaC" marker and the metadata blocks
+  /// @param data Next unread byte of the stream
+  /// @param length Bytes available at data
+  /// @param bytes_consumed Set to the bytes consumed; they may be discarded even if more data is needed
+  /// @return SUCCESS once the last metadata block is read, NEED_MORE_DATA if it isn't yet, or UNSUPPORTED
+  FlacDecoderResult read_header(const uint8_t *data, size_t length, size_t *bytes_consumed);
+
+  /// @brief Decodes the frame at the start of the input. Only call once the header is read.
+  /// @param data Start of the frame
+  /// @param length Bytes available at data
+  /// @param output Where the frame's interleaved samples are written; must hold get_max_output_bytes()
+  /// @param bytes_consumed Set to the frame's size if it was decoded, to 1 if it is corrupted, or else to 0
+  /// @param frames Set to the number of frames (samples per channel) written
+  /// @return SUCCESS, END_OF_STREAM, NEED_MORE_DATA, CORRUPTED, or UNSUPPORTED
+  FlacDecoderResult decode_frame(const uint8_t *data, size_t length, uint8_t *output, size_t *bytes_consumed,
+                                 uint32_t *frames);
+
+  /// @brief Finds the next frame header by its sync code, checking the reserved bits and the header's CRC-8 so audio
+  /// data that happens to look like a sync code is skipped
+  /// @return offset of the frame header, or -1 if there is none with a complete header in the data
+  static int32_t find_frame_header(const uint8_t *data, size_t length);
+
+  uint32_t get_sample_rate() const { return this->sample_rate_; }
+  uint8_t get_channels() const { return this->channels_; }
+  uint8_t get_bits_per_sample() const { return this->bits_per_sample_; }
+  /// @brief Bits per sample of the output: 16, 24, or 32
+  uint8_t get_output_bits_per_sample() const { return this->output_bytes_per_sample_ * 8; }
+  uint64_t get_total_samples() const { return this->total_samples_; }
+  /// @brief Largest number of bytes a single frame is decoded into
+  size_t get_max_output_bytes() const {
+    return static_cast<size_t>(this->max_block_size_) * this->channels_ * this->output_bytes_per_sample_;
+  }
+  /// @brief The SEEKTABLE's points, thinned out to at most 256
+  const std::vector<FlacSeekPoint> &get_seek_points() const { return this->seek_points_; }
+
+ protected:
+  /// @brief Reads the STREAMINFO block's fields and allocates the sample buffer
+  bool parse_stream_info_(const uint8_t *block);
+
+  /// @brief Stores the seek points that are whole in the input
+  /// @return bytes consumed
+  size_t read_seek_points_(const uint8_t *data, size_t length);
+
+  /// @brief Decodes one channel's subframe into samples
+  /// @return false if the subframe is invalid
+  bool decode_subframe_(FlacBitReader &reader, int32_t *samples, uint32_t block_size, uint8_t bits_per_sample);
+
+  /// @brief Decodes the 33 bit side channel of a 32 bit stereo stream's subframe into samples
+  /// @param residuals Channel's int32 sample area, used for the residuals
+  /// @return false if the subframe is invalid
+  bool decode_wide_subframe_(FlacBitReader &reader, int32_t *residuals, int64_t *samples, uint32_t block_size,
+                             uint8_t bits_per_sample);
+
+  /// @brief Decodes the residual into samples, after the predictor's warm up samples
+  /// @return false if the residual is invalid
+  bool decode_residual_(FlacBitReader &reader, int32_t *samples, uint32_t block_size, uint8_t order);
+
+  void free_samples_();
+
+  enum class HeaderState : uint8_t {
+    MARKER,
+    BLOCK_HEADER,
+    STREAM_INFO,
+    SEEK_TABLE,
+    SKIP_BLOCK,
+    DONE,
+  };
+  HeaderState header_state_{HeaderState::MARKER};
+  bool last_block_{false};
+  uint32_t block_bytes_left_{0};  // Of the metadata block being read or skipped
+  bool stream_info_read_{false};
+
+  uint32_t seek_points_total_{0};
+  uint32_t seek_point_index_{0};
+  uint32_t seek_point_stride_{1};
+  bool seek_points_done_{false};  // A placeholder point was reached
+  std::vector<FlacSeekPoint> seek_points_;
+
+  uint32_t sample_rate_{0};
+  uint8_t channels_{0};
+  uint8_t bits_per_sample_{0};
+  uint8_t output_bytes_per_sample_{2};
+  uint16_t min_block_size_{0};
+  uint16_t max_block_size_{0};
+  uint32_t max_frame_size_{0};  // Bytes, 0 if unknown
+  uint64_t total_samples_{0};   // 0 if unknown
+
+  // Each channel's decoded samples of the current frame, max_block_size_ apart
+  int32_t *samples_{nullptr};
+  size_t samples_length_{0};
+  // A 32 bit stereo stream's side channel of the current frame, which needs 33 bits; nullptr for other streams
+  int64_t *side_samples_{nullptr};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,120 @@
+#ifdef USE_ESP_IDF
+
+#include "http_connection_pool.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+
+namespace esphome {
+namespace nabu {
+
+// Each TLS connection keeps its session buffers, so only keep a connection for the media and the announcement host
+static const size_t MAX_IDLE_CONNECTIONS = 2;
+
+// Well below the keep-alive timeout of common servers (e.g., 75 s for Home Assistant), so a reused connection is
+// rarely closed by the server already
+static const uint32_t IDLE_TIMEOUT_MS = 30000;
+
+// Returns "scheme://host:port" in lower case, the part of a url that decides whether a connection can be reused
+static std::string url_origin(const std::string &url) {
+  size_t scheme_end = url.find("://");
+  size_t host_start = (scheme_end == std::string::npos) ? 0 : scheme_end + 3;
+  size_t host_end = url.find_first_of("/?#", host_start);
+  return str_lower_case(url.substr(0, host_end));
+}
+
+HttpConnectionPool::HttpConnectionPool() { this->lock_ = xSemaphoreCreateMutex(); }
+
+HttpConnectionPool::~HttpConnectionPool() {
+  for (const auto &connection : this->idle_connections_) {
+    close_(connection.client);
+  }
+  vSemaphoreDelete(this->lock_);
+}
+
+esp_http_client_handle_t HttpConnectionPool::take(const std::string &url) {
+  const std::string origin = url_origin(url);
+  esp_http_client_handle_t client = nullptr;
+
+  xSemaphoreTake(this->lock_, portMAX_DELAY);
+  for (auto it = this->idle_connections_.begin(); it != this->idle_connections_.end(); ++it) {
+    if (it->origin == origin) {
+      client = it->client;
+      this->idle_connections_.erase(it);
+      break;
+    }
+  }
+  xSemaphoreGive(this->lock_);
+
+  return client;
+}
+
+void HttpConnectionPool::give_back(esp_http_client_handle_t client) {
+  if (client == nullptr) {
+    return;
+  }
+
+  if (!esp_http_client_is_complete_data_received(client)) {
+    // The rest of the response is still on the connection
+    close_(client);
+    return;
+  }
+
+  // Key it by the url it ended up at, in case it was redirected to another host
+  char url[500];
+  if (esp_http_client_get_url(client, url, sizeof(url)) != ESP_OK) {
+    close_(client);
+    return;
+  }
+
+  IdleConnection connection;
+  connection.client = client;
+  connection.origin = url_origin(url);
+  connection.idle_since = millis();
+
+  esp_http_client_handle_t evicted = nullptr;
+
+  xSemaphoreTake(this->lock_, portMAX_DELAY);
+  if (this->idle_connections_.size() >= MAX_IDLE_CONNECTIONS) {
+    // Evict the connection that has been idle the longest
+    evicted = this->idle_connections_.front().client;
+    this->idle_connections_.erase(this->idle_connections_.begin());
+  }
+  this->idle_connections_.push_back(connection);
+  xSemaphoreGive(this->lock_);
+
+  if (evicted != nullptr) {
+    close_(evicted);
+  }
+}
+
+void HttpConnectionPool::close_expired() {
+  const uint32_t now = millis();
+  std::vector<esp_http_client_handle_t> expired;
+
+  xSemaphoreTake(this->lock_, portMAX_DELAY);
+  for (auto it = this->idle_connections_.begin(); it != this->idle_connections_.end();) {
+    if (now - it->idle_since >= IDLE_TIMEOUT_MS) {
+      expired.push_back(it->client);
+      it = this->idle_connections_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  xSemaphoreGive(this->lock_);
+
+  // Closing a TLS connection may block briefly, so do it outside the lock
+  for (esp_http_client_handle_t client : expired) {
+    close_(client);
+  }
+}
+
+void HttpConnectionPool::close_(esp_http_client_handle_t client) {
+  esp_http_client_close(client);
+  esp_http_client_cleanup(client);
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <esp_http_client.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+
+// Keeps idle keep-alive HTTP(S) connections so the next stream from the same host (e.g., the next TTS reply from Home
+// Assistant) skips DNS, TCP, and the TLS handshake
+//  - A reader takes an idle client for the url's origin (scheme, host, and port) and points it at the new url. The
+//    esp_http_client keeps the socket open as long as the origin matches.
+//  - Only clients whose response was read completely can be reused; anything else is closed
+//  - At most a few connections are kept, each for a limited time, as every TLS session holds tens of KiB
+//  - Shared by the readers of all pipelines, so a mutex guards the idle list
+class HttpConnectionPool {
+ public:
+  HttpConnectionPool();
+  ~HttpConnectionPool();
+
+  /// @brief Takes an idle connection to the url's origin
+  /// @return the client if one is idle, nullptr otherwise
+  esp_http_client_handle_t take(const std::string &url);
+
+  /// @brief Returns a client once the reader is done with it. Keeps it for reuse if its response was read completely,
+  /// closes it otherwise.
+  void give_back(esp_http_client_handle_t client);
+
+  /// @brief Closes idle connections that haven't been reused for a while. Call it periodically.
+  void close_expired();
+
+  /// @brief Records the time from starting a connection to its first byte of audio. Safe to call from any task.
+  void record_first_byte_time(uint32_t first_byte_time_ms) { this->first_byte_time_ms_.store(first_byte_time_ms); }
+
+  /// @brief Time from starting the most recent stream's connection to its first byte of audio, 0 if none yet
+  uint32_t get_first_byte_time_ms() const { return this->first_byte_time_ms_.load(); }
+
+ protected:
+  struct IdleConnection {
+    esp_http_client_handle_t client;
+    std::string origin;
+    uint32_t idle_since;
+  };
+
+  static void close_(esp_http_client_handle_t client);
+
+  SemaphoreHandle_t lock_;
+  std::vector<IdleConnection> idle_connections_;
+
+  std::atomic<uint32_t> first_byte_time_ms_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
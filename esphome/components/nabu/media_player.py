@@ -6,7 +6,7 @@ from pathlib import Path
 
 from esphome import automation, external_files
 import esphome.codegen as cg
-from esphome.components import audio_dac, media_player, speaker
+from esphome.components import audio_dac, esp32, media_player, sensor, speaker
 from esphome.components.media_player import MEDIA_FILE_TYPE_ENUM, MediaFile
 import esphome.config_validation as cv
 from esphome.const import (
@@ -15,18 +15,25 @@ from esphome.const import (
     CONF_FILES,
     CONF_ID,
     CONF_PATH,
+    CONF_POSITION,
     CONF_RAW_DATA_ID,
     CONF_SAMPLE_RATE,
     CONF_SPEAKER,
     CONF_TYPE,
+    CONF_UPDATE_INTERVAL,
     CONF_URL,
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
+    UNIT_MILLISECOND,
+    UNIT_PERCENT,
 )
 from esphome.core import CORE, HexInt
 from esphome.external_files import download_content
 
 _LOGGER = logging.getLogger(__name__)
 
-AUTO_LOAD = ["audio"]
+AUTO_LOAD = ["audio", "sensor"]
 
 CODEOWNERS = ["@synesthesiam", "@kahrendt"]
 DEPENDENCIES = ["media_player"]
@@ -39,11 +46,39 @@ CONF_DECIBEL_REDUCTION = "decibel_reduction"
 
 CONF_AUDIO_DAC = "audio_dac"
 CONF_ANNOUNCEMENT = "announcement"
+CONF_CACHE = "cache"
 CONF_MEDIA_FILE = "media_file"
+CONF_PRIORITY = "priority"
 CONF_VOLUME_INCREMENT = "volume_increment"
 CONF_VOLUME_MIN = "volume_min"
 CONF_VOLUME_MAX = "volume_max"
 
+CONF_DIAGNOSTICS = "diagnostics"
+CONF_READER = "reader"
+CONF_DECODER = "decoder"
+CONF_RESAMPLER = "resampler"
+CONF_MIXER = "mixer"
+CONF_THROUGHPUT = "throughput"
+CONF_INPUT_STALL = "input_stall"
+CONF_OUTPUT_STALL = "output_stall"
+CONF_INPUT_BUFFER_MIN_FILL = "input_buffer_min_fill"
+CONF_INPUT_BUFFER_MAX_FILL = "input_buffer_max_fill"
+CONF_INPUT_BUFFER_SIZE = "input_buffer_size"
+CONF_UNDERRUNS = "underruns"
+CONF_BUFFER_MEMORY = "buffer_memory"
+CONF_BUFFER_MEMORY_PEAK = "buffer_memory_peak"
+CONF_FIRST_BYTE_TIME = "first_byte_time"
+CONF_ANNOUNCEMENT_CACHE_HITS = "announcement_cache_hits"
+CONF_ANNOUNCEMENT_CACHE_MISSES = "announcement_cache_misses"
+CONF_ANNOUNCEMENT_CACHE_SIZE = "announcement_cache_size"
+CONF_FILE_CACHE_SIZE = "file_cache_size"
+CONF_STREAM_BUFFER_MAX_SIZE = "stream_buffer_max_size"
+CONF_MEDIA_PREBUFFER = "media_prebuffer"
+CONF_ANNOUNCEMENT_PREBUFFER = "announcement_prebuffer"
+
+UNIT_BYTES = "B"
+UNIT_BYTES_PER_SECOND = "B/s"
+
 CONF_ON_MUTE = "on_mute"
 CONF_ON_UNMUTE = "on_unmute"
 CONF_ON_VOLUME = "on_volume"
@@ -57,12 +92,40 @@ NabuMediaPlayer = nabu_ns.class_(
     cg.Component,
 )
 
+DiagnosticStage = nabu_ns.enum("DiagnosticStage", is_class=True)
+DIAGNOSTIC_STAGES = {
+    CONF_READER: DiagnosticStage.READER,
+    CONF_DECODER: DiagnosticStage.DECODER,
+    CONF_RESAMPLER: DiagnosticStage.RESAMPLER,
+    CONF_MIXER: DiagnosticStage.MIXER,
+}
+
+DiagnosticMetric = nabu_ns.enum("DiagnosticMetric", is_class=True)
+DIAGNOSTIC_METRICS = {
+    CONF_THROUGHPUT: DiagnosticMetric.THROUGHPUT,
+    CONF_INPUT_STALL: DiagnosticMetric.INPUT_STALL,
+    CONF_OUTPUT_STALL: DiagnosticMetric.OUTPUT_STALL,
+    CONF_INPUT_BUFFER_MIN_FILL: DiagnosticMetric.INPUT_BUFFER_MIN_FILL,
+    CONF_INPUT_BUFFER_MAX_FILL: DiagnosticMetric.INPUT_BUFFER_MAX_FILL,
+    CONF_INPUT_BUFFER_SIZE: DiagnosticMetric.INPUT_BUFFER_SIZE,
+    CONF_UNDERRUNS: DiagnosticMetric.UNDERRUNS,
+}
+
+AnnouncementPriority = nabu_ns.enum("AnnouncementPriority", is_class=True)
+ANNOUNCEMENT_PRIORITIES = {
+    "normal": AnnouncementPriority.NORMAL,
+    "urgent": AnnouncementPriority.URGENT,
+}
+
 DuckingSetAction = nabu_ns.class_(
     "DuckingSetAction", automation.Action, cg.Parented.template(NabuMediaPlayer)
 )
 PlayLocalMediaAction = nabu_ns.class_(
     "PlayLocalMediaAction", automation.Action, cg.Parented.template(NabuMediaPlayer)
 )
+SeekAction = nabu_ns.class_(
+    "SeekAction", automation.Action, cg.Parented.template(NabuMediaPlayer)
+)
 
 
 def _compute_local_file_path(value: dict) -> Path:
@@ -142,6 +205,83 @@ MEDIA_FILE_TYPE_SCHEMA = cv.Schema(
         cv.Required(CONF_ID): cv.declare_id(MediaFile),
         cv.Required(CONF_FILE): _file_schema,
         cv.GenerateID(CONF_RAW_DATA_ID): cv.declare_id(cg.uint8),
+        # Decodes the file into external RAM after boot, so announcing it skips the pipeline
+        cv.Optional(CONF_CACHE, default=False): cv.boolean,
+    }
+)
+
+
+THROUGHPUT_SENSOR_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_BYTES_PER_SECOND,
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+BYTES_SENSOR_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_BYTES,
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+COUNTER_SENSOR_SCHEMA = sensor.sensor_schema(
+    accuracy_decimals=0,
+    state_class=STATE_CLASS_TOTAL_INCREASING,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+PERCENT_SENSOR_SCHEMA = sensor.sensor_schema(
+    unit_of_measurement=UNIT_PERCENT,
+    accuracy_decimals=1,
+    state_class=STATE_CLASS_MEASUREMENT,
+    entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+)
+
+
+def _stage_diagnostics_schema(has_input, has_underruns=False):
+    schema = {
+        cv.Optional(CONF_THROUGHPUT): THROUGHPUT_SENSOR_SCHEMA,
+        cv.Optional(CONF_OUTPUT_STALL): PERCENT_SENSOR_SCHEMA,
+    }
+    if has_input:
+        # The reader's input is the network or flash, not a ring buffer
+        schema.update(
+            {
+                cv.Optional(CONF_INPUT_STALL): PERCENT_SENSOR_SCHEMA,
+                cv.Optional(CONF_INPUT_BUFFER_MIN_FILL): PERCENT_SENSOR_SCHEMA,
+                cv.Optional(CONF_INPUT_BUFFER_MAX_FILL): PERCENT_SENSOR_SCHEMA,
+                cv.Optional(CONF_INPUT_BUFFER_SIZE): BYTES_SENSOR_SCHEMA,
+            }
+        )
+    if has_underruns:
+        # Only the mixer knows whether the speaker ran out of audio
+        schema[cv.Optional(CONF_UNDERRUNS)] = COUNTER_SENSOR_SCHEMA
+    return cv.Schema(schema)
+
+
+DIAGNOSTICS_SCHEMA = cv.Schema(
+    {
+        cv.Optional(
+            CONF_UPDATE_INTERVAL, default="10s"
+        ): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_READER): _stage_diagnostics_schema(False),
+        cv.Optional(CONF_DECODER): _stage_diagnostics_schema(True),
+        cv.Optional(CONF_RESAMPLER): _stage_diagnostics_schema(True),
+        cv.Optional(CONF_MIXER): _stage_diagnostics_schema(True, True),
+        # Memory leased by the pipelines' buffers, which is given back once they are idle
+        cv.Optional(CONF_BUFFER_MEMORY): BYTES_SENSOR_SCHEMA,
+        cv.Optional(CONF_BUFFER_MEMORY_PEAK): BYTES_SENSOR_SCHEMA,
+        # Time from starting the latest url stream to its first byte; lower when an idle connection was reused
+        cv.Optional(CONF_FIRST_BYTE_TIME): sensor.sensor_schema(
+            unit_of_measurement=UNIT_MILLISECOND,
+            accuracy_decimals=0,
+            state_class=STATE_CLASS_MEASUREMENT,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        ),
+        # Announcement urls played from the cache and fetched from the network
+        cv.Optional(CONF_ANNOUNCEMENT_CACHE_HITS): COUNTER_SENSOR_SCHEMA,
+        cv.Optional(CONF_ANNOUNCEMENT_CACHE_MISSES): COUNTER_SENSOR_SCHEMA,
     }
 )
 
@@ -155,7 +295,21 @@ CONFIG_SCHEMA = media_player.MEDIA_PLAYER_SCHEMA.extend(
         cv.Optional(CONF_VOLUME_INCREMENT, default=0.05): cv.percentage,
         cv.Optional(CONF_VOLUME_MAX, default=1.0): cv.percentage,
         cv.Optional(CONF_VOLUME_MIN, default=0.0): cv.percentage,
+        cv.Optional(
+            CONF_MEDIA_PREBUFFER, default="300ms"
+        ): cv.positive_time_period_milliseconds,
+        cv.Optional(
+            CONF_ANNOUNCEMENT_PREBUFFER, default="100ms"
+        ): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_STREAM_BUFFER_MAX_SIZE, default=256 * 1024): cv.int_range(
+            min=64 * 1024
+        ),
+        # Encoded audio of recent announcement urls (e.g., repeated TTS responses) kept in external RAM; 0 disables it
+        cv.Optional(CONF_ANNOUNCEMENT_CACHE_SIZE, default=0): cv.int_range(min=0),
+        # Decoded audio of the files with cache: true kept in external RAM, at 384 kB per second of 48 kHz audio
+        cv.Optional(CONF_FILE_CACHE_SIZE, default=2 * 1024 * 1024): cv.int_range(min=0),
         cv.Optional(CONF_FILES): cv.ensure_list(MEDIA_FILE_TYPE_SCHEMA),
+        cv.Optional(CONF_DIAGNOSTICS): DIAGNOSTICS_SCHEMA,
         cv.Optional(CONF_ON_MUTE): automation.validate_automation(single=True),
         cv.Optional(CONF_ON_UNMUTE): automation.validate_automation(single=True),
         cv.Optional(CONF_ON_VOLUME): automation.validate_automation(single=True),
@@ -198,6 +352,10 @@ def _read_audio_file_and_type(file_config):
         media_file_type = MEDIA_FILE_TYPE_ENUM["MP3"]
     elif file_type in ("flac"):
         media_file_type = MEDIA_FILE_TYPE_ENUM["FLAC"]
+    elif file_type in ("opus", "ogg", "oga"):
+        media_file_type = MEDIA_FILE_TYPE_ENUM["OPUS"]
+    elif file_type in ("aac", "m4a", "m4b", "mp4"):
+        media_file_type = MEDIA_FILE_TYPE_ENUM["AAC"]
 
     return data, media_file_type
 
@@ -215,6 +373,16 @@ FINAL_VALIDATE_SCHEMA = _supported_local_file_validate
 
 async def to_code(config):
     cg.add_library("esphome/esp-audio-libs", "1.0.0")
+    esp32.add_idf_component(
+        name="esp-opus",
+        repo="https://github.com/78/esp-opus",
+        ref="v1.0.5",
+    )
+    esp32.add_idf_component(
+        name="esp-libhelix-aac",
+        repo="https://github.com/chmorgan/esp-libhelix-aac",
+        ref="v1.0.0",
+    )
 
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
@@ -227,6 +395,11 @@ async def to_code(config):
     cg.add(var.set_volume_increment(config[CONF_VOLUME_INCREMENT]))
     cg.add(var.set_volume_max(config[CONF_VOLUME_MAX]))
     cg.add(var.set_volume_min(config[CONF_VOLUME_MIN]))
+    cg.add(var.set_stream_buffer_max_size(config[CONF_STREAM_BUFFER_MAX_SIZE]))
+    cg.add(var.set_announcement_cache_size(config[CONF_ANNOUNCEMENT_CACHE_SIZE]))
+    cg.add(var.set_file_cache_size(config[CONF_FILE_CACHE_SIZE]))
+    cg.add(var.set_media_prebuffer(config[CONF_MEDIA_PREBUFFER]))
+    cg.add(var.set_announcement_prebuffer(config[CONF_ANNOUNCEMENT_PREBUFFER]))
 
     spkr = await cg.get_variable(config[CONF_SPEAKER])
     cg.add(var.set_speaker(spkr))
@@ -254,6 +427,34 @@ async def to_code(config):
         aud_dac = await cg.get_variable(audio_dac_config)
         cg.add(var.set_audio_dac(aud_dac))
 
+    if diagnostics_config := config.get(CONF_DIAGNOSTICS):
+        cg.add(
+            var.set_diagnostics_update_interval(
+                diagnostics_config[CONF_UPDATE_INTERVAL]
+            )
+        )
+        for stage, stage_enum in DIAGNOSTIC_STAGES.items():
+            stage_config = diagnostics_config.get(stage, {})
+            for metric, metric_enum in DIAGNOSTIC_METRICS.items():
+                if sensor_config := stage_config.get(metric):
+                    sens = await sensor.new_sensor(sensor_config)
+                    cg.add(var.set_diagnostic_sensor(stage_enum, metric_enum, sens))
+        if sensor_config := diagnostics_config.get(CONF_BUFFER_MEMORY):
+            sens = await sensor.new_sensor(sensor_config)
+            cg.add(var.set_buffer_memory_sensor(sens))
+        if sensor_config := diagnostics_config.get(CONF_BUFFER_MEMORY_PEAK):
+            sens = await sensor.new_sensor(sensor_config)
+            cg.add(var.set_buffer_memory_peak_sensor(sens))
+        if sensor_config := diagnostics_config.get(CONF_FIRST_BYTE_TIME):
+            sens = await sensor.new_sensor(sensor_config)
+            cg.add(var.set_first_byte_time_sensor(sens))
+        if sensor_config := diagnostics_config.get(CONF_ANNOUNCEMENT_CACHE_HITS):
+            sens = await sensor.new_sensor(sensor_config)
+            cg.add(var.set_announcement_cache_hits_sensor(sens))
+        if sensor_config := diagnostics_config.get(CONF_ANNOUNCEMENT_CACHE_MISSES):
+            sens = await sensor.new_sensor(sensor_config)
+            cg.add(var.set_announcement_cache_misses_sensor(sens))
+
     if files_list := config.get(CONF_FILES):
         for file_config in files_list:
             data, media_file_type = _read_audio_file_and_type(file_config)
@@ -277,11 +478,14 @@ async def to_code(config):
                 ),
             )
 
-            cg.new_Pvariable(
+            media_file = cg.new_Pvariable(
                 file_config[CONF_ID],
                 media_files_struct,
             )
 
+            if file_config[CONF_CACHE]:
+                cg.add(var.add_cached_media_file(media_file))
+
 
 DUCKING_SET_SCHEMA = cv.Schema(
     {
@@ -296,16 +500,28 @@ DUCKING_SET_SCHEMA = cv.Schema(
 )
 
 
+def _validate_announcement_priority(config):
+    if config[CONF_PRIORITY] != "normal" and not config[CONF_ANNOUNCEMENT]:
+        raise cv.Invalid(f"'{CONF_PRIORITY}' only applies to announcements")
+    return config
+
+
 @automation.register_action(
     "nabu.play_local_media_file",
     PlayLocalMediaAction,
-    cv.maybe_simple_value(
-        {
-            cv.GenerateID(): cv.use_id(NabuMediaPlayer),
-            cv.Required(CONF_MEDIA_FILE): cv.use_id(MediaFile),
-            cv.Optional(CONF_ANNOUNCEMENT, default=False): cv.boolean,
-        },
-        key=CONF_MEDIA_FILE,
+    cv.All(
+        cv.maybe_simple_value(
+            {
+                cv.GenerateID(): cv.use_id(NabuMediaPlayer),
+                cv.Required(CONF_MEDIA_FILE): cv.use_id(MediaFile),
+                cv.Optional(CONF_ANNOUNCEMENT, default=False): cv.boolean,
+                cv.Optional(CONF_PRIORITY, default="normal"): cv.enum(
+                    ANNOUNCEMENT_PRIORITIES, lower=True
+                ),
+            },
+            key=CONF_MEDIA_FILE,
+        ),
+        _validate_announcement_priority,
     ),
 )
 async def media_player_play_media_action(config, action_id, template_arg, args):
@@ -314,6 +530,7 @@ async def media_player_play_media_action(config, action_id, template_arg, args):
     media_file = await cg.get_variable(config[CONF_MEDIA_FILE])
     cg.add(var.set_media_file(media_file))
     cg.add(var.set_announcement(config[CONF_ANNOUNCEMENT]))
+    cg.add(var.set_priority(ANNOUNCEMENT_PRIORITIES[config[CONF_PRIORITY]]))
     return var
 
 
@@ -328,3 +545,24 @@ async def ducking_set_to_code(config, action_id, template_arg, args):
     duration = await cg.templatable(config[CONF_DURATION], args, cg.float_)
     cg.add(var.set_duration(duration))
     return var
+
+
+@automation.register_action(
+    "nabu.seek",
+    SeekAction,
+    cv.maybe_simple_value(
+        {
+            cv.GenerateID(): cv.use_id(NabuMediaPlayer),
+            cv.Required(CONF_POSITION): cv.templatable(
+                cv.positive_time_period_milliseconds
+            ),
+        },
+        key=CONF_POSITION,
+    ),
+)
+async def seek_to_code(config, action_id, template_arg, args):
+    var = cg.new_Pvariable(action_id, template_arg)
+    await cg.register_parented(var, config[CONF_ID])
+    position = await cg.templatable(config[CONF_POSITION], args, cg.uint32)
+    cg.add(var.set_position(position))
+    return var
@@ -0,0 +1,543 @@
+#ifdef USE_ESP_IDF
+
+#include "mp4_demuxer.h"
+
+#include "esphome/core/helpers.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+
+static constexpr uint32_t box_type(const char *name) {
+  return (static_cast<uint32_t>(name[0]) << 24) | (name[1] << 16) | (name[2] << 8) | name[3];
+}
+
+static const uint32_t MOOV_BOX = box_type("moov");
+static const uint32_t TRAK_BOX = box_type("trak");
+static const uint32_t MDIA_BOX = box_type("mdia");
+static const uint32_t MINF_BOX = box_type("minf");
+static const uint32_t STBL_BOX = box_type("stbl");
+static const uint32_t HDLR_BOX = box_type("hdlr");
+static const uint32_t STSD_BOX = box_type("stsd");
+static const uint32_t STSZ_BOX = box_type("stsz");
+static const uint32_t STCO_BOX = box_type("stco");
+static const uint32_t CO64_BOX = box_type("co64");
+static const uint32_t STSC_BOX = box_type("stsc");
+static const uint32_t MDAT_BOX = box_type("mdat");
+static const uint32_t MP4A_BOX = box_type("mp4a");
+static const uint32_t ESDS_BOX = box_type("esds");
+static const uint32_t WAVE_BOX = box_type("wave");
+static const uint32_t SOUND_HANDLER = box_type("soun");
+
+static const size_t BOX_HEADER_SIZE = 8;
+static const size_t LARGE_BOX_HEADER_SIZE = 16;
+static const uint8_t MAX_CONTAINER_DEPTH = 8;
+// hdlr and stsd boxes larger than this are skipped; the decoder peeks at most 2 KiB of a stream at once
+static const size_t MAX_WHOLE_BOX_SIZE = 2048;
+
+// Bytes of the fixed fields after the box header, including the version and flags
+static const size_t SAMPLE_SIZES_FIELDS = 12;
+static const size_t CHUNK_TABLE_FIELDS = 8;
+
+static const size_t SOUND_ENTRY_CHILDREN_OFFSET = 36;  // Sample entry header, then the version 0 sound description
+static const size_t SOUND_ENTRY_V1_EXTRA = 16;          // QuickTime sound description versions 1 and 2
+static const size_t SOUND_ENTRY_V2_EXTRA = 36;
+
+static const uint8_t ES_DESCRIPTOR_TAG = 0x03;
+static const uint8_t DECODER_CONFIG_DESCRIPTOR_TAG = 0x04;
+static const uint8_t DECODER_SPECIFIC_INFO_TAG = 0x05;
+
+static const uint32_t AAC_SAMPLE_RATES[] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+                                            22050, 16000, 12000, 11025, 8000,  7350};
+
+static uint16_t read_be16(const uint8_t *data) { return (data[0] << 8) | data[1]; }
+
+static uint32_t read_be32(const uint8_t *data) {
+  return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+static uint64_t read_be64(const uint8_t *data) {
+  return (static_cast<uint64_t>(read_be32(data)) << 32) | read_be32(data + 4);
+}
+
+// Finds a child box among the boxes that fill the data
+// @return pointer to the child's contents after its header, or nullptr if there is none
+static const uint8_t *find_child_box(const uint8_t *data, const uint8_t *end, uint32_t type, size_t *length) {
+  while (data + BOX_HEADER_SIZE <= end) {
+    const uint32_t size = read_be32(data);
+    if ((size < BOX_HEADER_SIZE) || (size > static_cast<size_t>(end - data))) {
+      return nullptr;
+    }
+    if (read_be32(data + 4) == type) {
+      *length = size - BOX_HEADER_SIZE;
+      return data + BOX_HEADER_SIZE;
+    }
+    data += size;
+  }
+  return nullptr;
+}
+
+// Reads an MPEG-4 descriptor's tag and its variable length size
+// @return pointer to the descriptor's contents, or nullptr if it doesn't fit in the data
+static const uint8_t *read_descriptor(const uint8_t *data, const uint8_t *end, uint8_t *tag, size_t *length) {
+  if (data >= end) {
+    return nullptr;
+  }
+  *tag = *data++;
+  *length = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (data >= end) {
+      return nullptr;
+    }
+    const uint8_t byte = *data++;
+    *length = (*length << 7) | (byte & 0x7F);
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  if (*length > static_cast<size_t>(end - data)) {
+    return nullptr;
+  }
+  return data;
+}
+
+MP4Demuxer::~MP4Demuxer() { this->free_tables_(); }
+
+void MP4Demuxer::free_tables_() {
+  if (this->sample_sizes_ != nullptr) {
+    ExternalRAMAllocator<uint16_t> allocator(ExternalRAMAllocator<uint16_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->sample_sizes_, this->sample_count_);
+    this->sample_sizes_ = nullptr;
+  }
+  if (this->chunk_offsets_ != nullptr) {
+    ExternalRAMAllocator<uint32_t> allocator(ExternalRAMAllocator<uint32_t>::ALLOW_FAILURE);
+    allocator.deallocate(this->chunk_offsets_, this->chunk_count_);
+    this->chunk_offsets_ = nullptr;
+  }
+  if (this->chunk_runs_ != nullptr) {
+    ExternalRAMAllocator<ChunkRun> allocator(ExternalRAMAllocator<ChunkRun>::ALLOW_FAILURE);
+    allocator.deallocate(this->chunk_runs_, this->chunk_run_count_);
+    this->chunk_runs_ = nullptr;
+  }
+}
+
+void MP4Demuxer::consume_(uint8_t **data, size_t *length, size_t bytes) {
+  *data += bytes;
+  *length -= bytes;
+  this->position_ += bytes;
+}
+
+MP4DemuxerState MP4Demuxer::next(uint8_t **data, size_t *length, uint8_t **sample, size_t *sample_length) {
+  while (true) {
+    if (this->skip_bytes_ > 0) {
+      const size_t bytes_to_skip = std::min<uint64_t>(this->skip_bytes_, *length);
+      this->consume_(data, length, bytes_to_skip);
+      this->skip_bytes_ -= bytes_to_skip;
+      if (this->skip_bytes_ > 0) {
+        return MP4DemuxerState::NEED_MORE_DATA;
+      }
+    }
+
+    if (this->tables_ready_) {
+      if (this->sample_index_ >= this->sample_count_) {
+        return MP4DemuxerState::END_OF_TRACK;
+      }
+      if (this->position_ > this->sample_offset_) {
+        // The sample is before the input, e.g., the tables point into the moov box
+        return MP4DemuxerState::FAILED;
+      }
+      if (this->position_ < this->sample_offset_) {
+        // Other boxes or another track's samples
+        this->skip_bytes_ = this->sample_offset_ - this->position_;
+        continue;
+      }
+
+      const uint32_t size = this->sample_size_(this->sample_index_);
+      if (*length < size) {
+        return MP4DemuxerState::NEED_MORE_DATA;
+      }
+      *sample = *data;
+      *sample_length = size;
+      this->consume_(data, length, size);
+
+      this->sample_offset_ += size;
+      ++this->sample_index_;
+      if ((--this->samples_left_in_chunk_ == 0) && !this->start_chunk_(this->chunk_index_ + 1)) {
+        // The chunks hold fewer samples than the sample size table lists
+        this->sample_count_ = std::min(this->sample_count_, this->sample_index_);
+      }
+      return MP4DemuxerState::SAMPLE_READY;
+    }
+
+    if (this->table_ != SampleTable::NONE) {
+      this->read_table_entries_(data, length);
+      if (this->table_ != SampleTable::NONE) {
+        return MP4DemuxerState::NEED_MORE_DATA;
+      }
+      if (this->position_ > this->table_end_) {
+        return MP4DemuxerState::FAILED;
+      }
+      this->skip_bytes_ = this->table_end_ - this->position_;
+      continue;
+    }
+
+    if (!this->leave_containers_()) {
+      return MP4DemuxerState::FAILED;
+    }
+    if (this->tables_ready_) {
+      continue;
+    }
+
+    MP4DemuxerState state;
+    if (!this->parse_box_(data, length, &state)) {
+      return state;
+    }
+  }
+}
+
+bool MP4Demuxer::parse_box_(uint8_t **data, size_t *length, MP4DemuxerState *state) {
+  if (*length < BOX_HEADER_SIZE) {
+    *state = MP4DemuxerState::NEED_MORE_DATA;
+    return false;
+  }
+
+  const uint8_t *header = *data;
+  uint64_t size = read_be32(header);
+  const uint32_t type = read_be32(header + 4);
+  size_t header_size = BOX_HEADER_SIZE;
+  if (size == 1) {
+    if (*length < LARGE_BOX_HEADER_SIZE) {
+      *state = MP4DemuxerState::NEED_MORE_DATA;
+      return false;
+    }
+    size = read_be64(header + 8);
+    header_size = LARGE_BOX_HEADER_SIZE;
+  }
+
+  if (type == MDAT_BOX) {
+    // The samples come before the sample tables; only progressive files can be played without rewinding
+    *state = MP4DemuxerState::FAILED;
+    return false;
+  }
+  if (size < header_size) {
+    // Includes boxes that extend to the end of the file, which only an mdat box may do
+    *state = MP4DemuxerState::FAILED;
+    return false;
+  }
+
+  const uint64_t box_end = this->position_ + size;
+  const uint32_t parent = (this->container_depth_ > 0) ? this->container_types_[this->container_depth_ - 1] : 0;
+
+  const bool container = (type == MOOV_BOX) || (type == TRAK_BOX) || (type == MDIA_BOX) || (type == MINF_BOX) ||
+                         (type == STBL_BOX);
+  if (container) {
+    // Only the first audio track's media information is needed; the handler comes before it in the mdia box
+    const bool skip = ((type == TRAK_BOX) && this->track_found_) || ((type == MINF_BOX) && !this->track_is_audio_);
+    if (skip) {
+      this->skip_bytes_ = size;
+      return true;
+    }
+    if (this->container_depth_ == MAX_CONTAINER_DEPTH) {
+      *state = MP4DemuxerState::FAILED;
+      return false;
+    }
+    if (type == TRAK_BOX) {
+      this->track_is_audio_ = false;
+    }
+    this->container_types_[this->container_depth_] = type;
+    this->container_ends_[this->container_depth_] = box_end;
+    ++this->container_depth_;
+    this->consume_(data, length, header_size);
+    return true;
+  }
+
+  const bool whole_box = ((type == HDLR_BOX) && (parent == MDIA_BOX)) || ((type == STSD_BOX) && this->track_is_audio_);
+  if (whole_box && (size <= MAX_WHOLE_BOX_SIZE)) {
+    if (*length < size) {
+      *state = MP4DemuxerState::NEED_MORE_DATA;
+      return false;
+    }
+    if (type == HDLR_BOX) {
+      // Version and flags, then a predefined field before the handler type
+      this->track_is_audio_ = (size >= header_size + 12) && (read_be32(header + header_size + 8) == SOUND_HANDLER);
+    } else {
+      this->parse_sample_description_(header + header_size, size - header_size);
+    }
+    this->consume_(data, length, size);
+    return true;
+  }
+
+  const bool table = ((type == STSZ_BOX) || (type == STCO_BOX) || (type == CO64_BOX) || (type == STSC_BOX)) &&
+                     this->track_is_audio_;
+  if (table) {
+    const size_t fields = (type == STSZ_BOX) ? SAMPLE_SIZES_FIELDS : CHUNK_TABLE_FIELDS;
+    if (size < header_size + fields) {
+      *state = MP4DemuxerState::FAILED;
+      return false;
+    }
+    if (*length < header_size + fields) {
+      *state = MP4DemuxerState::NEED_MORE_DATA;
+      return false;
+    }
+    if (!this->start_table_(type, header + header_size)) {
+      *state = MP4DemuxerState::FAILED;
+      return false;
+    }
+    this->table_end_ = box_end;
+    this->consume_(data, length, header_size + fields);
+    return true;
+  }
+
+  this->skip_bytes_ = size;
+  return true;
+}
+
+bool MP4Demuxer::start_table_(uint32_t type, const uint8_t *fields) {
+  this->table_entries_read_ = 0;
+
+  if (type == STSZ_BOX) {
+    ExternalRAMAllocator<uint16_t> allocator(ExternalRAMAllocator<uint16_t>::ALLOW_FAILURE);
+    if (this->sample_sizes_ != nullptr) {
+      allocator.deallocate(this->sample_sizes_, this->sample_count_);
+      this->sample_sizes_ = nullptr;
+    }
+    this->constant_sample_size_ = read_be32(fields + 4);
+    this->sample_count_ = read_be32(fields + 8);
+    if ((this->constant_sample_size_ > 0) || (this->sample_count_ == 0)) {
+      return true;
+    }
+    this->sample_sizes_ = allocator.allocate(this->sample_count_);
+    this->table_ = SampleTable::SAMPLE_SIZES;
+    this->table_entries_ = this->sample_count_;
+    return this->sample_sizes_ != nullptr;
+  }
+
+  const uint32_t entries = read_be32(fields + 4);
+  if (entries == 0) {
+    return true;
+  }
+
+  if (type == STSC_BOX) {
+    ExternalRAMAllocator<ChunkRun> allocator(ExternalRAMAllocator<ChunkRun>::ALLOW_FAILURE);
+    if (this->chunk_runs_ != nullptr) {
+      allocator.deallocate(this->chunk_runs_, this->chunk_run_count_);
+    }
+    this->chunk_run_count_ = entries;
+    this->chunk_runs_ = allocator.allocate(entries);
+    this->table_ = SampleTable::SAMPLES_PER_CHUNK;
+    this->table_entries_ = entries;
+    return this->chunk_runs_ != nullptr;
+  }
+
+  ExternalRAMAllocator<uint32_t> allocator(ExternalRAMAllocator<uint32_t>::ALLOW_FAILURE);
+  if (this->chunk_offsets_ != nullptr) {
+    allocator.deallocate(this->chunk_offsets_, this->chunk_count_);
+  }
+  this->chunk_count_ = entries;
+  this->chunk_offsets_ = allocator.allocate(entries);
+  this->table_ = (type == CO64_BOX) ? SampleTable::CHUNK_OFFSETS_64 : SampleTable::CHUNK_OFFSETS;
+  this->table_entries_ = entries;
+  return this->chunk_offsets_ != nullptr;
+}
+
+void MP4Demuxer::read_table_entries_(uint8_t **data, size_t *length) {
+  size_t entry_size = sizeof(uint32_t);
+  if (this->table_ == SampleTable::CHUNK_OFFSETS_64) {
+    entry_size = sizeof(uint64_t);
+  } else if (this->table_ == SampleTable::SAMPLES_PER_CHUNK) {
+    entry_size = 3 * sizeof(uint32_t);  // First chunk, samples per chunk, and sample description index
+  }
+
+  while ((this->table_entries_read_ < this->table_entries_) && (*length >= entry_size)) {
+    const uint8_t *entry = *data;
+    const uint32_t index = this->table_entries_read_;
+    switch (this->table_) {
+      case SampleTable::SAMPLE_SIZES:
+        // AAC frames are at most 768 bytes per channel
+        this->sample_sizes_[index] = std::min<uint32_t>(read_be32(entry), UINT16_MAX);
+        break;
+      case SampleTable::CHUNK_OFFSETS:
+        this->chunk_offsets_[index] = read_be32(entry);
+        break;
+      case SampleTable::CHUNK_OFFSETS_64:
+        this->chunk_offsets_[index] = std::min<uint64_t>(read_be64(entry), UINT32_MAX);
+        break;
+      case SampleTable::SAMPLES_PER_CHUNK:
+        this->chunk_runs_[index] = {read_be32(entry), read_be32(entry + 4)};
+        break;
+      case SampleTable::NONE:
+        break;
+    }
+    ++this->table_entries_read_;
+    this->consume_(data, length, entry_size);
+  }
+
+  if (this->table_entries_read_ == this->table_entries_) {
+    this->table_ = SampleTable::NONE;
+  }
+}
+
+void MP4Demuxer::parse_sample_description_(const uint8_t *box, size_t box_length) {
+  const uint8_t *end = box + box_length;
+
+  // Version and flags, then the entry count before the first sample entry
+  const uint8_t *entry = box + 8;
+  if ((entry + SOUND_ENTRY_CHILDREN_OFFSET > end) || (read_be32(entry + 4) != MP4A_BOX)) {
+    // Not AAC, so this track isn't usable
+    return;
+  }
+  const uint32_t entry_size = read_be32(entry);
+  if ((entry_size < SOUND_ENTRY_CHILDREN_OFFSET) || (entry_size > static_cast<size_t>(end - entry))) {
+    return;
+  }
+  const uint8_t *entry_end = entry + entry_size;
+
+  const uint16_t sound_version = read_be16(entry + 16);
+  this->channels_ = read_be16(entry + 24);
+  this->sample_rate_ = read_be32(entry + 32) >> 16;
+  this->object_type_ = 2;  // AAC-LC, unless the decoder configuration says otherwise
+
+  const uint8_t *children = entry + SOUND_ENTRY_CHILDREN_OFFSET;
+  if (sound_version == 1) {
+    children += SOUND_ENTRY_V1_EXTRA;
+  } else if (sound_version == 2) {
+    children += SOUND_ENTRY_V2_EXTRA;
+  }
+  if (children > entry_end) {
+    return;
+  }
+
+  // QuickTime files wrap the esds box in a wave box
+  size_t esds_length = 0;
+  const uint8_t *esds = find_child_box(children, entry_end, ESDS_BOX, &esds_length);
+  if (esds == nullptr) {
+    size_t wave_length = 0;
+    const uint8_t *wave = find_child_box(children, entry_end, WAVE_BOX, &wave_length);
+    if (wave != nullptr) {
+      esds = find_child_box(wave, wave + wave_length, ESDS_BOX, &esds_length);
+    }
+  }
+
+  if ((esds != nullptr) && (esds_length > 4)) {
+    // Skip the version and flags, then descend to the AudioSpecificConfig
+    const uint8_t *descriptor_end = esds + esds_length;
+    uint8_t tag = 0;
+    size_t length = 0;
+    const uint8_t *es = read_descriptor(esds + 4, descriptor_end, &tag, &length);
+    if ((es != nullptr) && (tag == ES_DESCRIPTOR_TAG) && (length >= 3)) {
+      const uint8_t flags = es[2];
+      const uint8_t *field = es + 3;
+      if (flags & 0x80) {
+        field += 2;  // Depends on stream ID
+      }
+      if ((flags & 0x40) && (field < es + length)) {
+        field += 1 + *field;  // URL
+      }
+      if (flags & 0x20) {
+        field += 2;  // OCR stream ID
+      }
+      const uint8_t *config = read_descriptor(field, es + length, &tag, &length);
+      if ((config != nullptr) && (tag == DECODER_CONFIG_DESCRIPTOR_TAG) && (length > 13)) {
+        // Object type indication, stream type, buffer size, and bitrates come before the decoder specific info
+        const uint8_t *asc = read_descriptor(config + 13, config + length, &tag, &length);
+        if ((asc != nullptr) && (tag == DECODER_SPECIFIC_INFO_TAG) && (length >= 2)) {
+          this->object_type_ = asc[0] >> 3;
+          const uint8_t frequency_index = ((asc[0] & 0x07) << 1) | (asc[1] >> 7);
+          if (frequency_index < sizeof(AAC_SAMPLE_RATES) / sizeof(AAC_SAMPLE_RATES[0])) {
+            this->sample_rate_ = AAC_SAMPLE_RATES[frequency_index];
+            this->channels_ = (asc[1] >> 3) & 0x0F;
+          } else if ((frequency_index == 0x0F) && (length >= 5)) {
+            // An explicit 24 bit sample rate
+            this->sample_rate_ = ((asc[1] & 0x7F) << 17) | (asc[2] << 9) | (asc[3] << 1) | (asc[4] >> 7);
+            this->channels_ = (asc[4] >> 3) & 0x0F;
+          }
+        }
+      }
+    }
+  }
+
+  this->track_found_ = true;
+}
+
+bool MP4Demuxer::leave_containers_() {
+  while ((this->container_depth_ > 0) && (this->position_ >= this->container_ends_[this->container_depth_ - 1])) {
+    --this->container_depth_;
+    const uint32_t type = this->container_types_[this->container_depth_];
+
+    if ((type == TRAK_BOX) && this->track_is_audio_ && this->track_found_) {
+      // Stop at the first audio track with an AAC sample description
+      this->track_is_audio_ = false;
+    } else if (type == TRAK_BOX) {
+      // Drop the tables of an audio track that turned out to be unusable
+      this->track_found_ = false;
+      this->track_is_audio_ = false;
+      this->free_tables_();
+      this->sample_count_ = 0;
+      this->chunk_count_ = 0;
+      this->chunk_run_count_ = 0;
+    } else if (type == MOOV_BOX) {
+      if (!this->track_found_ || (this->sample_count_ == 0) || (this->chunk_count_ == 0) ||
+          (this->chunk_run_count_ == 0)) {
+        return false;
+      }
+      this->tables_ready_ = true;
+      this->locate_sample_(0);
+    }
+  }
+  return true;
+}
+
+bool MP4Demuxer::start_chunk_(uint32_t chunk_index) {
+  uint32_t run_index = this->chunk_run_index_;
+  for (; chunk_index < this->chunk_count_; ++chunk_index) {
+    while ((run_index + 1 < this->chunk_run_count_) &&
+           (this->chunk_runs_[run_index + 1].first_chunk <= chunk_index + 1)) {
+      ++run_index;
+    }
+    if (this->chunk_runs_[run_index].samples_per_chunk > 0) {
+      this->chunk_index_ = chunk_index;
+      this->chunk_run_index_ = run_index;
+      this->samples_left_in_chunk_ = this->chunk_runs_[run_index].samples_per_chunk;
+      this->sample_offset_ = this->chunk_offsets_[chunk_index];
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t MP4Demuxer::seek(uint32_t sample_index) {
+  this->locate_sample_(sample_index);
+  this->skip_bytes_ = 0;
+  this->position_ = this->sample_offset_;
+  return this->sample_offset_;
+}
+
+void MP4Demuxer::locate_sample_(uint32_t sample_index) {
+  sample_index = std::min(sample_index, this->sample_count_ - 1);
+
+  this->sample_index_ = 0;
+  this->chunk_run_index_ = 0;
+  this->start_chunk_(0);
+
+  // Whole chunks first, then the samples within the chunk
+  while ((this->sample_index_ + this->samples_left_in_chunk_ <= sample_index) &&
+         (this->chunk_index_ + 1 < this->chunk_count_)) {
+    const uint32_t samples_in_chunk = this->samples_left_in_chunk_;
+    if (!this->start_chunk_(this->chunk_index_ + 1)) {
+      break;
+    }
+    this->sample_index_ += samples_in_chunk;
+  }
+  while ((this->sample_index_ < sample_index) && (this->samples_left_in_chunk_ > 1)) {
+    this->sample_offset_ += this->sample_size_(this->sample_index_);
+    ++this->sample_index_;
+    --this->samples_left_in_chunk_;
+  }
+}
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
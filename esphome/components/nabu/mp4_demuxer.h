@@ -0,0 +1,138 @@
+#pragma once
+
+#ifdef USE_ESP_IDF
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nabu {
+
+enum class MP4DemuxerState : uint8_t {
+  NEED_MORE_DATA,
+  SAMPLE_READY,
+  END_OF_TRACK,
+  FAILED,
+};
+
+// Locates the AAC samples of the first audio track of an MP4 (M4A) file that is read front to back.
+//  - Only progressive files are supported: the ``moov`` box with the sample tables has to come before the ``mdat`` box
+//    with the samples, since the input can't be rewound
+//  - The sample size, chunk offset, and sample-to-chunk tables are kept in external RAM as they stream by; everything
+//    else in the ``moov`` box is skipped. Only the small ``hdlr`` and ``stsd`` boxes have to be whole in the input.
+//  - Once the tables are read, the box structure is ignored; the bytes up to the offset of each sample are skipped
+//  - Each sample is handed out in place, once it is whole in the input
+class MP4Demuxer {
+ public:
+  ~MP4Demuxer();
+
+  /// @brief Consumes input until the next sample is whole in it
+  /// @param data Next unread byte of the file; advanced past the consumed bytes
+  /// @param length Bytes available at data; reduced by the consumed bytes
+  /// @param sample Set to the start of the sample in the input if a sample is ready
+  /// @param sample_length Set to the size of the sample if a sample is ready
+  /// @return SAMPLE_READY if a sample was consumed, NEED_MORE_DATA if the next box header or sample isn't whole in the
+  /// input yet, END_OF_TRACK after the last sample, or FAILED if the file isn't supported
+  MP4DemuxerState next(uint8_t **data, size_t *length, uint8_t **sample, size_t *sample_length);
+
+  /// @brief Continues with the given sample (or the last one). Only valid once the sample tables are read.
+  /// @return Offset in the file of the sample; the next input has to start there
+  size_t seek(uint32_t sample_index);
+
+  bool has_sample_tables() const { return this->tables_ready_; }
+
+  // From the track's AudioSpecificConfig, or its sample entry if it has none
+  uint8_t get_object_type() const { return this->object_type_; }
+  uint32_t get_sample_rate() const { return this->sample_rate_; }
+  uint8_t get_channels() const { return this->channels_; }
+
+  uint32_t get_sample_count() const { return this->sample_count_; }
+
+ protected:
+  enum class SampleTable : uint8_t {
+    NONE,
+    SAMPLE_SIZES,
+    CHUNK_OFFSETS,
+    CHUNK_OFFSETS_64,
+    SAMPLES_PER_CHUNK,
+  };
+
+  struct ChunkRun {
+    uint32_t first_chunk;  // Index of the run's first chunk, counting from 1
+    uint32_t samples_per_chunk;
+  };
+
+  /// @brief Handles the box whose header is at the start of the input
+  /// @return true if the box was entered, read, or scheduled to be skipped. Otherwise state is set to NEED_MORE_DATA
+  /// or FAILED.
+  bool parse_box_(uint8_t **data, size_t *length, MP4DemuxerState *state);
+
+  /// @brief Starts reading the entries of a sample table box whose fixed fields are at the start of the input
+  /// @return false if the table can't be stored
+  bool start_table_(uint32_t type, const uint8_t *fields);
+
+  /// @brief Stores the entries of the current sample table that are whole in the input
+  void read_table_entries_(uint8_t **data, size_t *length);
+
+  /// @brief Reads the codec configuration from a whole ``stsd`` box
+  void parse_sample_description_(const uint8_t *box, size_t box_length);
+
+  /// @brief Closes the containers that end at the current position
+  /// @return false if the ``moov`` box ended without a supported audio track
+  bool leave_containers_();
+
+  /// @brief Moves the next sample to the given sample (or the last one) without changing the input position
+  void locate_sample_(uint32_t sample_index);
+
+  /// @brief Moves to the first sample of the given chunk, skipping empty chunks
+  /// @return false if there are no more chunks
+  bool start_chunk_(uint32_t chunk_index);
+
+  uint32_t sample_size_(uint32_t sample_index) const {
+    return (this->sample_sizes_ != nullptr) ? this->sample_sizes_[sample_index] : this->constant_sample_size_;
+  }
+
+  void consume_(uint8_t **data, size_t *length, size_t bytes);
+
+  void free_tables_();
+
+  size_t position_{0};       // Offset in the file of the next input byte
+  uint64_t skip_bytes_{0};  // Input bytes left to skip
+
+  uint32_t container_types_[8];
+  uint64_t container_ends_[8];
+  uint8_t container_depth_{0};
+
+  bool track_is_audio_{false};  // The current track's handler is "soun"
+  bool track_found_{false};     // The first audio track's sample tables and configuration are read
+  bool tables_ready_{false};
+
+  SampleTable table_{SampleTable::NONE};
+  uint32_t table_entries_read_{0};
+  uint32_t table_entries_{0};
+  uint64_t table_end_{0};
+
+  uint8_t object_type_{0};
+  uint32_t sample_rate_{0};
+  uint8_t channels_{0};
+
+  uint16_t *sample_sizes_{nullptr};  // Not allocated if all samples have the same size
+  uint32_t constant_sample_size_{0};
+  uint32_t sample_count_{0};
+  uint32_t *chunk_offsets_{nullptr};
+  uint32_t chunk_count_{0};
+  ChunkRun *chunk_runs_{nullptr};
+  uint32_t chunk_run_count_{0};
+
+  // The next sample
+  uint32_t sample_index_{0};
+  uint32_t chunk_index_{0};
+  uint32_t chunk_run_index_{0};
+  uint32_t samples_left_in_chunk_{0};
+  size_t sample_offset_{0};
+};
+
+}  // namespace nabu
+}  // namespace esphome
+
+#endif
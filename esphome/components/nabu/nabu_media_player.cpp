@@ -19,20 +19,37 @@ namespace nabu {
 //    - If played together, they are mixed with the announcement stream staying at full volume
 //    - The media audio is scaled, if necessary, to avoid clipping when mixing an announcement stream
 //    - The media audio can be further ducked via the ``set_ducking_reduction`` function
-//  - Each stream is handled by an ``AudioPipeline`` object with three parts/tasks
+//  - Each stream is handled by an ``AudioPipeline`` object with three ``AudioStage``s
 //    - ``AudioReader`` handles reading from an HTTP source or from a PROGMEM flash set at compile time
-//    - ``AudioDecoder`` handles decoding the audio file. All formats are limited to two channels and 16 bits per sample
-//      - FLAC
-//      - WAV
+//    - ``AudioDecoder`` handles decoding the audio file. 5.1 audio is mixed down to stereo, and other
+//      layouts with more than two channels to mono
+//      - FLAC (up to 32 bits per sample)
+//      - WAV (16, 24, or 32 bits per sample)
 //      - MP3 (based on the libhelix decoder - a random mp3 file may be incompatible)
-//    - ``AudioResampler`` handles converting the sample rate to the configured output sample rate and converting mono
-//      to stereo
+//      - Opus in an Ogg container (mono or stereo)
+//      - AAC-LC in ADTS frames or a progressive (moov before mdat) MP4/M4A file
+//    - ``AudioResampler`` handles converting the sample rate to the configured output sample rate, converting mono
+//      to stereo, and widening the samples to the mixer's 32 bits
 //      - The quality is not good, and it is slow! Please use audio at the configured sample rate to avoid these issues
-//    - Each task will always run once started, but they will not doing anything until they are needed
-//    - FreeRTOS Event Groups make up the inter-task communication
-//    - The ``AudioPipeline`` sets up an output ring buffer for the Reader and Decoder parts. The next part/task
-//      automatically pulls from the previous ring buffer
+//    - The stages are assembled into an ``AudioStageGraph``, which starts each stage with the previous stage's output
+//      format and decides which tasks run which stages
+//      - Each stage runs in its own task by default. Each task will always run once created, but it will not do
+//        anything until it is needed.
+//      - The announcement pipeline allows fusing, so it runs all three stages cooperatively in a single task when
+//        playing a local media file. The other tasks are only created once it plays a url.
+//      - FreeRTOS Event Groups make up the inter-task communication
+//    - The graph sets up a ring buffer between consecutive stages. Each stage automatically pulls from the previous
+//      ring buffer
+//      - The ring buffers are ``AudioRingBuffer``s; each stage acquires/peeks spans and works on the audio in place
+//        instead of copying it into and out of private buffers
+//    - The ring buffers and the stages' scratch buffers are leased from an ``AudioBufferArena`` shared by all
+//      pipelines. Once a pipeline has been stopped for a while, the loop gives back its buffers and deletes its tasks.
+//  - Selected local media files can be cached as PCM audio in external RAM with ``AudioPcmCache``
+//    - The files are decoded and resampled after boot, a slice at a time in the component's loop
+//    - Announcing a cached file copies its audio straight into the mixer's announcement ring buffer from the loop, so
+//      the announcement pipeline isn't started at all
 //  - The streams are mixed together in the ``AudioMixer`` task
+//    - Mixing and ducking work on 32 bit samples; only the speaker narrows the audio to its output width
 //    - Each stream has a corresponding input buffer that the ``AudioResampler`` feeds directly
 //    - Pausing the media stream is done here
 //    - Media stream ducking is done here
@@ -45,9 +62,28 @@ namespace nabu {
 //      - Volume commands are ignored if the media control queue is full to avoid crashing when the track wheel is spun
 //      fast
 //    - Pausing is sent to the ``AudioMixer`` task. It only effects the media stream.
+//    - Seeking restarts the media pipeline's stages at the position's byte offset in the file while the mixer keeps
+//      running. The decoder keeps the header it parsed and locates the offset with the FLAC SEEKTABLE, the MP3 Xing or
+//      VBRI table of contents, or the WAV data's start, falling back to the file's average bitrate.
+//    - Media sent with the ``ENQUEUE`` command is added to a playlist instead of replacing the current media
+//      - Home Assistant's API has no ``ENQUEUE`` or ``CLEAR_PLAYLIST`` command, so only YAML lambdas can send them,
+//        e.g., ``id(player).make_call().set_command("ENQUEUE").set_media_url(url).perform();``
+//      - A track that fails to read or decode ends like a finished one; the playlist continues with the next track
+//      - A second media pipeline prefetches the next playlist item (connecting, reading, and decoding) while the
+//        current one plays, but holds its audio back from the mixer
+//      - Once the current pipeline has finished, the prefetched pipeline starts writing to the same mixer ring buffer,
+//        so the next track's first sample directly follows the previous track's last sample
+//    - Announcements are added to a bounded queue and play in order. An urgent announcement (only available through
+//      the ``nabu.play_local_media_file`` action) interrupts a normal one and plays before any queued normal ones.
+//      - ``control`` queues announcements and stops them right away instead of through the media control queue, so a
+//        stop followed by an announcement keeps the new announcement
+//      - A second announcement pipeline prefetches the next queued announcement while the current one plays, the same
+//        way as for the playlist, so a chime followed by a spoken reply plays back to back
 //  - The components main loop performs housekeeping:
 //    - It reads the media control queue and processes it directly
 //    - It watches the state of speaker and mixer tasks
+//    - It publishes the media stream's per-stage telemetry to the optional diagnostic sensors. The ring buffers count
+//      the bytes passing through them and the time each side spends waiting, so the stages themselves keep no state.
 //    - It determines the overall state of the media player by considering the state of each pipeline
 //      - announcement playback takes highest priority
 
@@ -61,6 +97,18 @@ static const UBaseType_t MIXER_TASK_PRIORITY = 10;
 
 static const size_t TASK_DELAY_MS = 10;
 
+static const uint32_t WAKEUP_LOG_INTERVAL_MS = 1000;
+
+// Announcements waiting behind the playing one; urgent ones displace the newest normal ones when it is full
+static const size_t ANNOUNCEMENT_QUEUE_LENGTH = 8;
+
+// A stopped pipeline keeps its buffers and tasks this long, so back to back streams (e.g., a reply following the wake
+// sound) don't allocate them again
+static const uint32_t PIPELINE_IDLE_RELEASE_MS = 10000;
+
+// Time spent caching files in each loop iteration until the cache is built
+static const uint32_t PCM_CACHE_BUILD_SLICE_MS = 10;
+
 static const float FIRST_BOOT_DEFAULT_VOLUME = 0.5f;
 
 static const char *const TAG = "nabu_media_player";
@@ -91,9 +139,15 @@ void NabuMediaPlayer::setup() {
           if (this->media_pipeline_ != nullptr) {
             this->media_pipeline_->suspend_tasks();
           }
+          if (this->next_media_pipeline_ != nullptr) {
+            this->next_media_pipeline_->suspend_tasks();
+          }
           if (this->announcement_pipeline_ != nullptr) {
             this->announcement_pipeline_->suspend_tasks();
           }
+          if (this->next_announcement_pipeline_ != nullptr) {
+            this->next_announcement_pipeline_->suspend_tasks();
+          }
         } else if (state == ota::OTA_ERROR) {
           if (this->audio_mixer_ != nullptr) {
             this->audio_mixer_->resume_task();
@@ -101,23 +155,39 @@ void NabuMediaPlayer::setup() {
           if (this->media_pipeline_ != nullptr) {
             this->media_pipeline_->resume_tasks();
           }
+          if (this->next_media_pipeline_ != nullptr) {
+            this->next_media_pipeline_->resume_tasks();
+          }
           if (this->announcement_pipeline_ != nullptr) {
             this->announcement_pipeline_->resume_tasks();
           }
+          if (this->next_announcement_pipeline_ != nullptr) {
+            this->next_announcement_pipeline_->resume_tasks();
+          }
         }
       });
 #endif
 
+  if (this->pcm_cache_ != nullptr) {
+    this->pcm_cache_->set_sample_rate(this->sample_rate_);
+    this->pcm_cache_->set_max_size(this->file_cache_size_);
+  }
+
   ESP_LOGI(TAG, "Set up nabu media player");
 }
 
-esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
-  esp_err_t err = ESP_OK;
+void NabuMediaPlayer::add_cached_media_file(media_player::MediaFile *media_file) {
+  if (this->pcm_cache_ == nullptr) {
+    this->pcm_cache_ = make_unique<AudioPcmCache>();
+  }
+  this->pcm_cache_->add_file(media_file);
+}
 
+esp_err_t NabuMediaPlayer::start_mixer_() {
   if (this->speaker_ != nullptr) {
     audio::AudioStreamInfo audio_stream_info;
     audio_stream_info.channels = 2;
-    audio_stream_info.bits_per_sample = 16;
+    audio_stream_info.bits_per_sample = 32;  // The mixer's format; the speaker narrows it if needed
     audio_stream_info.sample_rate = this->sample_rate_;
 
     this->speaker_->set_audio_stream_info(audio_stream_info);
@@ -125,23 +195,213 @@ esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
 
   if (this->audio_mixer_ == nullptr) {
     this->audio_mixer_ = make_unique<AudioMixer>();
-    err = this->audio_mixer_->start(this->speaker_, "mixer", MIXER_TASK_PRIORITY);
+
+    const size_t frame_bytes = NUMBER_OF_CHANNELS * sizeof(int32_t);
+    this->audio_mixer_->set_prebuffer(this->media_prebuffer_ms_ * this->sample_rate_ / 1000 * frame_bytes,
+                                      this->announcement_prebuffer_ms_ * this->sample_rate_ / 1000 * frame_bytes);
+
+    return this->audio_mixer_->start(this->speaker_, "mixer", MIXER_TASK_PRIORITY);
+  }
+
+  return ESP_OK;
+}
+
+std::unique_ptr<AudioPipeline> NabuMediaPlayer::make_pipeline_(AudioPipelineType type) {
+  auto pipeline = make_unique<AudioPipeline>(this->audio_mixer_.get(), type);
+  pipeline->set_stream_buffer_max_size(this->stream_buffer_max_size_);
+  pipeline->set_buffer_arena(&this->buffer_arena_);
+  pipeline->set_connection_pool(&this->connection_pool_);
+  if (type == AudioPipelineType::ANNOUNCEMENT) {
+    // Local announcement files (e.g., wake sounds) are short; one task for all stages saves RAM and start latency
+    pipeline->set_fuse_file_stages(true);
+    if (this->announcement_cache_enabled_) {
+      pipeline->set_url_cache(&this->url_cache_);
+    }
+  }
+  return pipeline;
+}
+
+esp_err_t NabuMediaPlayer::start_media_pipeline_(bool url) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  if (this->media_pipeline_ == nullptr) {
+    this->media_pipeline_ = this->make_pipeline_(AudioPipelineType::MEDIA);
+  }
+
+  if (url) {
+    err = this->media_pipeline_->start(this->media_url_.value(), this->sample_rate_, "media",
+                                       MEDIA_PIPELINE_TASK_PRIORITY);
+  } else {
+    err = this->media_pipeline_->start(this->media_file_.value(), this->sample_rate_, "media",
+                                       MEDIA_PIPELINE_TASK_PRIORITY);
+  }
+
+  if (this->is_paused_) {
+    CommandEvent command_event;
+    command_event.command = CommandEventType::RESUME_MEDIA;
+    this->audio_mixer_->send_command(&command_event);
+  }
+  this->is_paused_ = false;
+
+  return err;
+}
+
+esp_err_t NabuMediaPlayer::start_announcement_(const AnnouncementItem &item) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  if (item.file.has_value() && (this->pcm_cache_ != nullptr)) {
+    const CachedPcmEntry *entry = this->pcm_cache_->find(item.file.value());
+    if (entry != nullptr) {
+      return this->start_cached_announcement_(entry);
+    }
+  }
+
+  this->stop_cached_announcement_();
+
+  if (this->announcement_pipeline_ == nullptr) {
+    this->announcement_pipeline_ = this->make_pipeline_(AudioPipelineType::ANNOUNCEMENT);
+  }
+
+  if (item.url.has_value()) {
+    return this->announcement_pipeline_->start(item.url.value(), this->sample_rate_, "ann",
+                                               ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
+  }
+  return this->announcement_pipeline_->start(item.file.value(), this->sample_rate_, "ann",
+                                             ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
+}
+
+esp_err_t NabuMediaPlayer::start_cached_announcement_(const CachedPcmEntry *entry) {
+  if (this->announcement_pipeline_ != nullptr) {
+    // Clears the mixer's announcement ring buffer if the pipeline wrote into it
+    esp_err_t err = this->announcement_pipeline_->stop();
     if (err != ESP_OK) {
       return err;
     }
   }
+  this->stop_cached_announcement_();
+
+  // The clear commands only discard the audio written before they were sent, so the copy can start right away
+  this->cached_announcement_ = entry;
+  this->cached_announcement_position_ = 0;
+  this->feed_cached_announcement_();
+
+  return ESP_OK;
+}
+
+void NabuMediaPlayer::stop_cached_announcement_() {
+  if (this->cached_announcement_ == nullptr) {
+    return;
+  }
+  this->cached_announcement_ = nullptr;
+
+  CommandEvent command_event;
+  command_event.command = CommandEventType::CLEAR_ANNOUNCEMENT;
+  command_event.stream_end = this->audio_mixer_->get_announcement_ring_buffer()->get_stats().bytes_written;
+  this->audio_mixer_->send_command(&command_event);
+}
+
+void NabuMediaPlayer::feed_cached_announcement_() {
+  if (this->cached_announcement_ == nullptr) {
+    return;
+  }
+
+  // The ring buffer holds a quarter second of audio, which easily covers the time between loop iterations
+  AudioRingBuffer *ring_buffer = this->audio_mixer_->get_announcement_ring_buffer();
+  this->cached_announcement_position_ +=
+      AudioPcmCache::write_to(this->cached_announcement_, this->cached_announcement_position_, ring_buffer);
+
+  if (this->cached_announcement_position_ >= this->cached_announcement_->length) {
+    // The mixer plays out the rest on its own, even if it is shorter than the prebuffer
+    this->cached_announcement_ = nullptr;
 
-  if (type == AudioPipelineType::MEDIA) {
-    if (this->media_pipeline_ == nullptr) {
-      this->media_pipeline_ = make_unique<AudioPipeline>(this->audio_mixer_.get(), type);
+    CommandEvent command_event;
+    command_event.command = CommandEventType::FINISH_ANNOUNCEMENT;
+    command_event.stream_end = ring_buffer->get_stats().bytes_written;
+    this->audio_mixer_->send_command(&command_event);
+  }
+}
+
+esp_err_t NabuMediaPlayer::prefetch_next_media_() {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  if (this->next_media_pipeline_ == nullptr) {
+    this->next_media_pipeline_ = this->make_pipeline_(AudioPipelineType::MEDIA);
+  }
+
+  PlaylistItem item = this->media_playlist_.front();
+  this->media_playlist_.pop_front();
+
+  if (item.url.has_value()) {
+    err = this->next_media_pipeline_->prefetch(item.url.value(), this->sample_rate_, "media",
+                                               MEDIA_PIPELINE_TASK_PRIORITY);
+  } else {
+    err = this->next_media_pipeline_->prefetch(item.file.value(), this->sample_rate_, "media",
+                                               MEDIA_PIPELINE_TASK_PRIORITY);
+  }
+
+  this->next_media_prefetching_ = (err == ESP_OK);
+
+  return err;
+}
+
+void NabuMediaPlayer::stop_next_media_pipeline_() {
+  if (this->next_media_prefetching_) {
+    // Its output never started, so this leaves the audio already in the mixer alone
+    this->next_media_pipeline_->stop();
+    this->next_media_prefetching_ = false;
+  }
+}
+
+void NabuMediaPlayer::watch_media_playlist_() {
+  if (this->next_media_prefetching_) {
+    this->next_media_pipeline_state_ = this->next_media_pipeline_->get_state();
+
+    if ((this->next_media_pipeline_state_ == AudioPipelineState::ERROR_READING) ||
+        (this->next_media_pipeline_state_ == AudioPipelineState::ERROR_DECODING) ||
+        (this->next_media_pipeline_state_ == AudioPipelineState::ERROR_RESAMPLING)) {
+      ESP_LOGE(TAG, "Failed to prefetch the next playlist item; skipping it.");
+      this->next_media_prefetching_ = false;
     }
+  }
 
-    if (url) {
-      err = this->media_pipeline_->start(this->media_url_.value(), this->sample_rate_, "media",
-                                         MEDIA_PIPELINE_TASK_PRIORITY);
-    } else {
-      err = this->media_pipeline_->start(this->media_file_.value(), this->sample_rate_, "media",
-                                         MEDIA_PIPELINE_TASK_PRIORITY);
+  if ((this->media_pipeline_state_ == AudioPipelineState::ERROR_READING) ||
+      (this->media_pipeline_state_ == AudioPipelineState::ERROR_DECODING) ||
+      (this->media_pipeline_state_ == AudioPipelineState::ERROR_RESAMPLING)) {
+    // A failed item ends like a finished one. Its pipeline reports the error once and then reports playing until its
+    // tasks have stopped, so ask again instead of waiting for the next loop; the next item may only write to the
+    // mixer's media ring buffer once they have.
+    if (this->next_media_prefetching_ || !this->media_playlist_.empty()) {
+      ESP_LOGW(TAG, "The playlist item failed; skipping to the next one");
+    }
+    this->media_pipeline_state_ = this->media_pipeline_->get_state();
+  }
+
+  if (this->media_pipeline_state_ != AudioPipelineState::STOPPED) {
+    // Prefetch the next item while the current one plays
+    if (!this->next_media_prefetching_ && !this->media_playlist_.empty()) {
+      esp_err_t err = this->prefetch_next_media_();
+      if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Error prefetching the next playlist item: %s", esp_err_to_name(err));
+      }
+    }
+    return;
+  }
+
+  if (!this->next_media_prefetching_ && !this->media_playlist_.empty()) {
+    // Nothing is playing, so start the next item right away
+    esp_err_t err = this->prefetch_next_media_();
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Error starting the next playlist item: %s", esp_err_to_name(err));
+      return;
     }
 
     if (this->is_paused_) {
@@ -150,23 +410,174 @@ esp_err_t NabuMediaPlayer::start_pipeline_(AudioPipelineType type, bool url) {
       this->audio_mixer_->send_command(&command_event);
     }
     this->is_paused_ = false;
-  } else if (type == AudioPipelineType::ANNOUNCEMENT) {
-    if (this->announcement_pipeline_ == nullptr) {
-      this->announcement_pipeline_ = make_unique<AudioPipeline>(this->audio_mixer_.get(), type);
-    }
+  }
 
-    if (url) {
-      err = this->announcement_pipeline_->start(this->announcement_url_.value(), this->sample_rate_, "ann",
-                                                ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
-    } else {
-      err = this->announcement_pipeline_->start(this->announcement_file_.value(), this->sample_rate_, "ann",
-                                                ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
+  if (this->next_media_prefetching_) {
+    // The current pipeline has written its last sample to the mixer's media ring buffer. Let the prefetched pipeline
+    // continue the same ring buffer, so its first sample directly follows without a gap.
+    std::swap(this->media_pipeline_, this->next_media_pipeline_);
+    this->media_pipeline_->start_output();
+    this->media_pipeline_state_ = AudioPipelineState::PLAYING;
+    this->next_media_prefetching_ = false;
+  }
+}
+
+void NabuMediaPlayer::play_announcement(media_player::MediaFile *media_file, AnnouncementPriority priority) {
+  if (!this->is_ready()) {
+    return;
+  }
+
+  AnnouncementItem item;
+  item.file = media_file;
+  item.priority = priority;
+  this->queue_announcement_(item);
+}
+
+void NabuMediaPlayer::queue_announcement_(const AnnouncementItem &item) {
+  if (this->announcement_queue_.size() >= ANNOUNCEMENT_QUEUE_LENGTH) {
+    if (this->announcement_queue_.back().priority >= item.priority) {
+      ESP_LOGW(TAG, "The announcement queue is full; dropping the new announcement");
+      return;
     }
+    ESP_LOGW(TAG, "The announcement queue is full; dropping the newest normal announcement");
+    this->announcement_queue_.pop_back();
+  }
+
+  // Behind every queued announcement of the same or a higher priority
+  auto position = this->announcement_queue_.begin();
+  while ((position != this->announcement_queue_.end()) && (position->priority >= item.priority)) {
+    ++position;
+  }
+  this->announcement_queue_.insert(position, item);
+}
+
+void NabuMediaPlayer::requeue_announcement_(const AnnouncementItem &item) {
+  auto position = this->announcement_queue_.begin();
+  while ((position != this->announcement_queue_.end()) && (position->priority > item.priority)) {
+    ++position;
+  }
+  this->announcement_queue_.insert(position, item);
+}
+
+esp_err_t NabuMediaPlayer::prefetch_next_announcement_(const AnnouncementItem &item) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  if (this->next_announcement_pipeline_ == nullptr) {
+    this->next_announcement_pipeline_ = this->make_pipeline_(AudioPipelineType::ANNOUNCEMENT);
+  }
+
+  if (item.url.has_value()) {
+    err = this->next_announcement_pipeline_->prefetch(item.url.value(), this->sample_rate_, "ann",
+                                                      ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
+  } else {
+    err = this->next_announcement_pipeline_->prefetch(item.file.value(), this->sample_rate_, "ann",
+                                                      ANNOUNCEMENT_PIPELINE_TASK_PRIORITY);
+  }
+
+  if (err == ESP_OK) {
+    this->next_announcement_ = item;
   }
 
   return err;
 }
 
+void NabuMediaPlayer::stop_next_announcement_pipeline_() {
+  if (this->next_announcement_.has_value()) {
+    // Its output never started, so this leaves the audio already in the mixer alone
+    this->next_announcement_pipeline_->stop();
+    this->requeue_announcement_(this->next_announcement_.value());
+    this->next_announcement_.reset();
+  }
+}
+
+void NabuMediaPlayer::stop_announcements_() {
+  // Stopping the prefetch puts its announcement back in the queue, so clear the queue afterwards
+  this->stop_next_announcement_pipeline_();
+  this->announcement_queue_.clear();
+  this->stop_cached_announcement_();
+  if (this->announcement_pipeline_ != nullptr) {
+    // Don't wait for the pipeline's tasks; the audio stops as soon as the mixer clears its ring buffer
+    this->announcement_pipeline_->cancel();
+  }
+}
+
+void NabuMediaPlayer::watch_announcement_queue_() {
+  if (this->next_announcement_.has_value()) {
+    AudioPipelineState state = this->next_announcement_pipeline_->get_state();
+    if ((state == AudioPipelineState::ERROR_READING) || (state == AudioPipelineState::ERROR_DECODING) ||
+        (state == AudioPipelineState::ERROR_RESAMPLING)) {
+      ESP_LOGE(TAG, "Failed to prefetch the next announcement; skipping it.");
+      this->next_announcement_.reset();
+    } else if (!this->announcement_queue_.empty() &&
+               (this->announcement_queue_.front().priority > this->next_announcement_.value().priority)) {
+      // An urgent announcement arrived after the prefetch started; it plays first
+      this->stop_next_announcement_pipeline_();
+    }
+  }
+
+  bool playing = (this->announcement_pipeline_state_ == AudioPipelineState::PLAYING) ||
+                 (this->cached_announcement_ != nullptr);
+
+  if (playing && !this->announcement_queue_.empty() &&
+      (this->announcement_queue_.front().priority > this->announcement_priority_)) {
+    ESP_LOGD(TAG, "Interrupting the announcement for an urgent one");
+    this->stop_cached_announcement_();
+    if (this->announcement_pipeline_ != nullptr) {
+      // Clears the audio it already wrote into the mixer
+      this->announcement_pipeline_->cancel();
+    }
+    playing = false;
+  }
+
+  if (playing) {
+    // Prefetch the next announcement while the current one plays. Cached files start instantly without a pipeline.
+    if (!this->next_announcement_.has_value() && !this->announcement_queue_.empty()) {
+      const AnnouncementItem &item = this->announcement_queue_.front();
+      if (!item.file.has_value() || (this->pcm_cache_ == nullptr) ||
+          (this->pcm_cache_->find(item.file.value()) == nullptr)) {
+        AnnouncementItem next_item = item;
+        this->announcement_queue_.pop_front();
+        esp_err_t err = this->prefetch_next_announcement_(next_item);
+        if (err != ESP_OK) {
+          ESP_LOGE(TAG, "Error prefetching the next announcement: %s", esp_err_to_name(err));
+        }
+      }
+    }
+    return;
+  }
+
+  if (this->next_announcement_.has_value()) {
+    // The current announcement has written its last sample to the mixer's announcement ring buffer. Let the prefetched
+    // pipeline continue the same ring buffer, so its first sample directly follows without a gap.
+    std::swap(this->announcement_pipeline_, this->next_announcement_pipeline_);
+    this->announcement_pipeline_->start_output();
+    this->announcement_pipeline_state_ = AudioPipelineState::PLAYING;
+    this->announcement_priority_ = this->next_announcement_.value().priority;
+    this->next_announcement_.reset();
+    return;
+  }
+
+  while (!this->announcement_queue_.empty()) {
+    AnnouncementItem item = this->announcement_queue_.front();
+    this->announcement_queue_.pop_front();
+
+    esp_err_t err = this->start_announcement_(item);
+    if (err == ESP_OK) {
+      this->announcement_priority_ = item.priority;
+      this->announcement_pipeline_state_ =
+          (this->cached_announcement_ == nullptr) ? AudioPipelineState::PLAYING : AudioPipelineState::STOPPED;
+      this->status_clear_error();
+      return;
+    }
+
+    ESP_LOGE(TAG, "Error starting the announcement: %s", esp_err_to_name(err));
+    this->status_set_error();
+  }
+}
+
 void NabuMediaPlayer::watch_media_commands_() {
   if (!this->is_ready()) {
     return;
@@ -177,20 +588,15 @@ void NabuMediaPlayer::watch_media_commands_() {
   esp_err_t err = ESP_OK;
 
   if (xQueueReceive(this->media_control_command_queue_, &media_command, 0) == pdTRUE) {
+    // Announcements go through the announcement queue instead
     if (media_command.new_url.has_value() && media_command.new_url.value()) {
-      if (media_command.announce.has_value() && media_command.announce.value()) {
-        err = this->start_pipeline_(AudioPipelineType::ANNOUNCEMENT, true);
-      } else {
-        err = this->start_pipeline_(AudioPipelineType::MEDIA, true);
-      }
+      this->stop_next_media_pipeline_();
+      err = this->start_media_pipeline_(true);
     }
 
     if (media_command.new_file.has_value() && media_command.new_file.value()) {
-      if (media_command.announce.has_value() && media_command.announce.value()) {
-        err = this->start_pipeline_(AudioPipelineType::ANNOUNCEMENT, false);
-      } else {
-        err = this->start_pipeline_(AudioPipelineType::MEDIA, false);
-      }
+      this->stop_next_media_pipeline_();
+      err = this->start_media_pipeline_(false);
     }
 
     if (err != ESP_OK) {
@@ -200,6 +606,17 @@ void NabuMediaPlayer::watch_media_commands_() {
       this->status_clear_error();
     }
 
+    if (media_command.seek_position_ms.has_value()) {
+      if ((this->media_pipeline_ != nullptr) && (this->media_pipeline_state_ == AudioPipelineState::PLAYING)) {
+        err = this->media_pipeline_->seek(media_command.seek_position_ms.value());
+        if (err != ESP_OK) {
+          ESP_LOGE(TAG, "Error seeking the media: %s", esp_err_to_name(err));
+        }
+      } else {
+        ESP_LOGW(TAG, "No media is playing; ignoring the seek");
+      }
+    }
+
     if (media_command.volume.has_value()) {
       this->set_volume_(media_command.volume.value());
       this->publish_state();
@@ -223,16 +640,16 @@ void NabuMediaPlayer::watch_media_commands_() {
           break;
         case media_player::MEDIA_PLAYER_COMMAND_STOP:
           command_event.command = CommandEventType::STOP;
-          if (media_command.announce.has_value() && media_command.announce.value()) {
-            if (this->announcement_pipeline_ != nullptr) {
-              this->announcement_pipeline_->stop();
-            }
-          } else {
-            if (this->media_pipeline_ != nullptr) {
-              this->media_pipeline_->stop();
-            }
+          // Don't wait for the pipeline's tasks; the audio stops as soon as the mixer clears its ring buffer.
+          // Announcements are stopped in control() instead.
+          this->stop_next_media_pipeline_();
+          if (this->media_pipeline_ != nullptr) {
+            this->media_pipeline_->cancel();
           }
           break;
+        case media_player::MEDIA_PLAYER_COMMAND_CLEAR_PLAYLIST:
+          this->stop_next_media_pipeline_();
+          break;
         case media_player::MEDIA_PLAYER_COMMAND_TOGGLE:
           if ((this->audio_mixer_ != nullptr) && this->is_paused_) {
             command_event.command = CommandEventType::RESUME_MEDIA;
@@ -276,13 +693,181 @@ void NabuMediaPlayer::watch_mixer_() {
       if (event.type == EventType::WARNING) {
         ESP_LOGD(TAG, "Mixer encountered an error: %s", esp_err_to_name(event.err));
         this->status_set_error();
+      } else if (event.type == EventType::MEDIA_UNDERRUN) {
+        ESP_LOGW(TAG, "The media stream ran out of audio; buffered it again before continuing");
+      } else if (event.type == EventType::ANNOUNCEMENT_UNDERRUN) {
+        ESP_LOGW(TAG, "The announcement stream ran out of audio; buffered it again before continuing");
       }
   }
 }
 
+void NabuMediaPlayer::log_wakeups_() {
+  uint32_t now = millis();
+  if (now - this->last_wakeup_log_time_ < WAKEUP_LOG_INTERVAL_MS) {
+    return;
+  }
+
+  uint32_t wakeup_count = 0;
+  if (this->audio_mixer_ != nullptr) {
+    wakeup_count += this->audio_mixer_->get_wakeup_count();
+  }
+  if (this->media_pipeline_ != nullptr) {
+    wakeup_count += this->media_pipeline_->get_wakeup_count();
+  }
+  if (this->next_media_pipeline_ != nullptr) {
+    wakeup_count += this->next_media_pipeline_->get_wakeup_count();
+  }
+  if (this->announcement_pipeline_ != nullptr) {
+    wakeup_count += this->announcement_pipeline_->get_wakeup_count();
+  }
+  if (this->next_announcement_pipeline_ != nullptr) {
+    wakeup_count += this->next_announcement_pipeline_->get_wakeup_count();
+  }
+
+  ESP_LOGV(TAG, "Audio task wakeups per second: %.1f",
+           (wakeup_count - this->last_wakeup_count_) * 1000.0f / (now - this->last_wakeup_log_time_));
+
+  this->last_wakeup_count_ = wakeup_count;
+  this->last_wakeup_log_time_ = now;
+}
+
+#ifdef USE_SENSOR
+void NabuMediaPlayer::publish_diagnostics_() {
+  uint32_t now = millis();
+  uint32_t elapsed_ms = now - this->last_diagnostics_time_;
+  if (elapsed_ms < this->diagnostics_update_interval_ms_) {
+    return;
+  }
+  this->last_diagnostics_time_ = now;
+
+  AudioBufferArenaStats arena_stats = this->buffer_arena_.get_stats();
+  if (this->buffer_memory_sensor_ != nullptr) {
+    this->buffer_memory_sensor_->publish_state(arena_stats.leased_bytes);
+  }
+  if (this->buffer_memory_peak_sensor_ != nullptr) {
+    this->buffer_memory_peak_sensor_->publish_state(arena_stats.peak_leased_bytes);
+  }
+  const uint32_t first_byte_time_ms = this->connection_pool_.get_first_byte_time_ms();
+  if ((this->first_byte_time_sensor_ != nullptr) && (first_byte_time_ms > 0)) {
+    this->first_byte_time_sensor_->publish_state(first_byte_time_ms);
+  }
+  if (this->announcement_cache_hits_sensor_ != nullptr) {
+    this->announcement_cache_hits_sensor_->publish_state(this->url_cache_.get_hits());
+  }
+  if (this->announcement_cache_misses_sensor_ != nullptr) {
+    this->announcement_cache_misses_sensor_->publish_state(this->url_cache_.get_misses());
+  }
+
+  if ((this->media_pipeline_ == nullptr) || (this->audio_mixer_ == nullptr)) {
+    return;
+  }
+
+  AudioPipelineStats pipeline_stats = this->media_pipeline_->get_stats();
+  AudioMixerStats mixer_stats = this->audio_mixer_->get_stats();
+
+  std::array<AudioStageStats, DIAGNOSTIC_STAGE_COUNT> stage_stats = {
+      pipeline_stats.reader, pipeline_stats.decoder, pipeline_stats.resampler, mixer_stats.mixer};
+  std::array<const RingBufferStats *, DIAGNOSTIC_STAGE_COUNT> input_ring_buffer_stats = {
+      nullptr, &pipeline_stats.raw_file_ring_buffer, &pipeline_stats.decoded_ring_buffer,
+      &mixer_stats.media_ring_buffer};
+
+  // Counters restart with a different pipeline after a playlist transition, so skip one round of rates
+  bool same_pipeline = (this->media_pipeline_.get() == this->last_diagnostics_pipeline_);
+
+  for (size_t stage = 0; stage < DIAGNOSTIC_STAGE_COUNT; ++stage) {
+    auto &sensors = this->diagnostic_sensors_[stage];
+    const AudioStageStats &current = stage_stats[stage];
+    const AudioStageStats &last = this->last_stage_stats_[stage];
+
+    sensor::Sensor *throughput = sensors[static_cast<size_t>(DiagnosticMetric::THROUGHPUT)];
+    sensor::Sensor *input_stall = sensors[static_cast<size_t>(DiagnosticMetric::INPUT_STALL)];
+    sensor::Sensor *output_stall = sensors[static_cast<size_t>(DiagnosticMetric::OUTPUT_STALL)];
+    sensor::Sensor *min_fill = sensors[static_cast<size_t>(DiagnosticMetric::INPUT_BUFFER_MIN_FILL)];
+    sensor::Sensor *max_fill = sensors[static_cast<size_t>(DiagnosticMetric::INPUT_BUFFER_MAX_FILL)];
+    sensor::Sensor *buffer_size = sensors[static_cast<size_t>(DiagnosticMetric::INPUT_BUFFER_SIZE)];
+    sensor::Sensor *underruns = sensors[static_cast<size_t>(DiagnosticMetric::UNDERRUNS)];
+
+    if (underruns != nullptr) {
+      underruns->publish_state(mixer_stats.media_underruns);
+    }
+
+    if (same_pipeline) {
+      // Unsigned subtraction handles the counters wrapping around
+      if (throughput != nullptr) {
+        throughput->publish_state((current.bytes_out - last.bytes_out) * 1000.0f / elapsed_ms);
+      }
+      if (input_stall != nullptr) {
+        input_stall->publish_state((current.input_blocked_us - last.input_blocked_us) / (elapsed_ms * 10.0f));
+      }
+      if (output_stall != nullptr) {
+        output_stall->publish_state((current.output_blocked_us - last.output_blocked_us) / (elapsed_ms * 10.0f));
+      }
+    }
+
+    const RingBufferStats *ring_buffer_stats = input_ring_buffer_stats[stage];
+    if ((ring_buffer_stats != nullptr) && (ring_buffer_stats->capacity > 0)) {
+      if (min_fill != nullptr) {
+        min_fill->publish_state(ring_buffer_stats->min_fill * 100.0f / ring_buffer_stats->capacity);
+      }
+      if (max_fill != nullptr) {
+        max_fill->publish_state(ring_buffer_stats->max_fill * 100.0f / ring_buffer_stats->capacity);
+      }
+      if (buffer_size != nullptr) {
+        buffer_size->publish_state(ring_buffer_stats->capacity);
+      }
+    }
+  }
+
+  this->media_pipeline_->restart_fill_ranges();
+  this->audio_mixer_->restart_fill_ranges();
+
+  this->last_stage_stats_ = stage_stats;
+  this->last_diagnostics_pipeline_ = this->media_pipeline_.get();
+}
+#endif
+
+void NabuMediaPlayer::release_idle_pipelines_() {
+  bool released = false;
+
+  if ((this->announcement_pipeline_ != nullptr) &&
+      this->announcement_pipeline_->release_if_idle(PIPELINE_IDLE_RELEASE_MS)) {
+    released = true;
+  }
+  if ((this->media_pipeline_ != nullptr) && this->media_pipeline_->release_if_idle(PIPELINE_IDLE_RELEASE_MS)) {
+    released = true;
+#ifdef USE_SENSOR
+    // Its counters restart with the next stream
+    this->last_diagnostics_pipeline_ = nullptr;
+#endif
+  }
+  if ((this->next_media_pipeline_ != nullptr) &&
+      this->next_media_pipeline_->release_if_idle(PIPELINE_IDLE_RELEASE_MS)) {
+    released = true;
+  }
+  if ((this->next_announcement_pipeline_ != nullptr) &&
+      this->next_announcement_pipeline_->release_if_idle(PIPELINE_IDLE_RELEASE_MS)) {
+    released = true;
+  }
+
+  if (released) {
+    AudioBufferArenaStats arena_stats = this->buffer_arena_.get_stats();
+    ESP_LOGD(TAG, "Released idle pipeline buffers; %zu bytes still leased (peak %zu bytes)", arena_stats.leased_bytes,
+             arena_stats.peak_leased_bytes);
+  }
+}
+
 void NabuMediaPlayer::loop() {
   this->watch_media_commands_();
   this->watch_mixer_();
+  this->feed_cached_announcement_();
+  this->log_wakeups_();
+#ifdef USE_SENSOR
+  this->publish_diagnostics_();
+#endif
+
+  if ((this->pcm_cache_ != nullptr) && !this->pcm_cache_->is_built()) {
+    this->pcm_cache_->build(PCM_CACHE_BUILD_SLICE_MS);
+  }
 
   // Determine state of the media player
   media_player::MediaPlayerState old_state = this->state;
@@ -309,10 +894,26 @@ void NabuMediaPlayer::loop() {
     ESP_LOGE(TAG, "The announcement pipeline's audio resampler encountered an error.");
   }
 
-  if (this->announcement_pipeline_state_ != AudioPipelineState::STOPPED) {
+  this->watch_media_playlist_();
+  this->watch_announcement_queue_();
+  this->release_idle_pipelines_();
+  this->connection_pool_.close_expired();
+
+  // A pipeline stops once it has written all of its audio to the mixer, but the mixer still has to play it
+  bool announcement_buffered = false;
+  bool media_buffered = false;
+  if (this->audio_mixer_ != nullptr) {
+    AudioRingBuffer *announcement_ring_buffer = this->audio_mixer_->get_announcement_ring_buffer();
+    AudioRingBuffer *media_ring_buffer = this->audio_mixer_->get_media_ring_buffer();
+    announcement_buffered = (announcement_ring_buffer != nullptr) && (announcement_ring_buffer->available() > 0);
+    media_buffered = (media_ring_buffer != nullptr) && (media_ring_buffer->available() > 0);
+  }
+
+  if ((this->announcement_pipeline_state_ != AudioPipelineState::STOPPED) || announcement_buffered ||
+      (this->cached_announcement_ != nullptr)) {
     this->state = media_player::MEDIA_PLAYER_STATE_ANNOUNCING;
   } else {
-    if (this->media_pipeline_state_ == AudioPipelineState::STOPPED) {
+    if ((this->media_pipeline_state_ == AudioPipelineState::STOPPED) && !media_buffered) {
       this->state = media_player::MEDIA_PLAYER_STATE_IDLE;
     } else if (this->is_paused_) {
       this->state = media_player::MEDIA_PLAYER_STATE_PAUSED;
@@ -338,6 +939,16 @@ void NabuMediaPlayer::set_ducking_reduction(uint8_t decibel_reduction, float dur
   }
 }
 
+void NabuMediaPlayer::seek(uint32_t position_ms) {
+  if (!this->is_ready()) {
+    return;
+  }
+
+  MediaCallCommand media_command;
+  media_command.seek_position_ms = position_ms;
+  xQueueSend(this->media_control_command_queue_, &media_command, portMAX_DELAY);
+}
+
 void NabuMediaPlayer::control(const media_player::MediaPlayerCall &call) {
   if (!this->is_ready()) {
     return;
@@ -351,25 +962,60 @@ void NabuMediaPlayer::control(const media_player::MediaPlayerCall &call) {
     media_command.announce = false;
   }
 
-  if (call.get_media_url().has_value()) {
-    std::string new_uri = call.get_media_url().value();
+  if (!media_command.announce.value() && call.get_command().has_value() &&
+      (call.get_command().value() == media_player::MEDIA_PLAYER_COMMAND_ENQUEUE)) {
+    // The loop starts the item once the media before it finishes. Only YAML lambdas send ENQUEUE; see the top of file.
+    PlaylistItem item;
+    if (call.get_media_url().has_value()) {
+      item.url = call.get_media_url().value();
+    } else if (call.get_local_media_file().has_value()) {
+      item.file = call.get_local_media_file().value();
+    } else {
+      return;
+    }
+    this->media_playlist_.push_back(item);
+    return;
+  }
 
-    media_command.new_url = true;
-    if (call.get_announcement().has_value() && call.get_announcement().value()) {
-      this->announcement_url_ = new_uri;
+  if (!media_command.announce.value() &&
+      (call.get_media_url().has_value() || call.get_local_media_file().has_value() ||
+       (call.get_command().has_value() &&
+        ((call.get_command().value() == media_player::MEDIA_PLAYER_COMMAND_STOP) ||
+         (call.get_command().value() == media_player::MEDIA_PLAYER_COMMAND_CLEAR_PLAYLIST))))) {
+    // Playing new media replaces the playlist
+    this->media_playlist_.clear();
+  }
+
+  if (media_command.announce.value() && call.get_command().has_value() &&
+      (call.get_command().value() == media_player::MEDIA_PLAYER_COMMAND_STOP)) {
+    // Announcements are queued right here, so they are stopped right here too. Otherwise a stop followed by an
+    // announcement (e.g., the play_sound script) would clear the new announcement once the loop reads the stop.
+    this->stop_announcements_();
+    return;
+  }
+
+  if (media_command.announce.value() &&
+      (call.get_media_url().has_value() || call.get_local_media_file().has_value())) {
+    // The loop plays it once the announcements queued before it have played
+    AnnouncementItem item;
+    if (call.get_media_url().has_value()) {
+      item.url = call.get_media_url().value();
     } else {
-      this->media_url_ = new_uri;
+      item.file = call.get_local_media_file().value();
     }
+    this->queue_announcement_(item);
+    return;
+  }
+
+  if (call.get_media_url().has_value()) {
+    this->media_url_ = call.get_media_url().value();
+    media_command.new_url = true;
     xQueueSend(this->media_control_command_queue_, &media_command, portMAX_DELAY);
     return;
   }
 
   if (call.get_local_media_file().has_value()) {
-    if (call.get_announcement().has_value() && call.get_announcement().value()) {
-      this->announcement_file_ = call.get_local_media_file().value();
-    } else {
-      this->media_file_ = call.get_local_media_file().value();
-    }
+    this->media_file_ = call.get_local_media_file().value();
     media_command.new_file = true;
     xQueueSend(this->media_control_command_queue_, &media_command, portMAX_DELAY);
     return;
@@ -403,6 +1049,8 @@ media_player::MediaPlayerTraits NabuMediaPlayer::get_traits() {
                                                .num_channels = 2,
                                                .purpose = media_player::MediaPlayerFormatPurpose::PURPOSE_DEFAULT,
                                                .sample_bytes = 2});
+  // Opus streams play, but aren't offered for announcements until the decoder task's stack margin has been measured
+  // on the device with libopus
   traits.get_supported_formats().push_back(
       media_player::MediaPlayerSupportedFormat{.format = "flac",
                                                .sample_rate = this->sample_rate_,
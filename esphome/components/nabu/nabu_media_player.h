@@ -3,12 +3,16 @@
 #ifdef USE_ESP_IDF
 
 #include "audio_mixer.h"
+#include "audio_pcm_cache.h"
 #include "audio_pipeline.h"
 
 #ifdef USE_AUDIO_DAC
 #include "esphome/components/audio_dac/audio_dac.h"
 #endif
 #include "esphome/components/media_player/media_player.h"
+#ifdef USE_SENSOR
+#include "esphome/components/sensor/sensor.h"
+#endif
 #include "esphome/components/speaker/speaker.h"
 
 #include "esphome/core/automation.h"
@@ -20,6 +24,9 @@
 
 #include <esp_http_client.h>
 
+#include <array>
+#include <deque>
+
 namespace esphome {
 namespace nabu {
 
@@ -29,8 +36,51 @@ struct MediaCallCommand {
   optional<bool> announce;
   optional<bool> new_url;
   optional<bool> new_file;
+  optional<uint32_t> seek_position_ms;
+};
+
+// A queued media track; exactly one of url or file is set
+struct PlaylistItem {
+  optional<std::string> url;
+  optional<media_player::MediaFile *> file;
+};
+
+// Urgent announcements interrupt normal ones and play before any queued normal ones
+enum class AnnouncementPriority : uint8_t {
+  NORMAL = 0,
+  URGENT,
+};
+
+// A queued announcement; exactly one of url or file is set
+struct AnnouncementItem {
+  optional<std::string> url;
+  optional<media_player::MediaFile *> file;
+  AnnouncementPriority priority{AnnouncementPriority::NORMAL};
+};
+
+#ifdef USE_SENSOR
+// Stages of the media stream that diagnostic sensors report on
+enum class DiagnosticStage : uint8_t {
+  READER = 0,
+  DECODER,
+  RESAMPLER,
+  MIXER,
 };
 
+enum class DiagnosticMetric : uint8_t {
+  THROUGHPUT = 0,         // Bytes output per second
+  INPUT_STALL,            // Percentage of time waiting for input
+  OUTPUT_STALL,           // Percentage of time waiting for room to output
+  INPUT_BUFFER_MIN_FILL,  // Lowest fill level of the stage's input ring buffer, in percent
+  INPUT_BUFFER_MAX_FILL,  // Highest fill level of the stage's input ring buffer, in percent
+  INPUT_BUFFER_SIZE,      // Capacity of the stage's input ring buffer, in bytes
+  UNDERRUNS,              // Times the media stream ran dry before it finished; only for the mixer
+};
+
+static const size_t DIAGNOSTIC_STAGE_COUNT = 4;
+static const size_t DIAGNOSTIC_METRIC_COUNT = 7;
+#endif
+
 struct VolumeRestoreState {
   float volume;
   bool is_muted;
@@ -51,6 +101,15 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
   /// @param duration (float) The duration (in seconds) for transitioning to the new ducking level
   void set_ducking_reduction(uint8_t decibel_reduction, float duration);
 
+  /// @brief Continues the playing media at a new position. Only the media pipeline's reader and decoder restart; the
+  /// mixer and speaker keep running.
+  /// @param position_ms (uint32_t) The position in milliseconds from the start of the media
+  void seek(uint32_t position_ms);
+
+  /// @brief Queues a local media file as an announcement. Announcements play in order; an urgent one interrupts a
+  /// playing normal one and plays before any queued normal ones.
+  void play_announcement(media_player::MediaFile *media_file, AnnouncementPriority priority);
+
   void set_sample_rate(uint32_t sample_rate) { this->sample_rate_ = sample_rate; }
 
   // Percentage to increase or decrease the volume for volume up or volume down commands
@@ -65,6 +124,48 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
 
   void set_speaker(speaker::Speaker *speaker) { this->speaker_ = speaker; }
 
+  /// @brief Sets how much audio the mixer waits for before it starts (or continues after an underrun) each stream
+  void set_media_prebuffer(uint32_t prebuffer_ms) { this->media_prebuffer_ms_ = prebuffer_ms; }
+  void set_announcement_prebuffer(uint32_t prebuffer_ms) { this->announcement_prebuffer_ms_ = prebuffer_ms; }
+
+  /// @brief Sets the largest size a media stream's buffer of compressed audio grows to when the network stalls
+  void set_stream_buffer_max_size(size_t stream_buffer_max_size) {
+    this->stream_buffer_max_size_ = stream_buffer_max_size;
+  }
+
+  /// @brief Sets the byte budget for caching the encoded audio of announcement urls in external RAM; 0 disables it
+  void set_announcement_cache_size(size_t announcement_cache_size) {
+    this->url_cache_.set_max_size(announcement_cache_size);
+    this->announcement_cache_enabled_ = (announcement_cache_size > 0);
+  }
+
+  /// @brief Sets the byte budget for the decoded audio of the cached files in external RAM
+  void set_file_cache_size(size_t file_cache_size) { this->file_cache_size_ = file_cache_size; }
+
+  /// @brief Decodes and resamples the file once after boot. Announcements of it are then copied straight into the
+  /// mixer instead of going through the announcement pipeline.
+  void add_cached_media_file(media_player::MediaFile *media_file);
+
+#ifdef USE_SENSOR
+  /// @brief Sets a sensor that publishes one of the media stream's telemetry metrics
+  void set_diagnostic_sensor(DiagnosticStage stage, DiagnosticMetric metric, sensor::Sensor *sensor) {
+    this->diagnostic_sensors_[static_cast<size_t>(stage)][static_cast<size_t>(metric)] = sensor;
+  }
+  void set_diagnostics_update_interval(uint32_t update_interval_ms) {
+    this->diagnostics_update_interval_ms_ = update_interval_ms;
+  }
+  /// @brief Sets sensors that publish the current and peak memory leased by the pipelines' buffers
+  void set_buffer_memory_sensor(sensor::Sensor *sensor) { this->buffer_memory_sensor_ = sensor; }
+  void set_buffer_memory_peak_sensor(sensor::Sensor *sensor) { this->buffer_memory_peak_sensor_ = sensor; }
+  /// @brief Sets a sensor that publishes the time from starting the latest url stream to its first byte of audio
+  void set_first_byte_time_sensor(sensor::Sensor *sensor) { this->first_byte_time_sensor_ = sensor; }
+  /// @brief Sets sensors that count announcement urls played from the cache and fetched from the network
+  void set_announcement_cache_hits_sensor(sensor::Sensor *sensor) { this->announcement_cache_hits_sensor_ = sensor; }
+  void set_announcement_cache_misses_sensor(sensor::Sensor *sensor) {
+    this->announcement_cache_misses_sensor_ = sensor;
+  }
+#endif
+
   Trigger<> *get_mute_trigger() const { return this->mute_trigger_; }
   Trigger<> *get_unmute_trigger() const { return this->unmute_trigger_; }
   Trigger<float> *get_volume_trigger() const { return this->volume_trigger_; }
@@ -72,6 +173,7 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
  protected:
   // Receives commands from HA or from the voice assistant component
   // Sends commands to the media_control_commanda_queue_
+  // The ENQUEUE and CLEAR_PLAYLIST commands only come from YAML lambdas, as HA's API can't send them
   void control(const media_player::MediaPlayerCall &call) override;
 
   /// @brief Updates this->volume and saves volume/mute state to flash for restortation if publish is true.
@@ -88,31 +190,134 @@ class NabuMediaPlayer : public Component, public media_player::MediaPlayer {
   // Reads commands from media_control_command_queue_. Starts pipelines and mixer if necessary.
   void watch_media_commands_();
 
+  // Starts the next playlist item once the current media finishes and prefetches the one after it while it plays
+  void watch_media_playlist_();
+
+  /// @brief Starts reading and decoding the front playlist item in the next media pipeline without feeding the mixer
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t prefetch_next_media_();
+
+  /// @brief Stops the next media pipeline if it is prefetching. The item it was prefetching is dropped.
+  void stop_next_media_pipeline_();
+
+  /// @brief Adds an announcement to the queue behind the ones of the same or a higher priority. Drops the newest
+  /// normal announcement (or the new one) if the queue is full.
+  void queue_announcement_(const AnnouncementItem &item);
+
+  /// @brief Puts an announcement back in front of the queued ones of the same priority
+  void requeue_announcement_(const AnnouncementItem &item);
+
+  // Starts the front queued announcement once the playing one has written all of its audio to the mixer, interrupts a
+  // normal announcement for an urgent one, and prefetches the next announcement while one plays
+  void watch_announcement_queue_();
+
+  /// @brief Starts an announcement, either from the PCM cache or through the announcement pipeline
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t start_announcement_(const AnnouncementItem &item);
+
+  /// @brief Starts reading and decoding an announcement in the next announcement pipeline without feeding the mixer
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t prefetch_next_announcement_(const AnnouncementItem &item);
+
+  /// @brief Stops the next announcement pipeline if it is prefetching and puts its announcement back in the queue
+  void stop_next_announcement_pipeline_();
+
+  /// @brief Stops the playing announcement, its prefetched successor, and drops the queued ones. Called from control(),
+  /// in the same order as the announcements are queued.
+  void stop_announcements_();
+
+  // The pipelines lease their ring buffers and scratch buffers from here and give them back once idle. Declared before
+  // the pipelines, so it outlives them.
+  AudioBufferArena buffer_arena_;
+  // Keeps the pipelines' idle HTTP connections, so the next stream from the same host skips the handshakes
+  HttpConnectionPool connection_pool_;
+  // Keeps the encoded audio of recent announcement urls, so repeated TTS responses skip the network
+  AudioUrlCache url_cache_;
+  bool announcement_cache_enabled_{false};
+
   std::unique_ptr<AudioPipeline> media_pipeline_;
+  std::unique_ptr<AudioPipeline> next_media_pipeline_;  // Prefetches the next playlist item; swapped in when it starts
   std::unique_ptr<AudioPipeline> announcement_pipeline_;
+  std::unique_ptr<AudioPipeline> next_announcement_pipeline_;  // Prefetches the next queued announcement
   std::unique_ptr<AudioMixer> audio_mixer_;
 
+  // Gives back the memory of pipelines that have been stopped for a while
+  void release_idle_pipelines_();
+
   speaker::Speaker *speaker_{nullptr};
 
   // Monitors the mixer task
   void watch_mixer_();
 
-  // Starts the ``type`` pipeline with a ``url`` or file. Starts the mixer, pipeline, and speaker tasks if necessary.
+  // Logs how often the audio tasks wake up (at the verbose log level)
+  void log_wakeups_();
+  uint32_t last_wakeup_log_time_{0};
+  uint32_t last_wakeup_count_{0};
+
+#ifdef USE_SENSOR
+  // Publishes the media stream's telemetry to the configured diagnostic sensors
+  void publish_diagnostics_();
+  std::array<std::array<sensor::Sensor *, DIAGNOSTIC_METRIC_COUNT>, DIAGNOSTIC_STAGE_COUNT> diagnostic_sensors_{};
+  uint32_t diagnostics_update_interval_ms_{10000};
+  uint32_t last_diagnostics_time_{0};
+  std::array<AudioStageStats, DIAGNOSTIC_STAGE_COUNT> last_stage_stats_{};
+  AudioPipeline *last_diagnostics_pipeline_{nullptr};  // Rates are only computed across snapshots of the same pipeline
+  sensor::Sensor *buffer_memory_sensor_{nullptr};
+  sensor::Sensor *buffer_memory_peak_sensor_{nullptr};
+  sensor::Sensor *first_byte_time_sensor_{nullptr};
+  sensor::Sensor *announcement_cache_hits_sensor_{nullptr};
+  sensor::Sensor *announcement_cache_misses_sensor_{nullptr};
+#endif
+
+  // Sets the speaker's stream info and starts the mixer task if necessary
+  esp_err_t start_mixer_();
+
+  // Creates a pipeline feeding the ``type`` input of the mixer
+  std::unique_ptr<AudioPipeline> make_pipeline_(AudioPipelineType type);
+
+  // Starts the media pipeline with a ``url`` or file. Starts the mixer, pipeline, and speaker tasks if necessary.
   // Unpauses if starting media in paused state
-  esp_err_t start_pipeline_(AudioPipelineType type, bool url);
+  esp_err_t start_media_pipeline_(bool url);
+
+  /// @brief Plays a cached announcement instead of starting the announcement pipeline. Stops any playing announcement.
+  /// @return ESP_OK if successful or an appropriate error if not
+  esp_err_t start_cached_announcement_(const CachedPcmEntry *entry);
+
+  /// @brief Stops a playing cached announcement and clears the audio it already copied into the mixer
+  void stop_cached_announcement_();
+
+  /// @brief Copies as much of the playing cached announcement into the mixer's announcement ring buffer as fits
+  void feed_cached_announcement_();
+
+  std::unique_ptr<AudioPcmCache> pcm_cache_;
+  size_t file_cache_size_{0};
+  const CachedPcmEntry *cached_announcement_{nullptr};  // Set until all of its audio is copied into the mixer
+  size_t cached_announcement_position_{0};
 
   AudioPipelineState media_pipeline_state_{AudioPipelineState::STOPPED};
+  AudioPipelineState next_media_pipeline_state_{AudioPipelineState::STOPPED};
+  bool next_media_prefetching_{false};
   AudioPipelineState announcement_pipeline_state_{AudioPipelineState::STOPPED};
 
-  optional<std::string> media_url_{};                        // only modified by control function
-  optional<std::string> announcement_url_{};                 // only modified by control function
-  optional<media_player::MediaFile *> media_file_{};         // only modified by control fucntion
-  optional<media_player::MediaFile *> announcement_file_{};  // only modified by control fucntion
+  optional<std::string> media_url_{};                 // only modified by control function
+  optional<media_player::MediaFile *> media_file_{};  // only modified by control fucntion
+
+  std::deque<PlaylistItem> media_playlist_;  // only modified by control function and when prefetching
+
+  std::deque<AnnouncementItem> announcement_queue_;  // Ordered by priority; only modified in the component's task
+  AnnouncementPriority announcement_priority_{AnnouncementPriority::NORMAL};  // Of the playing announcement
+  optional<AnnouncementItem> next_announcement_;  // Set while the next announcement pipeline prefetches it
 
   QueueHandle_t media_control_command_queue_;
 
   uint32_t sample_rate_;
 
+  // Largest size of a url stream's buffer of compressed audio; each pipeline starts at 64 KiB and grows on stalls
+  size_t stream_buffer_max_size_;
+
+  uint32_t media_prebuffer_ms_;
+  uint32_t announcement_prebuffer_ms_;
+
   bool is_paused_{false};
   bool is_muted_{false};
 
@@ -142,14 +347,22 @@ template<typename... Ts> class DuckingSetAction : public Action<Ts...>, public P
   }
 };
 
+template<typename... Ts> class SeekAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
+  TEMPLATABLE_VALUE(uint32_t, position)
+  void play(Ts... x) override { this->parent_->seek(this->position_.value(x...)); }
+};
+
 template<typename... Ts> class PlayLocalMediaAction : public Action<Ts...>, public Parented<NabuMediaPlayer> {
   TEMPLATABLE_VALUE(media_player::MediaFile *, media_file)
   TEMPLATABLE_VALUE(bool, announcement)
+  TEMPLATABLE_VALUE(AnnouncementPriority, priority)
   void play(Ts... x) override {
-    this->parent_->make_call()
-        .set_announcement(this->announcement_.value(x...))
-        .set_local_media_file(this->media_file_.value(x...))
-        .perform();
+    if (this->announcement_.value(x...)) {
+      // A media player call has no way to carry the priority
+      this->parent_->play_announcement(this->media_file_.value(x...), this->priority_.value(x...));
+      return;
+    }
+    this->parent_->make_call().set_local_media_file(this->media_file_.value(x...)).perform();
   }
 };
 
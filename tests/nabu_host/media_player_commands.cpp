@@ -0,0 +1,235 @@
+// Drives NabuMediaPlayer through media player calls, running its loop() the way the application does, and checks what
+// the speaker received.
+//
+//   media_player_commands <scenario> <sounds directory>
+//     stop-then-announce        A stop for announcements followed by an announcement, as the play_sound script sends
+//     stop-during-announcement  The same while another announcement plays
+//     playlist-after-error      A playlist whose first track fails to decode; the enqueued track still plays
+//     playlist-skips-error      A playlist whose middle track fails to decode; the tracks around it play
+
+#include "support/wav_file_speaker.h"
+
+#include "nabu_media_player.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace esphome;
+using namespace esphome::nabu;
+
+static const uint32_t SAMPLE_RATE = 48000;
+static const uint32_t TIMEOUT_MS = 20000;
+static const uint32_t DRAIN_MS = 200;
+
+// Frames of the sounds the scenarios play; they are at the mixer's rate, so every frame reaches the speaker
+static const uint64_t WAKE_WORD_TRIGGERED_FRAMES = 45455;
+static const uint64_t TIMER_FINISHED_FRAMES = 131072;
+
+struct LoadedFile {
+  std::vector<uint8_t> data;
+  media_player::MediaFile media_file{};
+};
+
+static bool load_file(const std::string &path, LoadedFile *file) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    fprintf(stderr, "Unable to open %s\n", path.c_str());
+    return false;
+  }
+  file->data.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+  file->media_file.data = file->data.data();
+  file->media_file.length = file->data.size();
+  file->media_file.file_type = media_player::MediaFileType::FLAC;
+  return true;
+}
+
+static void set_up(NabuMediaPlayer *player, host::WavFileSpeaker *speaker) {
+  player->set_name("test");
+  player->set_speaker(speaker);
+  player->set_sample_rate(SAMPLE_RATE);
+  player->set_volume_increment(0.05f);
+  player->set_volume_min(0.0f);
+  player->set_volume_max(1.0f);
+  player->set_media_prebuffer(100);
+  player->set_announcement_prebuffer(50);
+  player->set_stream_buffer_max_size(256 * 1024);
+  player->call_setup();
+}
+
+/// @brief Runs the loop until the player is idle again after announcing or playing, or ms pass if given. The player is
+/// idle once the mixer took all of the audio, so it then runs a little longer for the mixer to pass it on to the
+/// speaker.
+/// @return false if it timed out waiting for idle
+static bool run_loop(NabuMediaPlayer *player, uint32_t ms = 0) {
+  const uint32_t start = millis();
+  bool busy = false;
+  while (millis() - start < ((ms > 0) ? ms : TIMEOUT_MS)) {
+    player->call_loop();
+    if (player->state != media_player::MEDIA_PLAYER_STATE_IDLE) {
+      busy = true;
+    } else if ((ms == 0) && busy) {
+      return run_loop(player, DRAIN_MS);
+    }
+    delay(1);
+  }
+  return ms > 0;
+}
+
+static void announce(NabuMediaPlayer *player, LoadedFile *file) {
+  player->make_call().set_local_media_file(&file->media_file).set_announcement(true).perform();
+}
+
+static void play(NabuMediaPlayer *player, LoadedFile *file) {
+  player->make_call().set_local_media_file(&file->media_file).perform();
+}
+
+static void enqueue(NabuMediaPlayer *player, LoadedFile *file) {
+  player->make_call()
+      .set_command(media_player::MEDIA_PLAYER_COMMAND_ENQUEUE)
+      .set_local_media_file(&file->media_file)
+      .perform();
+}
+
+/// @brief A FLAC file that isn't one, so decoding it fails right away
+static void make_broken_file(LoadedFile *file) {
+  file->data.assign(4096, 0x55);
+  file->media_file.data = file->data.data();
+  file->media_file.length = file->data.size();
+  file->media_file.file_type = media_player::MediaFileType::FLAC;
+}
+
+static void stop_announcements(NabuMediaPlayer *player) {
+  player->make_call().set_command(media_player::MEDIA_PLAYER_COMMAND_STOP).set_announcement(true).perform();
+}
+
+static int stop_then_announce(const std::string &sounds) {
+  LoadedFile wake;
+  if (!load_file(sounds + "/wake_word_triggered.flac", &wake)) {
+    return 1;
+  }
+  // Like every component, the player and the speaker live until the program exits; the mixer task never stops
+  auto *speaker = new host::WavFileSpeaker("", 16, true);
+  auto *player = new NabuMediaPlayer();
+  set_up(player, speaker);
+
+  // Both calls arrive before the next loop iteration
+  stop_announcements(player);
+  announce(player, &wake);
+  if (!run_loop(player)) {
+    fprintf(stderr, "The announcement didn't finish\n");
+    return 1;
+  }
+
+  const uint64_t frames = speaker->get_frames();
+  printf("speaker received %llu frames; the announcement has %llu\n", static_cast<unsigned long long>(frames),
+         static_cast<unsigned long long>(WAKE_WORD_TRIGGERED_FRAMES));
+  return (frames == WAKE_WORD_TRIGGERED_FRAMES) ? 0 : 1;
+}
+
+static int stop_during_announcement(const std::string &sounds) {
+  LoadedFile timer;
+  LoadedFile wake;
+  if (!load_file(sounds + "/timer_finished.flac", &timer) || !load_file(sounds + "/wake_word_triggered.flac", &wake)) {
+    return 1;
+  }
+  // Paced, so the first announcement is still playing when it is stopped
+  auto *speaker = new host::WavFileSpeaker("", 16, true);
+  auto *player = new NabuMediaPlayer();
+  set_up(player, speaker);
+
+  announce(player, &timer);
+  run_loop(player, 500);
+  if (player->state != media_player::MEDIA_PLAYER_STATE_ANNOUNCING) {
+    fprintf(stderr, "The first announcement isn't playing\n");
+    return 1;
+  }
+  const uint64_t frames_before_stop = speaker->get_frames();
+
+  stop_announcements(player);
+  announce(player, &wake);
+  if (!run_loop(player)) {
+    fprintf(stderr, "The announcement didn't finish\n");
+    return 1;
+  }
+
+  const uint64_t frames = speaker->get_frames() - frames_before_stop;
+  printf("speaker received %llu frames after the stop; the announcement has %llu\n",
+         static_cast<unsigned long long>(frames), static_cast<unsigned long long>(WAKE_WORD_TRIGGERED_FRAMES));
+  // The mixer may have passed on some of the first announcement before it handled the stop, but not all of it
+  return ((frames >= WAKE_WORD_TRIGGERED_FRAMES) &&
+          (frames < WAKE_WORD_TRIGGERED_FRAMES + TIMER_FINISHED_FRAMES - frames_before_stop))
+             ? 0
+             : 1;
+}
+
+/// @brief Plays the tracks as a playlist and checks the speaker received every frame of the ones that decode
+static int play_playlist(std::vector<LoadedFile *> tracks, uint64_t expected_frames) {
+  auto *speaker = new host::WavFileSpeaker("", 16, true);
+  auto *player = new NabuMediaPlayer();
+  set_up(player, speaker);
+
+  play(player, tracks[0]);
+  for (size_t i = 1; i < tracks.size(); ++i) {
+    enqueue(player, tracks[i]);
+  }
+  if (!run_loop(player)) {
+    fprintf(stderr, "The playlist didn't finish\n");
+    return 1;
+  }
+
+  const uint64_t frames = speaker->get_frames();
+  printf("speaker received %llu frames; the tracks that decode have %llu\n", static_cast<unsigned long long>(frames),
+         static_cast<unsigned long long>(expected_frames));
+  return (frames == expected_frames) ? 0 : 1;
+}
+
+static int playlist_after_error(const std::string &sounds) {
+  LoadedFile broken;
+  LoadedFile wake;
+  make_broken_file(&broken);
+  if (!load_file(sounds + "/wake_word_triggered.flac", &wake)) {
+    return 1;
+  }
+  return play_playlist({&broken, &wake}, WAKE_WORD_TRIGGERED_FRAMES);
+}
+
+static int playlist_skips_error(const std::string &sounds) {
+  LoadedFile wake;
+  LoadedFile broken;
+  LoadedFile timer;
+  make_broken_file(&broken);
+  if (!load_file(sounds + "/wake_word_triggered.flac", &wake) || !load_file(sounds + "/timer_finished.flac", &timer)) {
+    return 1;
+  }
+  return play_playlist({&wake, &broken, &timer}, WAKE_WORD_TRIGGERED_FRAMES + TIMER_FINISHED_FRAMES);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: media_player_commands <scenario> <sounds directory>\n");
+    return 2;
+  }
+  const std::string scenario = argv[1];
+  const std::string sounds = argv[2];
+
+  if (scenario == "stop-then-announce") {
+    return stop_then_announce(sounds);
+  }
+  if (scenario == "stop-during-announcement") {
+    return stop_during_announcement(sounds);
+  }
+  if (scenario == "playlist-after-error") {
+    return playlist_after_error(sounds);
+  }
+  if (scenario == "playlist-skips-error") {
+    return playlist_skips_error(sounds);
+  }
+  fprintf(stderr, "Unknown scenario: %s\n", scenario.c_str());
+  return 2;
+}
@@ -0,0 +1,373 @@
+// Times parts of the nabu pipeline in isolation, on the build machine. The results compare implementations and
+// revisions; they do not predict the time on the ESP32-S3.
+//
+//   nabu_bench <benchmark> [options]
+//     downmix [--seconds S]   The specialized 5.1 to stereo and average to mono downmixes against the general weighted
+//                             loop, on S seconds (default 10) of 48 kHz noise. Fails if their outputs differ.
+//     decode <file>           The decoder alone, fed the file through its input ring buffer the way a url stream is,
+//                             in the CPU time and output ring buffer writes per second of decoded audio. Compares
+//                             publishing each frame on its own with publishing batches. Fails if nothing decodes or
+//                             the two outputs differ.
+//     http [--mib N] [--drain-ms MS]
+//                             The reader alone, receiving N MiB (default 16) from a loopback HTTP server while this
+//                             task drains its ring buffer every MS ms (default 5), with and without the staging buffer.
+//                             Reports the throughput and how long the reader left the socket unread. Fails if the
+//                             received bytes differ from the served ones.
+
+#include "support/loopback_http_server.h"
+#include "support/md5.h"
+#include "support/media_file_types.h"
+
+#include "audio_decoder.h"
+#include "audio_downmix.h"
+#include "audio_reader.h"
+#include "audio_ring_buffer.h"
+
+#include "esphome/core/hal.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace esphome;
+using namespace esphome::nabu;
+
+static const uint32_t BENCH_SAMPLE_RATE = 48000;
+static const int BENCH_REPETITIONS = 5;
+
+// The sizes AudioPipeline gives the decoder and the ring buffers around it
+static const size_t DECODER_BUFFER_SIZE = 32 * 1024;
+static const size_t INPUT_RING_BUFFER_SIZE = 64 * 1024;
+static const size_t INPUT_RING_BUFFER_MAX_SPAN = 2 * 1024;
+static const size_t OUTPUT_RING_BUFFER_SIZE = 64 * 1024;
+static const size_t OUTPUT_RING_BUFFER_MAX_SPAN = 32 * 1024;
+static const size_t READER_MAX_READ_SIZE = 32 * 1024;
+
+static uint64_t thread_cpu_time_ns() {
+  timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return static_cast<uint64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+// Deterministic noise, so every run times the same audio
+static void fill_noise(std::vector<uint8_t> *data) {
+  uint32_t state = 0x12345678;
+  for (uint8_t &byte : *data) {
+    state = state * 1664525 + 1013904223;
+    byte = static_cast<uint8_t>(state >> 24);
+  }
+}
+
+/// @brief Times one downmix of the source, the fastest of a few repetitions
+/// @param output Set to the downmixed frames
+/// @return CPU time in ns
+template<typename F> static uint64_t time_downmix(const std::vector<uint8_t> &source, std::vector<uint8_t> *output,
+                                                  F downmix) {
+  uint64_t best = UINT64_MAX;
+  for (int repetition = 0; repetition < BENCH_REPETITIONS; ++repetition) {
+    *output = source;
+    const uint64_t start = thread_cpu_time_ns();
+    downmix(output->data());
+    best = std::min(best, thread_cpu_time_ns() - start);
+  }
+  return best;
+}
+
+static int bench_downmix(int argc, char **argv) {
+  double seconds = 10.0;
+  for (int i = 0; i < argc; ++i) {
+    if ((strcmp(argv[i], "--seconds") == 0) && (i + 1 < argc)) {
+      seconds = strtod(argv[++i], nullptr);
+    } else {
+      return 2;
+    }
+  }
+  const size_t frames = static_cast<size_t>(seconds * BENCH_SAMPLE_RATE);
+
+  struct Layout {
+    uint8_t channels;
+    uint8_t bytes_per_sample;
+  };
+  static const Layout LAYOUTS[] = {{6, 2}, {6, 3}, {4, 2}, {4, 3}, {8, 2}};
+
+  int result = 0;
+  printf("downmix of %.1f s at %u Hz; fastest of %d runs\n", seconds, BENCH_SAMPLE_RATE, BENCH_REPETITIONS);
+  for (const Layout &layout : LAYOUTS) {
+    const uint8_t output_channels = downmixed_channels(layout.channels);
+    std::vector<uint8_t> source(frames * layout.channels * layout.bytes_per_sample);
+    fill_noise(&source);
+
+    int32_t weights[2 * MAX_DOWNMIX_CHANNELS];
+    get_downmix_weights(layout.channels, weights);
+
+    std::vector<uint8_t> weighted_output;
+    std::vector<uint8_t> specialized_output;
+    const uint64_t weighted_ns = time_downmix(source, &weighted_output, [&](uint8_t *data) {
+      downmix_frames_weighted(data, frames, layout.channels, output_channels, weights, layout.bytes_per_sample);
+    });
+    const uint64_t specialized_ns = time_downmix(source, &specialized_output, [&](uint8_t *data) {
+      downmix_frames(data, frames, layout.channels, layout.bytes_per_sample);
+    });
+
+    const size_t output_bytes = frames * output_channels * layout.bytes_per_sample;
+    const bool same = memcmp(weighted_output.data(), specialized_output.data(), output_bytes) == 0;
+    printf("  %u ch %2u bit -> %u ch  weighted %6.2f ns/frame  specialized %6.2f ns/frame  %.2fx%s\n", layout.channels,
+           layout.bytes_per_sample * 8, output_channels, static_cast<double>(weighted_ns) / frames,
+           static_cast<double>(specialized_ns) / frames,
+           static_cast<double>(weighted_ns) / std::max<uint64_t>(specialized_ns, 1), same ? "" : "  OUTPUTS DIFFER");
+    if (!same) {
+      result = 1;
+    }
+  }
+  return result;
+}
+
+struct DecodeRun {
+  bool finished;
+  uint64_t decoder_ns;  // CPU time spent in the decoder's process()
+  uint64_t output_bytes;
+  uint32_t output_writes;
+  uint8_t digest[16];  // MD5 of the decoded audio
+  audio::AudioStreamInfo stream_info;
+};
+
+/// @brief Decodes a whole file in this task. Its stages would wait on each other, so the input ring buffer is topped
+/// up and the output ring buffer drained between the decoder's process() calls, outside of the timed part.
+/// @param per_frame Publish every frame on its own instead of in batches
+static DecodeRun decode_file(const std::vector<uint8_t> &data, media_player::MediaFileType file_type, bool per_frame) {
+  DecodeRun run{};
+  std::unique_ptr<AudioRingBuffer> input = AudioRingBuffer::create(INPUT_RING_BUFFER_SIZE, INPUT_RING_BUFFER_MAX_SPAN);
+  std::unique_ptr<AudioRingBuffer> output =
+      AudioRingBuffer::create(OUTPUT_RING_BUFFER_SIZE, OUTPUT_RING_BUFFER_MAX_SPAN);
+  AudioDecoder decoder(DECODER_BUFFER_SIZE);
+  decoder.set_ring_buffers(input.get(), output.get());
+  decoder.set_ticks_to_wait(0, 0);
+  if (per_frame) {
+    decoder.set_output_batch_bytes(0);
+  }
+
+  AudioStreamFormat input_format;
+  input_format.file_type = file_type;
+  if (decoder.start(input_format) != ESP_OK) {
+    return run;
+  }
+
+  host::Md5 md5;
+  size_t position = 0;
+  AudioStageState state = AudioStageState::RUNNING;
+  while (state == AudioStageState::RUNNING) {
+    position += input->write(data.data() + position, data.size() - position);
+
+    const uint64_t start = thread_cpu_time_ns();
+    state = decoder.process(position == data.size());
+    run.decoder_ns += thread_cpu_time_ns() - start;
+
+    uint8_t *span;
+    size_t span_length;
+    while ((span_length = output->peek(&span, 1)) > 0) {
+      md5.update(span, span_length);
+      output->release(span_length);
+      run.output_bytes += span_length;
+    }
+  }
+  md5.finish(run.digest);
+
+  run.finished = (state == AudioStageState::FINISHED);
+  run.output_writes = output->get_stats().writes;
+  if (decoder.get_output_format().has_value()) {
+    run.stream_info = decoder.get_output_format().value().stream_info;
+  }
+  return run;
+}
+
+/// @brief Decodes the file a few times
+/// @return The fastest run, or one that didn't finish
+static DecodeRun time_decode(const std::vector<uint8_t> &data, media_player::MediaFileType file_type, bool per_frame) {
+  DecodeRun best{};
+  best.decoder_ns = UINT64_MAX;
+  for (int repetition = 0; repetition < BENCH_REPETITIONS; ++repetition) {
+    const DecodeRun run = decode_file(data, file_type, per_frame);
+    if (!run.finished || (run.output_bytes == 0)) {
+      return run;
+    }
+    if (run.decoder_ns < best.decoder_ns) {
+      best = run;
+    }
+  }
+  return best;
+}
+
+static int bench_decode(int argc, char **argv) {
+  if (argc != 1) {
+    return 2;
+  }
+  const std::string path = argv[0];
+  const media_player::MediaFileType file_type = host::file_type_from_path(path);
+  std::ifstream file(path, std::ios::binary);
+  if (!file || (file_type == media_player::MediaFileType::NONE)) {
+    fprintf(stderr, "Unable to open %s, or its type is unknown\n", path.c_str());
+    return 1;
+  }
+  const std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+  static const char *const MODES[] = {"per frame", "batched"};
+
+  printf("decode of %s (%zu B); fastest of %d runs\n", path.c_str(), data.size(), BENCH_REPETITIONS);
+  DecodeRun runs[2];
+  for (int i = 0; i < 2; ++i) {
+    runs[i] = time_decode(data, file_type, i == 0);
+    if (!runs[i].finished || (runs[i].output_bytes == 0)) {
+      fprintf(stderr, "%s didn't decode\n", path.c_str());
+      return 1;
+    }
+    const audio::AudioStreamInfo &info = runs[i].stream_info;
+    const double audio_seconds =
+        static_cast<double>(runs[i].output_bytes) / (info.channels * info.get_bytes_per_sample() * info.sample_rate);
+    const double decoder_ms = runs[i].decoder_ns / 1e6;
+    if (i == 0) {
+      printf("  %u Hz %u ch %u bit  audio %.3f s\n", info.sample_rate, info.channels, info.bits_per_sample,
+             audio_seconds);
+    }
+    printf("  %-9s  decoder CPU %7.1f ms  => %5.2f ms CPU per second of audio  %6.1f writes per second of audio\n",
+           MODES[i], decoder_ms, decoder_ms / audio_seconds, runs[i].output_writes / audio_seconds);
+  }
+
+  const bool same = (runs[0].output_bytes == runs[1].output_bytes) &&
+                    (memcmp(runs[0].digest, runs[1].digest, sizeof(runs[0].digest)) == 0);
+  if (!same) {
+    printf("  OUTPUTS DIFFER\n");
+    return 1;
+  }
+  return 0;
+}
+
+struct ReceiveRun {
+  bool matched;  // The reader finished and every byte matched the served data
+  uint64_t wall_us;
+  uint32_t reader_blocked_us;  // Time the reader waited for ring buffer space, leaving the socket unread
+};
+
+/// @brief Receives the url with a reader in its own task, while this task drains the ring buffer every drain_ms
+static ReceiveRun receive_url(const std::string &url, const std::vector<uint8_t> &data, uint32_t drain_ms,
+                              bool staging) {
+  ReceiveRun run{};
+  std::unique_ptr<AudioRingBuffer> ring_buffer =
+      AudioRingBuffer::create(INPUT_RING_BUFFER_SIZE, INPUT_RING_BUFFER_MAX_SPAN);
+  AudioReader reader(READER_MAX_READ_SIZE);
+  reader.set_ring_buffers(nullptr, ring_buffer.get());
+  reader.set_staging(staging);
+  reader.set_source(url);
+
+  const uint32_t start_us = micros();
+  if (reader.start(AudioStreamFormat()) != ESP_OK) {
+    return run;
+  }
+  std::atomic<bool> reader_done{false};
+  AudioStageState reader_state = AudioStageState::RUNNING;
+  std::thread reader_thread([&]() {
+    while ((reader_state = reader.process(false)) == AudioStageState::RUNNING) {
+    }
+    reader_done.store(true);
+  });
+
+  size_t position = 0;
+  bool matched = true;
+  while (true) {
+    const bool done = reader_done.load();
+    uint8_t *span;
+    size_t span_length;
+    while ((span_length = ring_buffer->peek(&span, 1)) > 0) {
+      const size_t compare_length = std::min(span_length, data.size() - std::min(position, data.size()));
+      matched = matched && (compare_length == span_length) && (memcmp(span, data.data() + position, span_length) == 0);
+      position += span_length;
+      ring_buffer->release(span_length);
+    }
+    if (done) {
+      break;
+    }
+    delay(drain_ms);
+  }
+  reader_thread.join();
+
+  run.wall_us = micros() - start_us;
+  run.matched = matched && (reader_state == AudioStageState::FINISHED) && (position == data.size());
+  run.reader_blocked_us = ring_buffer->get_stats().producer_blocked_us;
+  return run;
+}
+
+static int bench_http(int argc, char **argv) {
+  size_t mib = 16;
+  uint32_t drain_ms = 5;
+  for (int i = 0; i < argc; ++i) {
+    if ((strcmp(argv[i], "--mib") == 0) && (i + 1 < argc)) {
+      mib = strtoul(argv[++i], nullptr, 10);
+    } else if ((strcmp(argv[i], "--drain-ms") == 0) && (i + 1 < argc)) {
+      drain_ms = strtoul(argv[++i], nullptr, 10);
+    } else {
+      return 2;
+    }
+  }
+
+  std::vector<uint8_t> data(mib * 1024 * 1024);
+  fill_noise(&data);
+  host::LoopbackHttpServer server;
+  if (!server.start()) {
+    fprintf(stderr, "Unable to start the loopback server\n");
+    return 1;
+  }
+  // The Content-Type decides the file type, so the noise isn't sniffed
+  server.add_file("/stream.flac", data, "audio/flac");
+  const std::string url = server.url("/stream.flac");
+
+  static const char *const MODES[] = {"unstaged", "staged"};
+
+  printf("http receive of %zu MiB, draining every %u ms; fastest of %d runs\n", mib, drain_ms, BENCH_REPETITIONS);
+  for (int i = 0; i < 2; ++i) {
+    ReceiveRun best{};
+    best.wall_us = UINT64_MAX;
+    for (int repetition = 0; repetition < BENCH_REPETITIONS; ++repetition) {
+      const ReceiveRun run = receive_url(url, data, drain_ms, i == 1);
+      if (!run.matched) {
+        fprintf(stderr, "The %s reader didn't receive the served data\n", MODES[i]);
+        return 1;
+      }
+      if (run.wall_us < best.wall_us) {
+        best = run;
+      }
+    }
+    printf("  %-8s  %7.1f MiB/s  socket unread while the ring buffer was full %7.1f ms (%4.1f%%)\n", MODES[i],
+           mib / (best.wall_us / 1e6), best.reader_blocked_us / 1000.0,
+           100.0 * best.reader_blocked_us / best.wall_us);
+  }
+  return 0;
+}
+
+static int usage() {
+  fprintf(stderr, "usage: nabu_bench downmix [--seconds S]\n"
+                  "       nabu_bench decode <file>\n"
+                  "       nabu_bench http [--mib N] [--drain-ms MS]\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    return usage();
+  }
+  const std::string benchmark = argv[1];
+  int result = 2;
+  if (benchmark == "downmix") {
+    result = bench_downmix(argc - 2, argv + 2);
+  } else if (benchmark == "decode") {
+    result = bench_decode(argc - 2, argv + 2);
+  } else if (benchmark == "http") {
+    result = bench_http(argc - 2, argv + 2);
+  }
+  return (result == 2) ? usage() : result;
+}
@@ -0,0 +1,356 @@
+// Plays a file or url through the nabu pipeline and mixer on the host and reports the CPU time per second of audio.
+//
+//   nabu_play [options] <file or http:// url> [output.wav]
+//     --rate HZ          Mixer and speaker sample rate (default 48000)
+//     --announcement     Feed the mixer's announcement stream
+//     --fuse             Run a local file's stages in one task
+//     --serve            Serve the local file from a loopback HTTP server and play its url
+//     --serve-rate BPS   Limit the loopback server to BPS bytes per second
+//     --realtime         Pace the speaker at the sample rate, like the I2S DMA buffers do
+//     --seek MS@AT_MS    Seek to MS once AT_MS of audio played
+//     --bits 16|32       Output WAV sample width (default 16)
+//     --cache            Build the PCM cache for the file in the media player's loop() slices instead of playing it
+//     --cache-size B     The PCM cache's byte budget (default 2 MiB, like the media player's file_cache_size)
+//     --check-md5        Check the played audio against a FLAC file's MD5 signature; needs --rate at the file's rate
+//     --prefetch MS      Prefetch a local file like the next announcement and start its output after MS; fails unless
+//                        the decoded ring buffer filled past what one pass of the stages decodes
+//     -v                 Debug logging; -vv for verbose
+
+#include "support/host_player.h"
+#include "support/loopback_http_server.h"
+#include "support/media_file_types.h"
+#include "support/md5.h"
+#include "support/wav_file_speaker.h"
+
+#include "audio_pcm_cache.h"
+
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace esphome;
+using namespace esphome::nabu;
+
+static const char *state_to_string(AudioPipelineState state) {
+  switch (state) {
+    case AudioPipelineState::PLAYING:
+      return "PLAYING";
+    case AudioPipelineState::STOPPED:
+      return "STOPPED";
+    case AudioPipelineState::ERROR_READING:
+      return "ERROR_READING";
+    case AudioPipelineState::ERROR_DECODING:
+      return "ERROR_DECODING";
+    case AudioPipelineState::ERROR_RESAMPLING:
+      return "ERROR_RESAMPLING";
+  }
+  return "UNKNOWN";
+}
+
+static void print_stage(const char *name, const AudioStageStats &stats) {
+  printf("  %-10s in %10u B  out %10u B  input blocked %8.1f ms  output blocked %8.1f ms\n", name, stats.bytes_in,
+         stats.bytes_out, stats.input_blocked_us / 1000.0, stats.output_blocked_us / 1000.0);
+}
+
+static void print_ring_buffer(const char *name, const RingBufferStats &stats) {
+  printf("  %-10s capacity %8zu B  fill %8zu .. %8zu B  copied in %10u B  out %10u B\n", name, stats.capacity,
+         stats.min_fill, stats.max_fill, stats.producer_bytes_copied, stats.consumer_bytes_copied);
+}
+
+static uint64_t bytes_copied(const RingBufferStats &stats) {
+  return static_cast<uint64_t>(stats.producer_bytes_copied) + stats.consumer_bytes_copied;
+}
+
+// The media player builds its PCM cache in slices of this length from loop(), as stereo audio for the mixer
+static const uint32_t PCM_CACHE_BUILD_SLICE_MS = 10;
+static const uint8_t NUMBER_OF_CHANNELS = 2;
+
+static uint64_t thread_cpu_time_us() {
+  timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return static_cast<uint64_t>(time.tv_sec) * 1000000 + time.tv_nsec / 1000;
+}
+
+static int build_cache(const std::string &source, media_player::MediaFile *media_file,
+                       const host::HostPlayerOptions &options, size_t cache_size) {
+  AudioPcmCache cache;
+  cache.set_sample_rate(options.sample_rate);
+  cache.set_max_size(cache_size);
+  cache.add_file(media_file);
+
+  const uint64_t start_cpu_us = thread_cpu_time_us();
+  uint32_t slices = 1;
+  while (!cache.build(PCM_CACHE_BUILD_SLICE_MS)) {
+    ++slices;
+  }
+  const uint64_t cpu_us = thread_cpu_time_us() - start_cpu_us;
+
+  const CachedPcmEntry *entry = cache.find(media_file);
+  printf("%s: %s\n", source.c_str(), (entry != nullptr) ? "CACHED" : "NOT CACHED");
+  if (entry == nullptr) {
+    return 1;
+  }
+
+  const size_t frame_bytes = NUMBER_OF_CHANNELS * sizeof(int32_t);
+  const double audio_seconds = static_cast<double>(entry->length / frame_bytes) / options.sample_rate;
+  printf("  audio %.3f s  %zu B in %zu chunks (%zu B)  built in %u slices\n", audio_seconds, entry->length,
+         entry->chunks.size(), cache.get_size(), slices);
+  printf("  loop CPU %.1f ms  => %.2f ms CPU per second of audio\n", cpu_us / 1000.0,
+         (audio_seconds > 0) ? cpu_us / 1000.0 / audio_seconds : 0.0);
+
+  if (!options.wav_path.empty()) {
+    host::WavFileSpeaker speaker(options.wav_path, options.bits_per_sample, false);
+    audio::AudioStreamInfo audio_stream_info;
+    audio_stream_info.channels = NUMBER_OF_CHANNELS;
+    audio_stream_info.bits_per_sample = 32;
+    audio_stream_info.sample_rate = options.sample_rate;
+    speaker.set_audio_stream_info(audio_stream_info);
+
+    std::unique_ptr<AudioRingBuffer> ring_buffer = AudioRingBuffer::create(16 * 1024, 4 * 1024);
+    size_t position = 0;
+    while (position < entry->length) {
+      position += AudioPcmCache::write_to(entry, position, ring_buffer.get());
+      uint8_t *span = nullptr;
+      size_t span_length;
+      while ((span_length = ring_buffer->peek(&span, 1, 0)) > 0) {
+        ring_buffer->release(speaker.play(span, span_length));
+      }
+    }
+    speaker.finish();
+  }
+
+  return (entry->length > 0) ? 0 : 1;
+}
+
+// Checks the audio the speaker received against the MD5 signature in a FLAC file's STREAMINFO block. The signature
+// covers the samples at their own depth, rounded up to whole bytes; the mixer outputs them as 32 bit stereo, with a
+// mono stream's samples on both channels.
+static bool check_flac_md5(const std::vector<uint8_t> &data, const std::vector<int32_t> &samples) {
+  if ((data.size() < 42) || (memcmp(data.data(), "fLaC", 4) != 0) || ((data[4] & 0x7F) != 0)) {
+    fprintf(stderr, "Not a FLAC file with a STREAMINFO block\n");
+    return false;
+  }
+  const uint8_t *stream_info = data.data() + 8;
+  const uint8_t channels = ((stream_info[12] >> 1) & 0x07) + 1;
+  const uint8_t bits_per_sample = (((stream_info[12] & 0x01) << 4) | (stream_info[13] >> 4)) + 1;
+  const uint8_t *signature = stream_info + 18;
+  if (channels > NUMBER_OF_CHANNELS) {
+    fprintf(stderr, "Streams with more than two channels are mixed down\n");
+    return false;
+  }
+
+  host::Md5 md5;
+  const uint8_t bytes_per_sample = (bits_per_sample + 7) / 8;
+  for (size_t frame = 0; frame + NUMBER_OF_CHANNELS <= samples.size(); frame += NUMBER_OF_CHANNELS) {
+    for (uint8_t channel = 0; channel < channels; ++channel) {
+      const int32_t sample = samples[frame + channel] >> (32 - bits_per_sample);
+      uint8_t bytes[4];
+      for (uint8_t i = 0; i < bytes_per_sample; ++i) {
+        bytes[i] = static_cast<uint8_t>(sample >> (8 * i));
+      }
+      md5.update(bytes, bytes_per_sample);
+    }
+  }
+  uint8_t digest[16];
+  md5.finish(digest);
+
+  const bool match = (memcmp(digest, signature, sizeof(digest)) == 0);
+  printf("  MD5 of %u bit samples: %s\n", bits_per_sample, match ? "match" : "MISMATCH");
+  return match;
+}
+
+static int usage() {
+  fprintf(stderr, "usage: nabu_play [--rate HZ] [--announcement] [--fuse] [--serve] [--serve-rate BPS] [--realtime]\n"
+                  "                 [--seek MS@AT_MS] [--bits 16|32] [--cache] [--cache-size B] [--check-md5]\n"
+                  "                 [--prefetch MS] [-v] <file or url> [output.wav]\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  host::HostPlayerOptions options;
+  bool serve = false;
+  size_t serve_rate = 0;
+  bool seek = false;
+  bool cache = false;
+  size_t cache_size = 2 * 1024 * 1024;
+  bool check_md5 = false;
+  uint32_t seek_position_ms = 0;
+  uint32_t seek_at_ms = 0;
+  uint32_t prefetch_ms = 0;
+  std::vector<std::string> positional;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if ((arg == "--rate") && (i + 1 < argc)) {
+      options.sample_rate = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--announcement") {
+      options.announcement = true;
+    } else if (arg == "--fuse") {
+      options.fuse_file_stages = true;
+    } else if (arg == "--serve") {
+      serve = true;
+    } else if ((arg == "--serve-rate") && (i + 1 < argc)) {
+      serve_rate = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--realtime") {
+      options.realtime = true;
+    } else if ((arg == "--seek") && (i + 1 < argc)) {
+      if (sscanf(argv[++i], "%u@%u", &seek_position_ms, &seek_at_ms) != 2) {
+        return usage();
+      }
+      seek = true;
+    } else if ((arg == "--bits") && (i + 1 < argc)) {
+      options.bits_per_sample = strtoul(argv[++i], nullptr, 10);
+      if ((options.bits_per_sample != 16) && (options.bits_per_sample != 32)) {
+        return usage();
+      }
+    } else if (arg == "--cache") {
+      cache = true;
+    } else if ((arg == "--cache-size") && (i + 1 < argc)) {
+      cache_size = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--check-md5") {
+      check_md5 = true;
+    } else if ((arg == "--prefetch") && (i + 1 < argc)) {
+      prefetch_ms = strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "-v") {
+      set_log_level(ESPHOME_LOG_LEVEL_DEBUG);
+    } else if (arg == "-vv") {
+      set_log_level(ESPHOME_LOG_LEVEL_VERBOSE);
+    } else if (!arg.empty() && (arg[0] == '-')) {
+      return usage();
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  if ((positional.empty()) || (positional.size() > 2)) {
+    return usage();
+  }
+  const std::string source = positional[0];
+  if (positional.size() == 2) {
+    options.wav_path = positional[1];
+  }
+
+  const bool is_url = str_startswith(source, "http://") || str_startswith(source, "https://");
+  std::vector<uint8_t> data;
+  media_player::MediaFile media_file{};
+  if (!is_url) {
+    std::ifstream file(source, std::ios::binary);
+    if (!file) {
+      fprintf(stderr, "Unable to open %s\n", source.c_str());
+      return 1;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    media_file.data = data.data();
+    media_file.length = data.size();
+    media_file.file_type = host::file_type_from_path(source);
+    if (!serve && (media_file.file_type == media_player::MediaFileType::NONE)) {
+      fprintf(stderr, "Unknown file type: %s\n", source.c_str());
+      return 1;
+    }
+  }
+
+  if (cache) {
+    if (is_url || serve) {
+      return usage();
+    }
+    return build_cache(source, &media_file, options, cache_size);
+  }
+
+  host::LoopbackHttpServer server;
+  std::string url = source;
+  if (serve && !is_url) {
+    if (!server.start()) {
+      fprintf(stderr, "Unable to start the loopback server\n");
+      return 1;
+    }
+    server.set_rate_limit(serve_rate);
+    std::string name = source.substr(source.find_last_of('/') + 1);
+    server.add_file("/" + name, data, host::content_type_from_path(source));
+    url = server.url("/" + name);
+  }
+
+  if (check_md5 && (is_url || (media_file.file_type != media_player::MediaFileType::FLAC))) {
+    return usage();
+  }
+  if ((prefetch_ms > 0) && (is_url || serve)) {
+    return usage();
+  }
+
+  host::HostPlayerResult result;
+  std::vector<int32_t> samples;
+  uint32_t prefetched_bytes = 0;
+  {
+    host::HostPlayer player(options);
+    if (check_md5) {
+      player.get_speaker()->set_capture(&samples);
+    }
+    esp_err_t err;
+    if (prefetch_ms > 0) {
+      err = player.prefetch(&media_file);
+    } else {
+      err = (is_url || serve) ? player.start(url) : player.start(&media_file);
+    }
+    if (err != ESP_OK) {
+      fprintf(stderr, "Unable to start the pipeline: %s\n", esp_err_to_name(err));
+      return 1;
+    }
+    if (prefetch_ms > 0) {
+      delay(prefetch_ms);
+      prefetched_bytes = player.get_pipeline()->get_stats().decoded_ring_buffer.bytes_written;
+      player.get_pipeline()->start_output();
+    }
+    if (seek) {
+      player.seek_at(seek_at_ms, seek_position_ms);
+    }
+    result = player.wait();
+  }
+
+  printf("%s: %s%s\n", source.c_str(), state_to_string(result.final_state), result.timed_out ? " (timed out)" : "");
+  printf("  audio %.3f s  wall %.1f ms  task CPU %.1f ms  => %.2f ms CPU per second of audio\n", result.audio_seconds,
+         result.wall_us / 1000.0, result.cpu_us / 1000.0,
+         (result.audio_seconds > 0) ? result.cpu_us / 1000.0 / result.audio_seconds : 0.0);
+  printf("  wakeups %u  (%.1f per second of audio)\n", result.wakeups,
+         (result.audio_seconds > 0) ? result.wakeups / result.audio_seconds : 0.0);
+  print_stage("reader", result.pipeline_stats.reader);
+  print_stage("decoder", result.pipeline_stats.decoder);
+  print_stage("resampler", result.pipeline_stats.resampler);
+  print_stage("mixer", result.mixer_stats.mixer);
+  const RingBufferStats &mixer_input_stats =
+      options.announcement ? result.mixer_stats.announcement_ring_buffer : result.mixer_stats.media_ring_buffer;
+  print_ring_buffer("raw", result.pipeline_stats.raw_file_ring_buffer);
+  print_ring_buffer("decoded", result.pipeline_stats.decoded_ring_buffer);
+  print_ring_buffer("mixer in", mixer_input_stats);
+  const uint64_t ring_buffer_bytes_copied = bytes_copied(result.pipeline_stats.raw_file_ring_buffer) +
+                                            bytes_copied(result.pipeline_stats.decoded_ring_buffer) +
+                                            bytes_copied(mixer_input_stats);
+  printf("  ring buffers copied %llu B  (%.0f B per second of audio)\n",
+         static_cast<unsigned long long>(ring_buffer_bytes_copied),
+         (result.audio_seconds > 0) ? ring_buffer_bytes_copied / result.audio_seconds : 0.0);
+  printf("  arena peak %zu B\n", result.arena_stats.peak_leased_bytes);
+  if (serve) {
+    printf("  loopback server: %u connections, %u requests\n", server.get_connections(), server.get_requests());
+  }
+
+  if (check_md5 && !check_flac_md5(data, samples)) {
+    return 1;
+  }
+
+  if (prefetch_ms > 0) {
+    // One pass decodes at most a batch, which is well below the decoded ring buffer's capacity
+    const bool read_ahead = prefetched_bytes > result.pipeline_stats.decoded_ring_buffer.capacity / 2;
+    printf("  decoded %u B before the output started: %s\n", prefetched_bytes,
+           read_ahead ? "read ahead" : "NOT READ AHEAD");
+    if (!read_ahead) {
+      return 1;
+    }
+  }
+
+  return (result.final_state == AudioPipelineState::STOPPED) && !result.timed_out ? 0 : 1;
+}
@@ -0,0 +1,471 @@
+#include "esp_http_client.h"
+
+#include "esphome/core/log.h"
+
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const char *const TAG = "esp_http_client";
+
+static const size_t RECEIVE_CHUNK_SIZE = 4096;
+static const size_t MAX_HEADER_BYTES = 16384;
+
+struct esp_http_client {
+  http_event_handle_cb event_handler{nullptr};
+  void *user_data{nullptr};
+  int timeout_ms{5000};
+  int max_redirection_count{10};
+  bool disable_auto_redirect{false};
+
+  std::string url;
+  std::vector<std::pair<std::string, std::string>> headers;
+
+  int fd{-1};
+  std::string connected_host;
+  std::string connected_port;
+  bool keep_alive{false};
+
+  // Bytes received from the socket but not yet parsed or returned
+  std::string rx;
+
+  // State of the current response
+  int status_code{0};
+  int64_t content_length{-1};
+  int64_t data_process{0};
+  bool chunked{false};
+  int64_t chunk_remaining{0};
+  bool chunk_needs_crlf{false};
+  bool chunked_done{false};
+  bool eof{false};
+  bool headers_fetched{false};
+  std::string location;
+};
+
+namespace {
+
+bool parse_url(const std::string &url, std::string *host, std::string *port, std::string *path) {
+  static const char *const SCHEME = "http://";
+  if (strncasecmp(url.c_str(), SCHEME, strlen(SCHEME)) != 0) {
+    return false;
+  }
+  size_t authority_start = strlen(SCHEME);
+  size_t path_start = url.find('/', authority_start);
+  std::string authority = url.substr(authority_start, path_start - authority_start);
+  *path = (path_start == std::string::npos) ? "/" : url.substr(path_start);
+
+  size_t colon = authority.rfind(':');
+  if (colon == std::string::npos) {
+    *host = authority;
+    *port = "80";
+  } else {
+    *host = authority.substr(0, colon);
+    *port = authority.substr(colon + 1);
+  }
+  return !host->empty();
+}
+
+void close_socket(esp_http_client *client) {
+  if (client->fd >= 0) {
+    close(client->fd);
+    client->fd = -1;
+  }
+  client->rx.clear();
+  client->keep_alive = false;
+}
+
+bool response_complete(const esp_http_client *client) {
+  if (!client->headers_fetched) {
+    return false;
+  }
+  if (client->chunked) {
+    return client->chunked_done;
+  }
+  if (client->content_length >= 0) {
+    return client->data_process >= client->content_length;
+  }
+  return client->eof;
+}
+
+/// @return Bytes received, 0 if the receive timed out, or -1 if the connection closed or failed
+int receive(esp_http_client *client, uint8_t *buffer, size_t length) {
+  if (client->fd < 0) {
+    client->eof = true;
+    return -1;
+  }
+  ssize_t received = recv(client->fd, buffer, length, 0);
+  if (received > 0) {
+    return static_cast<int>(received);
+  }
+  if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+    return 0;
+  }
+  client->eof = true;
+  return -1;
+}
+
+/// @return 1 once rx holds a full line, 0 on a timeout, -1 if the connection closed first
+int ensure_line(esp_http_client *client, const char *terminator) {
+  uint8_t buffer[RECEIVE_CHUNK_SIZE];
+  while (client->rx.find(terminator) == std::string::npos) {
+    if (client->rx.size() > MAX_HEADER_BYTES) {
+      return -1;
+    }
+    int received = receive(client, buffer, sizeof(buffer));
+    if (received <= 0) {
+      return received;
+    }
+    client->rx.append(reinterpret_cast<char *>(buffer), received);
+  }
+  return 1;
+}
+
+/// @brief Returns body bytes from rx first, then straight from the socket into the caller's buffer
+int take_body(esp_http_client *client, char *buffer, size_t length) {
+  if (!client->rx.empty()) {
+    size_t bytes = std::min(length, client->rx.size());
+    std::memcpy(buffer, client->rx.data(), bytes);
+    client->rx.erase(0, bytes);
+    return static_cast<int>(bytes);
+  }
+  return receive(client, reinterpret_cast<uint8_t *>(buffer), length);
+}
+
+/// @return 1 once the next chunk's size is known, 0 on a timeout, -1 if the connection closed
+int next_chunk(esp_http_client *client) {
+  if (client->chunk_needs_crlf) {
+    int result = ensure_line(client, "\r\n");
+    if (result <= 0) {
+      return result;
+    }
+    client->rx.erase(0, client->rx.find("\r\n") + 2);
+    client->chunk_needs_crlf = false;
+  }
+
+  int result = ensure_line(client, "\r\n");
+  if (result <= 0) {
+    return result;
+  }
+  size_t end = client->rx.find("\r\n");
+  client->chunk_remaining = strtoll(client->rx.substr(0, end).c_str(), nullptr, 16);
+  client->rx.erase(0, end + 2);
+
+  if (client->chunk_remaining == 0) {
+    // Skips an empty trailer; a response with trailer fields ends the connection's reuse instead
+    if ((client->rx.size() >= 2) && (client->rx.compare(0, 2, "\r\n") == 0)) {
+      client->rx.erase(0, 2);
+    } else {
+      client->keep_alive = false;
+    }
+    client->chunked_done = true;
+  }
+  return 1;
+}
+
+esp_err_t send_request(esp_http_client *client) {
+  std::string host, port, path;
+  if (!parse_url(client->url, &host, &port, &path)) {
+    ESP_LOGE(TAG, "Only http:// urls are supported on the host: %s", client->url.c_str());
+    return ESP_ERR_HTTP_INVALID_TRANSPORT;
+  }
+
+  const bool reusable = (client->fd >= 0) && client->keep_alive && response_complete(client) &&
+                        (host == client->connected_host) && (port == client->connected_port);
+  if (!reusable) {
+    close_socket(client);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+      return ESP_ERR_HTTP_CONNECT;
+    }
+    for (addrinfo *address = addresses; address != nullptr; address = address->ai_next) {
+      int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+        client->fd = fd;
+        break;
+      }
+      close(fd);
+    }
+    freeaddrinfo(addresses);
+    if (client->fd < 0) {
+      return ESP_ERR_HTTP_CONNECT;
+    }
+
+    timeval timeout{};
+    timeout.tv_sec = client->timeout_ms / 1000;
+    timeout.tv_usec = (client->timeout_ms % 1000) * 1000;
+    setsockopt(client->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    client->connected_host = host;
+    client->connected_port = port;
+  }
+
+  std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + host + ":" + port + "\r\nConnection: keep-alive\r\n";
+  for (const auto &header : client->headers) {
+    request += header.first + ": " + header.second + "\r\n";
+  }
+  request += "\r\n";
+
+  size_t sent = 0;
+  while (sent < request.size()) {
+    ssize_t result = send(client->fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+    if (result <= 0) {
+      close_socket(client);
+      return ESP_ERR_HTTP_WRITE_DATA;
+    }
+    sent += result;
+  }
+
+  client->status_code = 0;
+  client->content_length = -1;
+  client->data_process = 0;
+  client->chunked = false;
+  client->chunk_remaining = 0;
+  client->chunk_needs_crlf = false;
+  client->chunked_done = false;
+  client->eof = false;
+  client->headers_fetched = false;
+  client->keep_alive = true;
+  client->location.clear();
+  return ESP_OK;
+}
+
+/// @return false if no complete response header arrived
+bool receive_headers(esp_http_client *client) {
+  if (ensure_line(client, "\r\n\r\n") <= 0) {
+    return false;
+  }
+  size_t end = client->rx.find("\r\n\r\n");
+  std::string block = client->rx.substr(0, end + 2);
+  client->rx.erase(0, end + 4);
+
+  size_t line_start = 0;
+  bool status_line = true;
+  while (line_start < block.size()) {
+    size_t line_end = block.find("\r\n", line_start);
+    std::string line = block.substr(line_start, line_end - line_start);
+    line_start = line_end + 2;
+
+    if (status_line) {
+      status_line = false;
+      size_t space = line.find(' ');
+      if ((line.compare(0, 5, "HTTP/") != 0) || (space == std::string::npos)) {
+        return false;
+      }
+      client->status_code = atoi(line.c_str() + space + 1);
+      if (line.compare(0, 8, "HTTP/1.0") == 0) {
+        client->keep_alive = false;
+      }
+      continue;
+    }
+
+    size_t colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string key = line.substr(0, colon);
+    size_t value_start = line.find_first_not_of(' ', colon + 1);
+    std::string value = (value_start == std::string::npos) ? "" : line.substr(value_start);
+
+    if (strcasecmp(key.c_str(), "Content-Length") == 0) {
+      client->content_length = strtoll(value.c_str(), nullptr, 10);
+    } else if ((strcasecmp(key.c_str(), "Transfer-Encoding") == 0) && (strcasestr(value.c_str(), "chunked"))) {
+      client->chunked = true;
+    } else if ((strcasecmp(key.c_str(), "Connection") == 0) && (strcasecmp(value.c_str(), "close") == 0)) {
+      client->keep_alive = false;
+    } else if (strcasecmp(key.c_str(), "Location") == 0) {
+      client->location = value;
+    }
+
+    if (client->event_handler != nullptr) {
+      esp_http_client_event_t event{};
+      event.event_id = HTTP_EVENT_ON_HEADER;
+      event.client = client;
+      event.user_data = client->user_data;
+      event.header_key = &key[0];
+      event.header_value = &value[0];
+      client->event_handler(&event);
+    }
+  }
+
+  if (client->chunked) {
+    client->content_length = -1;
+  } else if (client->content_length < 0) {
+    // The body ends with the connection
+    client->keep_alive = false;
+  }
+  client->headers_fetched = true;
+  return true;
+}
+
+bool is_redirect(int status_code) {
+  return (status_code == 301) || (status_code == 302) || (status_code == 303) || (status_code == 307) ||
+         (status_code == 308);
+}
+
+}  // namespace
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config) {
+  if ((config == nullptr) || (config->url == nullptr)) {
+    return nullptr;
+  }
+  auto *client = new esp_http_client();
+  client->url = config->url;
+  client->event_handler = config->event_handler;
+  client->user_data = config->user_data;
+  if (config->timeout_ms > 0) {
+    client->timeout_ms = config->timeout_ms;
+  }
+  client->max_redirection_count = config->max_redirection_count;
+  client->disable_auto_redirect = config->disable_auto_redirect;
+  return client;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client) {
+  if (client == nullptr) {
+    return ESP_FAIL;
+  }
+  close_socket(client);
+  delete client;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url) {
+  client->url = url;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_get_url(esp_http_client_handle_t client, char *url, int len) {
+  if ((len <= 0) || (client->url.size() >= static_cast<size_t>(len))) {
+    return ESP_FAIL;
+  }
+  memcpy(url, client->url.c_str(), client->url.size() + 1);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value) {
+  esp_http_client_delete_header(client, key);
+  client->headers.emplace_back(key, value);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char *key) {
+  client->headers.erase(std::remove_if(client->headers.begin(), client->headers.end(),
+                                       [key](const std::pair<std::string, std::string> &header) {
+                                         return strcasecmp(header.first.c_str(), key) == 0;
+                                       }),
+                        client->headers.end());
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client, void *data) {
+  client->user_data = data;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len) { return send_request(client); }
+
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client) {
+  // Redirects are followed here rather than in esp_http_client_perform, as the reader only uses open/fetch/read
+  for (int redirects = 0;; ++redirects) {
+    if (!receive_headers(client)) {
+      close_socket(client);
+      return -1;
+    }
+    if (client->disable_auto_redirect || !is_redirect(client->status_code) || client->location.empty()) {
+      break;
+    }
+    if (redirects >= client->max_redirection_count) {
+      ESP_LOGE(TAG, "Too many redirects");
+      return -1;
+    }
+
+    // Drains the redirect's body so the connection can carry the next request
+    char discard[RECEIVE_CHUNK_SIZE];
+    while (!response_complete(client) && (esp_http_client_read(client, discard, sizeof(discard)) > 0)) {
+    }
+    if (!response_complete(client)) {
+      close_socket(client);
+    }
+
+    if (client->location[0] == '/') {
+      client->url = "http://" + client->connected_host + ":" + client->connected_port + client->location;
+    } else {
+      client->url = client->location;
+    }
+    if (send_request(client) != ESP_OK) {
+      return -1;
+    }
+  }
+
+  return client->content_length;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len) {
+  int ridx = 0;
+  while ((ridx < len) && !response_complete(client)) {
+    size_t bytes_to_take = len - ridx;
+    if (client->chunked) {
+      if (client->chunk_remaining == 0) {
+        int result = next_chunk(client);
+        if (result == 0) {
+          break;
+        } else if (result < 0) {
+          return (ridx == 0) ? -1 : ridx;
+        }
+        continue;
+      }
+      bytes_to_take = std::min<size_t>(bytes_to_take, client->chunk_remaining);
+    } else if (client->content_length >= 0) {
+      bytes_to_take = std::min<size_t>(bytes_to_take, client->content_length - client->data_process);
+    }
+
+    int received = take_body(client, buffer + ridx, bytes_to_take);
+    if (received == 0) {
+      // Timed out; returns what arrived so far
+      break;
+    } else if (received < 0) {
+      if (response_complete(client)) {
+        // A response without a length ends with the connection
+        break;
+      }
+      return (ridx == 0) ? -1 : ridx;
+    }
+
+    ridx += received;
+    client->data_process += received;
+    if (client->chunked) {
+      client->chunk_remaining -= received;
+      client->chunk_needs_crlf = (client->chunk_remaining == 0);
+    }
+  }
+  return ridx;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client) {
+  close_socket(client);
+  return ESP_OK;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client) { return client->status_code; }
+
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client) { return client->content_length; }
+
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client) { return client->chunked; }
+
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client) { return response_complete(client); }
@@ -0,0 +1,69 @@
+#pragma once
+
+// ESP-IDF's HTTP client over POSIX sockets for the host build. Supports plain http:// urls with keep-alive, Range
+// headers, chunked responses, and redirects; https:// urls fail to open.
+
+#include "esp_err.h"
+
+#include <cstdint>
+
+typedef struct esp_http_client *esp_http_client_handle_t;
+
+typedef enum {
+  HTTP_EVENT_ERROR = 0,
+  HTTP_EVENT_ON_CONNECTED,
+  HTTP_EVENT_HEADERS_SENT,
+  HTTP_EVENT_ON_HEADER,
+  HTTP_EVENT_ON_DATA,
+  HTTP_EVENT_ON_FINISH,
+  HTTP_EVENT_DISCONNECTED,
+  HTTP_EVENT_REDIRECT,
+} esp_http_client_event_id_t;
+
+typedef struct esp_http_client_event {
+  esp_http_client_event_id_t event_id;
+  esp_http_client_handle_t client;
+  void *data;
+  int data_len;
+  void *user_data;
+  char *header_key;
+  char *header_value;
+} esp_http_client_event_t;
+
+typedef esp_err_t (*http_event_handle_cb)(esp_http_client_event_t *event);
+
+typedef struct {
+  const char *url;
+  const char *cert_pem;
+  bool disable_auto_redirect;
+  int max_redirection_count;
+  int buffer_size;
+  bool keep_alive_enable;
+  int timeout_ms;
+  esp_err_t (*crt_bundle_attach)(void *conf);
+  http_event_handle_cb event_handler;
+  void *user_data;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url);
+esp_err_t esp_http_client_get_url(esp_http_client_handle_t client, char *url, int len);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value);
+esp_err_t esp_http_client_delete_header(esp_http_client_handle_t client, const char *key);
+esp_err_t esp_http_client_set_user_data(esp_http_client_handle_t client, void *data);
+
+/// @brief Sends a GET request, reusing the connection if the previous response on it was read completely
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len);
+/// @return The Content-Length, or -1 if the response has none or no response arrived
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client);
+/// @brief Reads until len bytes arrived, the response is complete, or the connection timed out
+/// @return Number of bytes read, or -1 if the connection failed before any data arrived
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client);
+bool esp_http_client_is_chunked_response(esp_http_client_handle_t client);
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace audio {
+
+struct AudioStreamInfo {
+  bool operator==(const AudioStreamInfo &rhs) const {
+    return (this->bits_per_sample == rhs.bits_per_sample) && (this->channels == rhs.channels) &&
+           (this->sample_rate == rhs.sample_rate);
+  }
+  bool operator!=(const AudioStreamInfo &rhs) const { return !operator==(rhs); }
+  size_t get_bytes_per_sample() const { return this->bits_per_sample / 8; }
+
+  uint8_t bits_per_sample = 16;
+  uint8_t channels = 1;
+  uint32_t sample_rate = 16000;
+};
+
+}  // namespace audio
+}  // namespace esphome
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "esphome/components/audio/audio.h"
+
+#include <freertos/FreeRTOS.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace speaker {
+
+class Speaker {
+ public:
+  virtual ~Speaker() = default;
+
+  /// @brief Plays the audio, waiting up to ticks_to_wait for room in the output
+  /// @return Number of bytes accepted
+  virtual size_t play(const uint8_t *data, size_t length, TickType_t ticks_to_wait) { return this->play(data, length); }
+  virtual size_t play(const uint8_t *data, size_t length) = 0;
+
+  virtual void set_volume(float volume) { this->volume_ = volume; }
+  float get_volume() { return this->volume_; }
+
+  void set_audio_stream_info(const audio::AudioStreamInfo &audio_stream_info) {
+    this->audio_stream_info_ = audio_stream_info;
+  }
+  audio::AudioStreamInfo &get_audio_stream_info() { return this->audio_stream_info_; }
+
+ protected:
+  audio::AudioStreamInfo audio_stream_info_;
+  float volume_{1.0f};
+};
+
+}  // namespace speaker
+}  // namespace esphome
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <functional>
+#include <utility>
+
+// The subset of ESPHome's automations the nabu component declares; the host build never runs the actions
+
+namespace esphome {
+
+template<typename... Ts> class Trigger {
+ public:
+  void trigger(Ts... x) {
+    if (this->callback_) {
+      this->callback_(x...);
+    }
+  }
+  void set_callback(std::function<void(Ts...)> &&callback) { this->callback_ = std::move(callback); }
+
+ protected:
+  std::function<void(Ts...)> callback_;
+};
+
+template<typename... Ts> class Action {
+ public:
+  virtual ~Action() = default;
+  virtual void play(Ts... x) = 0;
+};
+
+template<typename T> class Parented {
+ public:
+  Parented() = default;
+  Parented(T *parent) : parent_(parent) {}
+  void set_parent(T *parent) { this->parent_ = parent; }
+
+ protected:
+  T *parent_{nullptr};
+};
+
+template<typename T, typename... X> class TemplatableValue {
+ public:
+  TemplatableValue() = default;
+  TemplatableValue(T value) : f_([value](X...) { return value; }) {}
+
+  T value(X... x) { return this->f_(x...); }
+
+ protected:
+  std::function<T(X...)> f_;
+};
+
+}  // namespace esphome
+
+#define TEMPLATABLE_VALUE_(type, name) \
+ protected: \
+  TemplatableValue<type, Ts...> name##_{}; \
+\
+ public: \
+  template<typename V> void set_##name(V name) { this->name##_ = name; }
+
+#define TEMPLATABLE_VALUE(type, name) TEMPLATABLE_VALUE_(type, name)
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+namespace esphome {
+
+namespace setup_priority {
+
+extern const float PROCESSOR;
+
+}  // namespace setup_priority
+
+// Runs setup() and loop() on the calling thread, the way the application's main loop does
+class Component {
+ public:
+  virtual ~Component() = default;
+
+  virtual void setup() {}
+  virtual void loop() {}
+  virtual float get_setup_priority() const { return 0.0f; }
+
+  /// @brief Calls setup(); the component is ready afterwards
+  void call_setup();
+  /// @brief Calls loop(), then the functions deferred since the last call
+  void call_loop();
+
+  bool is_ready() const { return this->ready_; }
+  bool is_failed() const { return this->failed_; }
+  bool status_has_error() const { return this->error_; }
+
+  void mark_failed() { this->failed_ = true; }
+  void status_set_error(const char *message = "unspecified") { this->error_ = true; }
+  void status_clear_error() { this->error_ = false; }
+
+ protected:
+  void defer(std::function<void()> &&f) { this->deferred_.push_back(std::move(f)); }
+
+  std::vector<std::function<void()>> deferred_;
+  bool ready_{false};
+  bool failed_{false};
+  bool error_{false};
+};
+
+}  // namespace esphome
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace esphome {
+
+class EntityBase {
+ public:
+  const std::string &get_name() const { return this->name_; }
+  void set_name(const std::string &name) { this->name_ = name; }
+
+  /// @brief Identifies the entity's preferences; hashes the name, as the object id is derived from it
+  uint32_t get_object_id_hash() const { return std::hash<std::string>()(this->name_); }
+
+ protected:
+  std::string name_;
+};
+
+}  // namespace esphome
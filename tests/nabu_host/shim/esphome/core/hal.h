@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+
+namespace esphome {
+
+uint32_t millis();
+uint32_t micros();
+
+/// @brief Sleeps through vTaskDelay, so a task deleted or suspended by another task stops here
+void delay(uint32_t ms);
+
+}  // namespace esphome
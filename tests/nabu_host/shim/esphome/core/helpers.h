@@ -0,0 +1,115 @@
+#pragma once
+
+// The subset of ESPHome's helpers the nabu component and the media_player base use
+
+#include "esphome/core/optional.h"
+
+#include <esp_err.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace esphome {
+
+template<typename T, typename... Args> std::unique_ptr<T> make_unique(Args &&...args) {
+  return std::unique_ptr<T>(new T(std::forward<Args>(args)...));
+}
+
+template<typename T> constexpr const T &clamp(const T &value, const T &min, const T &max) {
+  return (value < min) ? min : ((max < value) ? max : value);
+}
+
+template<typename T, typename U> T remap(U value, U min, U max, T min_out, T max_out) {
+  return (value - min) * (max_out - min_out) / (max - min) + min_out;
+}
+
+bool str_equals_case_insensitive(const std::string &a, const std::string &b);
+bool str_startswith(const std::string &str, const std::string &start);
+bool str_endswith(const std::string &str, const std::string &end);
+std::string str_lower_case(const std::string &str);
+
+// There is no PSRAM on the host; both allocators use the heap, and allocations only fail where ALLOW_FAILURE is set
+template<class T> class ExternalRAMAllocator {
+ public:
+  using value_type = T;
+
+  enum Flags {
+    NONE = 0,
+    REFUSE_INTERNAL = 1 << 0,
+    ALLOW_FAILURE = 1 << 1,
+  };
+
+  ExternalRAMAllocator() = default;
+  ExternalRAMAllocator(Flags flags) : flags_{flags} {}
+  template<class U> constexpr ExternalRAMAllocator(const ExternalRAMAllocator<U> &other) : flags_{other.flags_} {}
+
+  T *allocate(size_t n) {
+    T *ptr = static_cast<T *>(malloc(n * sizeof(T)));
+    if ((ptr == nullptr) && ((this->flags_ & Flags::ALLOW_FAILURE) == 0)) {
+      abort();
+    }
+    return ptr;
+  }
+
+  void deallocate(T *p, size_t n) { free(p); }
+
+ private:
+  template<class U> friend class ExternalRAMAllocator;
+
+  uint8_t flags_{Flags::NONE};
+};
+
+template<class T> class RAMAllocator {
+ public:
+  using value_type = T;
+
+  enum Flags {
+    NONE = 0,
+    ALLOC_EXTERNAL = 1 << 0,
+    ALLOC_INTERNAL = 1 << 1,
+    ALLOW_FAILURE = 1 << 2,
+  };
+
+  RAMAllocator() = default;
+  RAMAllocator(uint8_t flags) : flags_{flags} {}
+
+  T *allocate(size_t n) {
+    T *ptr = static_cast<T *>(malloc(n * sizeof(T)));
+    if ((ptr == nullptr) && ((this->flags_ & Flags::ALLOW_FAILURE) == 0)) {
+      abort();
+    }
+    return ptr;
+  }
+
+  void deallocate(T *p, size_t n) { free(p); }
+
+ private:
+  uint8_t flags_{Flags::NONE};
+};
+
+template<typename... X> class CallbackManager;
+
+template<typename... Ts> class CallbackManager<void(Ts...)> {
+ public:
+  void add(std::function<void(Ts...)> &&callback) { this->callbacks_.push_back(std::move(callback)); }
+
+  void call(Ts... args) {
+    for (auto &callback : this->callbacks_) {
+      callback(args...);
+    }
+  }
+
+ protected:
+  std::vector<std::function<void(Ts...)>> callbacks_;
+};
+
+}  // namespace esphome
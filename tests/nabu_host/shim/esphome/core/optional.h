@@ -0,0 +1,13 @@
+#pragma once
+
+// ESPHome ships its own optional for older toolchains; the host build uses the standard one it is modeled on
+
+#include <optional>
+
+namespace esphome {
+
+template<typename T> using optional = std::optional<T>;
+using nullopt_t = std::nullopt_t;
+using std::nullopt;
+
+}  // namespace esphome
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace esphome {
+
+// Keeps each preference in memory for the life of the process
+class ESPPreferenceObject {
+ public:
+  ESPPreferenceObject() = default;
+  explicit ESPPreferenceObject(std::shared_ptr<std::vector<uint8_t>> data) : data_(std::move(data)) {}
+
+  template<typename T> bool save(const T *src) {
+    if (this->data_ == nullptr) {
+      return false;
+    }
+    this->data_->assign(reinterpret_cast<const uint8_t *>(src), reinterpret_cast<const uint8_t *>(src) + sizeof(T));
+    return true;
+  }
+
+  template<typename T> bool load(T *dest) {
+    if ((this->data_ == nullptr) || (this->data_->size() != sizeof(T))) {
+      return false;
+    }
+    memcpy(dest, this->data_->data(), sizeof(T));
+    return true;
+  }
+
+ protected:
+  std::shared_ptr<std::vector<uint8_t>> data_;
+};
+
+class ESPPreferences {
+ public:
+  template<typename T> ESPPreferenceObject make_preference(uint32_t type, bool in_flash = false) {
+    return ESPPreferenceObject(this->find_(type));
+  }
+
+ protected:
+  std::shared_ptr<std::vector<uint8_t>> find_(uint32_t type);
+};
+
+extern ESPPreferences *global_preferences;
+
+}  // namespace esphome
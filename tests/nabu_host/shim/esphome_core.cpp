@@ -0,0 +1,140 @@
+#include "esphome/core/component.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/helpers.h"
+#include "esphome/core/log.h"
+#include "esphome/core/preferences.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <esp_err.h>
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <map>
+#include <strings.h>
+
+namespace esphome {
+
+namespace {
+
+const auto START_TIME = std::chrono::steady_clock::now();
+std::atomic<int> log_level{ESPHOME_LOG_LEVEL_WARN};
+
+}  // namespace
+
+uint32_t millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - START_TIME).count();
+}
+
+uint32_t micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - START_TIME).count();
+}
+
+void delay(uint32_t ms) { vTaskDelay(pdMS_TO_TICKS(ms)); }
+
+bool str_equals_case_insensitive(const std::string &a, const std::string &b) {
+  return strcasecmp(a.c_str(), b.c_str()) == 0;
+}
+
+bool str_startswith(const std::string &str, const std::string &start) { return str.rfind(start, 0) == 0; }
+
+bool str_endswith(const std::string &str, const std::string &end) {
+  return (str.size() >= end.size()) && (str.compare(str.size() - end.size(), end.size(), end) == 0);
+}
+
+std::string str_lower_case(const std::string &str) {
+  std::string result(str);
+  for (char &c : result) {
+    c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+  }
+  return result;
+}
+
+const float setup_priority::PROCESSOR = 400.0f;
+
+void Component::call_setup() {
+  this->setup();
+  this->ready_ = !this->failed_;
+}
+
+void Component::call_loop() {
+  this->loop();
+  std::vector<std::function<void()>> deferred;
+  deferred.swap(this->deferred_);
+  for (auto &f : deferred) {
+    f();
+  }
+}
+
+std::shared_ptr<std::vector<uint8_t>> ESPPreferences::find_(uint32_t type) {
+  static std::map<uint32_t, std::shared_ptr<std::vector<uint8_t>>> preferences;
+  auto &data = preferences[type];
+  if (data == nullptr) {
+    data = std::make_shared<std::vector<uint8_t>>();
+  }
+  return data;
+}
+
+static ESPPreferences host_preferences;
+ESPPreferences *global_preferences = &host_preferences;
+
+void set_log_level(int level) { log_level = level; }
+
+void esp_log_printf_(int level, const char *tag, int line, const char *format, ...) {
+  if (level > log_level) {
+    return;
+  }
+  static const char LEVEL_LETTERS[] = "?EWICDV";
+
+  char message[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  // One fprintf call per line keeps lines from different tasks from interleaving
+  fprintf(stderr, "[%8.3f][%c][%s:%d]: %s\n", micros() / 1e6, LEVEL_LETTERS[level], tag, line, message);
+}
+
+}  // namespace esphome
+
+const char *esp_err_to_name(esp_err_t code) {
+  switch (code) {
+    case ESP_OK:
+      return "ESP_OK";
+    case ESP_FAIL:
+      return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+      return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+      return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+      return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+      return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+      return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+      return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+      return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_RESPONSE:
+      return "ESP_ERR_INVALID_RESPONSE";
+    case ESP_ERR_HTTP_MAX_REDIRECT:
+      return "ESP_ERR_HTTP_MAX_REDIRECT";
+    case ESP_ERR_HTTP_CONNECT:
+      return "ESP_ERR_HTTP_CONNECT";
+    case ESP_ERR_HTTP_WRITE_DATA:
+      return "ESP_ERR_HTTP_WRITE_DATA";
+    case ESP_ERR_HTTP_FETCH_HEADER:
+      return "ESP_ERR_HTTP_FETCH_HEADER";
+    case ESP_ERR_HTTP_INVALID_TRANSPORT:
+      return "ESP_ERR_HTTP_INVALID_TRANSPORT";
+    default:
+      return "UNKNOWN ERROR";
+  }
+}
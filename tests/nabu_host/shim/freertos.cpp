@@ -0,0 +1,496 @@
+// FreeRTOS on pthreads for the host build. Only what the nabu component uses is implemented.
+//  - A single mutex guards every kernel object. A blocked task waits on its own condition variable, and whatever may
+//    unblock it signals that condition variable.
+//  - Task priorities and stack buffers are ignored. Each task runs on a host stack of its own, filled with a pattern
+//    like FreeRTOS does, so uxTaskGetStackHighWaterMark can report how much of it was never used. Host code needs a
+//    different amount of stack than the ESP32's, so compare the numbers between decoders and revisions rather than
+//    against the stack sizes the component asks for.
+//  - A task can't be stopped from the outside at an arbitrary point, so a task suspended or deleted by another task
+//    only stops at its next call into the shim. The nabu component only deletes tasks blocked in a wait, and only
+//    suspends the mixer and stage tasks, which call into the shim at least every process() call.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "host_tasks.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct tskTaskControlBlock {
+  pthread_t thread;
+  pthread_cond_t wake;
+  TaskFunction_t task_code{nullptr};
+  void *parameters{nullptr};
+  std::string name;
+  uint8_t *stack{nullptr};  // Lowest usable address; a guard page sits below it
+  size_t stack_size{0};
+
+  uint32_t notification_count{0};
+
+  bool blocked{false};
+  bool suspended{false};  // Parked by a suspend request
+  bool suspend_requested{false};
+  bool delete_requested{false};
+};
+
+namespace {
+
+const size_t HOST_TASK_STACK_SIZE = 2 * 1024 * 1024;  // Plenty for the sanitizer builds too
+const uint8_t STACK_FILL_BYTE = 0xa5;                 // The pattern FreeRTOS fills task stacks with
+
+// The tasks blocked on a kernel object
+struct WaitList {
+  std::vector<TaskHandle_t> tasks;
+};
+
+pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+thread_local TaskHandle_t current_task = nullptr;
+
+class KernelLock {
+ public:
+  KernelLock() { pthread_mutex_lock(&kernel_lock); }
+  ~KernelLock() { pthread_mutex_unlock(&kernel_lock); }
+};
+
+// Every task started by the shim that hasn't been deleted, and the CPU time of the ones that have exited
+std::vector<TaskHandle_t> live_tasks;
+std::atomic<uint64_t> exited_tasks_cpu_us{0};
+
+const timespec START_TIME = [] {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now;
+}();
+
+uint64_t to_us(const timespec &time) { return static_cast<uint64_t>(time.tv_sec) * 1000000 + time.tv_nsec / 1000; }
+
+uint64_t thread_cpu_time_us(pthread_t thread) {
+  clockid_t clock;
+  timespec time;
+  if ((pthread_getcpuclockid(thread, &clock) != 0) || (clock_gettime(clock, &time) != 0)) {
+    return 0;
+  }
+  return to_us(time);
+}
+
+// Maps a stack for the task with a guard page below it and fills it with the pattern
+bool map_stack(TaskHandle_t task) {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  void *mapping = mmap(nullptr, HOST_TASK_STACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  mprotect(mapping, page_size, PROT_NONE);
+  task->stack = static_cast<uint8_t *>(mapping) + page_size;
+  task->stack_size = HOST_TASK_STACK_SIZE;
+  memset(task->stack, STACK_FILL_BYTE, task->stack_size);
+  return true;
+}
+
+void unmap_stack(TaskHandle_t task) {
+  if (task->stack != nullptr) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    munmap(task->stack - page_size, task->stack_size + page_size);
+  }
+}
+
+TaskHandle_t new_task() {
+  TaskHandle_t task = new tskTaskControlBlock();
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&task->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  return task;
+}
+
+// Ends the calling task's thread. Only call with the kernel lock held through a KernelLock, which releases it while
+// pthread_exit unwinds the stack.
+[[noreturn]] void exit_task_locked(TaskHandle_t task) {
+  exited_tasks_cpu_us += thread_cpu_time_us(pthread_self());
+  live_tasks.erase(std::remove(live_tasks.begin(), live_tasks.end(), task), live_tasks.end());
+  pthread_exit(nullptr);
+}
+
+// Acts on suspend and delete requests made by other tasks. Only call with the kernel lock held.
+void checkpoint_locked(TaskHandle_t task) {
+  while (true) {
+    if (task->delete_requested) {
+      exit_task_locked(task);
+    }
+    if (!task->suspend_requested) {
+      break;
+    }
+    task->suspended = true;
+    pthread_cond_wait(&task->wake, &kernel_lock);
+    task->suspended = false;
+  }
+}
+
+TaskHandle_t current_task_locked() {
+  if (current_task == nullptr) {
+    // A thread the shim didn't start, e.g., main; it only needs the wait state
+    current_task = new_task();
+    current_task->thread = pthread_self();
+    current_task->name = "host";
+  }
+  return current_task;
+}
+
+void wake_all(WaitList &list) {
+  for (TaskHandle_t task : list.tasks) {
+    pthread_cond_signal(&task->wake);
+  }
+}
+
+// Blocks the calling task until ready() holds or the ticks elapsed. Only call with the kernel lock held.
+// @return true if ready() holds
+template<typename F> bool block_locked(TaskHandle_t task, WaitList *list, TickType_t ticks_to_wait, F ready) {
+  checkpoint_locked(task);
+
+  timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  if (ticks_to_wait != portMAX_DELAY) {
+    const uint64_t wait_ns = static_cast<uint64_t>(pdTICKS_TO_MS(ticks_to_wait)) * 1000000;
+    deadline.tv_sec += (deadline.tv_nsec + wait_ns) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + wait_ns) % 1000000000;
+  }
+
+  while (!ready()) {
+    if (ticks_to_wait == 0) {
+      return false;
+    }
+
+    if (list != nullptr) {
+      list->tasks.push_back(task);
+    }
+    task->blocked = true;
+
+    int result = 0;
+    if (ticks_to_wait == portMAX_DELAY) {
+      pthread_cond_wait(&task->wake, &kernel_lock);
+    } else {
+      result = pthread_cond_timedwait(&task->wake, &kernel_lock, &deadline);
+    }
+
+    task->blocked = false;
+    if (list != nullptr) {
+      list->tasks.erase(std::find(list->tasks.begin(), list->tasks.end(), task));
+    }
+    checkpoint_locked(task);
+
+    if ((result == ETIMEDOUT) && !ready()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void *task_trampoline(void *arg) {
+  TaskHandle_t task = static_cast<TaskHandle_t>(arg);
+  current_task = task;
+  task->task_code(task->parameters);
+
+  // FreeRTOS tasks never return; treat it as deleting itself
+  vTaskDelete(nullptr);
+  return nullptr;
+}
+
+}  // namespace
+
+struct QueueDefinition {
+  size_t length;
+  size_t item_size;
+  std::deque<std::vector<uint8_t>> items;
+  WaitList senders;
+  WaitList receivers;
+};
+
+struct EventGroupDef_t {
+  EventBits_t bits{0};
+  WaitList waiters;
+};
+
+namespace esphome {
+namespace host {
+
+uint64_t task_cpu_time_us() {
+  KernelLock lock;
+  uint64_t cpu_time_us = exited_tasks_cpu_us.load();
+  for (TaskHandle_t task : live_tasks) {
+    cpu_time_us += thread_cpu_time_us(task->thread);
+  }
+  return cpu_time_us;
+}
+
+}  // namespace host
+}  // namespace esphome
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                               UBaseType_t priority, StackType_t *stack_buffer, StaticTask_t *task_buffer) {
+  TaskHandle_t task = new_task();
+  task->task_code = task_code;
+  task->parameters = parameters;
+  task->name = name;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (map_stack(task)) {
+    pthread_attr_setstack(&attr, task->stack, task->stack_size);
+  }
+
+  KernelLock lock;
+  const int result = pthread_create(&task->thread, &attr, task_trampoline, task);
+  pthread_attr_destroy(&attr);
+  if (result != 0) {
+    unmap_stack(task);
+    pthread_cond_destroy(&task->wake);
+    delete task;
+    return nullptr;
+  }
+  pthread_setname_np(task->thread, task->name.substr(0, 15).c_str());
+  live_tasks.push_back(task);
+  return task;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  {
+    KernelLock lock;
+    TaskHandle_t self = current_task_locked();
+    if ((task == nullptr) || (task == self)) {
+      pthread_detach(pthread_self());
+      exit_task_locked(self);
+    }
+
+    task->delete_requested = true;
+    pthread_cond_signal(&task->wake);
+  }
+
+  pthread_join(task->thread, nullptr);
+  unmap_stack(task);
+  pthread_cond_destroy(&task->wake);
+  delete task;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  if (task == nullptr) {
+    KernelLock lock;
+    task = current_task_locked();
+  }
+  if (task->stack == nullptr) {
+    return 0;
+  }
+  // The stack grows down, so the bytes still holding the pattern at the bottom were never used
+  size_t unused = 0;
+  while ((unused < task->stack_size) && (task->stack[unused] == STACK_FILL_BYTE)) {
+    ++unused;
+  }
+  return unused;
+}
+
+void vTaskSuspend(TaskHandle_t task) {
+  KernelLock lock;
+  TaskHandle_t self = current_task_locked();
+  if (task == nullptr) {
+    task = self;
+  }
+  task->suspend_requested = true;
+  if (task == self) {
+    checkpoint_locked(self);
+  }
+}
+
+void vTaskResume(TaskHandle_t task) {
+  KernelLock lock;
+  task->suspend_requested = false;
+  pthread_cond_signal(&task->wake);
+}
+
+eTaskState eTaskGetState(TaskHandle_t task) {
+  KernelLock lock;
+  if (task == current_task) {
+    return eRunning;
+  }
+  if (task->suspended) {
+    return eSuspended;
+  }
+  if (task->blocked) {
+    return eBlocked;
+  }
+  return eReady;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  {
+    KernelLock lock;
+    TaskHandle_t task = current_task_locked();
+    if (ticks > 0) {
+      block_locked(task, nullptr, ticks, [] { return false; });
+      return;
+    }
+    checkpoint_locked(task);
+  }
+  sched_yield();
+}
+
+TickType_t xTaskGetTickCount() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return pdMS_TO_TICKS((to_us(now) - to_us(START_TIME)) / 1000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  KernelLock lock;
+  return current_task_locked();
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  KernelLock lock;
+  ++task->notification_count;
+  pthread_cond_signal(&task->wake);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait) {
+  KernelLock lock;
+  TaskHandle_t task = current_task_locked();
+  block_locked(task, nullptr, ticks_to_wait, [task] { return task->notification_count > 0; });
+
+  const uint32_t count = task->notification_count;
+  if (count > 0) {
+    task->notification_count = clear_count_on_exit ? 0 : count - 1;
+  }
+  return count;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+  QueueHandle_t queue = new QueueDefinition();
+  queue->length = length;
+  queue->item_size = item_size;
+  return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) { delete queue; }
+
+static BaseType_t queue_send(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait, bool front) {
+  KernelLock lock;
+  TaskHandle_t task = current_task_locked();
+  if (!block_locked(task, &queue->senders, ticks_to_wait, [queue] { return queue->items.size() < queue->length; })) {
+    return pdFAIL;
+  }
+
+  const uint8_t *bytes = static_cast<const uint8_t *>(item);
+  std::vector<uint8_t> copy(bytes, bytes + (item != nullptr ? queue->item_size : 0));
+  if (front) {
+    queue->items.push_front(std::move(copy));
+  } else {
+    queue->items.push_back(std::move(copy));
+  }
+  wake_all(queue->receivers);
+  return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+  return queue_send(queue, item, ticks_to_wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+  return queue_send(queue, item, ticks_to_wait, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait) {
+  KernelLock lock;
+  TaskHandle_t task = current_task_locked();
+  if (!block_locked(task, &queue->receivers, ticks_to_wait, [queue] { return !queue->items.empty(); })) {
+    return pdFALSE;
+  }
+
+  if ((buffer != nullptr) && (queue->item_size > 0)) {
+    std::memcpy(buffer, queue->items.front().data(), queue->item_size);
+  }
+  queue->items.pop_front();
+  wake_all(queue->senders);
+  return pdTRUE;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue) {
+  KernelLock lock;
+  queue->items.clear();
+  wake_all(queue->senders);
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  KernelLock lock;
+  return queue->items.size();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  SemaphoreHandle_t semaphore = xQueueCreate(1, 0);
+  xSemaphoreGive(semaphore);
+  return semaphore;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore) { vQueueDelete(semaphore); }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait) {
+  return xQueueReceive(semaphore, nullptr, ticks_to_wait);
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) { return xQueueSend(semaphore, nullptr, 0); }
+
+EventGroupHandle_t xEventGroupCreate() { return new EventGroupDef_t(); }
+
+void vEventGroupDelete(EventGroupHandle_t event_group) { delete event_group; }
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t event_group, EventBits_t bits_to_set) {
+  KernelLock lock;
+  event_group->bits |= bits_to_set;
+  wake_all(event_group->waiters);
+  return event_group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t event_group, EventBits_t bits_to_clear) {
+  KernelLock lock;
+  const EventBits_t bits = event_group->bits;
+  event_group->bits &= ~bits_to_clear;
+  return bits;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t event_group) {
+  KernelLock lock;
+  return event_group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t event_group, EventBits_t bits_to_wait_for,
+                                BaseType_t clear_on_exit, BaseType_t wait_for_all_bits, TickType_t ticks_to_wait) {
+  KernelLock lock;
+  TaskHandle_t task = current_task_locked();
+  const bool satisfied = block_locked(task, &event_group->waiters, ticks_to_wait, [=] {
+    const EventBits_t set_bits = event_group->bits & bits_to_wait_for;
+    return wait_for_all_bits ? (set_bits == bits_to_wait_for) : (set_bits != 0);
+  });
+
+  const EventBits_t bits = event_group->bits;
+  if (satisfied && clear_on_exit) {
+    event_group->bits &= ~bits_to_wait_for;
+  }
+  return bits;
+}
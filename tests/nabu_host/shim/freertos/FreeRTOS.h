@@ -0,0 +1,23 @@
+#pragma once
+
+// FreeRTOS types and macros for the host build. The kernel functions are implemented on pthreads in freertos.cpp.
+
+#include <cstddef>
+#include <cstdint>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;  // As on the ESP32, stack sizes are in bytes
+
+// ESPHome builds ESP-IDF with a 1 kHz tick
+#define configTICK_RATE_HZ 1000
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+#define pdTICKS_TO_MS(ticks) ((uint32_t) (((uint64_t) (ticks) * 1000) / configTICK_RATE_HZ))
+
+#define pdFALSE ((BaseType_t) 0)
+#define pdTRUE ((BaseType_t) 1)
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
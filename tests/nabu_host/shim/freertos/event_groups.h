@@ -0,0 +1,16 @@
+#pragma once
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef uint32_t EventBits_t;
+typedef struct EventGroupDef_t *EventGroupHandle_t;
+
+EventGroupHandle_t xEventGroupCreate();
+void vEventGroupDelete(EventGroupHandle_t event_group);
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t event_group, EventBits_t bits_to_set);
+EventBits_t xEventGroupClearBits(EventGroupHandle_t event_group, EventBits_t bits_to_clear);
+EventBits_t xEventGroupGetBits(EventGroupHandle_t event_group);
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t event_group, EventBits_t bits_to_wait_for,
+                                BaseType_t clear_on_exit, BaseType_t wait_for_all_bits, TickType_t ticks_to_wait);
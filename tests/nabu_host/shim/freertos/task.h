@@ -0,0 +1,47 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct tskTaskControlBlock *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+// The host tasks run on their own pthread stacks, so the static task buffer is only a placeholder
+typedef struct {
+  uint8_t unused;
+} StaticTask_t;
+
+typedef enum {
+  eRunning = 0,
+  eReady,
+  eBlocked,
+  eSuspended,
+  eDeleted,
+  eInvalid,
+} eTaskState;
+
+/// @brief Starts a task on a new thread. The priority, stack depth, and stack buffer are ignored; the thread gets a
+/// host stack of its own.
+TaskHandle_t xTaskCreateStatic(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                               UBaseType_t priority, StackType_t *stack_buffer, StaticTask_t *task_buffer);
+
+/// @brief Deletes a task. Another task stops at its next call into the shim, e.g., in the wait it is blocked in; the
+/// call returns once its thread has exited.
+void vTaskDelete(TaskHandle_t task);
+
+/// @brief Smallest number of bytes the task's host stack has had left since it started; 0 for threads the shim didn't
+/// start. nullptr for the calling task.
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+
+/// @brief Suspends a task. Another task parks at its next call into the shim.
+void vTaskSuspend(TaskHandle_t task);
+void vTaskResume(TaskHandle_t task);
+eTaskState eTaskGetState(TaskHandle_t task);
+
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+
+/// @brief The calling thread's task. Threads the shim didn't start (e.g., main) get a task on their first call.
+TaskHandle_t xTaskGetCurrentTaskHandle();
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+namespace esphome {
+namespace host {
+
+/// @brief CPU time used by every task started through xTaskCreateStatic so far, including deleted ones. Leaves out
+/// threads the shim didn't start, e.g., main or a loopback HTTP server.
+/// @return CPU time in microseconds
+uint64_t task_cpu_time_us();
+
+}  // namespace host
+}  // namespace esphome
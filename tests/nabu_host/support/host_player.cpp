@@ -0,0 +1,164 @@
+#include "host_player.h"
+
+#include "host_tasks.h"
+
+#include "esphome/core/log.h"
+
+#include <freertos/task.h>
+
+#include <chrono>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+static const char *const TAG = "host_player";
+
+static const uint8_t NUMBER_OF_CHANNELS = 2;
+static const UBaseType_t PIPELINE_TASK_PRIORITY = 1;
+static const UBaseType_t MIXER_TASK_PRIORITY = 10;
+static const uint32_t POLL_INTERVAL_MS = 16;  // Roughly how often ESPHome's main loop calls loop()
+
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+HostPlayer::HostPlayer(const HostPlayerOptions &options)
+    : options_(options), speaker_(options.wav_path, options.bits_per_sample, options.realtime) {}
+
+HostPlayer::~HostPlayer() {
+  if (this->pipeline_ != nullptr) {
+    this->pipeline_->stop();
+    this->pipeline_.reset();
+  }
+  if (this->mixer_ != nullptr) {
+    CommandEvent command_event;
+    command_event.command = CommandEventType::STOP;
+    this->mixer_->send_command(&command_event);
+
+    TaskEvent event;
+    while (this->mixer_->read_event(&event, pdMS_TO_TICKS(1000)) && (event.type != EventType::STOPPED)) {
+    }
+    this->mixer_->stop();
+  }
+  this->speaker_.finish();
+}
+
+esp_err_t HostPlayer::start_mixer_() {
+  audio::AudioStreamInfo audio_stream_info;
+  audio_stream_info.channels = NUMBER_OF_CHANNELS;
+  audio_stream_info.bits_per_sample = 32;
+  audio_stream_info.sample_rate = this->options_.sample_rate;
+  this->speaker_.set_audio_stream_info(audio_stream_info);
+
+  this->mixer_ = make_unique<AudioMixer>();
+  const size_t frame_bytes = NUMBER_OF_CHANNELS * sizeof(int32_t);
+  this->mixer_->set_prebuffer(this->options_.media_prebuffer_ms * this->options_.sample_rate / 1000 * frame_bytes,
+                              this->options_.announcement_prebuffer_ms * this->options_.sample_rate / 1000 *
+                                  frame_bytes);
+  esp_err_t err = this->mixer_->start(&this->speaker_, "mixer", MIXER_TASK_PRIORITY);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  const AudioPipelineType type =
+      this->options_.announcement ? AudioPipelineType::ANNOUNCEMENT : AudioPipelineType::MEDIA;
+  this->pipeline_ = make_unique<AudioPipeline>(this->mixer_.get(), type);
+  this->pipeline_->set_buffer_arena(&this->arena_);
+  this->pipeline_->set_fuse_file_stages(this->options_.fuse_file_stages);
+
+  this->start_cpu_us_ = esphome::host::task_cpu_time_us();
+  this->start_wall_us_ = now_us();
+  return ESP_OK;
+}
+
+esp_err_t HostPlayer::start(const std::string &uri) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+  return this->pipeline_->start(uri, this->options_.sample_rate, "pipeline", PIPELINE_TASK_PRIORITY);
+}
+
+esp_err_t HostPlayer::start(media_player::MediaFile *media_file) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+  return this->pipeline_->start(media_file, this->options_.sample_rate, "pipeline", PIPELINE_TASK_PRIORITY);
+}
+
+esp_err_t HostPlayer::prefetch(media_player::MediaFile *media_file) {
+  esp_err_t err = this->start_mixer_();
+  if (err != ESP_OK) {
+    return err;
+  }
+  return this->pipeline_->prefetch(media_file, this->options_.sample_rate, "pipeline", PIPELINE_TASK_PRIORITY);
+}
+
+HostPlayerResult HostPlayer::wait(uint32_t timeout_ms) {
+  HostPlayerResult result{};
+  result.final_state = AudioPipelineState::STOPPED;
+
+  const uint64_t deadline_us = now_us() + static_cast<uint64_t>(timeout_ms) * 1000;
+  while (true) {
+    this->drain_mixer_events_();
+
+    AudioPipelineState state = this->pipeline_->get_state();
+    result.final_state = state;
+    if (state != AudioPipelineState::PLAYING) {
+      AudioRingBuffer *ring_buffer = this->mixer_ring_buffer_();
+      if ((state != AudioPipelineState::STOPPED) || (ring_buffer == nullptr) || (ring_buffer->available() == 0)) {
+        break;
+      }
+    }
+
+    if (this->seek_pending_) {
+      const uint64_t played_ms = this->speaker_.get_frames() * 1000 / this->options_.sample_rate;
+      if (played_ms >= this->seek_at_ms_) {
+        this->seek_pending_ = false;
+        esp_err_t err = this->pipeline_->seek(this->seek_position_ms_);
+        ESP_LOGI(TAG, "Seek to %u ms after %u ms of audio: %s", (unsigned) this->seek_position_ms_,
+                 (unsigned) played_ms, esp_err_to_name(err));
+      }
+    }
+
+    if (now_us() >= deadline_us) {
+      result.timed_out = true;
+      break;
+    }
+    vTaskDelay(pdMS_TO_TICKS(POLL_INTERVAL_MS));
+  }
+
+  result.cpu_us = esphome::host::task_cpu_time_us() - this->start_cpu_us_;
+  result.wall_us = now_us() - this->start_wall_us_;
+  result.audio_seconds = static_cast<double>(this->speaker_.get_frames()) / this->options_.sample_rate;
+  result.wakeups = this->pipeline_->get_wakeup_count() + this->mixer_->get_wakeup_count();
+  result.pipeline_stats = this->pipeline_->get_stats();
+  result.mixer_stats = this->mixer_->get_stats();
+  result.arena_stats = this->arena_.get_stats();
+  return result;
+}
+
+void HostPlayer::drain_mixer_events_() {
+  TaskEvent event;
+  while (this->mixer_->read_event(&event)) {
+    if (event.type == EventType::MEDIA_UNDERRUN) {
+      ESP_LOGD(TAG, "Media stream underrun");
+    } else if (event.type == EventType::ANNOUNCEMENT_UNDERRUN) {
+      ESP_LOGD(TAG, "Announcement stream underrun");
+    } else if (event.type == EventType::WARNING) {
+      ESP_LOGW(TAG, "Mixer warning: %s", esp_err_to_name(event.err));
+    }
+  }
+}
+
+AudioRingBuffer *HostPlayer::mixer_ring_buffer_() {
+  return this->options_.announcement ? this->mixer_->get_announcement_ring_buffer()
+                                     : this->mixer_->get_media_ring_buffer();
+}
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "wav_file_speaker.h"
+
+#include "audio_buffer_arena.h"
+#include "audio_mixer.h"
+#include "audio_pipeline.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+struct HostPlayerOptions {
+  uint32_t sample_rate{48000};
+  bool announcement{false};       // Feed the mixer's announcement stream instead of the media stream
+  bool fuse_file_stages{false};   // Run a MediaFile's stages in one task, as announcements do on the device
+  uint32_t media_prebuffer_ms{300};  // The media_player component's defaults
+  uint32_t announcement_prebuffer_ms{100};
+  std::string wav_path;           // Empty to discard the output
+  uint8_t bits_per_sample{16};
+  bool realtime{false};
+};
+
+struct HostPlayerResult {
+  AudioPipelineState final_state;
+  bool timed_out;
+  uint64_t cpu_us;       // CPU time of the pipeline's and mixer's tasks
+  uint64_t wall_us;
+  double audio_seconds;  // Audio the speaker received
+  uint32_t wakeups;      // Pipeline and mixer wakeups while waiting on their ring buffers
+  AudioPipelineStats pipeline_stats;
+  AudioMixerStats mixer_stats;
+  AudioBufferArenaStats arena_stats;
+};
+
+// Plays one source through an AudioPipeline and the AudioMixer into a WavFileSpeaker, the way the media player
+// component wires them on the device
+class HostPlayer {
+ public:
+  explicit HostPlayer(const HostPlayerOptions &options);
+  ~HostPlayer();
+
+  esp_err_t start(const std::string &uri);
+  esp_err_t start(media_player::MediaFile *media_file);
+
+  /// @brief Starts the pipeline like the media player prefetches the next announcement: it reads and decodes, but
+  /// holds its output back until get_pipeline()->start_output()
+  esp_err_t prefetch(media_player::MediaFile *media_file);
+
+  /// @brief Seeks once the speaker received at_ms of audio. Call before wait().
+  void seek_at(uint32_t at_ms, uint32_t position_ms) {
+    this->seek_at_ms_ = at_ms;
+    this->seek_position_ms_ = position_ms;
+    this->seek_pending_ = true;
+  }
+
+  /// @brief Polls the pipeline like the media player's loop() until it stopped and the mixer played everything
+  HostPlayerResult wait(uint32_t timeout_ms = 600000);
+
+  AudioPipeline *get_pipeline() { return this->pipeline_.get(); }
+  WavFileSpeaker *get_speaker() { return &this->speaker_; }
+
+ protected:
+  esp_err_t start_mixer_();
+  void drain_mixer_events_();
+  AudioRingBuffer *mixer_ring_buffer_();
+
+  HostPlayerOptions options_;
+  WavFileSpeaker speaker_;
+  AudioBufferArena arena_;
+  std::unique_ptr<AudioMixer> mixer_;
+  std::unique_ptr<AudioPipeline> pipeline_;
+
+  bool seek_pending_{false};
+  uint32_t seek_at_ms_{0};
+  uint32_t seek_position_ms_{0};
+
+  uint64_t start_cpu_us_{0};
+  uint64_t start_wall_us_{0};
+};
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
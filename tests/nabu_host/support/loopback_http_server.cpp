@@ -0,0 +1,210 @@
+#include "loopback_http_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+static const size_t MAX_REQUEST_BYTES = 8192;
+static const size_t SEND_SLICE_BYTES = 16384;
+static const uint32_t RATE_LIMIT_SLICE_MS = 20;
+
+bool LoopbackHttpServer::start() {
+  this->listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (this->listen_fd_ < 0) {
+    return false;
+  }
+  int reuse = 1;
+  setsockopt(this->listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t address_length = sizeof(address);
+  if ((bind(this->listen_fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) ||
+      (listen(this->listen_fd_, 16) != 0) ||
+      (getsockname(this->listen_fd_, reinterpret_cast<sockaddr *>(&address), &address_length) != 0)) {
+    close(this->listen_fd_);
+    this->listen_fd_ = -1;
+    return false;
+  }
+  this->port_ = ntohs(address.sin_port);
+
+  this->stopping_ = false;
+  this->accept_thread_ = std::thread(&LoopbackHttpServer::accept_loop_, this);
+  return true;
+}
+
+void LoopbackHttpServer::stop() {
+  if (this->listen_fd_ < 0) {
+    return;
+  }
+  this->stopping_ = true;
+  shutdown(this->listen_fd_, SHUT_RDWR);
+  this->accept_thread_.join();
+  close(this->listen_fd_);
+  this->listen_fd_ = -1;
+
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    for (int fd : this->connection_fds_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    threads.swap(this->connection_threads_);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void LoopbackHttpServer::add_file(const std::string &path, std::vector<uint8_t> data, const std::string &content_type) {
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  File &file = this->files_[path];
+  file.data = std::move(data);
+  file.content_type = content_type;
+}
+
+std::string LoopbackHttpServer::url(const std::string &path) const {
+  return "http://127.0.0.1:" + std::to_string(this->port_) + path;
+}
+
+void LoopbackHttpServer::accept_loop_() {
+  while (!this->stopping_) {
+    int fd = accept(this->listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    int no_delay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    ++this->connections_;
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->connection_fds_.push_back(fd);
+    this->connection_threads_.emplace_back(&LoopbackHttpServer::serve_connection_, this, fd);
+  }
+}
+
+void LoopbackHttpServer::serve_connection_(int fd) {
+  std::string pending;
+  char buffer[4096];
+
+  while (!this->stopping_) {
+    size_t header_end;
+    while ((header_end = pending.find("\r\n\r\n")) == std::string::npos) {
+      ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+      if ((received <= 0) || (pending.size() > MAX_REQUEST_BYTES)) {
+        goto done;
+      }
+      pending.append(buffer, received);
+    }
+    std::string request = pending.substr(0, header_end);
+    pending.erase(0, header_end + 4);
+    ++this->requests_;
+
+    size_t path_start = request.find(' ') + 1;
+    size_t path_end = request.find(' ', path_start);
+    std::string path = request.substr(path_start, path_end - path_start);
+
+    size_t range_start = 0;
+    bool ranged = false;
+    size_t range_header = request.find("\r\nRange: bytes=");
+    if (range_header == std::string::npos) {
+      range_header = request.find("\r\nrange: bytes=");
+    }
+    if (range_header != std::string::npos) {
+      range_start = strtoull(request.c_str() + range_header + strlen("\r\nRange: bytes="), nullptr, 10);
+      ranged = true;
+    }
+
+    const File *file = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex_);
+      auto it = this->files_.find(path);
+      if (it != this->files_.end()) {
+        file = &it->second;
+      }
+    }
+
+    std::string response;
+    const uint8_t *body = nullptr;
+    size_t body_length = 0;
+    if (file == nullptr) {
+      response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n";
+    } else if (ranged && (range_start >= file->data.size())) {
+      response = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n";
+    } else {
+      body = file->data.data() + range_start;
+      body_length = file->data.size() - range_start;
+      if (ranged) {
+        response = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(range_start) + "-" +
+                   std::to_string(file->data.size() - 1) + "/" + std::to_string(file->data.size()) + "\r\n";
+      } else {
+        response = "HTTP/1.1 200 OK\r\n";
+      }
+      response += "Content-Type: " + file->content_type + "\r\nAccept-Ranges: bytes\r\nContent-Length: " +
+                  std::to_string(body_length) + "\r\n";
+    }
+    const bool close_after = this->close_connections_.load();
+    response += close_after ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+
+    if (!this->send_all_(fd, reinterpret_cast<const uint8_t *>(response.data()), response.size())) {
+      break;
+    }
+
+    const size_t rate_limit = this->rate_limit_.load();
+    const auto body_start = std::chrono::steady_clock::now();
+    size_t sent = 0;
+    while (sent < body_length) {
+      size_t slice = std::min(SEND_SLICE_BYTES, body_length - sent);
+      if (rate_limit > 0) {
+        slice = std::min(slice, std::max<size_t>(1, rate_limit * RATE_LIMIT_SLICE_MS / 1000));
+        // Sleeps until the bytes sent so far are due
+        auto due = body_start + std::chrono::microseconds(static_cast<uint64_t>(sent) * 1000000 / rate_limit);
+        std::this_thread::sleep_until(due);
+      }
+      if (!this->send_all_(fd, body + sent, slice)) {
+        goto done;
+      }
+      sent += slice;
+    }
+
+    if (close_after) {
+      break;
+    }
+  }
+
+done:
+  std::lock_guard<std::mutex> lock(this->mutex_);
+  this->connection_fds_.erase(std::remove(this->connection_fds_.begin(), this->connection_fds_.end(), fd),
+                              this->connection_fds_.end());
+  close(fd);
+}
+
+bool LoopbackHttpServer::send_all_(int fd, const uint8_t *data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return !this->stopping_;
+}
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
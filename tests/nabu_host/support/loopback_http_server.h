@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+// HTTP/1.1 server on 127.0.0.1 that serves files from memory, standing in for a media server on the local network
+//  - Supports keep-alive and single "bytes=N-" Range requests
+//  - An optional rate limit spreads each response over time, like a stream arriving over Wi-Fi
+//  - Each connection is served by its own thread
+class LoopbackHttpServer {
+ public:
+  ~LoopbackHttpServer() { this->stop(); }
+
+  /// @brief Binds an ephemeral port and starts accepting connections
+  /// @return true if successful
+  bool start();
+  void stop();
+
+  /// @brief Serves data at path, e.g., "/tada.mp3"
+  void add_file(const std::string &path, std::vector<uint8_t> data, const std::string &content_type);
+
+  /// @brief Limits each response to bytes_per_second; 0 for unlimited
+  void set_rate_limit(size_t bytes_per_second) { this->rate_limit_ = bytes_per_second; }
+
+  /// @brief Closes the connection after each response instead of keeping it alive
+  void set_close_connections(bool close_connections) { this->close_connections_ = close_connections; }
+
+  std::string url(const std::string &path) const;
+
+  uint32_t get_connections() const { return this->connections_.load(); }
+  uint32_t get_requests() const { return this->requests_.load(); }
+
+ protected:
+  struct File {
+    std::vector<uint8_t> data;
+    std::string content_type;
+  };
+
+  void accept_loop_();
+  void serve_connection_(int fd);
+  /// @return false if the connection should close
+  bool send_all_(int fd, const uint8_t *data, size_t length);
+
+  int listen_fd_{-1};
+  uint16_t port_{0};
+  std::thread accept_thread_;
+  std::atomic<bool> stopping_{false};
+
+  std::mutex mutex_;
+  std::map<std::string, File> files_;
+  std::vector<std::thread> connection_threads_;
+  std::vector<int> connection_fds_;
+
+  std::atomic<size_t> rate_limit_{0};
+  std::atomic<bool> close_connections_{false};
+  std::atomic<uint32_t> connections_{0};
+  std::atomic<uint32_t> requests_{0};
+};
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
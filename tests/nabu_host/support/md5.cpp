@@ -0,0 +1,111 @@
+#include "md5.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+static const uint32_t SINES[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+
+static const uint8_t SHIFTS[64] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+                                   5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+                                   4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+                                   6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+static uint32_t rotate_left(uint32_t value, uint8_t bits) { return (value << bits) | (value >> (32 - bits)); }
+
+Md5::Md5() : state_{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476} {}
+
+void Md5::update(const uint8_t *data, size_t length) {
+  size_t buffered = this->length_ % 64;
+  this->length_ += length;
+
+  if (buffered > 0) {
+    const size_t count = std::min<size_t>(64 - buffered, length);
+    std::memcpy(this->buffer_ + buffered, data, count);
+    data += count;
+    length -= count;
+    buffered += count;
+    if (buffered < 64) {
+      return;
+    }
+    this->transform_(this->buffer_);
+  }
+  for (; length >= 64; data += 64, length -= 64) {
+    this->transform_(data);
+  }
+  std::memcpy(this->buffer_, data, length);
+}
+
+void Md5::finish(uint8_t digest[16]) {
+  const uint64_t bit_length = this->length_ * 8;
+  const uint8_t padding_start = 0x80;
+  this->update(&padding_start, 1);
+  const uint8_t zero = 0;
+  while (this->length_ % 64 != 56) {
+    this->update(&zero, 1);
+  }
+  uint8_t length_bytes[8];
+  for (int i = 0; i < 8; ++i) {
+    length_bytes[i] = static_cast<uint8_t>(bit_length >> (8 * i));
+  }
+  this->update(length_bytes, sizeof(length_bytes));
+
+  for (int i = 0; i < 16; ++i) {
+    digest[i] = static_cast<uint8_t>(this->state_[i / 4] >> (8 * (i % 4)));
+  }
+}
+
+void Md5::transform_(const uint8_t block[64]) {
+  uint32_t words[16];
+  for (int i = 0; i < 16; ++i) {
+    words[i] = block[i * 4] | (block[i * 4 + 1] << 8) | (block[i * 4 + 2] << 16) |
+               (static_cast<uint32_t>(block[i * 4 + 3]) << 24);
+  }
+
+  uint32_t a = this->state_[0];
+  uint32_t b = this->state_[1];
+  uint32_t c = this->state_[2];
+  uint32_t d = this->state_[3];
+  for (int i = 0; i < 64; ++i) {
+    uint32_t f;
+    int word;
+    if (i < 16) {
+      f = (b & c) | (~b & d);
+      word = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & c);
+      word = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ c ^ d;
+      word = (3 * i + 5) % 16;
+    } else {
+      f = c ^ (b | ~d);
+      word = (7 * i) % 16;
+    }
+    const uint32_t next_d = c;
+    c = b;
+    b = b + rotate_left(a + f + SINES[i] + words[word], SHIFTS[i]);
+    a = d;
+    d = next_d;
+  }
+
+  this->state_[0] += a;
+  this->state_[1] += b;
+  this->state_[2] += c;
+  this->state_[3] += d;
+}
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+// MD5 digest (RFC 1321), for checking decoded audio against the signature in a FLAC file's STREAMINFO block
+class Md5 {
+ public:
+  Md5();
+
+  void update(const uint8_t *data, size_t length);
+
+  /// @brief Finishes the digest; call update() no more afterwards
+  void finish(uint8_t digest[16]);
+
+ protected:
+  void transform_(const uint8_t block[64]);
+
+  uint32_t state_[4];
+  uint64_t length_{0};  // Bytes hashed so far
+  uint8_t buffer_[64];
+};
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
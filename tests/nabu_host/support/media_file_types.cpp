@@ -0,0 +1,45 @@
+#include "media_file_types.h"
+
+#include "esphome/core/helpers.h"
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+media_player::MediaFileType file_type_from_path(const std::string &path) {
+  std::string lower = str_lower_case(path);
+  if (str_endswith(lower, ".wav")) {
+    return media_player::MediaFileType::WAV;
+  } else if (str_endswith(lower, ".mp3")) {
+    return media_player::MediaFileType::MP3;
+  } else if (str_endswith(lower, ".flac")) {
+    return media_player::MediaFileType::FLAC;
+  } else if (str_endswith(lower, ".opus") || str_endswith(lower, ".ogg")) {
+    return media_player::MediaFileType::OPUS;
+  } else if (str_endswith(lower, ".aac") || str_endswith(lower, ".m4a")) {
+    return media_player::MediaFileType::AAC;
+  }
+  return media_player::MediaFileType::NONE;
+}
+
+const char *content_type_from_path(const std::string &path) {
+  std::string lower = str_lower_case(path);
+  if (str_endswith(lower, ".wav")) {
+    return "audio/wav";
+  } else if (str_endswith(lower, ".mp3")) {
+    return "audio/mpeg";
+  } else if (str_endswith(lower, ".flac")) {
+    return "audio/flac";
+  } else if (str_endswith(lower, ".opus") || str_endswith(lower, ".ogg")) {
+    return "audio/ogg";
+  } else if (str_endswith(lower, ".aac")) {
+    return "audio/aac";
+  } else if (str_endswith(lower, ".m4a")) {
+    return "audio/mp4";
+  }
+  return "application/octet-stream";
+}
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
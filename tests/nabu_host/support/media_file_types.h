@@ -0,0 +1,20 @@
+#pragma once
+
+#include "esphome/components/media_player/media_player.h"
+
+#include <string>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+/// @brief File type of a local file, from its extension
+/// @return NONE if the extension isn't one the decoder handles
+media_player::MediaFileType file_type_from_path(const std::string &path);
+
+/// @brief Content-Type a server would send for a file, from its extension
+const char *content_type_from_path(const std::string &path);
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
@@ -0,0 +1,136 @@
+#include "wav_file_speaker.h"
+
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+static const size_t WAV_HEADER_SIZE = 44;
+static const uint8_t INPUT_CHANNELS = 2;
+static const size_t INPUT_FRAME_BYTES = INPUT_CHANNELS * sizeof(int32_t);
+
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void put_le(uint8_t *buffer, uint32_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; ++i) {
+    buffer[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+WavFileSpeaker::WavFileSpeaker(const std::string &path, uint8_t bits_per_sample, bool realtime, uint32_t buffer_ms)
+    : path_(path), output_bits_per_sample_(bits_per_sample), realtime_(realtime), buffer_ms_(buffer_ms) {
+  if (!this->path_.empty()) {
+    this->file_ = fopen(this->path_.c_str(), "wb");
+    if (this->file_ != nullptr) {
+      // Placeholder until finish() knows the length
+      this->write_header_();
+    }
+  }
+}
+
+WavFileSpeaker::~WavFileSpeaker() { this->finish(); }
+
+size_t WavFileSpeaker::play(const uint8_t *data, size_t length, TickType_t ticks_to_wait) {
+  const size_t frames_offered = length / INPUT_FRAME_BYTES;
+  size_t frames = this->frames_accepted_now_(frames_offered);
+  for (TickType_t waited = 0; (frames == 0) && (frames_offered > 0) && (waited < ticks_to_wait); ++waited) {
+    vTaskDelay(1);
+    frames = this->frames_accepted_now_(frames_offered);
+  }
+
+  if ((frames > 0) && (this->capture_ != nullptr)) {
+    const int32_t *samples = reinterpret_cast<const int32_t *>(data);
+    this->capture_->insert(this->capture_->end(), samples, samples + frames * INPUT_CHANNELS);
+  }
+
+  if ((frames > 0) && (this->file_ != nullptr)) {
+    const int32_t *samples = reinterpret_cast<const int32_t *>(data);
+    const size_t samples_to_write = frames * INPUT_CHANNELS;
+    if (this->output_bits_per_sample_ == 16) {
+      int16_t narrowed[1024];
+      for (size_t start = 0; start < samples_to_write; start += 1024) {
+        const size_t count = std::min<size_t>(1024, samples_to_write - start);
+        for (size_t i = 0; i < count; ++i) {
+          narrowed[i] = static_cast<int16_t>(samples[start + i] >> 16);
+        }
+        fwrite(narrowed, sizeof(int16_t), count, this->file_);
+      }
+      this->data_bytes_ += samples_to_write * sizeof(int16_t);
+    } else {
+      fwrite(samples, sizeof(int32_t), samples_to_write, this->file_);
+      this->data_bytes_ += samples_to_write * sizeof(int32_t);
+    }
+  }
+
+  this->frames_ += frames;
+  return frames * INPUT_FRAME_BYTES;
+}
+
+void WavFileSpeaker::finish() {
+  if (this->file_ != nullptr) {
+    fseek(this->file_, 0, SEEK_SET);
+    this->write_header_();
+    fclose(this->file_);
+    this->file_ = nullptr;
+  }
+}
+
+size_t WavFileSpeaker::frames_accepted_now_(size_t frames_offered) {
+  if (!this->realtime_) {
+    return frames_offered;
+  }
+
+  const uint64_t sample_rate = this->audio_stream_info_.sample_rate;
+  const uint64_t now = now_us();
+  if (this->paced_frames_ == 0) {
+    this->pacing_start_us_ = now;
+  }
+
+  const uint64_t played_frames = (now - this->pacing_start_us_) * sample_rate / 1000000;
+  if (played_frames > this->paced_frames_) {
+    // The DMA buffers ran dry and played silence; the real clock keeps going, so restart the pacing from now
+    this->pacing_start_us_ = now - this->paced_frames_ * 1000000 / sample_rate;
+  }
+  const uint64_t ahead_frames = this->paced_frames_ - std::min(played_frames, this->paced_frames_);
+  const uint64_t buffer_frames = this->buffer_ms_ * sample_rate / 1000;
+  if (ahead_frames >= buffer_frames) {
+    return 0;
+  }
+
+  const size_t frames = std::min<uint64_t>(frames_offered, buffer_frames - ahead_frames);
+  this->paced_frames_ += frames;
+  return frames;
+}
+
+void WavFileSpeaker::write_header_() {
+  const uint32_t sample_rate = this->audio_stream_info_.sample_rate;
+  const uint16_t block_align = INPUT_CHANNELS * this->output_bits_per_sample_ / 8;
+  const uint32_t data_bytes = static_cast<uint32_t>(std::min<uint64_t>(this->data_bytes_, UINT32_MAX - 36));
+
+  uint8_t header[WAV_HEADER_SIZE];
+  memcpy(header, "RIFF", 4);
+  put_le(header + 4, 36 + data_bytes, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le(header + 16, 16, 4);
+  put_le(header + 20, 1, 2);  // PCM
+  put_le(header + 22, INPUT_CHANNELS, 2);
+  put_le(header + 24, sample_rate, 4);
+  put_le(header + 28, sample_rate * block_align, 4);
+  put_le(header + 32, block_align, 2);
+  put_le(header + 34, this->output_bits_per_sample_, 2);
+  memcpy(header + 36, "data", 4);
+  put_le(header + 40, data_bytes, 4);
+  fwrite(header, 1, sizeof(header), this->file_);
+}
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "esphome/components/speaker/speaker.h"
+
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace nabu {
+namespace host {
+
+// Speaker that writes the mixer's 32 bit stereo output into a WAV file
+//  - 16 bit output keeps the upper half of each sample, like an I2S speaker configured for 16 bit does
+//  - Without a path, the audio is only counted
+//  - The samples can also be captured in memory, e.g., to check them against a file's MD5 signature
+//  - With realtime pacing, play() accepts no more than the emulated DMA buffers hold ahead of the wall clock, so the
+//    mixer and the tasks feeding it wake up as often as they do on the device
+class WavFileSpeaker : public speaker::Speaker {
+ public:
+  /// @param path WAV file to write; empty to discard the audio
+  /// @param bits_per_sample 16 or 32
+  /// @param realtime true to consume the audio at the sample rate instead of as fast as possible
+  /// @param buffer_ms Audio the emulated DMA buffers hold ahead of the wall clock when pacing
+  WavFileSpeaker(const std::string &path, uint8_t bits_per_sample, bool realtime, uint32_t buffer_ms = 64);
+  ~WavFileSpeaker() override;
+
+  size_t play(const uint8_t *data, size_t length, TickType_t ticks_to_wait) override;
+  size_t play(const uint8_t *data, size_t length) override { return this->play(data, length, 0); }
+
+  /// @brief Writes the final WAV header and closes the file
+  void finish();
+
+  /// @brief Appends every 32 bit sample played from now on to samples. Call before the mixer starts.
+  void set_capture(std::vector<int32_t> *samples) { this->capture_ = samples; }
+
+  /// @brief Frames received so far
+  uint64_t get_frames() const { return this->frames_.load(); }
+
+ protected:
+  /// @brief Frames the emulated DMA buffers may accept right now
+  size_t frames_accepted_now_(size_t frames_offered);
+  void write_header_();
+
+  std::string path_;
+  FILE *file_{nullptr};
+  uint8_t output_bits_per_sample_;
+  bool realtime_;
+  uint32_t buffer_ms_;
+  std::vector<int32_t> *capture_{nullptr};
+
+  std::atomic<uint64_t> frames_{0};
+  uint64_t data_bytes_{0};
+  uint64_t pacing_start_us_{0};
+  uint64_t paced_frames_{0};
+};
+
+}  // namespace host
+}  // namespace nabu
+}  // namespace esphome